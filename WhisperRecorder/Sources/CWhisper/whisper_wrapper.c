@@ -4,35 +4,145 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <math.h>
+#include <pthread.h>
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#define WHISPER_WRAPPER_RESULT_SIZE (16 * 1024)
+
+struct whisper_wrapper_state
+{
+    struct whisper_state *state;
+    struct whisper_wrapper_state *next; // free list link
+};
 
 struct whisper_wrapper
 {
     struct whisper_context *ctx;
-    char *result_buffer;
+
+    // pool of decoding states sharing the model weights in ctx
+    struct whisper_wrapper_state *states;
+    struct whisper_wrapper_state *idle;
+    int n_states;
+
+    pthread_mutex_t pool_mutex;
+    pthread_cond_t pool_cond;
 };
 
-whisper_wrapper_t *whisper_wrapper_create(const char *model_path)
+// the v1 API returns a pointer into a buffer of the calling thread, valid until the next v1 call on that thread
+// another thread never writes into it, so v1 calls can run concurrently over the state pool
+struct whisper_wrapper_result
+{
+    char *data;
+    size_t size;
+};
+
+static pthread_key_t result_key;
+static pthread_once_t result_key_once = PTHREAD_ONCE_INIT;
+
+static void result_free(void *ptr)
 {
+    struct whisper_wrapper_result *result = (struct whisper_wrapper_result *)ptr;
+    free(result->data);
+    free(result);
+}
+
+static void result_key_init(void)
+{
+    pthread_key_create(&result_key, result_free);
+}
+
+// the result buffer of the calling thread, allocated on its first v1 call
+static struct whisper_wrapper_result *result_get(void)
+{
+    pthread_once(&result_key_once, result_key_init);
+
+    struct whisper_wrapper_result *result = (struct whisper_wrapper_result *)pthread_getspecific(result_key);
+    if (result != NULL)
+    {
+        return result;
+    }
+
+    result = (struct whisper_wrapper_result *)calloc(1, sizeof(struct whisper_wrapper_result));
+    if (result == NULL)
+    {
+        return NULL;
+    }
+
+    // allocated up front so that the v1 calls only reallocate for unusually long results
+    result->data = (char *)malloc(WHISPER_WRAPPER_RESULT_SIZE);
+    if (result->data == NULL || pthread_setspecific(result_key, result) != 0)
+    {
+        result_free(result);
+        return NULL;
+    }
+    result->data[0] = '\0';
+    result->size = WHISPER_WRAPPER_RESULT_SIZE;
+
+    return result;
+}
+
+whisper_wrapper_t *whisper_wrapper_create_pool(const char *model_path, int n_states)
+{
+    if (model_path == NULL || n_states < 1)
+    {
+        return NULL;
+    }
+
     struct whisper_context_params params = whisper_context_default_params();
 
-    whisper_wrapper_t *wrapper = (whisper_wrapper_t *)malloc(sizeof(whisper_wrapper_t));
+    whisper_wrapper_t *wrapper = (whisper_wrapper_t *)calloc(1, sizeof(whisper_wrapper_t));
     if (wrapper == NULL)
     {
         return NULL;
     }
 
-    wrapper->ctx = whisper_init_from_file_with_params(model_path, params);
-    wrapper->result_buffer = NULL;
+    pthread_mutex_init(&wrapper->pool_mutex, NULL);
+    pthread_cond_init(&wrapper->pool_cond, NULL);
 
+    // the weights are loaded once, each pooled state only owns its KV cache and compute buffers
+    wrapper->ctx = whisper_init_from_file_with_params_no_state(model_path, params);
     if (wrapper->ctx == NULL)
     {
-        free(wrapper);
+        whisper_wrapper_free(wrapper);
         return NULL;
     }
 
+    wrapper->states = (struct whisper_wrapper_state *)calloc(n_states, sizeof(struct whisper_wrapper_state));
+    if (wrapper->states == NULL)
+    {
+        whisper_wrapper_free(wrapper);
+        return NULL;
+    }
+
+    for (int i = 0; i < n_states; i++)
+    {
+        wrapper->states[i].state = whisper_init_state(wrapper->ctx);
+        if (wrapper->states[i].state == NULL)
+        {
+            fprintf(stderr, "Failed to initialize whisper state %d / %d\n", i + 1, n_states);
+            whisper_wrapper_free(wrapper);
+            return NULL;
+        }
+        wrapper->n_states++;
+
+        wrapper->states[i].next = wrapper->idle;
+        wrapper->idle = &wrapper->states[i];
+    }
+
     return wrapper;
 }
 
+whisper_wrapper_t *whisper_wrapper_create(const char *model_path)
+{
+    return whisper_wrapper_create_pool(model_path, 1);
+}
+
 void whisper_wrapper_free(whisper_wrapper_t *wrapper)
 {
     if (wrapper == NULL)
@@ -40,16 +150,20 @@ void whisper_wrapper_free(whisper_wrapper_t *wrapper)
         return;
     }
 
-    if (wrapper->ctx != NULL)
+    for (int i = 0; i < wrapper->n_states; i++)
     {
-        whisper_free(wrapper->ctx);
+        whisper_free_state(wrapper->states[i].state);
     }
+    free(wrapper->states);
 
-    if (wrapper->result_buffer != NULL)
+    if (wrapper->ctx != NULL)
     {
-        free(wrapper->result_buffer);
+        whisper_free(wrapper->ctx);
     }
 
+    pthread_cond_destroy(&wrapper->pool_cond);
+    pthread_mutex_destroy(&wrapper->pool_mutex);
+
     free(wrapper);
 }
 
@@ -58,245 +172,673 @@ bool whisper_wrapper_is_loaded(whisper_wrapper_t *wrapper)
     return wrapper != NULL && wrapper->ctx != NULL;
 }
 
-// Helper function to read WAV file content
-// This is a simplified WAV loader - works with standard WAV files
-bool read_wav_file(const char *filename, float **pcm, int *samples, int *sample_rate)
+//
+// Streaming WAV reader
+//
+// Walks the RIFF chunks, converts the data chunk block by block to mono float and resamples it to
+// WHISPER_SAMPLE_RATE, so that only a few fixed-size buffers are needed regardless of the file length.
+// WAV data is little-endian, as are all the targets of the wrapper.
+//
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+#define WAV_BLOCK_FRAMES 4096 // input frames converted per block
+#define WAV_RESAMPLE_TAPS 32  // filter taps per polyphase branch
+
+#define WAV_FORMAT_PCM 0x0001
+#define WAV_FORMAT_FLOAT 0x0003
+#define WAV_FORMAT_EXTENSIBLE 0xFFFE
+
+static uint16_t read_u16le(const unsigned char *p)
 {
-    FILE *fp = fopen(filename, "rb");
-    if (!fp)
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static uint32_t read_u32le(const unsigned char *p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+// Dot product of two float arrays
+static float dot_f32(const float *a, const float *b, int n)
+{
+    int i = 0;
+    float sum = 0.0f;
+#if defined(__ARM_NEON)
+    float32x4_t acc0 = vdupq_n_f32(0.0f);
+    float32x4_t acc1 = vdupq_n_f32(0.0f);
+    for (; i + 8 <= n; i += 8)
     {
-        fprintf(stderr, "Failed to open WAV file: %s\n", filename);
-        return false;
+        acc0 = vmlaq_f32(acc0, vld1q_f32(a + i), vld1q_f32(b + i));
+        acc1 = vmlaq_f32(acc1, vld1q_f32(a + i + 4), vld1q_f32(b + i + 4));
     }
+    float32x4_t acc = vaddq_f32(acc0, acc1);
+    float32x2_t acc2 = vadd_f32(vget_low_f32(acc), vget_high_f32(acc));
+    sum = vget_lane_f32(vpadd_f32(acc2, acc2), 0);
+#elif defined(__SSE2__)
+    __m128 acc0 = _mm_setzero_ps();
+    __m128 acc1 = _mm_setzero_ps();
+    for (; i + 8 <= n; i += 8)
+    {
+        acc0 = _mm_add_ps(acc0, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+        acc1 = _mm_add_ps(acc1, _mm_mul_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4)));
+    }
+    float tmp[4];
+    _mm_storeu_ps(tmp, _mm_add_ps(acc0, acc1));
+    sum = (tmp[0] + tmp[1]) + (tmp[2] + tmp[3]);
+#endif
+    for (; i < n; i++)
+    {
+        sum += a[i] * b[i];
+    }
+    return sum;
+}
 
-    // Read WAV header
-    char header[44];
-    if (fread(header, 1, 44, fp) != 44)
+// 16-bit PCM -> mono float, channels are averaged
+static void convert_s16(const int16_t *src, float *dst, int n_frames, int n_channels)
+{
+    int i = 0;
+    if (n_channels == 1)
     {
-        fprintf(stderr, "Failed to read WAV header\n");
-        fclose(fp);
-        return false;
+        const float scale = 1.0f / 32768.0f;
+#if defined(__ARM_NEON)
+        const float32x4_t vscale = vdupq_n_f32(scale);
+        for (; i + 8 <= n_frames; i += 8)
+        {
+            const int16x8_t v = vld1q_s16(src + i);
+            vst1q_f32(dst + i, vmulq_f32(vcvtq_f32_s32(vmovl_s16(vget_low_s16(v))), vscale));
+            vst1q_f32(dst + i + 4, vmulq_f32(vcvtq_f32_s32(vmovl_s16(vget_high_s16(v))), vscale));
+        }
+#elif defined(__SSE2__)
+        const __m128 vscale = _mm_set1_ps(scale);
+        for (; i + 8 <= n_frames; i += 8)
+        {
+            const __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+            const __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16);
+            const __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16);
+            _mm_storeu_ps(dst + i, _mm_mul_ps(_mm_cvtepi32_ps(lo), vscale));
+            _mm_storeu_ps(dst + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(hi), vscale));
+        }
+#endif
+        for (; i < n_frames; i++)
+        {
+            dst[i] = src[i] * scale;
+        }
+    }
+    else if (n_channels == 2)
+    {
+        const float scale = 1.0f / 65536.0f;
+#if defined(__ARM_NEON)
+        const float32x4_t vscale = vdupq_n_f32(scale);
+        for (; i + 8 <= n_frames; i += 8)
+        {
+            const int16x8x2_t v = vld2q_s16(src + 2 * i);
+            const int32x4_t lo = vaddl_s16(vget_low_s16(v.val[0]), vget_low_s16(v.val[1]));
+            const int32x4_t hi = vaddl_s16(vget_high_s16(v.val[0]), vget_high_s16(v.val[1]));
+            vst1q_f32(dst + i, vmulq_f32(vcvtq_f32_s32(lo), vscale));
+            vst1q_f32(dst + i + 4, vmulq_f32(vcvtq_f32_s32(hi), vscale));
+        }
+#elif defined(__SSE2__)
+        // madd with ones adds each left/right pair into one 32-bit lane
+        const __m128 vscale = _mm_set1_ps(scale);
+        const __m128i ones = _mm_set1_epi16(1);
+        for (; i + 4 <= n_frames; i += 4)
+        {
+            const __m128i v = _mm_loadu_si128((const __m128i *)(src + 2 * i));
+            _mm_storeu_ps(dst + i, _mm_mul_ps(_mm_cvtepi32_ps(_mm_madd_epi16(v, ones)), vscale));
+        }
+#endif
+        for (; i < n_frames; i++)
+        {
+            dst[i] = (src[2 * i] + src[2 * i + 1]) * scale;
+        }
+    }
+    else
+    {
+        const float scale = 1.0f / (32768.0f * n_channels);
+        for (; i < n_frames; i++)
+        {
+            int32_t sum = 0;
+            for (int c = 0; c < n_channels; c++)
+            {
+                sum += src[i * n_channels + c];
+            }
+            dst[i] = sum * scale;
+        }
     }
+}
 
-    // Check if the file is a valid WAV file
-    if (memcmp(header, "RIFF", 4) != 0 || memcmp(header + 8, "WAVE", 4) != 0)
+// 32-bit PCM (and 24-bit PCM shifted into the upper bytes) -> mono float
+static void convert_s32(const int32_t *src, float *dst, int n_frames, int n_channels)
+{
+    int i = 0;
+    const float scale = 1.0f / (2147483648.0f * n_channels);
+    if (n_channels == 1)
     {
-        fprintf(stderr, "Not a valid WAV file\n");
-        fclose(fp);
-        return false;
+#if defined(__ARM_NEON)
+        const float32x4_t vscale = vdupq_n_f32(scale);
+        for (; i + 4 <= n_frames; i += 4)
+        {
+            vst1q_f32(dst + i, vmulq_f32(vcvtq_f32_s32(vld1q_s32(src + i)), vscale));
+        }
+#elif defined(__SSE2__)
+        const __m128 vscale = _mm_set1_ps(scale);
+        for (; i + 4 <= n_frames; i += 4)
+        {
+            const __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+            _mm_storeu_ps(dst + i, _mm_mul_ps(_mm_cvtepi32_ps(v), vscale));
+        }
+#endif
     }
+    else if (n_channels == 2)
+    {
+        // the channels are added after the conversion to float, the integer sum could overflow
+#if defined(__ARM_NEON)
+        const float32x4_t vscale = vdupq_n_f32(scale);
+        for (; i + 4 <= n_frames; i += 4)
+        {
+            const int32x4x2_t v = vld2q_s32(src + 2 * i);
+            const float32x4_t sum = vaddq_f32(vcvtq_f32_s32(v.val[0]), vcvtq_f32_s32(v.val[1]));
+            vst1q_f32(dst + i, vmulq_f32(sum, vscale));
+        }
+#elif defined(__SSE2__)
+        const __m128 vscale = _mm_set1_ps(scale);
+        for (; i + 4 <= n_frames; i += 4)
+        {
+            const __m128 a = _mm_cvtepi32_ps(_mm_loadu_si128((const __m128i *)(src + 2 * i)));
+            const __m128 b = _mm_cvtepi32_ps(_mm_loadu_si128((const __m128i *)(src + 2 * i + 4)));
+            const __m128 l = _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0));
+            const __m128 r = _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1));
+            _mm_storeu_ps(dst + i, _mm_mul_ps(_mm_add_ps(l, r), vscale));
+        }
+#endif
+    }
+    for (; i < n_frames; i++)
+    {
+        float sum = 0.0f;
+        for (int c = 0; c < n_channels; c++)
+        {
+            sum += (float)src[i * n_channels + c];
+        }
+        dst[i] = sum * scale;
+    }
+}
 
-    // Extract header info
-    *sample_rate = *(int *)(header + 24);
-    int num_channels = *(short *)(header + 22);
-    int bits_per_sample = *(short *)(header + 34);
-    int data_size = *(int *)(header + 40);
+// 32-bit float -> mono float
+static void convert_f32(const float *src, float *dst, int n_frames, int n_channels)
+{
+    int i = 0;
+    if (n_channels == 1)
+    {
+        memcpy(dst, src, n_frames * sizeof(float));
+        return;
+    }
+    if (n_channels == 2)
+    {
+#if defined(__ARM_NEON)
+        const float32x4_t half = vdupq_n_f32(0.5f);
+        for (; i + 4 <= n_frames; i += 4)
+        {
+            const float32x4x2_t v = vld2q_f32(src + 2 * i);
+            vst1q_f32(dst + i, vmulq_f32(vaddq_f32(v.val[0], v.val[1]), half));
+        }
+#elif defined(__SSE2__)
+        const __m128 half = _mm_set1_ps(0.5f);
+        for (; i + 4 <= n_frames; i += 4)
+        {
+            const __m128 a = _mm_loadu_ps(src + 2 * i);
+            const __m128 b = _mm_loadu_ps(src + 2 * i + 4);
+            const __m128 l = _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0));
+            const __m128 r = _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1));
+            _mm_storeu_ps(dst + i, _mm_mul_ps(_mm_add_ps(l, r), half));
+        }
+#endif
+    }
+    for (; i < n_frames; i++)
+    {
+        float sum = 0.0f;
+        for (int c = 0; c < n_channels; c++)
+        {
+            sum += src[i * n_channels + c];
+        }
+        dst[i] = sum / n_channels;
+    }
+}
 
-    // Debug info
-    fprintf(stderr, "WAV file details:\n");
-    fprintf(stderr, "  Sample rate: %d Hz\n", *sample_rate);
-    fprintf(stderr, "  Channels: %d\n", num_channels);
-    fprintf(stderr, "  Bits per sample: %d\n", bits_per_sample);
-    fprintf(stderr, "  Data size: %d bytes\n", data_size);
+// Rational polyphase resampler: up by L, low-pass, down by M
+typedef struct wav_resampler
+{
+    int L;
+    int M;
+    int K;       // taps per branch
+    float *coef; // L branches of K taps, each in input order (oldest sample first)
+    int64_t delay; // group delay of the filter in upsampled samples
+
+    float *buf;      // input history followed by the new block
+    int buf_len;
+    int buf_cap;
+    int64_t buf_start; // input index of buf[0]
+
+    int64_t n_out; // output samples produced so far
+    int64_t n_in;  // input samples received so far
+} wav_resampler_t;
+
+static int gcd_int(int a, int b)
+{
+    while (b != 0)
+    {
+        int t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
 
-    // Safety checks
-    if (data_size <= 0)
+static bool wav_resampler_init(wav_resampler_t *rs, int rate_in, int rate_out, int max_block)
+{
+    memset(rs, 0, sizeof(*rs));
+
+    const int g = gcd_int(rate_in, rate_out);
+    rs->L = rate_out / g;
+    rs->M = rate_in / g;
+    // when decimating, the filter has to span proportionally more input samples for the same transition band
+    rs->K = WAV_RESAMPLE_TAPS * ((rs->M + rs->L - 1) / rs->L);
+
+    const int n_taps = rs->L * rs->K;
+    rs->delay = n_taps / 2;
+
+    rs->coef = (float *)malloc(n_taps * sizeof(float));
+    rs->buf_cap = rs->K + max_block;
+    rs->buf = (float *)calloc(rs->buf_cap, sizeof(float));
+    if (rs->coef == NULL || rs->buf == NULL)
     {
-        fprintf(stderr, "Error: WAV data size is invalid: %d\n", data_size);
-        fclose(fp);
+        free(rs->coef);
+        free(rs->buf);
         return false;
     }
 
-    if (num_channels <= 0)
+    // Blackman-windowed sinc at the lower of the two Nyquist frequencies, with unity gain after upsampling
+    const double fc = 0.5 / (rs->L > rs->M ? rs->L : rs->M) * 0.95;
+    // centered on tap n_taps/2 so that the group delay is a whole number of upsampled samples
+    for (int i = 0; i < n_taps; i++)
     {
-        fprintf(stderr, "Error: Invalid number of channels: %d\n", num_channels);
-        fclose(fp);
-        return false;
+        const double x = i - (double)rs->delay;
+        const double sinc = x == 0.0 ? 2.0 * fc : sin(2.0 * M_PI * fc * x) / (M_PI * x);
+        const double w = 0.42 + 0.5 * cos(2.0 * M_PI * x / n_taps) + 0.08 * cos(4.0 * M_PI * x / n_taps);
+
+        // tap i belongs to branch i % L, as the (i / L)-th newest input sample
+        const int phase = i % rs->L;
+        const int k = i / rs->L;
+        rs->coef[phase * rs->K + (rs->K - 1 - k)] = (float)(sinc * w * rs->L);
+    }
+
+    // the history starts as K zeros before the first input sample
+    rs->buf_len = rs->K;
+    rs->buf_start = -rs->K;
+
+    return true;
+}
+
+static void wav_resampler_free(wav_resampler_t *rs)
+{
+    free(rs->coef);
+    free(rs->buf);
+}
+
+// Feed n input samples (n <= max_block, NULL for zeros) and write the available output samples.
+// The output is capped at the length of the input at the output rate.
+static int wav_resampler_process(wav_resampler_t *rs, const float *in, int n, float *out, int max_out)
+{
+    if (in != NULL)
+    {
+        memcpy(rs->buf + rs->buf_len, in, n * sizeof(float));
+        rs->n_in += n;
     }
+    else
+    {
+        memset(rs->buf + rs->buf_len, 0, n * sizeof(float));
+    }
+    rs->buf_len += n;
+
+    const int64_t n_out_max = (rs->n_in * rs->L + rs->M - 1) / rs->M;
 
-    if (bits_per_sample != 16 && bits_per_sample != 32 && bits_per_sample != 8 && bits_per_sample != 24)
+    int n_written = 0;
+    while (n_written < max_out && rs->n_out < n_out_max)
     {
-        fprintf(stderr, "Unsupported bits per sample: %d\n", bits_per_sample);
-        fclose(fp);
-        return false;
+        const int64_t t = rs->n_out * rs->M + rs->delay;
+        const int64_t newest = t / rs->L;
+        if (newest >= rs->buf_start + rs->buf_len)
+        {
+            break;
+        }
+
+        const int phase = (int)(t % rs->L);
+        const float *x = rs->buf + (newest - rs->K + 1 - rs->buf_start);
+        out[n_written++] = dot_f32(rs->coef + phase * rs->K, x, rs->K);
+        rs->n_out++;
     }
 
-    // Allocate memory for PCM data
-    *samples = data_size / (bits_per_sample / 8) / num_channels;
-    if (*samples <= 0)
+    // keep the history that the next output sample starts at
+    const int64_t t_next = rs->n_out * rs->M + rs->delay;
+    int64_t keep_from = t_next / rs->L - rs->K + 1;
+    if (keep_from > rs->buf_start + rs->buf_len)
     {
-        fprintf(stderr, "Error: Invalid number of samples calculated: %d\n", *samples);
-        fclose(fp);
-        return false;
+        keep_from = rs->buf_start + rs->buf_len;
     }
+    if (keep_from > rs->buf_start)
+    {
+        const int drop = (int)(keep_from - rs->buf_start);
+        memmove(rs->buf, rs->buf + drop, (rs->buf_len - drop) * sizeof(float));
+        rs->buf_len -= drop;
+        rs->buf_start = keep_from;
+    }
+
+    return n_written;
+}
+
+typedef struct wav_reader
+{
+    FILE *fp;
+
+    int format;
+    int n_channels;
+    int sample_rate;
+    int bits_per_sample;
+    int block_align;
 
-    fprintf(stderr, "  Calculated samples: %d\n", *samples);
+    int64_t n_frames;   // frames in the data chunk
+    int64_t frames_read;
 
-    *pcm = (float *)malloc(*samples * sizeof(float));
-    if (!*pcm)
+    unsigned char *raw; // one block of raw data
+    int32_t *s32;       // 24-bit samples widened to 32 bits
+    float *mono;        // one block of mono samples at the input rate
+
+    bool resample;
+    bool flushed;
+    wav_resampler_t rs;
+} wav_reader_t;
+
+static void wav_reader_close(wav_reader_t *r)
+{
+    if (r->fp != NULL)
     {
-        fprintf(stderr, "Failed to allocate memory for PCM data\n");
-        fclose(fp);
+        fclose(r->fp);
+    }
+    free(r->raw);
+    free(r->s32);
+    free(r->mono);
+    if (r->resample)
+    {
+        wav_resampler_free(&r->rs);
+    }
+    memset(r, 0, sizeof(*r));
+}
+
+static bool wav_reader_open(wav_reader_t *r, const char *filename)
+{
+    memset(r, 0, sizeof(*r));
+
+    r->fp = fopen(filename, "rb");
+    if (!r->fp)
+    {
+        fprintf(stderr, "Failed to open WAV file: %s\n", filename);
         return false;
     }
 
-    // Add support for more bit depths
-    if (bits_per_sample == 16)
+    unsigned char header[12];
+    if (fread(header, 1, 12, r->fp) != 12 || memcmp(header, "RIFF", 4) != 0 || memcmp(header + 8, "WAVE", 4) != 0)
     {
-        short *buf = (short *)malloc(data_size);
-        if (!buf)
-        {
-            fprintf(stderr, "Failed to allocate memory for WAV data\n");
-            free(*pcm);
-            fclose(fp);
-            return false;
-        }
+        fprintf(stderr, "Not a valid WAV file\n");
+        wav_reader_close(r);
+        return false;
+    }
 
-        if (fread(buf, 1, data_size, fp) != data_size)
+    // walk the chunks until the data chunk - LIST, fact, cue, ... are skipped
+    bool have_fmt = false;
+    for (;;)
+    {
+        unsigned char chunk[8];
+        if (fread(chunk, 1, 8, r->fp) != 8)
         {
-            fprintf(stderr, "Failed to read WAV data\n");
-            free(buf);
-            free(*pcm);
-            fclose(fp);
+            fprintf(stderr, "WAV file has no data chunk\n");
+            wav_reader_close(r);
             return false;
         }
+        const uint32_t size = read_u32le(chunk + 4);
 
-        // Convert to float and handle multiple channels by averaging
-        for (int i = 0; i < *samples; i++)
+        if (memcmp(chunk, "fmt ", 4) == 0)
         {
-            float sum = 0.0f;
-            for (int j = 0; j < num_channels; j++)
+            unsigned char fmt[40] = {0};
+            const uint32_t n = size < sizeof(fmt) ? size : (uint32_t)sizeof(fmt);
+            if (size < 16 || fread(fmt, 1, n, r->fp) != n || fseek(r->fp, (long)(size - n + (size & 1)), SEEK_CUR) != 0)
+            {
+                fprintf(stderr, "Invalid WAV fmt chunk\n");
+                wav_reader_close(r);
+                return false;
+            }
+
+            r->format = read_u16le(fmt);
+            r->n_channels = read_u16le(fmt + 2);
+            r->sample_rate = (int)read_u32le(fmt + 4);
+            r->block_align = read_u16le(fmt + 12);
+            r->bits_per_sample = read_u16le(fmt + 14);
+
+            // WAVE_FORMAT_EXTENSIBLE carries the actual format in the first bytes of the sub-format GUID
+            if (r->format == WAV_FORMAT_EXTENSIBLE && size >= 40)
             {
-                sum += buf[i * num_channels + j] / 32768.0f;
+                r->format = read_u16le(fmt + 24);
             }
-            (*pcm)[i] = sum / num_channels;
+            have_fmt = true;
         }
+        else if (memcmp(chunk, "data", 4) == 0)
+        {
+            if (!have_fmt)
+            {
+                fprintf(stderr, "WAV data chunk before fmt chunk\n");
+                wav_reader_close(r);
+                return false;
+            }
 
-        free(buf);
-    }
-    else if (bits_per_sample == 32)
-    {
-        float *buf = (float *)malloc(data_size);
-        if (!buf)
+            // streaming writers leave the size at 0 or 0xFFFFFFFF, the data then runs to the end of the file
+            int64_t data_size = size;
+            if (size == 0 || size == 0xFFFFFFFF)
+            {
+                const long pos = ftell(r->fp);
+                fseek(r->fp, 0, SEEK_END);
+                data_size = ftell(r->fp) - pos;
+                fseek(r->fp, pos, SEEK_SET);
+            }
+            r->n_frames = r->block_align > 0 ? data_size / r->block_align : 0;
+            break;
+        }
+        else if (fseek(r->fp, (long)size + (size & 1), SEEK_CUR) != 0)
         {
-            fprintf(stderr, "Failed to allocate memory for WAV data\n");
-            free(*pcm);
-            fclose(fp);
+            fprintf(stderr, "Truncated WAV chunk\n");
+            wav_reader_close(r);
             return false;
         }
+    }
+
+    fprintf(stderr, "WAV file details:\n");
+    fprintf(stderr, "  Format: %d\n", r->format);
+    fprintf(stderr, "  Sample rate: %d Hz\n", r->sample_rate);
+    fprintf(stderr, "  Channels: %d\n", r->n_channels);
+    fprintf(stderr, "  Bits per sample: %d\n", r->bits_per_sample);
+    fprintf(stderr, "  Frames: %lld\n", (long long)r->n_frames);
+
+    const bool supported =
+        (r->format == WAV_FORMAT_PCM && (r->bits_per_sample == 8 || r->bits_per_sample == 16 || r->bits_per_sample == 24 || r->bits_per_sample == 32)) ||
+        (r->format == WAV_FORMAT_FLOAT && r->bits_per_sample == 32);
+
+    if (!supported || r->n_channels <= 0 || r->sample_rate <= 0 || r->block_align != r->n_channels * r->bits_per_sample / 8)
+    {
+        fprintf(stderr, "Unsupported WAV format: %d, %d bits, %d channels\n", r->format, r->bits_per_sample, r->n_channels);
+        wav_reader_close(r);
+        return false;
+    }
+
+    if (r->n_frames <= 0)
+    {
+        fprintf(stderr, "Error: WAV file has no samples\n");
+        wav_reader_close(r);
+        return false;
+    }
 
-        if (fread(buf, 1, data_size, fp) != data_size)
+    r->raw = (unsigned char *)malloc((size_t)WAV_BLOCK_FRAMES * r->block_align);
+    r->mono = (float *)malloc(WAV_BLOCK_FRAMES * sizeof(float));
+    if (r->bits_per_sample == 24)
+    {
+        r->s32 = (int32_t *)malloc((size_t)WAV_BLOCK_FRAMES * r->n_channels * sizeof(int32_t));
+    }
+    if (r->raw == NULL || r->mono == NULL || (r->bits_per_sample == 24 && r->s32 == NULL))
+    {
+        fprintf(stderr, "Failed to allocate memory for WAV data\n");
+        wav_reader_close(r);
+        return false;
+    }
+
+    if (r->sample_rate != WHISPER_SAMPLE_RATE)
+    {
+        if (!wav_resampler_init(&r->rs, r->sample_rate, WHISPER_SAMPLE_RATE, WAV_BLOCK_FRAMES))
         {
-            fprintf(stderr, "Failed to read WAV data\n");
-            free(buf);
-            free(*pcm);
-            fclose(fp);
+            fprintf(stderr, "Failed to allocate memory for the resampler\n");
+            wav_reader_close(r);
             return false;
         }
+        r->resample = true;
+    }
 
-        // Handle multiple channels by averaging
-        for (int i = 0; i < *samples; i++)
-        {
-            float sum = 0.0f;
-            for (int j = 0; j < num_channels; j++)
-            {
-                sum += buf[i * num_channels + j];
-            }
-            (*pcm)[i] = sum / num_channels;
-        }
+    return true;
+}
 
-        free(buf);
-    }
-    else if (bits_per_sample == 8)
+// Upper bound of the number of samples at WHISPER_SAMPLE_RATE that the reader produces
+static int64_t wav_reader_n_samples(const wav_reader_t *r)
+{
+    return r->resample ? (r->n_frames * r->rs.L + r->rs.M - 1) / r->rs.M : r->n_frames;
+}
+
+// Largest output of a single wav_reader_read() call
+static int wav_reader_max_block(const wav_reader_t *r)
+{
+    return r->resample ? (int)(((int64_t)WAV_BLOCK_FRAMES * r->rs.L) / r->rs.M) + 2 : WAV_BLOCK_FRAMES;
+}
+
+// Read the next block of mono samples at WHISPER_SAMPLE_RATE into out (at least wav_reader_max_block() samples).
+// Returns the number of samples, 0 at the end of the data and -1 on error.
+static int wav_reader_read(wav_reader_t *r, float *out)
+{
+    const int max_out = wav_reader_max_block(r);
+
+    while (r->frames_read < r->n_frames)
     {
-        // Handle 8-bit audio (uncommon but possible)
-        unsigned char *buf = (unsigned char *)malloc(data_size);
-        if (!buf)
+        int64_t n = r->n_frames - r->frames_read;
+        if (n > WAV_BLOCK_FRAMES)
         {
-            fprintf(stderr, "Failed to allocate memory for WAV data\n");
-            free(*pcm);
-            fclose(fp);
-            return false;
+            n = WAV_BLOCK_FRAMES;
         }
 
-        if (fread(buf, 1, data_size, fp) != data_size)
+        const size_t n_read = fread(r->raw, r->block_align, (size_t)n, r->fp);
+        if (n_read == 0)
         {
-            fprintf(stderr, "Failed to read WAV data\n");
-            free(buf);
-            free(*pcm);
-            fclose(fp);
-            return false;
+            // truncated file - treat what was read so far as the whole recording
+            r->n_frames = r->frames_read;
+            break;
         }
+        r->frames_read += n_read;
+
+        const int n_frames = (int)n_read;
+        float *dst = r->resample ? r->mono : out;
 
-        // Convert to float and handle multiple channels by averaging
-        for (int i = 0; i < *samples; i++)
+        switch (r->bits_per_sample)
         {
-            float sum = 0.0f;
-            for (int j = 0; j < num_channels; j++)
+        case 8:
+            for (int i = 0; i < n_frames; i++)
             {
-                // 8-bit WAV is unsigned [0, 255], normalize to [-1.0, 1.0]
-                sum += ((float)buf[i * num_channels + j] - 128.0f) / 128.0f;
+                float sum = 0.0f;
+                for (int c = 0; c < r->n_channels; c++)
+                {
+                    // 8-bit WAV is unsigned [0, 255], normalize to [-1.0, 1.0]
+                    sum += ((float)r->raw[i * r->n_channels + c] - 128.0f) / 128.0f;
+                }
+                dst[i] = sum / r->n_channels;
             }
-            (*pcm)[i] = sum / num_channels;
-        }
-
-        free(buf);
-    }
-    else if (bits_per_sample == 24)
-    {
-        // Handle 24-bit audio
-        unsigned char *buf = (unsigned char *)malloc(data_size);
-        if (!buf)
+            break;
+        case 16:
+            convert_s16((const int16_t *)r->raw, dst, n_frames, r->n_channels);
+            break;
+        case 24:
         {
-            fprintf(stderr, "Failed to allocate memory for WAV data\n");
-            free(*pcm);
-            fclose(fp);
-            return false;
+            const int n_samples = n_frames * r->n_channels;
+            for (int i = 0; i < n_samples; i++)
+            {
+                const unsigned char *p = r->raw + 3 * i;
+                r->s32[i] = (int32_t)(((uint32_t)p[0] << 8) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 24));
+            }
+            convert_s32(r->s32, dst, n_frames, r->n_channels);
+            break;
+        }
+        case 32:
+            if (r->format == WAV_FORMAT_FLOAT)
+            {
+                convert_f32((const float *)r->raw, dst, n_frames, r->n_channels);
+            }
+            else
+            {
+                convert_s32((const int32_t *)r->raw, dst, n_frames, r->n_channels);
+            }
+            break;
+        default:
+            return -1;
         }
 
-        if (fread(buf, 1, data_size, fp) != data_size)
+        if (!r->resample)
         {
-            fprintf(stderr, "Failed to read WAV data\n");
-            free(buf);
-            free(*pcm);
-            fclose(fp);
-            return false;
+            return n_frames;
         }
 
-        // Convert to float and handle multiple channels by averaging
-        for (int i = 0; i < *samples; i++)
+        const int n_out = wav_resampler_process(&r->rs, r->mono, n_frames, out, max_out);
+        if (n_out > 0)
         {
-            float sum = 0.0f;
-            for (int j = 0; j < num_channels; j++)
-            {
-                // Convert 3 bytes to a 24-bit integer, then normalize
-                int sample = (buf[3 * (i * num_channels + j)] << 8) |
-                             (buf[3 * (i * num_channels + j) + 1] << 16) |
-                             (buf[3 * (i * num_channels + j) + 2] << 24);
-                sum += (float)sample / 2147483648.0f; // normalize to [-1.0, 1.0]
-            }
-            (*pcm)[i] = sum / num_channels;
+            return n_out;
         }
+    }
 
-        free(buf);
+    // push zeros through the filter to get the samples that its delay still holds back
+    if (r->resample && !r->flushed)
+    {
+        r->flushed = true;
+        return wav_resampler_process(&r->rs, NULL, r->rs.K + (int)(r->rs.delay / r->rs.L) + 1, out, max_out);
     }
 
-    fclose(fp);
-    fprintf(stderr, "WAV file loaded successfully\n");
-    return true;
+    return 0;
+}
+
+whisper_wrapper_params_t whisper_wrapper_default_params(void)
+{
+    whisper_wrapper_params_t params;
+    params.language = "auto";
+    params.n_threads = 4;
+    params.translate = false;
+    params.no_context = false;
+    params.single_segment = false;
+    return params;
 }
 
 // Common function to set up transcription parameters
-void setup_params(struct whisper_full_params *params, bool use_language_detection)
+static void setup_params(struct whisper_full_params *params, const whisper_wrapper_params_t *wparams)
 {
     params->print_realtime = false;
     params->print_progress = false;
     params->print_timestamps = false;
     params->print_special = false;
-    params->translate = false;
-    params->language = use_language_detection ? "auto" : "en";
-    params->n_threads = 4;
+    params->translate = wparams->translate;
+    params->language = wparams->language != NULL ? wparams->language : "auto";
+    params->n_threads = wparams->n_threads > 0 ? wparams->n_threads : 4;
     params->offset_ms = 0;
+    params->no_context = wparams->no_context;
+    params->single_segment = wparams->single_segment;
 
     // Added for better handling of longer audio:
     params->max_len = 0;          // disable length constraints
@@ -305,194 +847,353 @@ void setup_params(struct whisper_full_params *params, bool use_language_detectio
     params->split_on_word = true; // try to split on word boundaries
 }
 
-const char *whisper_wrapper_transcribe_with_lang(whisper_wrapper_t *wrapper, const char *audio_path, bool use_language_detection)
+// Options used by the v1 API
+static whisper_wrapper_params_t legacy_params(bool use_language_detection)
 {
-    if (wrapper == NULL || wrapper->ctx == NULL || audio_path == NULL)
+    whisper_wrapper_params_t params = whisper_wrapper_default_params();
+    params.language = use_language_detection ? "auto" : "en";
+    return params;
+}
+
+int whisper_wrapper_n_states(whisper_wrapper_t *wrapper)
+{
+    return wrapper != NULL ? wrapper->n_states : 0;
+}
+
+whisper_wrapper_state_t *whisper_wrapper_acquire(whisper_wrapper_t *wrapper)
+{
+    if (wrapper == NULL || wrapper->n_states == 0)
     {
-        return "Error: Invalid parameters";
+        return NULL;
     }
 
-    // Free any previous result
-    if (wrapper->result_buffer != NULL)
+    pthread_mutex_lock(&wrapper->pool_mutex);
+    while (wrapper->idle == NULL)
     {
-        free(wrapper->result_buffer);
-        wrapper->result_buffer = NULL;
+        pthread_cond_wait(&wrapper->pool_cond, &wrapper->pool_mutex);
     }
+    whisper_wrapper_state_t *state = wrapper->idle;
+    wrapper->idle = state->next;
+    state->next = NULL;
+    pthread_mutex_unlock(&wrapper->pool_mutex);
 
-    // Load audio file
-    float *pcm = NULL;
-    int n_samples = 0;
-    int sample_rate = 0;
+    return state;
+}
 
-    if (!read_wav_file(audio_path, &pcm, &n_samples, &sample_rate))
+whisper_wrapper_state_t *whisper_wrapper_try_acquire(whisper_wrapper_t *wrapper)
+{
+    if (wrapper == NULL)
     {
-        wrapper->result_buffer = strdup("Error: Failed to load audio file");
-        return wrapper->result_buffer;
+        return NULL;
     }
 
-    // Resample to 16kHz if needed
-    if (sample_rate != WHISPER_SAMPLE_RATE)
+    pthread_mutex_lock(&wrapper->pool_mutex);
+    whisper_wrapper_state_t *state = wrapper->idle;
+    if (state != NULL)
     {
-        fprintf(stderr, "Warning: Audio sample rate (%d Hz) doesn't match Whisper's expected rate (%d Hz)\n",
-                sample_rate, WHISPER_SAMPLE_RATE);
-        // For a proper app, you'd implement resampling here
+        wrapper->idle = state->next;
+        state->next = NULL;
     }
+    pthread_mutex_unlock(&wrapper->pool_mutex);
 
-    // Use whisper_full_params for transcription
-    struct whisper_full_params params = whisper_full_default_params(WHISPER_SAMPLING_GREEDY);
+    return state;
+}
+
+void whisper_wrapper_release(whisper_wrapper_t *wrapper, whisper_wrapper_state_t *state)
+{
+    if (wrapper == NULL || state == NULL)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&wrapper->pool_mutex);
+    state->next = wrapper->idle;
+    wrapper->idle = state;
+    pthread_cond_signal(&wrapper->pool_cond);
+    pthread_mutex_unlock(&wrapper->pool_mutex);
+}
+
+int whisper_wrapper_run(whisper_wrapper_t *wrapper, whisper_wrapper_state_t *state, const whisper_wrapper_params_t *params, const float *pcm_data, int n_samples)
+{
+    if (wrapper == NULL || wrapper->ctx == NULL || state == NULL || pcm_data == NULL || n_samples <= 0)
+    {
+        return WHISPER_WRAPPER_ERR_INVALID;
+    }
 
-    // Set parameters for transcription
-    setup_params(&params, use_language_detection);
+    whisper_wrapper_params_t defaults;
+    if (params == NULL)
+    {
+        defaults = whisper_wrapper_default_params();
+        params = &defaults;
+    }
+
+    struct whisper_full_params full_params = whisper_full_default_params(WHISPER_SAMPLING_GREEDY);
+    setup_params(&full_params, params);
 
-    // Run the whisper inference
-    if (whisper_full(wrapper->ctx, params, pcm, n_samples) != 0)
+    if (whisper_full_with_state(wrapper->ctx, state->state, full_params, pcm_data, n_samples) != 0)
     {
-        free(pcm);
-        wrapper->result_buffer = strdup("Error: Failed to process audio with whisper");
-        return wrapper->result_buffer;
+        return WHISPER_WRAPPER_ERR_INFERENCE;
     }
 
-    free(pcm);
+    return WHISPER_WRAPPER_OK;
+}
 
-    // Get the transcription result
-    int n_segments = whisper_full_n_segments(wrapper->ctx);
-    if (n_segments <= 0)
+int whisper_wrapper_run_file(whisper_wrapper_t *wrapper, whisper_wrapper_state_t *state, const whisper_wrapper_params_t *params, const char *audio_path)
+{
+    if (wrapper == NULL || wrapper->ctx == NULL || state == NULL || audio_path == NULL)
     {
-        wrapper->result_buffer = strdup("No speech detected");
-        return wrapper->result_buffer;
+        return WHISPER_WRAPPER_ERR_INVALID;
     }
 
-    // Allocate a buffer for the result (estimate size)
-    int buffer_size = 1024 * 16; // 16KB initial buffer
-    wrapper->result_buffer = (char *)malloc(buffer_size);
-    if (!wrapper->result_buffer)
+    whisper_wrapper_params_t defaults;
+    if (params == NULL)
     {
-        return "Error: Failed to allocate memory for transcription";
+        defaults = whisper_wrapper_default_params();
+        params = &defaults;
     }
-    wrapper->result_buffer[0] = '\0'; // Empty string initially
 
-    // Concatenate all segments
-    for (int i = 0; i < n_segments; i++)
+    struct whisper_full_params full_params = whisper_full_default_params(WHISPER_SAMPLING_GREEDY);
+    setup_params(&full_params, params);
+
+    wav_reader_t reader;
+    if (!wav_reader_open(&reader, audio_path))
+    {
+        return WHISPER_WRAPPER_ERR_AUDIO;
+    }
+
+    float *block = (float *)malloc(wav_reader_max_block(&reader) * sizeof(float));
+    if (block == NULL)
     {
-        const char *segment_text = whisper_full_get_segment_text(wrapper->ctx, i);
-        int current_length = strlen(wrapper->result_buffer);
-        int segment_length = strlen(segment_text);
+        wav_reader_close(&reader);
+        return WHISPER_WRAPPER_ERR_AUDIO;
+    }
 
-        // Check if we need to expand the buffer
-        if (current_length + segment_length + 2 > buffer_size)
+    // the stream has to hold the mel of the whole recording, the audio itself is never kept in full
+    const int64_t n_frames = wav_reader_n_samples(&reader) / WHISPER_HOP_LENGTH + 2;
+    whisper_mel_stream_reset_with_state(wrapper->ctx, state->state, (int)n_frames);
+
+    int ret = WHISPER_WRAPPER_OK;
+    int n;
+    while ((n = wav_reader_read(&reader, block)) > 0)
+    {
+        if (whisper_mel_stream_push_with_state(wrapper->ctx, state->state, block, n, full_params.n_threads) < 0)
         {
-            buffer_size *= 2;
-            char *new_buffer = (char *)realloc(wrapper->result_buffer, buffer_size);
-            if (!new_buffer)
-            {
-                free(wrapper->result_buffer);
-                wrapper->result_buffer = strdup("Error: Failed to allocate memory for transcription");
-                return wrapper->result_buffer;
-            }
-            wrapper->result_buffer = new_buffer;
+            ret = WHISPER_WRAPPER_ERR_INFERENCE;
+            break;
         }
+    }
+    if (n < 0)
+    {
+        ret = WHISPER_WRAPPER_ERR_AUDIO;
+    }
 
-        // Append this segment
-        strcat(wrapper->result_buffer, segment_text);
+    free(block);
+    wav_reader_close(&reader);
+
+    if (ret != WHISPER_WRAPPER_OK)
+    {
+        return ret;
+    }
+
+    // zero padding completes the frames that overlap the end of the audio, as the offline mel does
+    static const float padding[WHISPER_N_FFT / 2] = {0};
+    if (whisper_mel_stream_push_with_state(wrapper->ctx, state->state, padding, WHISPER_N_FFT / 2, full_params.n_threads) < 0 ||
+        whisper_mel_stream_apply_with_state(wrapper->ctx, state->state, 0) != 0)
+    {
+        return WHISPER_WRAPPER_ERR_INFERENCE;
+    }
+
+    if (whisper_full_with_state(wrapper->ctx, state->state, full_params, NULL, 0) != 0)
+    {
+        return WHISPER_WRAPPER_ERR_INFERENCE;
+    }
+
+    return WHISPER_WRAPPER_OK;
+}
+
+int whisper_wrapper_n_segments(whisper_wrapper_state_t *state)
+{
+    return state != NULL ? whisper_full_n_segments_from_state(state->state) : 0;
+}
+
+int whisper_wrapper_get_text(whisper_wrapper_state_t *state, char *text, size_t text_size)
+{
+    if (state == NULL || (text == NULL && text_size > 0))
+    {
+        return WHISPER_WRAPPER_ERR_INVALID;
+    }
+
+    const int n_segments = whisper_full_n_segments_from_state(state->state);
+
+    // join the segments with a space, truncating but always counting the full length
+    size_t length = 0;
+    for (int i = 0; i < n_segments; i++)
+    {
+        const char *segment_text = whisper_full_get_segment_text_from_state(state->state, i);
+        const size_t segment_length = strlen(segment_text);
+
+        if (length < text_size)
+        {
+            const size_t n = segment_length < text_size - length ? segment_length : text_size - length;
+            memcpy(text + length, segment_text, n);
+        }
+        length += segment_length;
 
-        // Add space between segments
         if (i < n_segments - 1)
         {
-            strcat(wrapper->result_buffer, " ");
+            if (length < text_size)
+            {
+                text[length] = ' ';
+            }
+            length += 1;
         }
     }
 
-    return wrapper->result_buffer;
+    if (text_size > 0)
+    {
+        text[length < text_size ? length : text_size - 1] = '\0';
+    }
+
+    return (int)length;
 }
 
-// Original transcribe function now calls the new one with auto language detection
-const char *whisper_wrapper_transcribe(whisper_wrapper_t *wrapper, const char *audio_path)
+int whisper_wrapper_get_segments(whisper_wrapper_state_t *state, whisper_wrapper_segment_t *segments, int max_segments, char *arena, size_t arena_size)
 {
-    return whisper_wrapper_transcribe_with_lang(wrapper, audio_path, true);
+    if (state == NULL || (segments == NULL && max_segments > 0) || (arena == NULL && arena_size > 0))
+    {
+        return WHISPER_WRAPPER_ERR_INVALID;
+    }
+
+    const int n_segments = whisper_full_n_segments_from_state(state->state);
+
+    size_t used = 0;
+    int i = 0;
+    for (; i < n_segments && i < max_segments; i++)
+    {
+        const char *segment_text = whisper_full_get_segment_text_from_state(state->state, i);
+        const size_t segment_size = strlen(segment_text) + 1;
+        if (segment_size > arena_size - used)
+        {
+            break;
+        }
+        memcpy(arena + used, segment_text, segment_size);
+
+        segments[i].t0_ms = whisper_full_get_segment_t0_from_state(state->state, i) * 10;
+        segments[i].t1_ms = whisper_full_get_segment_t1_from_state(state->state, i) * 10;
+        segments[i].no_speech_prob = whisper_full_get_segment_no_speech_prob_from_state(state->state, i);
+        segments[i].text = arena + used;
+
+        used += segment_size;
+    }
+
+    return i;
 }
 
-const char *whisper_wrapper_transcribe_pcm_with_lang(whisper_wrapper_t *wrapper, const float *pcm_data, int n_samples, bool use_language_detection)
+int whisper_wrapper_transcribe_pcm_into(whisper_wrapper_t *wrapper, const whisper_wrapper_params_t *params, const float *pcm_data, int n_samples, char *text, size_t text_size)
 {
-    if (wrapper == NULL || wrapper->ctx == NULL || pcm_data == NULL || n_samples <= 0)
+    whisper_wrapper_state_t *state = whisper_wrapper_acquire(wrapper);
+    if (state == NULL)
     {
-        return "Error: Invalid parameters";
+        return WHISPER_WRAPPER_ERR_INVALID;
     }
 
-    // Free any previous result
-    if (wrapper->result_buffer != NULL)
+    int ret = whisper_wrapper_run(wrapper, state, params, pcm_data, n_samples);
+    if (ret == WHISPER_WRAPPER_OK)
     {
-        free(wrapper->result_buffer);
-        wrapper->result_buffer = NULL;
+        ret = whisper_wrapper_get_text(state, text, text_size);
     }
 
-    // Use whisper_full_params for transcription
-    struct whisper_full_params params = whisper_full_default_params(WHISPER_SAMPLING_GREEDY);
+    whisper_wrapper_release(wrapper, state);
 
-    // Set parameters for transcription
-    setup_params(&params, use_language_detection);
-    params.no_context = true;
-    params.single_segment = true;
+    return ret;
+}
 
-    // Run the whisper inference directly on the provided PCM data
-    if (whisper_full(wrapper->ctx, params, pcm_data, n_samples) != 0)
+// Runs a v1 transcription and returns its text from the result buffer of the calling thread.
+static const char *legacy_transcribe(whisper_wrapper_t *wrapper, const whisper_wrapper_params_t *params, const float *pcm_data, int n_samples, const char *audio_path)
+{
+    struct whisper_wrapper_result *result = result_get();
+    if (result == NULL)
     {
-        wrapper->result_buffer = strdup("Error: Failed to process audio with whisper");
-        return wrapper->result_buffer;
+        return "Error: Failed to allocate memory for transcription";
     }
 
-    // Get the transcription result
-    int n_segments = whisper_full_n_segments(wrapper->ctx);
-    if (n_segments <= 0)
+    whisper_wrapper_state_t *state = whisper_wrapper_acquire(wrapper);
+
+    const int ret = audio_path != NULL ? whisper_wrapper_run_file(wrapper, state, params, audio_path)
+                                       : whisper_wrapper_run(wrapper, state, params, pcm_data, n_samples);
+    if (ret != WHISPER_WRAPPER_OK)
     {
-        wrapper->result_buffer = strdup("No speech detected");
-        return wrapper->result_buffer;
+        whisper_wrapper_release(wrapper, state);
+        return ret == WHISPER_WRAPPER_ERR_AUDIO ? "Error: Failed to load audio file" : "Error: Failed to process audio with whisper";
     }
 
-    // Allocate a buffer for the result (estimate size)
-    int buffer_size = 1024 * 16; // 16KB initial buffer
-    wrapper->result_buffer = (char *)malloc(buffer_size);
-    if (!wrapper->result_buffer)
+    if (whisper_wrapper_n_segments(state) <= 0)
     {
-        return "Error: Failed to allocate memory for transcription";
+        whisper_wrapper_release(wrapper, state);
+        return "No speech detected";
     }
-    wrapper->result_buffer[0] = '\0'; // Empty string initially
 
-    // Concatenate all segments
-    for (int i = 0; i < n_segments; i++)
+    int length = whisper_wrapper_get_text(state, result->data, result->size);
+    if ((size_t)length >= result->size)
     {
-        const char *segment_text = whisper_full_get_segment_text(wrapper->ctx, i);
-        int current_length = strlen(wrapper->result_buffer);
-        int segment_length = strlen(segment_text);
-
-        // Check if we need to expand the buffer
-        if (current_length + segment_length + 2 > buffer_size)
+        // only grows for results that do not fit in the preallocated buffer
+        size_t new_size = result->size;
+        while (new_size <= (size_t)length)
         {
-            buffer_size *= 2;
-            char *new_buffer = (char *)realloc(wrapper->result_buffer, buffer_size);
-            if (!new_buffer)
-            {
-                free(wrapper->result_buffer);
-                wrapper->result_buffer = strdup("Error: Failed to allocate memory for transcription");
-                return wrapper->result_buffer;
-            }
-            wrapper->result_buffer = new_buffer;
+            new_size *= 2;
         }
 
-        // Append this segment
-        strcat(wrapper->result_buffer, segment_text);
-
-        // Add space between segments
-        if (i < n_segments - 1)
+        char *new_buffer = (char *)realloc(result->data, new_size);
+        if (!new_buffer)
         {
-            strcat(wrapper->result_buffer, " ");
+            whisper_wrapper_release(wrapper, state);
+            return "Error: Failed to allocate memory for transcription";
         }
+        result->data = new_buffer;
+        result->size = new_size;
+
+        whisper_wrapper_get_text(state, result->data, result->size);
     }
 
-    return wrapper->result_buffer;
+    whisper_wrapper_release(wrapper, state);
+
+    return result->data;
+}
+
+const char *whisper_wrapper_transcribe_with_lang(whisper_wrapper_t *wrapper, const char *audio_path, bool use_language_detection)
+{
+    if (wrapper == NULL || wrapper->ctx == NULL || audio_path == NULL)
+    {
+        return "Error: Invalid parameters";
+    }
+
+    const whisper_wrapper_params_t params = legacy_params(use_language_detection);
+
+    return legacy_transcribe(wrapper, &params, NULL, 0, audio_path);
+}
+
+// Original transcribe function now calls the new one with auto language detection
+const char *whisper_wrapper_transcribe(whisper_wrapper_t *wrapper, const char *audio_path)
+{
+    return whisper_wrapper_transcribe_with_lang(wrapper, audio_path, true);
+}
+
+const char *whisper_wrapper_transcribe_pcm_with_lang(whisper_wrapper_t *wrapper, const float *pcm_data, int n_samples, bool use_language_detection)
+{
+    if (wrapper == NULL || wrapper->ctx == NULL || pcm_data == NULL || n_samples <= 0)
+    {
+        return "Error: Invalid parameters";
+    }
+
+    whisper_wrapper_params_t params = legacy_params(use_language_detection);
+    params.no_context = true;
+    params.single_segment = true;
+
+    return legacy_transcribe(wrapper, &params, pcm_data, n_samples, NULL);
 }
 
 // Original PCM transcribe function now calls the new one with auto language detection
 const char *whisper_wrapper_transcribe_pcm(whisper_wrapper_t *wrapper, const float *pcm_data, int n_samples)
 {
     return whisper_wrapper_transcribe_pcm_with_lang(wrapper, pcm_data, n_samples, true);
-}
\ No newline at end of file
+}
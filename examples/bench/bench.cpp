@@ -1,14 +1,45 @@
 #include "whisper.h"
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
+#include <new>
 #include <string>
 #include <thread>
+#include <vector>
+
+#if defined(__linux__)
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// number of heap allocations made through operator new in this process (the whisper library included)
+static std::atomic<size_t> g_n_alloc(0);
+
+void * operator new(size_t size) {
+    g_n_alloc++;
+    if (void * ptr = malloc(size > 0 ? size : 1)) {
+        return ptr;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void * ptr) noexcept {
+    free(ptr);
+}
+
+void operator delete(void * ptr, size_t) noexcept {
+    free(ptr);
+}
 
 // command-line parameters
 struct whisper_params {
     int32_t n_threads = std::min(4, (int32_t) std::thread::hardware_concurrency());
-    int32_t what = 0; // what to benchmark: 0 - whisper encoder, 1 - memcpy, 2 - ggml_mul_mat
+    int32_t what = 0; // what to benchmark: 0 - whisper encoder, 1 - memcpy, 2 - ggml_mul_mat, 3 - model load, 4 - logits, 5 - beam search, 6 - tokenizer, 7 - adaptive audio_ctx, 8 - DTW token timestamps, 9 - command scoring, 10 - KV cache type
 
     std::string model = "models/ggml-base.en.bin";
 
@@ -55,6 +86,14 @@ void whisper_print_usage(int /*argc*/, char ** argv, const whisper_params & para
     fprintf(stderr, "                           %-7s  0 - whisper\n",                                 "");
     fprintf(stderr, "                           %-7s  1 - memcpy\n",                                  "");
     fprintf(stderr, "                           %-7s  2 - ggml_mul_mat\n",                            "");
+    fprintf(stderr, "                           %-7s  3 - model load (read vs mmap, cold vs warm)\n", "");
+    fprintf(stderr, "                           %-7s  4 - logit processing (fused kernels vs scalar)\n", "");
+    fprintf(stderr, "                           %-7s  5 - beam search decoding (heap allocations)\n", "");
+    fprintf(stderr, "                           %-7s  6 - tokenizer (hashed vocab vs std::regex + std::map)\n", "");
+    fprintf(stderr, "                           %-7s  7 - adaptive audio context on short clips (latency and agreement)\n", "");
+    fprintf(stderr, "                           %-7s  8 - DTW token timestamps (overhead per audio minute)\n", "");
+    fprintf(stderr, "                           %-7s  9 - batched command scoring (latency vs number of commands)\n", "");
+    fprintf(stderr, "                           %-7s 10 - quantized KV cache (memory per state and WER vs F16)\n", "");
     fprintf(stderr, "\n");
 }
 
@@ -155,6 +194,674 @@ static int whisper_bench_full(const whisper_params & params) {
     return 0;
 }
 
+// evict the model file from the page cache so that the next load is a cold start
+// returns false if this is not possible on the current platform
+static bool whisper_bench_drop_file_cache(const std::string & path) {
+#if defined(__linux__)
+    const int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    const bool ok = fdatasync(fd) == 0 && posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED) == 0;
+    close(fd);
+    return ok;
+#else
+    (void) path;
+    return false;
+#endif
+}
+
+static int whisper_bench_load(const whisper_params & params) {
+    struct load_mode {
+        const char * name;
+        bool use_mmap;
+        bool mmap_prefetch;
+    };
+
+    const load_mode modes[] = {
+        { "read",          false, false },
+        { "mmap",          true,  false },
+        { "mmap+prefetch", true,  true  },
+    };
+
+    const bool can_drop = whisper_bench_drop_file_cache(params.model);
+    if (!can_drop) {
+        fprintf(stderr, "%s: warning: cannot evict the model from the page cache - cold runs are warm\n", __func__);
+    }
+
+    whisper_log_set([](enum ggml_log_level, const char *, void *) { }, nullptr);
+
+    fprintf(stderr, "\n");
+    fprintf(stderr, "%-14s %-5s %10s %14s\n", "mode", "start", "load [ms]", "1st enc [ms]");
+
+    for (const auto & mode : modes) {
+        for (int warm = 0; warm < 2; ++warm) {
+            if (!warm && can_drop) {
+                whisper_bench_drop_file_cache(params.model);
+            }
+
+            struct whisper_context_params cparams = whisper_context_default_params();
+
+            cparams.use_gpu       = params.use_gpu;
+            cparams.flash_attn    = params.flash_attn;
+            cparams.use_mmap      = mode.use_mmap;
+            cparams.mmap_prefetch = mode.mmap_prefetch;
+
+            const auto t_start = std::chrono::steady_clock::now();
+
+            struct whisper_context * ctx = whisper_init_from_file_with_params_no_state(params.model.c_str(), cparams);
+            if (ctx == nullptr) {
+                fprintf(stderr, "error: failed to initialize whisper context\n");
+                return 2;
+            }
+
+            const auto t_load = std::chrono::steady_clock::now();
+
+            // with mmap, the page faults are paid on first use - include the first encoder pass
+            struct whisper_state * state = whisper_init_state(ctx);
+            if (state == nullptr) {
+                fprintf(stderr, "error: failed to initialize whisper state\n");
+                whisper_free(ctx);
+                return 2;
+            }
+
+            if (whisper_set_mel_with_state(ctx, state, nullptr, 0, whisper_model_n_mels(ctx)) != 0 ||
+                whisper_encode_with_state(ctx, state, 0, params.n_threads) != 0) {
+                fprintf(stderr, "error: failed to encode\n");
+                whisper_free_state(state);
+                whisper_free(ctx);
+                return 4;
+            }
+
+            const auto t_enc = std::chrono::steady_clock::now();
+
+            whisper_free_state(state);
+            whisper_free(ctx);
+
+            fprintf(stderr, "%-14s %-5s %10.2f %14.2f\n", mode.name, warm ? "warm" : "cold",
+                    std::chrono::duration<double, std::milli>(t_load - t_start).count(),
+                    std::chrono::duration<double, std::milli>(t_enc  - t_load ).count());
+        }
+    }
+
+    fprintf(stderr, "\n");
+
+    return 0;
+}
+
+static int whisper_bench_tokenize(const whisper_params & params) {
+    struct whisper_context_params cparams = whisper_context_default_params();
+
+    cparams.use_gpu = params.use_gpu;
+
+    whisper_log_set([](enum ggml_log_level, const char *, void *) { }, nullptr);
+
+    struct whisper_context * ctx = whisper_init_from_file_with_params_no_state(params.model.c_str(), cparams);
+    if (ctx == nullptr) {
+        fprintf(stderr, "error: failed to initialize whisper context\n");
+        return 2;
+    }
+
+    const int ret = whisper_bench_tokenize(ctx);
+
+    whisper_free(ctx);
+
+    return ret;
+}
+
+// len_s seconds of a deterministic chirp with noise, so that the decoders have something to transcribe
+// the sweep restarts every 10 s to stay in the same frequency range on long clips
+static std::vector<float> bench_chirp(float len_s) {
+    std::vector<float> pcmf32((size_t) (len_s*WHISPER_SAMPLE_RATE));
+
+    uint32_t seed = 1;
+    for (size_t i = 0; i < pcmf32.size(); ++i) {
+        const double t = double(i)/WHISPER_SAMPLE_RATE;
+        seed = seed*1664525u + 1013904223u;
+        pcmf32[i] = 0.3f*sinf(2.0*M_PI*(200.0 + 40.0*fmod(t, 10.0))*t) + 0.05f*(float(seed >> 8)/float(1 << 24) - 0.5f);
+    }
+
+    return pcmf32;
+}
+
+static int whisper_bench_beam(const whisper_params & params) {
+    struct whisper_context_params cparams = whisper_context_default_params();
+
+    cparams.use_gpu    = params.use_gpu;
+    cparams.flash_attn = params.flash_attn;
+
+    whisper_log_set([](enum ggml_log_level, const char *, void *) { }, nullptr);
+
+    struct whisper_context * ctx = whisper_init_from_file_with_params(params.model.c_str(), cparams);
+    if (ctx == nullptr) {
+        fprintf(stderr, "error: failed to initialize whisper context\n");
+        return 2;
+    }
+
+    const std::vector<float> pcmf32 = bench_chirp(20.0f);
+
+    // root ::= [a-z0-9 ]*
+    const whisper_grammar_element rule_root[] = {
+        { WHISPER_GRETYPE_RULE_REF, 1 }, { WHISPER_GRETYPE_END, 0 },
+    };
+    const whisper_grammar_element rule_text[] = {
+        { WHISPER_GRETYPE_CHAR, 'a' }, { WHISPER_GRETYPE_CHAR_RNG_UPPER, 'z' },
+        { WHISPER_GRETYPE_CHAR_ALT, '0' }, { WHISPER_GRETYPE_CHAR_RNG_UPPER, '9' }, { WHISPER_GRETYPE_CHAR_ALT, ' ' },
+        { WHISPER_GRETYPE_RULE_REF, 1 }, { WHISPER_GRETYPE_ALT, 0 }, { WHISPER_GRETYPE_END, 0 },
+    };
+    const whisper_grammar_element * grammar_rules[] = { rule_root, rule_text };
+
+    struct bench_case {
+        const char * name;
+        whisper_sampling_strategy strategy;
+        int n;
+        float temperature;
+        bool grammar;
+    };
+
+    const bench_case cases[] = {
+        { "greedy",         WHISPER_SAMPLING_GREEDY,      1, 0.0f, false },
+        { "greedy x5",      WHISPER_SAMPLING_GREEDY,      5, 0.0f, false },
+        { "sampling x5",    WHISPER_SAMPLING_GREEDY,      5, 0.5f, false },
+        { "beam 2",         WHISPER_SAMPLING_BEAM_SEARCH, 2, 0.0f, false },
+        { "beam 5",         WHISPER_SAMPLING_BEAM_SEARCH, 5, 0.0f, false },
+        { "beam 5 grammar", WHISPER_SAMPLING_BEAM_SEARCH, 5, 0.0f, true  },
+    };
+
+    fprintf(stderr, "\n");
+    fprintf(stderr, "%-14s %8s %10s %10s %11s\n", "decoding", "steps", "time [ms]", "allocs", "allocs/step");
+
+    for (const auto & bc : cases) {
+        struct whisper_full_params wparams = whisper_full_default_params(bc.strategy);
+
+        wparams.n_threads        = params.n_threads;
+        wparams.language         = "en";
+        wparams.temperature      = bc.temperature;
+        wparams.temperature_inc  = 0.0f; // no fallback
+        wparams.seed             = 0;    // every run decodes the same tokens
+        wparams.no_timestamps    = true;
+        wparams.greedy.best_of   = bc.n;
+        wparams.beam_search.beam_size = bc.n;
+
+        if (bc.grammar) {
+            wparams.grammar_rules   = grammar_rules;
+            wparams.n_grammar_rules = 2;
+            wparams.i_start_rule    = 0;
+        }
+
+        // count the sampling steps of all decoders
+        // the end of text and the timestamps are suppressed so that each window is decoded up to the maximum length
+        // the decoders are sampled concurrently on the threadpool of the state, hence the atomic counter
+        std::atomic<int> n_steps(0);
+
+        wparams.logits_filter_callback = [](struct whisper_context * ctx, struct whisper_state *, const whisper_token_data *, int, float * logits, void * user_data) {
+            logits[whisper_token_eot(ctx)] = -INFINITY;
+            ++*(std::atomic<int> *) user_data;
+        };
+        wparams.logits_filter_callback_user_data = &n_steps;
+
+        // the first run allocates the buffers of the state
+        for (int run = 0; run < 2; ++run) {
+            const size_t n_alloc0 = g_n_alloc;
+
+            n_steps = 0;
+
+            const auto   t_start  = std::chrono::steady_clock::now();
+
+            if (whisper_full(ctx, wparams, pcmf32.data(), pcmf32.size()) != 0) {
+                fprintf(stderr, "error: failed to process audio\n");
+                whisper_free(ctx);
+                return 4;
+            }
+
+            const auto   t_end   = std::chrono::steady_clock::now();
+            const size_t n_alloc = g_n_alloc - n_alloc0;
+
+            if (run == 0) {
+                continue;
+            }
+
+            fprintf(stderr, "%-14s %8d %10.2f %10zu %11.2f\n", bc.name, n_steps.load(),
+                    std::chrono::duration<double, std::milli>(t_end - t_start).count(), n_alloc, double(n_alloc)/std::max(1, n_steps.load()));
+        }
+    }
+
+    fprintf(stderr, "\n");
+
+    whisper_free(ctx);
+
+    return 0;
+}
+
+// short clips transcribed with the full audio context and with the smallest reserved bucket that covers them
+// the agreement is the share of the tokens of the full context result found in the same order in the adaptive one
+static int whisper_bench_audio_ctx(const whisper_params & params) {
+    struct whisper_context_params cparams = whisper_context_default_params();
+
+    cparams.use_gpu           = params.use_gpu;
+    cparams.flash_attn        = params.flash_attn;
+    cparams.audio_ctx_buckets = 6;
+
+    whisper_log_set([](enum ggml_log_level, const char *, void *) { }, nullptr);
+
+    struct whisper_context * ctx = whisper_init_from_file_with_params(params.model.c_str(), cparams);
+    if (ctx == nullptr) {
+        fprintf(stderr, "error: failed to initialize whisper context\n");
+        return 2;
+    }
+
+    // returns the tokens of the result and the encoder time of the best of 3 runs
+    auto run = [&](const std::vector<float> & pcmf32, bool adaptive, double & t_encode_ms, double & t_total_ms) {
+        struct whisper_full_params wparams = whisper_full_default_params(WHISPER_SAMPLING_GREEDY);
+
+        wparams.n_threads          = params.n_threads;
+        wparams.language           = "en";
+        wparams.temperature_inc    = 0.0f; // no fallback
+        wparams.print_progress     = false;
+        wparams.audio_ctx_adaptive = adaptive;
+
+        std::vector<whisper_token> tokens;
+
+        t_encode_ms = 1e9;
+        t_total_ms  = 1e9;
+
+        for (int i = 0; i < 3; ++i) {
+            whisper_reset_timings(ctx);
+
+            const auto t_start = std::chrono::steady_clock::now();
+
+            if (whisper_full(ctx, wparams, pcmf32.data(), pcmf32.size()) != 0) {
+                fprintf(stderr, "error: failed to process audio\n");
+                return tokens;
+            }
+
+            const auto t_end = std::chrono::steady_clock::now();
+
+            struct whisper_timings * timings = whisper_get_timings(ctx);
+            t_encode_ms = std::min(t_encode_ms, (double) timings->encode_ms);
+            delete timings;
+
+            t_total_ms = std::min(t_total_ms, std::chrono::duration<double, std::milli>(t_end - t_start).count());
+        }
+
+        for (int i = 0; i < whisper_full_n_segments(ctx); ++i) {
+            for (int j = 0; j < whisper_full_n_tokens(ctx, i); ++j) {
+                const whisper_token id = whisper_full_get_token_id(ctx, i, j);
+                if (id < whisper_token_eot(ctx)) {
+                    tokens.push_back(id);
+                }
+            }
+        }
+
+        return tokens;
+    };
+
+    // longest common subsequence
+    auto n_common = [](const std::vector<whisper_token> & a, const std::vector<whisper_token> & b) {
+        std::vector<int> row(b.size() + 1, 0);
+        for (size_t i = 0; i < a.size(); ++i) {
+            int diag = 0;
+            for (size_t j = 0; j < b.size(); ++j) {
+                const int up = row[j + 1];
+                row[j + 1] = a[i] == b[j] ? diag + 1 : std::max(row[j + 1], row[j]);
+                diag = up;
+            }
+        }
+        return row[b.size()];
+    };
+
+    fprintf(stderr, "\n");
+    fprintf(stderr, "%8s | %14s %14s | %14s %14s | %8s %9s\n",
+            "clip [s]", "full enc [ms]", "full tot [ms]", "adapt enc [ms]", "adapt tot [ms]", "speedup", "agreement");
+
+    for (const float len_s : { 2.0f, 4.0f, 8.0f, 15.0f, 30.0f }) {
+        const std::vector<float> pcmf32 = bench_chirp(len_s);
+
+        double t_enc_full  = 0.0, t_tot_full  = 0.0;
+        double t_enc_adapt = 0.0, t_tot_adapt = 0.0;
+
+        const auto tokens_full  = run(pcmf32, false, t_enc_full,  t_tot_full);
+        const auto tokens_adapt = run(pcmf32, true,  t_enc_adapt, t_tot_adapt);
+
+        const double agreement = tokens_full.empty() ? 1.0 : double(n_common(tokens_full, tokens_adapt))/tokens_full.size();
+
+        fprintf(stderr, "%8.1f | %14.2f %14.2f | %14.2f %14.2f | %7.2fx %8.1f%%\n",
+                len_s, t_enc_full, t_tot_full, t_enc_adapt, t_tot_adapt, t_tot_full/t_tot_adapt, 100.0*agreement);
+    }
+
+    fprintf(stderr, "\n");
+
+    whisper_free(ctx);
+
+    return 0;
+}
+
+// one minute of audio transcribed without and with DTW token timestamps (the top half of the text layers as alignment
+// heads), the difference is the DTW overhead per audio minute
+static int whisper_bench_dtw(const whisper_params & params) {
+    whisper_log_set([](enum ggml_log_level, const char *, void *) { }, nullptr);
+
+    struct whisper_context_params cparams = whisper_context_default_params();
+
+    cparams.use_gpu    = params.use_gpu;
+    cparams.flash_attn = false; // DTW is not supported with flash attention
+
+    struct whisper_context * ctx = whisper_init_from_file_with_params(params.model.c_str(), cparams);
+    if (ctx == nullptr) {
+        fprintf(stderr, "error: failed to initialize whisper context\n");
+        return 2;
+    }
+
+    cparams.dtw_token_timestamps = true;
+    cparams.dtw_aheads_preset    = WHISPER_AHEADS_N_TOP_MOST;
+    cparams.dtw_n_top            = std::max(1, whisper_model_n_text_layer(ctx)/2);
+
+    struct whisper_context * ctx_dtw = whisper_init_from_file_with_params(params.model.c_str(), cparams);
+    if (ctx_dtw == nullptr) {
+        fprintf(stderr, "error: failed to initialize whisper context\n");
+        whisper_free(ctx);
+        return 2;
+    }
+
+    const float len_s = 60.0f;
+
+    const std::vector<float> pcmf32 = bench_chirp(len_s);
+
+    fprintf(stderr, "\n");
+    fprintf(stderr, "%-12s | %12s %12s | %14s %14s | %6s %10s\n",
+            "strategy", "plain [ms]", "dtw [ms]", "overhead/min", "dtw time/min", "runs", "re-decoded");
+
+    for (const auto strategy : { WHISPER_SAMPLING_GREEDY, WHISPER_SAMPLING_BEAM_SEARCH }) {
+        struct whisper_full_params wparams = whisper_full_default_params(strategy);
+
+        wparams.n_threads       = params.n_threads;
+        wparams.language        = "en";
+        wparams.temperature_inc = 0.0f; // no fallback, both contexts decode the same tokens
+        wparams.print_progress  = false;
+
+        // best of 3 runs, the first one also allocates the buffers of the state
+        auto run = [&](struct whisper_context * wctx, struct whisper_timings & timings) {
+            double t_best_ms = 1e9;
+
+            for (int i = 0; i < 3; ++i) {
+                whisper_reset_timings(wctx);
+
+                const auto t_start = std::chrono::steady_clock::now();
+
+                if (whisper_full(wctx, wparams, pcmf32.data(), pcmf32.size()) != 0) {
+                    fprintf(stderr, "error: failed to process audio\n");
+                    return -1.0;
+                }
+
+                const double t_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t_start).count();
+                if (t_ms < t_best_ms) {
+                    struct whisper_timings * t = whisper_get_timings(wctx);
+                    timings   = *t;
+                    t_best_ms = t_ms;
+                    delete t;
+                }
+            }
+
+            return t_best_ms;
+        };
+
+        struct whisper_timings timings_plain;
+        struct whisper_timings timings_dtw;
+
+        const double t_plain_ms = run(ctx,     timings_plain);
+        const double t_dtw_ms   = run(ctx_dtw, timings_dtw);
+
+        if (t_plain_ms < 0.0 || t_dtw_ms < 0.0) {
+            break;
+        }
+
+        const double n_min = len_s/60.0;
+
+        fprintf(stderr, "%-12s | %12.2f %12.2f | %11.2f ms %11.2f ms | %6d %10d\n",
+                strategy == WHISPER_SAMPLING_GREEDY ? "greedy" : "beam search", t_plain_ms, t_dtw_ms,
+                (t_dtw_ms - t_plain_ms)/n_min, timings_dtw.dtw_ms/n_min, timings_dtw.n_dtw, timings_dtw.n_dtw_redecode);
+    }
+
+    fprintf(stderr, "\n");
+
+    whisper_free(ctx_dtw);
+    whisper_free(ctx);
+
+    return 0;
+}
+
+static int whisper_bench_score(const whisper_params & params) {
+    whisper_log_set([](enum ggml_log_level, const char *, void *) { }, nullptr);
+
+    struct whisper_context_params cparams = whisper_context_default_params();
+
+    cparams.use_gpu    = params.use_gpu;
+    cparams.flash_attn = params.flash_attn;
+
+    struct whisper_context * ctx = whisper_init_from_file_with_params(params.model.c_str(), cparams);
+    if (ctx == nullptr) {
+        fprintf(stderr, "error: failed to initialize whisper context\n");
+        return 2;
+    }
+
+    // 2 s of audio, encoded once
+    const std::vector<float> pcmf32 = bench_chirp(2.0f);
+
+    if (whisper_pcm_to_mel(ctx, pcmf32.data(), pcmf32.size(), params.n_threads) != 0 ||
+        whisper_encode(ctx, 0, params.n_threads) != 0) {
+        fprintf(stderr, "error: failed to encode the audio\n");
+        whisper_free(ctx);
+        return 3;
+    }
+
+    std::vector<whisper_token> prompt = { whisper_token_sot(ctx) };
+    if (whisper_is_multilingual(ctx)) {
+        prompt.push_back(whisper_token_lang(ctx, whisper_lang_id("en")));
+        prompt.push_back(whisper_token_transcribe(ctx));
+    }
+    prompt.push_back(whisper_token_not(ctx));
+
+    // voice-assistant style commands: verb + object, sometimes with a qualifier
+    const char * verbs[]   = { "turn on", "turn off", "open", "close", "play", "stop", "show", "hide", "start", "call" };
+    const char * objects[] = { "the light", "the door", "the window", "music", "the radio", "the fan", "the oven",
+                               "the garage", "the camera", "the alarm", "the heater", "the blinds", "the tv",
+                               "the timer", "the kettle" };
+    const char * quals[]   = { "", " in the kitchen", " in the bedroom", " now" };
+
+    std::vector<std::vector<whisper_token>> commands;
+    for (const char * q : quals) {
+        for (const char * o : objects) {
+            for (const char * v : verbs) {
+                const std::string cmd = std::string(" ") + v + " " + o + q;
+
+                whisper_token tokens[64];
+                const int n = whisper_tokenize(ctx, cmd.c_str(), tokens, 64);
+
+                commands.emplace_back(tokens, tokens + std::max(0, n));
+                commands.back().push_back(whisper_token_eot(ctx));
+            }
+        }
+    }
+
+    fprintf(stderr, "\n");
+    fprintf(stderr, "%8s %8s | %12s %12s | %14s %8s\n", "commands", "tokens", "scored [ms]", "per cmd [ms]", "one/cmd [ms]", "speedup");
+
+    for (const int n_commands : { 10, 30, 100, 300, 600 }) {
+        std::vector<const whisper_token *> candidates;
+        std::vector<int> n_candidate_tokens;
+
+        int n_tokens = 0;
+        for (int i = 0; i < n_commands; ++i) {
+            const auto & cmd = commands[i % commands.size()];
+            candidates.push_back(cmd.data());
+            n_candidate_tokens.push_back(cmd.size());
+            n_tokens += cmd.size();
+        }
+
+        std::vector<float> logprobs(n_commands);
+
+        // best of 3, the first call also allocates the scoring batch
+        double t_score_ms = 1e9;
+        for (int k = 0; k < 3; ++k) {
+            const auto t_start = std::chrono::steady_clock::now();
+
+            if (whisper_score(ctx, prompt.data(), prompt.size(), candidates.data(), n_candidate_tokens.data(),
+                        n_commands, logprobs.data(), params.n_threads) != 0) {
+                fprintf(stderr, "error: failed to score the commands\n");
+                whisper_free(ctx);
+                return 4;
+            }
+
+            t_score_ms = std::min(t_score_ms, std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t_start).count());
+        }
+
+        // one forced decode per command after the shared prompt
+        double t_seq_ms = 0.0;
+        {
+            const auto t_start = std::chrono::steady_clock::now();
+
+            whisper_decode(ctx, prompt.data(), prompt.size(), 0, params.n_threads);
+            for (int i = 0; i < n_commands; ++i) {
+                whisper_decode(ctx, candidates[i], n_candidate_tokens[i], prompt.size(), params.n_threads);
+            }
+
+            t_seq_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t_start).count();
+        }
+
+        fprintf(stderr, "%8d %8d | %12.2f %12.3f | %14.2f %7.2fx\n",
+                n_commands, n_tokens, t_score_ms, t_score_ms/n_commands, t_seq_ms, t_seq_ms/t_score_ms);
+    }
+
+    fprintf(stderr, "\n");
+
+    whisper_free(ctx);
+
+    return 0;
+}
+
+// word-level edit distance between two transcripts
+static int whisper_bench_word_distance(const std::string & a, const std::string & b) {
+    auto split = [](const std::string & s) {
+        std::vector<std::string> words;
+        std::string word;
+        for (const char c : s) {
+            if (c == ' ' || c == '\n') {
+                if (!word.empty()) {
+                    words.push_back(word);
+                    word.clear();
+                }
+            } else {
+                word += c;
+            }
+        }
+        if (!word.empty()) {
+            words.push_back(word);
+        }
+        return words;
+    };
+
+    const auto wa = split(a);
+    const auto wb = split(b);
+
+    std::vector<int> prev(wb.size() + 1);
+    std::vector<int> cur (wb.size() + 1);
+
+    for (size_t j = 0; j <= wb.size(); ++j) {
+        prev[j] = j;
+    }
+
+    for (size_t i = 1; i <= wa.size(); ++i) {
+        cur[0] = i;
+        for (size_t j = 1; j <= wb.size(); ++j) {
+            cur[j] = std::min(std::min(prev[j] + 1, cur[j - 1] + 1), prev[j - 1] + (wa[i - 1] == wb[j - 1] ? 0 : 1));
+        }
+        std::swap(prev, cur);
+    }
+
+    return prev[wb.size()];
+}
+
+static int whisper_bench_kv_type(const whisper_params & params) {
+    whisper_log_set([](enum ggml_log_level, const char *, void *) { }, nullptr);
+
+    const float len_s = 30.0f;
+
+    const std::vector<float> pcmf32 = bench_chirp(len_s);
+
+    fprintf(stderr, "\n");
+    fprintf(stderr, "%-5s %-6s | %10s %12s | %10s | %6s %8s\n",
+            "fa", "kv", "kv [MB]", "state [MB]", "time [ms]", "words", "WER");
+
+    for (const bool flash_attn : { false, true }) {
+        std::string text_ref;
+
+        for (const auto kv_type : { GGML_TYPE_F16, GGML_TYPE_Q8_0, GGML_TYPE_Q4_0 }) {
+            struct whisper_context_params cparams = whisper_context_default_params();
+
+            cparams.use_gpu    = params.use_gpu;
+            cparams.flash_attn = flash_attn;
+            cparams.kv_type    = kv_type;
+
+            struct whisper_context * ctx = whisper_init_from_file_with_params_no_state(params.model.c_str(), cparams);
+            if (ctx == nullptr) {
+                fprintf(stderr, "error: failed to initialize whisper context\n");
+                return 2;
+            }
+
+            struct whisper_state * state = whisper_init_state(ctx);
+            if (state == nullptr) {
+                fprintf(stderr, "error: failed to initialize whisper state\n");
+                whisper_free(ctx);
+                return 2;
+            }
+
+            struct whisper_full_params wparams = whisper_full_default_params(WHISPER_SAMPLING_BEAM_SEARCH);
+
+            wparams.n_threads             = params.n_threads;
+            wparams.language              = "en";
+            wparams.beam_search.beam_size = 5;
+            wparams.temperature_inc       = 0.0f; // no fallback, compare a single pass per KV type
+            wparams.print_progress        = false;
+
+            const auto t_start = std::chrono::steady_clock::now();
+
+            if (whisper_full_with_state(ctx, state, wparams, pcmf32.data(), pcmf32.size()) != 0) {
+                fprintf(stderr, "error: failed to process audio\n");
+                whisper_free_state(state);
+                whisper_free(ctx);
+                return 3;
+            }
+
+            const double t_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t_start).count();
+
+            std::string text;
+            for (int i = 0; i < whisper_full_n_segments_from_state(state); ++i) {
+                text += whisper_full_get_segment_text_from_state(state, i);
+                text += " ";
+            }
+
+            if (kv_type == GGML_TYPE_F16) {
+                text_ref = text;
+            }
+
+            const int n_ref   = std::max(1, whisper_bench_word_distance(text_ref, ""));
+            const int n_error = whisper_bench_word_distance(text_ref, text);
+
+            fprintf(stderr, "%-5s %-6s | %10.2f %12.2f | %10.2f | %6d %7.2f%%\n",
+                    flash_attn ? "on" : "off", ggml_type_name(kv_type),
+                    whisper_state_kv_size(state)/1e6, whisper_state_memory_size(state)/1e6, t_ms,
+                    whisper_bench_word_distance(text, ""), 100.0*n_error/n_ref);
+
+            whisper_free_state(state);
+            whisper_free(ctx);
+        }
+    }
+
+    fprintf(stderr, "\n");
+
+    return 0;
+}
+
 int main(int argc, char ** argv) {
     whisper_params params;
 
@@ -168,6 +875,14 @@ int main(int argc, char ** argv) {
         case 0: ret = whisper_bench_full(params);                break;
         case 1: ret = whisper_bench_memcpy(params.n_threads);       break;
         case 2: ret = whisper_bench_ggml_mul_mat(params.n_threads); break;
+        case 3: ret = whisper_bench_load(params);                   break;
+        case 4: ret = whisper_bench_logits();                       break;
+        case 5: ret = whisper_bench_beam(params);                   break;
+        case 6: ret = whisper_bench_tokenize(params);               break;
+        case 7: ret = whisper_bench_audio_ctx(params);              break;
+        case 8: ret = whisper_bench_dtw(params);                    break;
+        case 9: ret = whisper_bench_score(params);                  break;
+        case 10: ret = whisper_bench_kv_type(params);               break;
         default: fprintf(stderr, "error: unknown benchmark: %d\n", params.what); break;
     }
 
@@ -44,6 +44,7 @@ struct whisper_params {
     int32_t best_of       = whisper_full_default_params(WHISPER_SAMPLING_GREEDY).greedy.best_of;
     int32_t beam_size     = whisper_full_default_params(WHISPER_SAMPLING_BEAM_SEARCH).beam_search.beam_size;
     int32_t audio_ctx     = 0;
+    int32_t draft_n       = whisper_full_default_params(WHISPER_SAMPLING_GREEDY).draft_n_tokens;
 
     float word_thold      =  0.01f;
     float entropy_thold   =  2.40f;
@@ -82,6 +83,7 @@ struct whisper_params {
     std::string prompt;
     std::string font_path = "/System/Library/Fonts/Supplemental/Courier New Bold.ttf";
     std::string model     = "models/ggml-base.en.bin";
+    std::string model_draft;
     std::string grammar;
     std::string grammar_rule;
 
@@ -176,6 +178,8 @@ static bool whisper_params_parse(int argc, char ** argv, whisper_params & params
         else if (arg == "-dl"   || arg == "--detect-language") { params.detect_language = true; }
         else if (                  arg == "--prompt")          { params.prompt          = ARGV_NEXT; }
         else if (arg == "-m"    || arg == "--model")           { params.model           = ARGV_NEXT; }
+        else if (arg == "-md"   || arg == "--model-draft")     { params.model_draft     = ARGV_NEXT; }
+        else if (arg == "-dn"   || arg == "--draft-n")         { params.draft_n         = std::stoi(ARGV_NEXT); }
         else if (arg == "-f"    || arg == "--file")            { params.fname_inp.emplace_back(ARGV_NEXT); }
         else if (arg == "-oved" || arg == "--ov-e-device")     { params.openvino_encode_device = ARGV_NEXT; }
         else if (arg == "-dtw"  || arg == "--dtw")             { params.dtw             = ARGV_NEXT; }
@@ -244,6 +248,8 @@ static void whisper_print_usage(int /*argc*/, char ** argv, const whisper_params
     fprintf(stderr, "  -dl,       --detect-language   [%-7s] exit after automatically detecting language\n",    params.detect_language ? "true" : "false");
     fprintf(stderr, "             --prompt PROMPT     [%-7s] initial prompt (max n_text_ctx/2 tokens)\n",       params.prompt.c_str());
     fprintf(stderr, "  -m FNAME,  --model FNAME       [%-7s] model path\n",                                     params.model.c_str());
+    fprintf(stderr, "  -md FNAME, --model-draft FNAME [%-7s] draft model for speculative decoding (greedy only)\n", params.model_draft.c_str());
+    fprintf(stderr, "  -dn N,     --draft-n N         [%-7d] number of tokens to draft per step\n",             params.draft_n);
     fprintf(stderr, "  -f FNAME,  --file FNAME        [%-7s] input WAV file path\n",                            "");
     fprintf(stderr, "  -oved D,   --ov-e-device DNAME [%-7s] the OpenVINO device used for encode inference\n",  params.openvino_encode_device.c_str());
     fprintf(stderr, "  -dtw MODEL --dtw MODEL         [%-7s] compute token-level timestamps\n",                 params.dtw.c_str());
@@ -1039,6 +1045,22 @@ int main(int argc, char ** argv) {
     // initialize openvino encoder. this has no effect on whisper.cpp builds that don't have OpenVINO configured
     whisper_ctx_init_openvino_encoder(ctx, nullptr, params.openvino_encode_device.c_str(), nullptr);
 
+    // the draft model for speculative decoding, without DTW token timestamps
+    // it runs on a state owned by the state of ctx, so it does not need a default state
+    struct whisper_context * ctx_draft = nullptr;
+    if (!params.model_draft.empty()) {
+        struct whisper_context_params cparams_draft = cparams;
+        cparams_draft.dtw_token_timestamps = false;
+
+        ctx_draft = whisper_init_from_file_with_params_no_state(params.model_draft.c_str(), cparams_draft);
+
+        if (ctx_draft == nullptr) {
+            fprintf(stderr, "error: failed to initialize the draft whisper context\n");
+            whisper_free(ctx);
+            return 3;
+        }
+    }
+
     if (!params.grammar.empty()) {
         auto & grammar = params.grammar_parsed;
         if (is_file_exist(params.grammar.c_str())) {
@@ -1140,6 +1162,9 @@ int main(int argc, char ** argv) {
             wparams.greedy.best_of        = params.best_of;
             wparams.beam_search.beam_size = params.beam_size;
 
+            wparams.draft_ctx        = ctx_draft;
+            wparams.draft_n_tokens   = params.draft_n;
+
             wparams.temperature_inc  = params.no_fallback ? 0.0f : params.temperature_inc;
             wparams.temperature      = params.temperature;
 
@@ -1267,6 +1292,7 @@ int main(int argc, char ** argv) {
         whisper_print_timings(ctx);
     }
     whisper_free(ctx);
+    whisper_free(ctx_draft);
 
     return 0;
 }
@@ -44,6 +44,7 @@ struct whisper_params {
     bool no_timestamps = true;
     bool use_gpu       = true;
     bool flash_attn    = false;
+    bool score         = false;
 
     std::string language  = "en";
     std::string model     = "models/ggml-base.en.bin";
@@ -80,6 +81,7 @@ static bool whisper_params_parse(int argc, char ** argv, whisper_params & params
         else if (arg == "-pe"  || arg == "--print-energy")  { params.print_energy  = true; }
         else if (arg == "-ng"  || arg == "--no-gpu")        { params.use_gpu       = false; }
         else if (arg == "-fa"  || arg == "--flash-attn")    { params.flash_attn    = true; }
+        else if (arg == "-sc"  || arg == "--score")         { params.score         = true; }
         else if (arg == "-l"   || arg == "--language")      { params.language      = argv[++i]; }
         else if (arg == "-m"   || arg == "--model")         { params.model         = argv[++i]; }
         else if (arg == "-f"   || arg == "--file")          { params.fname_out     = argv[++i]; }
@@ -118,6 +120,7 @@ void whisper_print_usage(int /*argc*/, char ** argv, const whisper_params & para
     fprintf(stderr, "  -pe,        --print-energy   [%-7s] print sound energy (for debugging)\n",          params.print_energy ? "true" : "false");
     fprintf(stderr, "  -ng,        --no-gpu         [%-7s] disable GPU\n",                                 params.use_gpu ? "false" : "true");
     fprintf(stderr, "  -fa,        --flash-attn     [%-7s] flash attention\n",                             params.flash_attn ? "true" : "false");
+    fprintf(stderr, "  -sc,        --score          [%-7s] guided mode: score the full commands in one batched pass\n", params.score ? "true" : "false");
     fprintf(stderr, "  -l LANG,    --language LANG  [%-7s] spoken language\n",                             params.language.c_str());
     fprintf(stderr, "  -m FNAME,   --model FNAME    [%-7s] model path\n",                                  params.model.c_str());
     fprintf(stderr, "  -f FNAME,   --file FNAME     [%-7s] text output file name\n",                       params.fname_out.c_str());
@@ -461,6 +464,195 @@ static int process_command_list(struct whisper_context * ctx, audio_async &audio
     return 0;
 }
 
+// command-list mode, scored
+// encode the audio once and score every command in full with whisper_score()
+static int process_command_list_scored(struct whisper_context * ctx, audio_async &audio, const whisper_params &params) {
+    fprintf(stderr, "\n");
+    fprintf(stderr, "%s: guided mode (scored)\n", __func__);
+
+    std::vector<std::string> allowed_commands = read_allowed_commands(params.commands);
+
+    if (allowed_commands.empty()) {
+        fprintf(stderr, "%s: error: failed to read allowed commands from '%s'\n", __func__, params.commands.c_str());
+        return 2;
+    }
+
+    if (params.audio_ctx > 0) {
+        fprintf(stderr, "%s: warning: the audio context is not reduced in this mode, ignoring -ac %d\n", __func__, params.audio_ctx);
+    }
+
+    int max_len = 0;
+
+    // each candidate is the whole command followed by the end of the transcription
+    std::vector<std::vector<whisper_token>> allowed_tokens;
+
+    for (const auto & cmd : allowed_commands) {
+        whisper_token tokens[1024];
+
+        // NOTE: very important to add the whitespace !
+        //       the reason is that the first decoded token starts with a whitespace too!
+        const std::string ss = std::string(" ") + cmd;
+
+        const int n = whisper_tokenize(ctx, ss.c_str(), tokens, 1024);
+        if (n < 0) {
+            fprintf(stderr, "%s: error: failed to tokenize command '%s'\n", __func__, cmd.c_str());
+            return 3;
+        }
+
+        allowed_tokens.emplace_back(tokens, tokens + n);
+        allowed_tokens.back().push_back(whisper_token_eot(ctx));
+
+        max_len = std::max(max_len, (int) cmd.size());
+    }
+
+    fprintf(stderr, "%s: allowed commands [ tokens ]:\n", __func__);
+    fprintf(stderr, "\n");
+    for (int i = 0; i < (int) allowed_commands.size(); ++i) {
+        fprintf(stderr, "  - \033[1m%-*s\033[0m = [", max_len, allowed_commands[i].c_str());
+        for (const auto & token : allowed_tokens[i]) {
+            fprintf(stderr, " %5d", token);
+        }
+        fprintf(stderr, " ]\n");
+    }
+
+    std::string k_prompt = "select one from the available words: ";
+    for (int i = 0; i < (int) allowed_commands.size(); ++i) {
+        if (i > 0) {
+            k_prompt += ", ";
+        }
+        k_prompt += allowed_commands[i];
+    }
+    k_prompt += ". selected word: ";
+
+    // [prev, prompt tail, sot, lang, task, notimestamps] - like whisper_full(), at most half of the text context
+    std::vector<whisper_token> k_tokens;
+    {
+        std::vector<whisper_token> tokens(1024);
+        const int n = whisper_tokenize(ctx, k_prompt.c_str(), tokens.data(), 1024);
+        if (n < 0) {
+            fprintf(stderr, "%s: error: failed to tokenize prompt '%s'\n", __func__, k_prompt.c_str());
+            return 4;
+        }
+
+        const int n_keep = std::min(n, whisper_n_text_ctx(ctx)/2 - 5);
+
+        k_tokens.push_back(whisper_token_prev(ctx));
+        k_tokens.insert(k_tokens.end(), tokens.begin() + (n - n_keep), tokens.begin() + n);
+        k_tokens.push_back(whisper_token_sot(ctx));
+        if (whisper_is_multilingual(ctx)) {
+            k_tokens.push_back(whisper_token_lang(ctx, std::max(0, whisper_lang_id(params.language.c_str()))));
+            k_tokens.push_back(params.translate ? whisper_token_translate(ctx) : whisper_token_transcribe(ctx));
+        }
+        k_tokens.push_back(whisper_token_not(ctx));
+    }
+
+    std::vector<const whisper_token *> candidates;
+    std::vector<int> n_candidate_tokens;
+    for (const auto & tokens : allowed_tokens) {
+        if ((int) (k_tokens.size() + tokens.size()) > whisper_n_text_ctx(ctx)) {
+            fprintf(stderr, "%s: error: command too long for the text context\n", __func__);
+            return 4;
+        }
+        candidates.push_back(tokens.data());
+        n_candidate_tokens.push_back(tokens.size());
+    }
+
+    fprintf(stderr, "\n");
+    fprintf(stderr, "%s: prompt: '%s'\n", __func__, k_prompt.c_str());
+    fprintf(stderr, "%s: tokens: [", __func__);
+    for (const auto & token : k_tokens) {
+        fprintf(stderr, " %d", token);
+    }
+    fprintf(stderr, " ]\n");
+
+    fprintf(stderr, "\n");
+    fprintf(stderr, "%s: listening for a command ...\n", __func__);
+    fprintf(stderr, "\n");
+
+    bool is_running  = true;
+
+    std::vector<float> pcmf32_cur;
+    std::vector<float> logprobs(allowed_commands.size());
+
+    // main loop
+    while (is_running) {
+        // handle Ctrl + C
+        is_running = sdl_poll_events();
+
+        // delay
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+        audio.get(2000, pcmf32_cur);
+
+        if (::vad_simple(pcmf32_cur, WHISPER_SAMPLE_RATE, 1000, params.vad_thold, params.freq_thold, params.print_energy)) {
+            fprintf(stdout, "%s: Speech detected! Processing ...\n", __func__);
+
+            const auto t_start = std::chrono::high_resolution_clock::now();
+
+            // encode once, then score all commands in batches
+            if (whisper_pcm_to_mel(ctx, pcmf32_cur.data(), pcmf32_cur.size(), params.n_threads) != 0 ||
+                whisper_encode(ctx, 0, params.n_threads) != 0) {
+                fprintf(stderr, "%s: ERROR: failed to encode the audio\n", __func__);
+                break;
+            }
+
+            if (whisper_score(ctx, k_tokens.data(), k_tokens.size(), candidates.data(), n_candidate_tokens.data(),
+                        candidates.size(), logprobs.data(), params.n_threads) != 0) {
+                fprintf(stderr, "%s: ERROR: whisper_score() failed\n", __func__);
+                break;
+            }
+
+            // probability of each command among the allowed ones
+            std::vector<std::pair<float, int>> probs_id;
+            {
+                const float max = *std::max_element(logprobs.begin(), logprobs.end());
+
+                double psum = 0.0;
+                for (int i = 0; i < (int) allowed_commands.size(); ++i) {
+                    probs_id.emplace_back(expf(logprobs[i] - max), i);
+                    psum += probs_id.back().first;
+                }
+
+                for (auto & p : probs_id) {
+                    p.first /= psum;
+                }
+
+                using pair_type = decltype(probs_id)::value_type;
+                std::sort(probs_id.begin(), probs_id.end(), [](const pair_type & a, const pair_type & b) {
+                    return a.first > b.first;
+                });
+            }
+
+            // print the commands, the respective probabilities and log-probabilities
+            {
+                fprintf(stdout, "\n");
+                for (const auto & cmd : probs_id) {
+                    fprintf(stdout, "%s: %s%-*s%s = %f | logprob = %8.3f\n", __func__, "\033[1m", max_len,
+                            allowed_commands[cmd.second].c_str(), "\033[0m", cmd.first, logprobs[cmd.second]);
+                }
+            }
+
+            // best command
+            {
+                const auto t_end = std::chrono::high_resolution_clock::now();
+
+                const float prob = probs_id[0].first;
+                const int index = probs_id[0].second;
+
+                fprintf(stdout, "\n");
+                fprintf(stdout, "%s: detected command: %s%s%s | p = %f | t = %d ms\n", __func__,
+                        "\033[1m", allowed_commands[index].c_str(), "\033[0m", prob,
+                        (int) std::chrono::duration_cast<std::chrono::milliseconds>(t_end - t_start).count());
+                fprintf(stdout, "\n");
+            }
+
+            audio.clear();
+        }
+    }
+
+    return 0;
+}
+
 // always-prompt mode
 // transcribe the voice into text after valid prompt
 static int always_prompt_transcription(struct whisper_context * ctx, audio_async & audio, const whisper_params & params) {
@@ -759,7 +951,9 @@ int main(int argc, char ** argv) {
     }
 
     if (ret_val == 0) {
-        if (!params.commands.empty()) {
+        if (!params.commands.empty() && params.score) {
+            ret_val = process_command_list_scored(ctx, audio, params);
+        } else if (!params.commands.empty()) {
             ret_val = process_command_list(ctx, audio, params);
         } else if (!params.prompt.empty() && params.grammar_parsed.rules.empty()) {
             ret_val = always_prompt_transcription(ctx, audio, params);
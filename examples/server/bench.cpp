@@ -0,0 +1,215 @@
+// load generator for whisper-server
+//
+// sends the same WAV file to the /inference endpoint from several concurrent clients
+// and reports the request throughput and the latency distribution
+//
+#include "common.h"
+
+#include "whisper.h"
+#include "httplib.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(_MSC_VER)
+#pragma warning(disable: 4244 4267) // possible loss of data
+#endif
+
+namespace {
+
+struct bench_params {
+    std::string hostname        = "127.0.0.1";
+    std::string inference_path  = "/inference";
+    std::string fname_inp       = "samples/jfk.wav";
+    std::string response_format = "json";
+
+    int32_t port          = 8080;
+    int32_t n_clients     = 4;
+    int32_t n_requests    = 32;
+    int32_t n_warmup      = 1;
+    int32_t read_timeout  = 600;
+};
+
+void bench_print_usage(int /*argc*/, char ** argv, const bench_params & params) {
+    fprintf(stderr, "\n");
+    fprintf(stderr, "usage: %s [options]\n", argv[0]);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "options:\n");
+    fprintf(stderr, "  -h,       --help             [default] show this help message and exit\n");
+    fprintf(stderr, "  -f FNAME, --file FNAME       [%-7s] WAV file sent with every request\n",          params.fname_inp.c_str());
+    fprintf(stderr, "  -c N,     --clients N        [%-7d] number of concurrent clients\n",              params.n_clients);
+    fprintf(stderr, "  -n N,     --requests N       [%-7d] total number of measured requests\n",         params.n_requests);
+    fprintf(stderr, "  -w N,     --warmup N         [%-7d] number of unmeasured requests sent first\n",  params.n_warmup);
+    fprintf(stderr, "  -rf FMT,  --response-format  [%-7s] response format requested from the server\n", params.response_format.c_str());
+    fprintf(stderr, "  --host HOST,                 [%-7s] hostname of the server\n",                    params.hostname.c_str());
+    fprintf(stderr, "  --port PORT,                 [%-7d] port of the server\n",                        params.port);
+    fprintf(stderr, "  --inference-path PATH,       [%-7s] inference path of the server\n",              params.inference_path.c_str());
+    fprintf(stderr, "\n");
+}
+
+bool bench_params_parse(int argc, char ** argv, bench_params & params) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+
+        if (arg == "-h" || arg == "--help") {
+            bench_print_usage(argc, argv, params);
+            exit(0);
+        }
+        else if (arg == "-f"  || arg == "--file")            { params.fname_inp       = argv[++i]; }
+        else if (arg == "-c"  || arg == "--clients")         { params.n_clients       = std::stoi(argv[++i]); }
+        else if (arg == "-n"  || arg == "--requests")        { params.n_requests      = std::stoi(argv[++i]); }
+        else if (arg == "-w"  || arg == "--warmup")          { params.n_warmup        = std::stoi(argv[++i]); }
+        else if (arg == "-rf" || arg == "--response-format") { params.response_format = argv[++i]; }
+        else if (                arg == "--host")            { params.hostname        = argv[++i]; }
+        else if (                arg == "--port")            { params.port            = std::stoi(argv[++i]); }
+        else if (                arg == "--inference-path")  { params.inference_path  = argv[++i]; }
+        else {
+            fprintf(stderr, "error: unknown argument: %s\n", arg.c_str());
+            bench_print_usage(argc, argv, params);
+            return false;
+        }
+    }
+
+    return params.n_clients > 0 && params.n_requests > 0;
+}
+
+// nearest-rank percentile of an already sorted sample
+double percentile(const std::vector<double> & sorted, double p) {
+    if (sorted.empty()) {
+        return 0.0;
+    }
+    const size_t idx = std::min(sorted.size() - 1, (size_t) std::max(0.0, std::ceil(p/100.0*sorted.size()) - 1));
+    return sorted[idx];
+}
+
+}  // namespace
+
+int main(int argc, char ** argv) {
+    bench_params params;
+
+    if (bench_params_parse(argc, argv, params) == false) {
+        bench_print_usage(argc, argv, params);
+        return 1;
+    }
+
+    std::string content;
+    {
+        std::ifstream fin(params.fname_inp, std::ios::binary);
+        if (!fin) {
+            fprintf(stderr, "error: failed to open '%s'\n", params.fname_inp.c_str());
+            return 2;
+        }
+        std::stringstream ss;
+        ss << fin.rdbuf();
+        content = ss.str();
+    }
+
+    // the audio length is only used to report the real-time factor
+    float audio_sec = 0.0f;
+    {
+        std::vector<float> pcmf32;
+        std::vector<std::vector<float>> pcmf32s;
+        if (::read_wav(content, pcmf32, pcmf32s, false)) {
+            audio_sec = float(pcmf32.size())/WHISPER_SAMPLE_RATE;
+        } else {
+            fprintf(stderr, "warning: '%s' is not a WAV file the server can read\n", params.fname_inp.c_str());
+        }
+    }
+
+    const httplib::MultipartFormDataItems items = {
+        { "file",            content,                params.fname_inp, "audio/wav" },
+        { "response_format", params.response_format, "",               ""          },
+    };
+
+    // returns the latency of one request in ms, or a negative value on failure
+    auto send = [&](httplib::Client & cli) -> double {
+        const auto t_start = std::chrono::steady_clock::now();
+        auto res = cli.Post(params.inference_path, items);
+        const auto t_end = std::chrono::steady_clock::now();
+
+        if (!res || res->status != 200 || res->body.find("\"error\"") != std::string::npos) {
+            return -1.0;
+        }
+
+        return std::chrono::duration<double, std::milli>(t_end - t_start).count();
+    };
+
+    fprintf(stderr, "%s: sending %d requests (+%d warmup) from %d clients to %s:%d%s\n", __func__,
+            params.n_requests, params.n_warmup, params.n_clients, params.hostname.c_str(), params.port, params.inference_path.c_str());
+
+    for (int i = 0; i < params.n_warmup; ++i) {
+        httplib::Client cli(params.hostname, params.port);
+        cli.set_read_timeout(params.read_timeout, 0);
+        if (send(cli) < 0.0) {
+            fprintf(stderr, "error: warmup request failed - is the server running?\n");
+            return 3;
+        }
+    }
+
+    std::atomic<int> n_next  (0);
+    std::atomic<int> n_failed(0);
+
+    std::vector<std::vector<double>> latencies(params.n_clients);
+    std::vector<std::thread> workers(params.n_clients);
+
+    const auto t_start = std::chrono::steady_clock::now();
+
+    for (int i = 0; i < params.n_clients; ++i) {
+        workers[i] = std::thread([&, i]() {
+            httplib::Client cli(params.hostname, params.port);
+            cli.set_read_timeout(params.read_timeout, 0);
+            cli.set_keep_alive(true);
+
+            while (n_next.fetch_add(1) < params.n_requests) {
+                const double ms = send(cli);
+                if (ms < 0.0) {
+                    n_failed++;
+                } else {
+                    latencies[i].push_back(ms);
+                }
+            }
+        });
+    }
+
+    for (auto & w : workers) {
+        w.join();
+    }
+
+    const double t_total_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - t_start).count();
+
+    std::vector<double> all;
+    for (const auto & l : latencies) {
+        all.insert(all.end(), l.begin(), l.end());
+    }
+    std::sort(all.begin(), all.end());
+
+    double sum = 0.0;
+    for (double ms : all) {
+        sum += ms;
+    }
+
+    const int n_ok = (int) all.size();
+
+    fprintf(stderr, "\n");
+    fprintf(stderr, "%s: requests    = %d ok, %d failed\n", __func__, n_ok, n_failed.load());
+    fprintf(stderr, "%s: wall time   = %8.2f s\n", __func__, t_total_s);
+    fprintf(stderr, "%s: throughput  = %8.2f req/s\n", __func__, n_ok/t_total_s);
+    if (audio_sec > 0.0f) {
+        fprintf(stderr, "%s: audio       = %8.2f s/s (%.1f s per request)\n", __func__, n_ok*audio_sec/t_total_s, audio_sec);
+    }
+    fprintf(stderr, "%s: latency avg = %8.2f ms\n", __func__, n_ok > 0 ? sum/n_ok : 0.0);
+    fprintf(stderr, "%s: latency p50 = %8.2f ms\n", __func__, percentile(all, 50.0));
+    fprintf(stderr, "%s: latency p90 = %8.2f ms\n", __func__, percentile(all, 90.0));
+    fprintf(stderr, "%s: latency p99 = %8.2f ms\n", __func__, percentile(all, 99.0));
+    fprintf(stderr, "%s: latency max = %8.2f ms\n", __func__, all.empty() ? 0.0 : all.back());
+
+    return n_failed > 0 ? 4 : 0;
+}
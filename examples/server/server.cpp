@@ -12,6 +12,8 @@
 #include <vector>
 #include <cstring>
 #include <sstream>
+#include <mutex>
+#include <condition_variable>
 
 #if defined(_MSC_VER)
 #pragma warning(disable: 4244 4267) // possible loss of data
@@ -39,6 +41,7 @@ struct server_params
     int32_t port          = 8080;
     int32_t read_timeout  = 600;
     int32_t write_timeout = 600;
+    int32_t n_parallel    = 1;
 
     bool ffmpeg_converter = false;
 };
@@ -137,6 +140,7 @@ void whisper_print_usage(int /*argc*/, char ** argv, const whisper_params & para
     fprintf(stderr, "  --request-path PATH,           [%-7s] Request path for all requests\n", sparams.request_path.c_str());
     fprintf(stderr, "  --inference-path PATH,         [%-7s] Inference path for all requests\n", sparams.inference_path.c_str());
     fprintf(stderr, "  --convert,                     [%-7s] Convert audio to WAV, requires ffmpeg on the server\n", sparams.ffmpeg_converter ? "true" : "false");
+    fprintf(stderr, "  -np N,    --parallel N         [%-7d] number of requests processed concurrently\n", sparams.n_parallel);
     fprintf(stderr, "  -sns,      --suppress-nst      [%-7s] suppress non-speech tokens\n", params.suppress_nst ? "true" : "false");
     fprintf(stderr, "  -nth N,    --no-speech-thold N [%-7.2f] no speech threshold\n",   params.no_speech_thold);
     fprintf(stderr, "\n");
@@ -193,6 +197,7 @@ bool whisper_params_parse(int argc, char ** argv, whisper_params & params, serve
         else if (                  arg == "--request-path")    { sparams.request_path = argv[++i]; }
         else if (                  arg == "--inference-path")  { sparams.inference_path = argv[++i]; }
         else if (                  arg == "--convert")         { sparams.ffmpeg_converter     = true; }
+        else if (arg == "-np"   || arg == "--parallel")        { sparams.n_parallel  = std::stoi(argv[++i]); }
         else {
             fprintf(stderr, "error: unknown argument: %s\n", arg.c_str());
             whisper_print_usage(argc, argv, params, sparams);
@@ -210,6 +215,99 @@ struct whisper_print_user_data {
     int progress_prev;
 };
 
+// pool of whisper_state objects sharing the weights of a single whisper_context
+// each in-flight request borrows one state, so up to n_parallel requests run concurrently
+struct whisper_state_pool {
+    std::mutex mutex;
+    std::condition_variable cv;
+
+    std::vector<whisper_state *> states;
+    std::vector<whisper_state *> idle;
+
+    // set while the model is being swapped - blocks new acquisitions
+    bool draining = false;
+
+    bool init(struct whisper_context * ctx, int n_states, const char * openvino_device) {
+        std::vector<whisper_state *> result;
+        for (int i = 0; i < n_states; ++i) {
+            whisper_state * state = whisper_init_state(ctx);
+            if (state == nullptr) {
+                fprintf(stderr, "error: failed to initialize whisper state %d / %d\n", i + 1, n_states);
+                for (auto * s : result) {
+                    whisper_free_state(s);
+                }
+                return false;
+            }
+
+            // initialize openvino encoder of each state. this has no effect on whisper.cpp builds that don't have OpenVINO configured
+            whisper_ctx_init_openvino_encoder_with_state(ctx, state, nullptr, openvino_device, nullptr);
+
+            result.push_back(state);
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        states = result;
+        idle   = result;
+
+        return true;
+    }
+
+    void free() {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto * state : states) {
+            whisper_free_state(state);
+        }
+        states.clear();
+        idle.clear();
+    }
+
+    whisper_state * acquire() {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [this] { return !draining && !idle.empty(); });
+
+        whisper_state * state = idle.back();
+        idle.pop_back();
+
+        return state;
+    }
+
+    void release(whisper_state * state) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            idle.push_back(state);
+        }
+        cv.notify_all();
+    }
+
+    // wait for all in-flight requests to finish and keep new ones out until end_exclusive()
+    void begin_exclusive() {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [this] { return !draining; });
+        draining = true;
+        cv.wait(lock, [this] { return idle.size() == states.size(); });
+    }
+
+    void end_exclusive() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            draining = false;
+        }
+        cv.notify_all();
+    }
+};
+
+// returns the borrowed state to the pool on every exit path of a request handler
+struct whisper_state_lease {
+    whisper_state_pool & pool;
+    whisper_state * state;
+
+    explicit whisper_state_lease(whisper_state_pool & pool) : pool(pool), state(pool.acquire()) {}
+    ~whisper_state_lease() { pool.release(state); }
+
+    whisper_state_lease(const whisper_state_lease &) = delete;
+    whisper_state_lease & operator=(const whisper_state_lease &) = delete;
+};
+
 void check_ffmpeg_availibility() {
     int result = system("ffmpeg -version");
 
@@ -309,11 +407,11 @@ void whisper_print_progress_callback(struct whisper_context * /*ctx*/, struct wh
     }
 }
 
-void whisper_print_segment_callback(struct whisper_context * ctx, struct whisper_state * /*state*/, int n_new, void * user_data) {
+void whisper_print_segment_callback(struct whisper_context * ctx, struct whisper_state * state, int n_new, void * user_data) {
     const auto & params  = *((whisper_print_user_data *) user_data)->params;
     const auto & pcmf32s = *((whisper_print_user_data *) user_data)->pcmf32s;
 
-    const int n_segments = whisper_full_n_segments(ctx);
+    const int n_segments = whisper_full_n_segments_from_state(state);
 
     std::string speaker = "";
 
@@ -329,8 +427,8 @@ void whisper_print_segment_callback(struct whisper_context * ctx, struct whisper
 
     for (int i = s0; i < n_segments; i++) {
         if (!params.no_timestamps || params.diarize) {
-            t0 = whisper_full_get_segment_t0(ctx, i);
-            t1 = whisper_full_get_segment_t1(ctx, i);
+            t0 = whisper_full_get_segment_t0_from_state(state, i);
+            t1 = whisper_full_get_segment_t1_from_state(state, i);
         }
 
         if (!params.no_timestamps) {
@@ -342,29 +440,29 @@ void whisper_print_segment_callback(struct whisper_context * ctx, struct whisper
         }
 
         if (params.print_colors) {
-            for (int j = 0; j < whisper_full_n_tokens(ctx, i); ++j) {
+            for (int j = 0; j < whisper_full_n_tokens_from_state(state, i); ++j) {
                 if (params.print_special == false) {
-                    const whisper_token id = whisper_full_get_token_id(ctx, i, j);
+                    const whisper_token id = whisper_full_get_token_id_from_state(state, i, j);
                     if (id >= whisper_token_eot(ctx)) {
                         continue;
                     }
                 }
 
-                const char * text = whisper_full_get_token_text(ctx, i, j);
-                const float  p    = whisper_full_get_token_p   (ctx, i, j);
+                const char * text = whisper_full_get_token_text_from_state(ctx, state, i, j);
+                const float  p    = whisper_full_get_token_p_from_state(state, i, j);
 
                 const int col = std::max(0, std::min((int) k_colors.size() - 1, (int) (std::pow(p, 3)*float(k_colors.size()))));
 
                 printf("%s%s%s%s", speaker.c_str(), k_colors[col].c_str(), text, "\033[0m");
             }
         } else {
-            const char * text = whisper_full_get_segment_text(ctx, i);
+            const char * text = whisper_full_get_segment_text_from_state(state, i);
 
             printf("%s%s", speaker.c_str(), text);
         }
 
         if (params.tinydiarize) {
-            if (whisper_full_get_segment_speaker_turn_next(ctx, i)) {
+            if (whisper_full_get_segment_speaker_turn_next_from_state(state, i)) {
                 printf("%s", params.tdrz_speaker_turn.c_str());
             }
         }
@@ -377,17 +475,17 @@ void whisper_print_segment_callback(struct whisper_context * ctx, struct whisper
     }
 }
 
-std::string output_str(struct whisper_context * ctx, const whisper_params & params, std::vector<std::vector<float>> pcmf32s) {
+std::string output_str(struct whisper_state * state, const whisper_params & params, std::vector<std::vector<float>> pcmf32s) {
     std::stringstream result;
-    const int n_segments = whisper_full_n_segments(ctx);
+    const int n_segments = whisper_full_n_segments_from_state(state);
     for (int i = 0; i < n_segments; ++i) {
-        const char * text = whisper_full_get_segment_text(ctx, i);
+        const char * text = whisper_full_get_segment_text_from_state(state, i);
         std::string speaker = "";
 
         if (params.diarize && pcmf32s.size() == 2)
         {
-            const int64_t t0 = whisper_full_get_segment_t0(ctx, i);
-            const int64_t t1 = whisper_full_get_segment_t1(ctx, i);
+            const int64_t t0 = whisper_full_get_segment_t0_from_state(state, i);
+            const int64_t t1 = whisper_full_get_segment_t1_from_state(state, i);
             speaker = estimate_diarization_speaker(pcmf32s, t0, t1);
         }
 
@@ -513,8 +611,6 @@ int main(int argc, char ** argv) {
     whisper_params params;
     server_params sparams;
 
-    std::mutex whisper_mutex;
-
     if (whisper_params_parse(argc, argv, params, sparams) == false) {
         whisper_print_usage(argc, argv, params, sparams);
         return 1;
@@ -532,6 +628,17 @@ int main(int argc, char ** argv) {
         exit(0);
     }
 
+    if (sparams.n_parallel < 1) {
+        fprintf(stderr, "error: --parallel must be at least 1\n");
+        whisper_print_usage(argc, argv, params, sparams);
+        exit(0);
+    }
+
+    if (params.n_processors > 1) {
+        fprintf(stderr, "warning: --processors is ignored by the server, use --parallel to run requests concurrently\n");
+        params.n_processors = 1;
+    }
+
     if (sparams.ffmpeg_converter) {
         check_ffmpeg_availibility();
     }
@@ -585,15 +692,19 @@ int main(int argc, char ** argv) {
         }
     }
 
-    struct whisper_context * ctx = whisper_init_from_file_with_params(params.model.c_str(), cparams);
+    // the model weights are loaded once and shared by all states in the pool
+    struct whisper_context * ctx = whisper_init_from_file_with_params_no_state(params.model.c_str(), cparams);
 
     if (ctx == nullptr) {
         fprintf(stderr, "error: failed to initialize whisper context\n");
         return 3;
     }
 
-    // initialize openvino encoder. this has no effect on whisper.cpp builds that don't have OpenVINO configured
-    whisper_ctx_init_openvino_encoder(ctx, nullptr, params.openvino_encode_device.c_str(), nullptr);
+    whisper_state_pool state_pool;
+    if (!state_pool.init(ctx, sparams.n_parallel, params.openvino_encode_device.c_str())) {
+        whisper_free(ctx);
+        return 3;
+    }
 
     Server svr;
     svr.set_default_headers({{"Server", "whisper.cpp"},
@@ -684,8 +795,8 @@ int main(int argc, char ** argv) {
     });
 
     svr.Post(sparams.request_path + sparams.inference_path, [&](const Request &req, Response &res){
-        // acquire whisper model mutex lock
-        std::lock_guard<std::mutex> lock(whisper_mutex);
+        // every request works on its own copy of the parameters - several may be in flight at once
+        whisper_params params = default_params;
 
         // first check user requested fields of the request
         if (!req.has_file("file"))
@@ -745,6 +856,10 @@ int main(int argc, char ** argv) {
 
         printf("Successfully loaded %s\n", filename.c_str());
 
+        // borrow a state from the pool - blocks while all of them are busy or the model is being reloaded
+        whisper_state_lease lease(state_pool);
+        whisper_state * state = lease.state;
+
         // print system information
         {
             fprintf(stderr, "\n");
@@ -858,7 +973,7 @@ int main(int argc, char ** argv) {
                 wparams.abort_callback_user_data = &is_aborted;
             }
 
-            if (whisper_full_parallel(ctx, wparams, pcmf32.data(), pcmf32.size(), params.n_processors) != 0) {
+            if (whisper_full_with_state(ctx, state, wparams, pcmf32.data(), pcmf32.size()) != 0) {
                 fprintf(stderr, "%s: failed to process audio\n", argv[0]);
                 const std::string error_resp = "{\"error\":\"failed to process audio\"}";
                 res.set_content(error_resp, "application/json");
@@ -869,17 +984,17 @@ int main(int argc, char ** argv) {
         // return results to user
         if (params.response_format == text_format)
         {
-            std::string results = output_str(ctx, params, pcmf32s);
+            std::string results = output_str(state, params, pcmf32s);
             res.set_content(results.c_str(), "text/html; charset=utf-8");
         }
         else if (params.response_format == srt_format)
         {
             std::stringstream ss;
-            const int n_segments = whisper_full_n_segments(ctx);
+            const int n_segments = whisper_full_n_segments_from_state(state);
             for (int i = 0; i < n_segments; ++i) {
-                const char * text = whisper_full_get_segment_text(ctx, i);
-                const int64_t t0 = whisper_full_get_segment_t0(ctx, i);
-                const int64_t t1 = whisper_full_get_segment_t1(ctx, i);
+                const char * text = whisper_full_get_segment_text_from_state(state, i);
+                const int64_t t0 = whisper_full_get_segment_t0_from_state(state, i);
+                const int64_t t1 = whisper_full_get_segment_t1_from_state(state, i);
                 std::string speaker = "";
 
                 if (params.diarize && pcmf32s.size() == 2)
@@ -897,11 +1012,11 @@ int main(int argc, char ** argv) {
 
             ss << "WEBVTT\n\n";
 
-            const int n_segments = whisper_full_n_segments(ctx);
+            const int n_segments = whisper_full_n_segments_from_state(state);
             for (int i = 0; i < n_segments; ++i) {
-                const char * text = whisper_full_get_segment_text(ctx, i);
-                const int64_t t0 = whisper_full_get_segment_t0(ctx, i);
-                const int64_t t1 = whisper_full_get_segment_t1(ctx, i);
+                const char * text = whisper_full_get_segment_text_from_state(state, i);
+                const int64_t t0 = whisper_full_get_segment_t0_from_state(state, i);
+                const int64_t t1 = whisper_full_get_segment_t1_from_state(state, i);
                 std::string speaker = "";
 
                 if (params.diarize && pcmf32s.size() == 2)
@@ -917,37 +1032,37 @@ int main(int argc, char ** argv) {
             res.set_content(ss.str(), "text/vtt");
         } else if (params.response_format == vjson_format) {
             /* try to match openai/whisper's Python format */
-            std::string results = output_str(ctx, params, pcmf32s);
+            std::string results = output_str(state, params, pcmf32s);
             json jres = json{
                 {"task", params.translate ? "translate" : "transcribe"},
-                {"language", whisper_lang_str_full(whisper_full_lang_id(ctx))},
+                {"language", whisper_lang_str_full(whisper_full_lang_id_from_state(state))},
                 {"duration", float(pcmf32.size())/WHISPER_SAMPLE_RATE},
                 {"text", results},
                 {"segments", json::array()}
             };
-            const int n_segments = whisper_full_n_segments(ctx);
+            const int n_segments = whisper_full_n_segments_from_state(state);
             for (int i = 0; i < n_segments; ++i)
             {
                 json segment = json{
                     {"id", i},
-                    {"text", whisper_full_get_segment_text(ctx, i)},
+                    {"text", whisper_full_get_segment_text_from_state(state, i)},
                 };
 
                 if (!params.no_timestamps) {
-                    segment["start"] = whisper_full_get_segment_t0(ctx, i) * 0.01;
-                    segment["end"] = whisper_full_get_segment_t1(ctx, i) * 0.01;
+                    segment["start"] = whisper_full_get_segment_t0_from_state(state, i) * 0.01;
+                    segment["end"] = whisper_full_get_segment_t1_from_state(state, i) * 0.01;
                 }
 
                 float total_logprob = 0;
-                const int n_tokens = whisper_full_n_tokens(ctx, i);
+                const int n_tokens = whisper_full_n_tokens_from_state(state, i);
                 for (int j = 0; j < n_tokens; ++j) {
-                    whisper_token_data token = whisper_full_get_token_data(ctx, i, j);
+                    whisper_token_data token = whisper_full_get_token_data_from_state(state, i, j);
                     if (token.id >= whisper_token_eot(ctx)) {
                         continue;
                     }
 
                     segment["tokens"].push_back(token.id);
-                    json word = json{{"word", whisper_full_get_token_text(ctx, i, j)}};
+                    json word = json{{"word", whisper_full_get_token_text_from_state(ctx, state, i, j)}};
                     if (!params.no_timestamps) {
                         word["start"] = token.t0 * 0.01;
                         word["end"] = token.t1 * 0.01;
@@ -963,7 +1078,7 @@ int main(int argc, char ** argv) {
 
                 // TODO compression_ratio and no_speech_prob are not implemented yet
                 // segment["compression_ratio"] = 0;
-                segment["no_speech_prob"] = whisper_full_get_segment_no_speech_prob(ctx, i);
+                segment["no_speech_prob"] = whisper_full_get_segment_no_speech_prob_from_state(state, i);
 
                 jres["segments"].push_back(segment);
             }
@@ -973,19 +1088,15 @@ int main(int argc, char ** argv) {
         // TODO add more output formats
         else
         {
-            std::string results = output_str(ctx, params, pcmf32s);
+            std::string results = output_str(state, params, pcmf32s);
             json jres = json{
                 {"text", results}
             };
             res.set_content(jres.dump(-1, ' ', false, json::error_handler_t::replace),
                             "application/json");
         }
-
-        // reset params to their defaults
-        params = default_params;
     });
     svr.Post(sparams.request_path + "/load", [&](const Request &req, Response &res){
-        std::lock_guard<std::mutex> lock(whisper_mutex);
         if (!req.has_file("model"))
         {
             fprintf(stderr, "error: no 'model' field in the request\n");
@@ -1002,20 +1113,23 @@ int main(int argc, char ** argv) {
             return;
         }
 
+        // wait for the in-flight requests to finish before swapping the model
+        state_pool.begin_exclusive();
+
         // clean up
+        state_pool.free();
         whisper_free(ctx);
 
         // whisper init
-        ctx = whisper_init_from_file_with_params(model.c_str(), cparams);
+        ctx = whisper_init_from_file_with_params_no_state(model.c_str(), cparams);
 
         // TODO perhaps load prior model here instead of exit
-        if (ctx == nullptr) {
+        if (ctx == nullptr || !state_pool.init(ctx, sparams.n_parallel, params.openvino_encode_device.c_str())) {
             fprintf(stderr, "error: model init  failed, no model loaded must exit\n");
             exit(1);
         }
 
-        // initialize openvino encoder. this has no effect on whisper.cpp builds that don't have OpenVINO configured
-        whisper_ctx_init_openvino_encoder(ctx, nullptr, params.openvino_encode_device.c_str(), nullptr);
+        state_pool.end_exclusive();
 
         const std::string success = "Load was successful!";
         res.set_content(success, "application/text");
@@ -1046,6 +1160,12 @@ int main(int argc, char ** argv) {
         }
     });
 
+    // keep enough http workers around so that every state in the pool can be busy
+    // while other connections are still being accepted and uploaded
+    svr.new_task_queue = [&sparams] {
+        return new ThreadPool(std::max<size_t>(CPPHTTPLIB_THREAD_POOL_COUNT, 2*sparams.n_parallel));
+    };
+
     // set timeouts and change hostname and port
     svr.set_read_timeout(sparams.read_timeout);
     svr.set_write_timeout(sparams.write_timeout);
@@ -1061,7 +1181,7 @@ int main(int argc, char ** argv) {
     svr.set_base_dir(sparams.public_path);
 
     // to make it ctrl+clickable:
-    printf("\nwhisper server listening at http://%s:%d\n\n", sparams.hostname.c_str(), sparams.port);
+    printf("\nwhisper server listening at http://%s:%d (%d parallel)\n\n", sparams.hostname.c_str(), sparams.port, sparams.n_parallel);
 
     if (!svr.listen_after_bind())
     {
@@ -1069,6 +1189,8 @@ int main(int argc, char ** argv) {
     }
 
     whisper_print_timings(ctx);
+
+    state_pool.free();
     whisper_free(ctx);
 
     return 0;
@@ -118,6 +118,36 @@ extern "C" {
         bool  flash_attn;
         int   gpu_device;  // CUDA device
 
+        // load the model through a read-only memory map of the file (whisper_init_from_file_* only)
+        // with the CPU backend the weight tensors point directly into the mapping, so the page
+        // cache is shared between all processes that load the same file
+        bool  use_mmap;
+        bool  mmap_prefetch; // ask the OS to read the whole mapping ahead instead of faulting it in lazily
+        bool  use_mlock;     // lock the mapped weights in RAM (requires use_mmap and the CPU backend)
+
+        // persistent CPU threadpool owned by each state and reused by the mel, encoder and decoder computations,
+        // instead of starting new threads for each of them
+        bool                     use_threadpool;
+        uint32_t                 threadpool_poll;       // busy-wait level of idle threads (0 - sleep right away (default), 100 - spin)
+        enum ggml_sched_priority threadpool_prio;
+        bool                     threadpool_strict_cpu; // pin each thread to a single core of the mask
+        const bool *             threadpool_cpumask;    // cores to run on (threadpool_n_cpumask entries), NULL - any core
+        int                      threadpool_n_cpumask;
+
+        // [EXPERIMENTAL] cache of encoder outputs shared by all states of the context, so that decoding the same audio
+        // again (e.g. with another language, prompt or sampling strategy) skips the encoder - see whisper_encoder_cache_*
+        size_t encoder_cache_size;  // memory budget in bytes, least recently used entries are dropped (0 - disabled)
+        bool   encoder_cache_cross; // also cache the cross-attention KV of each window (larger entries, no cross graph on a hit)
+
+        // [EXPERIMENTAL] reserve the encoder graphs of each state for audio contexts of n_audio_ctx*k/n (k = 1..n-1, rounded
+        // up to a multiple of 64) in addition to the full one - see whisper_full_params.audio_ctx_adaptive (0 - disabled)
+        int audio_ctx_buckets;
+
+        // [EXPERIMENTAL] type of the self- and cross-attention KV caches: GGML_TYPE_F16 (default), GGML_TYPE_F32 or a
+        // block-quantized type like GGML_TYPE_Q8_0. V is only quantized with flash_attn - without it the attention reads
+        // V transposed, one element per row. F16 is used if the attention head size is not a multiple of the block size
+        enum ggml_type kv_type;
+
         // [EXPERIMENTAL] Token-level timestamps with DTW
         bool dtw_token_timestamps;
         enum whisper_alignment_heads_preset dtw_aheads_preset;
@@ -125,7 +155,9 @@ extern "C" {
         int dtw_n_top;
         struct whisper_aheads dtw_aheads;
 
-        size_t dtw_mem_size; // TODO: remove
+        // [DEPRECATED] ignored - the DTW workspace is kept by each state and sized for the window being aligned
+        // the field is kept so that existing callers still compile, it will be removed
+        size_t dtw_mem_size;
     };
 
     typedef struct whisper_token_data {
@@ -259,6 +291,11 @@ extern "C" {
     WHISPER_API void whisper_free_params(struct whisper_full_params * params);
     WHISPER_API void whisper_free_context_params(struct whisper_context_params * params);
 
+    // Memory held by a state in bytes: its self- and cross-attention KV caches, and in total with the compute buffers
+    // The self-attention KV cache is recreated larger the first time whisper_full() runs with more decoders
+    WHISPER_API size_t whisper_state_kv_size    (struct whisper_state * state);
+    WHISPER_API size_t whisper_state_memory_size(struct whisper_state * state);
+
     // Convert RAW PCM audio to log mel spectrogram.
     // The resulting spectrogram is stored inside the default state of the provided whisper context.
     // Returns 0 on success
@@ -292,6 +329,51 @@ extern "C" {
                                int   n_len,
                                int   n_mel);
 
+    // [EXPERIMENTAL] Incremental log mel spectrogram for streaming audio
+    // whisper_mel_stream_push() appends samples to the stream of the state and computes only the frames that the new
+    // samples complete. The state keeps the tail of the audio that is not yet covered by a complete frame and a ring
+    // buffer of the last n_max_frames frames (0 - 30 seconds).
+    // whisper_mel_stream_apply() sets the mel of the state to the last n_frames buffered frames (0 - all of them), to be
+    // used with whisper_encode() or whisper_full() with n_samples = 0.
+    //
+    // Compared to whisper_pcm_to_mel() on the same audio:
+    //   - the buffered frames are identical, but the last few frames that overlap the end of the audio are only
+    //     computed once more samples arrive
+    //   - the dynamic range (max - 8 in log10 units) is clamped relative to the max of the applied window instead of
+    //     the max of the whole input, so a loud passage that left the window no longer affects the result
+    //
+    // whisper_mel_stream_push() returns the number of new frames, all functions return negative on failure
+    WHISPER_API int whisper_mel_stream_reset(
+            struct whisper_context * ctx,
+                               int   n_max_frames);
+
+    WHISPER_API int whisper_mel_stream_reset_with_state(
+            struct whisper_context * ctx,
+              struct whisper_state * state,
+                               int   n_max_frames);
+
+    WHISPER_API int whisper_mel_stream_push(
+            struct whisper_context * ctx,
+                       const float * samples,
+                               int   n_samples,
+                               int   n_threads);
+
+    WHISPER_API int whisper_mel_stream_push_with_state(
+            struct whisper_context * ctx,
+              struct whisper_state * state,
+                       const float * samples,
+                               int   n_samples,
+                               int   n_threads);
+
+    WHISPER_API int whisper_mel_stream_apply(
+            struct whisper_context * ctx,
+                               int   n_frames);
+
+    WHISPER_API int whisper_mel_stream_apply_with_state(
+            struct whisper_context * ctx,
+              struct whisper_state * state,
+                               int   n_frames);
+
     // Run the Whisper encoder on the log mel spectrogram stored inside the default state in the provided whisper context.
     // Make sure to call whisper_pcm_to_mel() or whisper_set_mel() first.
     // offset can be used to specify the offset of the first frame in the spectrogram.
@@ -328,6 +410,33 @@ extern "C" {
                                int   n_past,
                                int   n_threads);
 
+    // [EXPERIMENTAL] Score candidate token sequences against the audio last encoded on the state
+    // The prompt (e.g. [sot, lang, transcribe, notimestamps]) is decoded once, then the candidates are forced-decoded
+    // together: shared prefixes are decoded once and up to 31 candidates go in the same batch.
+    // logprobs[i] receives the sum of the log-probabilities of the tokens of candidates[i] after the prompt.
+    // n_prompt + n_candidate_tokens[i] must not exceed the text context. The KV cache of the state is overwritten.
+    // Returns 0 on success, -1 on invalid arguments, -2 if a decode failed
+    WHISPER_API int whisper_score(
+            struct whisper_context * ctx,
+               const whisper_token * prompt,
+                               int   n_prompt,
+       const whisper_token * const * candidates,
+                         const int * n_candidate_tokens,
+                               int   n_candidates,
+                             float * logprobs,
+                               int   n_threads);
+
+    WHISPER_API int whisper_score_with_state(
+            struct whisper_context * ctx,
+              struct whisper_state * state,
+               const whisper_token * prompt,
+                               int   n_prompt,
+       const whisper_token * const * candidates,
+                         const int * n_candidate_tokens,
+                               int   n_candidates,
+                             float * logprobs,
+                               int   n_threads);
+
     // Convert the provided text into tokens.
     // The tokens pointer must be large enough to hold the resulting tokens.
     // Returns the number of tokens on success, no more than n_max_tokens
@@ -430,11 +539,68 @@ extern "C" {
         float decode_ms;
         float batchd_ms;
         float prompt_ms;
+
+        int   n_compute;     // number of computations on the CPU threads (graphs and mel)
+        int   n_threadpool;  // number of threadpools created for them - 1 when the threadpool is reused
+        float threadpool_ms; // total time spent creating threadpools
+
+        int   n_encode_cache_hit;    // encoder calls served from the encoder cache
+        int   n_encode_cache_miss;   // encoder calls computed and offered to the encoder cache
+        float encode_cache_saved_ms; // encoder time saved by the hits, net of restoring the cached tensors
+
+        int   n_silence_skip;     // number of silent stretches skipped by the silence gate (whisper_full_params.silence_gate)
+        int   n_silence_frames;   // mel frames (10 ms) skipped by the silence gate
+        float silence_saved_ms;   // estimated encoder time saved by the silence gate, from the average encoder run
+
+        // graphs of the last whisper_full() call: built, reused from the previous call of the same shape, and the
+        // allocations that made ggml plan a compute buffer again (0 in steady state)
+        int   n_graph_build;
+        int   n_graph_reuse;
+        int   n_graph_realloc;
+
+        float dtw_ms;         // [EXPERIMENTAL] time spent on the DTW token timestamps (QK capture, alignment and re-decodes)
+        int   n_dtw;          // windows aligned with DTW
+        int   n_dtw_redecode; // of which the QKs captured while decoding did not cover the text and it was decoded again
+
+        int   n_prompt_cache_hit;    // [EXPERIMENTAL] prompts decoded past a prefix restored by the prompt cache
+        int   n_prompt_cache_miss;   // prompts decoded from scratch with whisper_full_params.prompt_cache
+        float prompt_cache_saved_ms; // estimated decoder time saved by the hits
+
+        float draft_ms;          // [EXPERIMENTAL] time spent in the draft model (whisper_full_params.draft_ctx)
+        int   n_draft;           // tokens proposed by the draft model
+        int   n_draft_accept;    // of which the model sampled the same token
+        float draft_accept_rate; // n_draft_accept / n_draft
+
+        float decode_tokens_per_s; // tokens sampled per second of the decoding loop (sampling, decoder and draft model)
     };
     WHISPER_API struct whisper_timings * whisper_get_timings(struct whisper_context * ctx);
     WHISPER_API void whisper_print_timings(struct whisper_context * ctx);
     WHISPER_API void whisper_reset_timings(struct whisper_context * ctx);
 
+    // [EXPERIMENTAL] Encoder cache (whisper_context_params.encoder_cache_size > 0)
+    // Each encoded 30 s window is identified by a key hashed from its mel spectrogram, the audio context size and the model.
+    // whisper_encoder_cache_keys_from_state() returns the keys of the windows encoded since the start of the last
+    // whisper_full() call on the state, e.g. to pin them while the same audio is decoded again.
+    // Pinned entries are never dropped to make room, whisper_encoder_cache_evict() and whisper_encoder_cache_clear()
+    // remove them too. pin and evict return -1 if the key is not in the cache.
+    WHISPER_API const uint64_t * whisper_encoder_cache_keys_from_state(struct whisper_state * state, int * n_keys);
+
+    WHISPER_API int    whisper_encoder_cache_pin      (struct whisper_context * ctx, uint64_t key, bool pin);
+    WHISPER_API int    whisper_encoder_cache_evict    (struct whisper_context * ctx, uint64_t key);
+    WHISPER_API void   whisper_encoder_cache_clear    (struct whisper_context * ctx);
+    WHISPER_API int    whisper_encoder_cache_n_entries(struct whisper_context * ctx);
+    WHISPER_API size_t whisper_encoder_cache_size     (struct whisper_context * ctx); // bytes used by the entries
+
+    // [EXPERIMENTAL] Named suppression masks
+    // A mask is a set of tokens computed once per context. The masks listed in whisper_full_params.suppress_masks are
+    // suppressed at every decoding step, after the logits_filter_callback. "non_speech_tokens" is predefined.
+    // Registering an existing name replaces the mask. register returns -1 on an invalid token or regular expression,
+    // remove returns -1 and n_tokens returns -1 if the name is not registered.
+    WHISPER_API int whisper_suppress_mask_register      (struct whisper_context * ctx, const char * name, const whisper_token * tokens, int n_tokens);
+    WHISPER_API int whisper_suppress_mask_register_regex(struct whisper_context * ctx, const char * name, const char * regex);
+    WHISPER_API int whisper_suppress_mask_remove        (struct whisper_context * ctx, const char * name);
+    WHISPER_API int whisper_suppress_mask_n_tokens      (struct whisper_context * ctx, const char * name);
+
     // Print system information
     WHISPER_API const char * whisper_print_system_info(void);
 
@@ -502,13 +668,20 @@ extern "C" {
         // note: these can significantly reduce the quality of the output
         bool debug_mode;        // enable debug_mode provides extra info (eg. Dump log_mel)
         int  audio_ctx;         // overwrite the audio context size (0 = use default)
+        bool audio_ctx_adaptive; // [EXPERIMENTAL] with audio_ctx = 0, encode each window with the smallest audio context
+                                 // bucket reserved on the context that covers the audio left in it (short clips, the last window)
 
         // [EXPERIMENTAL] [TDRZ] tinydiarize
         bool tdrz_enable;       // enable tinydiarize speaker turn detection
 
         // A regular expression that matches tokens to suppress
+        // it is matched against the vocabulary once and the result is cached on the context
         const char * suppress_regex;
 
+        // [EXPERIMENTAL] names of masks registered with whisper_suppress_mask_register*() to suppress
+        const char * const * suppress_masks;
+        int suppress_n_masks;
+
         // tokens to provide to the whisper decoder as initial prompt
         // these are prepended to any existing text context from a previous call
         // use whisper_tokenize() to convert text to tokens
@@ -518,8 +691,11 @@ extern "C" {
         int prompt_n_tokens;
 
         // for auto-detection, set to nullptr, "" or "auto"
+        // the language is detected from the encoding of the first window, which is then reused for the transcription
         const char * language;
         bool detect_language;
+        bool detect_language_per_window; // [EXPERIMENTAL] with auto-detection, detect the language of each 30 s window
+                                         // again for code-switched audio - see whisper_full_get_segment_lang_id()
 
         // common decoding parameters:
         bool suppress_blank; // ref: https://github.com/openai/whisper/blob/f82bc59f5ea234d4b97fb2860842ed38519f7e65/whisper/decoding.py#L89
@@ -529,6 +705,11 @@ extern "C" {
         float max_initial_ts;   // ref: https://github.com/openai/whisper/blob/f82bc59f5ea234d4b97fb2860842ed38519f7e65/whisper/decoding.py#L97
         float length_penalty;   // ref: https://github.com/openai/whisper/blob/f82bc59f5ea234d4b97fb2860842ed38519f7e65/whisper/transcribe.py#L267
 
+        // [EXPERIMENTAL] sampling at temperature > 0 and beam search candidates
+        float top_p;            // sample among the most likely tokens with a total probability >= top_p (1.0 = all tokens)
+        float min_p;            // sample among the tokens at least min_p times as likely as the most likely one (0.0 = all tokens)
+        int   seed;             // >= 0: seed decoder i with seed + i at the start of each call, for reproducible runs
+
         // fallback parameters
         // ref: https://github.com/openai/whisper/blob/f82bc59f5ea234d4b97fb2860842ed38519f7e65/whisper/transcribe.py#L274-L278
         float temperature_inc;
@@ -536,6 +717,27 @@ extern "C" {
         float logprob_thold;
         float no_speech_thold;
 
+        // [EXPERIMENTAL] skip silence before encoding
+        // stretches of at least silence_min_ms whose log mel energy stays more than silence_thold_db below the loudest
+        // frame of the input are neither encoded nor decoded - the seek position jumps over them, up to a short margin
+        // in front of the next speech, so the timestamps of the segments stay those of the input
+        bool  silence_gate;
+        float silence_thold_db;
+        int   silence_min_ms;
+
+        // [EXPERIMENTAL] keep the self-attention KV of the last prompt on the state and only decode a new prompt past
+        // the prefix they share. The KV depends on the encoded audio too, so it is reused for the same window only:
+        // at the temperature fallbacks, or when the same audio is transcribed again on the state. Not used with DTW
+        bool  prompt_cache;
+
+        // [EXPERIMENTAL] speculative decoding
+        // a smaller model with the same vocabulary (e.g. tiny or base for large-v2) proposes draft_n_tokens tokens that
+        // are verified in one batched decode. Only used for greedy decoding at temperature 0 without DTW, the result is
+        // the same as without the draft model. Each state encodes the audio with the draft model on a state of its own,
+        // so draft_ctx must outlive the states it is used with
+        struct whisper_context * draft_ctx;
+        int   draft_n_tokens;
+
         struct {
             int best_of;    // ref: https://github.com/openai/whisper/blob/f82bc59f5ea234d4b97fb2860842ed38519f7e65/whisper/transcribe.py#L264
         } greedy;
@@ -597,8 +799,7 @@ extern "C" {
     // Split the input audio in chunks and process each chunk separately using whisper_full_with_state()
     // Result is stored in the default state of the context
     // Not thread safe if executed in parallel on the same context.
-    // It seems this approach can offer some speedup in some cases.
-    // However, the transcription accuracy can be worse at the beginning and end of each chunk.
+    // Same as whisper_full_parallel_with_states() with the default state and n_processors - 1 temporary states.
     WHISPER_API int whisper_full_parallel(
                 struct whisper_context * ctx,
             struct whisper_full_params   params,
@@ -606,6 +807,23 @@ extern "C" {
                                    int   n_samples,
                                    int   n_processors);
 
+    // [EXPERIMENTAL] Parallel long-form transcription over a pool of states
+    // The audio is split into chunks of about chunk_ms (0 - two chunks per state, at least 30 s) at the quietest
+    // point near each nominal boundary. Every chunk but the first starts overlap_ms (0 - 2 s) before its boundary and
+    // the text that is decoded twice in the overlap is removed at the token level when the chunks are merged.
+    // Each of the n_states threads takes the next chunk from a shared queue, so there can be more chunks than states.
+    // The progress callback is called with the state that finished a chunk, the new segment callback once at the end.
+    // The merged result is stored in states[0]. Returns 0 on success
+    WHISPER_API int whisper_full_parallel_with_states(
+                struct whisper_context * ctx,
+                  struct whisper_state ** states,
+                                   int   n_states,
+            struct whisper_full_params   params,
+                           const float * samples,
+                                   int   n_samples,
+                                   int   chunk_ms,
+                                   int   overlap_ms);
+
     // Number of generated text segments
     // A segment can be a few words, a sentence, or even a paragraph.
     WHISPER_API int whisper_full_n_segments           (struct whisper_context * ctx);
@@ -660,6 +878,10 @@ extern "C" {
     WHISPER_API const char * whisper_bench_memcpy_str      (int n_threads);
     WHISPER_API int          whisper_bench_ggml_mul_mat    (int n_threads);
     WHISPER_API const char * whisper_bench_ggml_mul_mat_str(int n_threads);
+    WHISPER_API int          whisper_bench_logits          (void);
+    WHISPER_API const char * whisper_bench_logits_str      (void);
+    WHISPER_API int          whisper_bench_tokenize        (struct whisper_context * ctx);
+    WHISPER_API const char * whisper_bench_tokenize_str    (struct whisper_context * ctx);
 
     // Control logging output; default behavior is to print to stderr
 
@@ -668,6 +890,11 @@ extern "C" {
     // Get the no_speech probability for the specified segment
     WHISPER_API float whisper_full_get_segment_no_speech_prob           (struct whisper_context * ctx, int i_segment);
     WHISPER_API float whisper_full_get_segment_no_speech_prob_from_state(struct whisper_state * state, int i_segment);
+
+    // Get the language id the specified segment was decoded with
+    // differs from whisper_full_lang_id() only with detect_language_per_window
+    WHISPER_API int whisper_full_get_segment_lang_id           (struct whisper_context * ctx, int i_segment);
+    WHISPER_API int whisper_full_get_segment_lang_id_from_state(struct whisper_state * state, int i_segment);
 #ifdef __cplusplus
 }
 #endif
@@ -4,14 +4,47 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 typedef struct whisper_wrapper whisper_wrapper_t;
 
+// A decoding slot borrowed from the wrapper's pool. Transcription results stay
+// in the slot until it runs again or is released.
+typedef struct whisper_wrapper_state whisper_wrapper_state_t;
+
 #ifdef __cplusplus
 extern "C"
 {
 #endif
 
+    // Error codes returned by the v2 API
+    enum whisper_wrapper_error
+    {
+        WHISPER_WRAPPER_OK = 0,
+        WHISPER_WRAPPER_ERR_INVALID = -1,   // NULL handle, empty audio, ...
+        WHISPER_WRAPPER_ERR_INFERENCE = -2, // whisper_full failed
+        WHISPER_WRAPPER_ERR_AUDIO = -3,     // the audio file could not be read
+    };
+
+    // Per-call transcription options for the v2 API
+    typedef struct whisper_wrapper_params
+    {
+        const char *language; // "auto" or NULL to detect the language
+        int n_threads;
+        bool translate;
+        bool no_context;     // do not use the previous transcription as prompt
+        bool single_segment; // force a single output segment
+    } whisper_wrapper_params_t;
+
+    // One transcribed segment. Timestamps are in milliseconds, text points into the caller's arena.
+    typedef struct whisper_wrapper_segment
+    {
+        int64_t t0_ms;
+        int64_t t1_ms;
+        float no_speech_prob;
+        const char *text;
+    } whisper_wrapper_segment_t;
+
     // Create a new whisper wrapper instance
     whisper_wrapper_t *whisper_wrapper_create(const char *model_path);
 
@@ -33,8 +66,56 @@ extern "C"
     // Check if the model is loaded
     bool whisper_wrapper_is_loaded(whisper_wrapper_t *wrapper);
 
+    //
+    // v2 API - reentrant
+    //
+    // The model is loaded once and shared by a fixed pool of decoding states, so up to n_states
+    // transcriptions can run concurrently from different threads. The v2 calls write into
+    // caller-provided memory, only whisper_wrapper_run_file allocates its fixed-size decode buffers.
+    //
+
+    // Create a wrapper with a pool of n_states decoding states (n_states >= 1)
+    whisper_wrapper_t *whisper_wrapper_create_pool(const char *model_path, int n_states);
+
+    // Number of states in the pool
+    int whisper_wrapper_n_states(whisper_wrapper_t *wrapper);
+
+    whisper_wrapper_params_t whisper_wrapper_default_params(void);
+
+    // Borrow a state from the pool. Blocks until one is free.
+    whisper_wrapper_state_t *whisper_wrapper_acquire(whisper_wrapper_t *wrapper);
+
+    // Same as whisper_wrapper_acquire, but returns NULL instead of blocking when all states are busy
+    whisper_wrapper_state_t *whisper_wrapper_try_acquire(whisper_wrapper_t *wrapper);
+
+    // Return a state to the pool
+    void whisper_wrapper_release(whisper_wrapper_t *wrapper, whisper_wrapper_state_t *state);
+
+    // Run the transcription on a borrowed state. Returns WHISPER_WRAPPER_OK or a negative error code.
+    int whisper_wrapper_run(whisper_wrapper_t *wrapper, whisper_wrapper_state_t *state, const whisper_wrapper_params_t *params, const float *pcm_data, int n_samples);
+
+    // Same as whisper_wrapper_run, reading a WAV file (8/16/24/32-bit PCM or 32-bit float, any channel count and
+    // sample rate). The file is decoded, downmixed and resampled to 16 kHz block by block straight into the
+    // incremental mel spectrogram, so the samples of the whole recording are never held in memory.
+    int whisper_wrapper_run_file(whisper_wrapper_t *wrapper, whisper_wrapper_state_t *state, const whisper_wrapper_params_t *params, const char *audio_path);
+
+    // Number of segments produced by the last run on the state
+    int whisper_wrapper_n_segments(whisper_wrapper_state_t *state);
+
+    // Copy the text of the last run into text (segments joined by a space, NUL-terminated, truncated to fit).
+    // Returns the full length of the text like snprintf, so a return value >= text_size means the output was truncated.
+    int whisper_wrapper_get_text(whisper_wrapper_state_t *state, char *text, size_t text_size);
+
+    // Fill up to max_segments entries, copying the segment texts into the arena.
+    // Returns the number of entries written - less than whisper_wrapper_n_segments() if either buffer ran out.
+    int whisper_wrapper_get_segments(whisper_wrapper_state_t *state, whisper_wrapper_segment_t *segments, int max_segments, char *arena, size_t arena_size);
+
+    // Acquire a state, run and copy the text, release. Returns the full text length (see whisper_wrapper_get_text)
+    // or a negative error code.
+    int whisper_wrapper_transcribe_pcm_into(whisper_wrapper_t *wrapper, const whisper_wrapper_params_t *params, const float *pcm_data, int n_samples, char *text, size_t text_size);
+
 #ifdef __cplusplus
 }
 #endif
 
-#endif // WHISPER_WRAPPER_H
\ No newline at end of file
+#endif // WHISPER_WRAPPER_H
@@ -14,25 +14,49 @@
 #include "openvino/whisper-openvino-encoder.h"
 #endif
 
+#include <array>
 #include <atomic>
 #include <algorithm>
 #include <cassert>
+#include <cerrno>
 #define _USE_MATH_DEFINES
 #include <cmath>
 #include <cstdio>
 #include <cstdarg>
 #include <cstring>
 #include <fstream>
+#include <list>
 #include <map>
-#include <set>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <thread>
+#include <unordered_map>
 #include <vector>
 #include <regex>
 #include <random>
 #include <functional>
 #include <codecvt>
 
+// with GCC and Clang on x86-64 the AVX2 and AVX512 kernels are compiled with per-function target attributes and
+// picked at runtime, the rest of the library is built for the baseline instruction set
+#if defined(__x86_64__) && defined(__GNUC__)
+#define WHISPER_SIMD_DISPATCH
+#endif
+
+#if defined(__SSE2__) || defined(__AVX2__) || defined(WHISPER_SIMD_DISPATCH)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 // dummy
 
 #if defined(_MSC_VER)
@@ -111,6 +135,55 @@ static void byteswap_tensor(ggml_tensor * tensor) {
 #define WHISPER_ATTRIBUTE_FORMAT(...)
 #endif
 
+//
+// SIMD dispatch
+//
+
+#if defined(WHISPER_SIMD_DISPATCH)
+#define WHISPER_TARGET_AVX2   __attribute__((target("avx2,fma")))
+#define WHISPER_TARGET_AVX512 __attribute__((target("avx512f")))
+#define WHISPER_SIMD_AVX2
+#define WHISPER_SIMD_AVX512
+#else
+// other compilers only get the kernels enabled by their flags
+#define WHISPER_TARGET_AVX2
+#define WHISPER_TARGET_AVX512
+#if defined(__AVX2__) && defined(__FMA__)
+#define WHISPER_SIMD_AVX2
+#endif
+#if defined(__AVX512F__)
+#define WHISPER_SIMD_AVX512
+#endif
+#endif
+
+enum whisper_simd_level {
+    WHISPER_SIMD_LEVEL_BASE,   // SSE2, NEON or scalar, as compiled
+    WHISPER_SIMD_LEVEL_AVX2,   // AVX2 + FMA
+    WHISPER_SIMD_LEVEL_AVX512, // AVX512F
+};
+
+static whisper_simd_level whisper_simd_detect() {
+#if defined(WHISPER_SIMD_DISPATCH)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        return WHISPER_SIMD_LEVEL_AVX512;
+    }
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        return WHISPER_SIMD_LEVEL_AVX2;
+    }
+    return WHISPER_SIMD_LEVEL_BASE;
+#elif defined(WHISPER_SIMD_AVX512)
+    return WHISPER_SIMD_LEVEL_AVX512;
+#elif defined(WHISPER_SIMD_AVX2)
+    return WHISPER_SIMD_LEVEL_AVX2;
+#else
+    return WHISPER_SIMD_LEVEL_BASE;
+#endif
+}
+
+// the kernels used on this CPU
+static const whisper_simd_level g_simd_level = whisper_simd_detect();
+
 //
 // logging
 //
@@ -141,7 +214,10 @@ static void whisper_log_callback_default(ggml_log_level level, const char * text
     } while (0)
 
 #define WHISPER_MAX_DECODERS 8
+#define WHISPER_MAX_SEQ      32 // the decoders and the temporary copies made by the beam search, or the candidates of whisper_score
+#define WHISPER_PROMPT_SEQ   (WHISPER_MAX_SEQ - 1) // holds the KV of the last prompt, see whisper_prompt_cache
 #define WHISPER_MAX_NODES 4096
+#define WHISPER_MAX_CACHED_REGEX 16
 
 //
 // ggml helpers
@@ -169,13 +245,18 @@ static bool ggml_graph_compute_helper(
 static bool ggml_graph_compute_helper(
       ggml_backend_sched_t   sched,
         struct ggml_cgraph * graph,
-                       int   n_threads) {
+                       int   n_threads,
+       ggml_threadpool_t     threadpool) {
 
     for (int i = 0; i < ggml_backend_sched_get_n_backends(sched); ++i) {
         ggml_backend_t backend = ggml_backend_sched_get_backend(sched, i);
         ggml_backend_dev_t dev = ggml_backend_get_device(backend);
         ggml_backend_reg_t reg = dev ? ggml_backend_dev_backend_reg(dev) : nullptr;
 
+        if (ggml_backend_is_cpu(backend)) {
+            ggml_backend_cpu_set_threadpool(backend, threadpool);
+        }
+
         auto * fn_set_n_threads = (ggml_backend_set_n_threads_t) ggml_backend_reg_get_proc_address(reg, "ggml_backend_set_n_threads");
         if (fn_set_n_threads) {
             fn_set_n_threads(backend, n_threads);
@@ -187,6 +268,50 @@ static bool ggml_graph_compute_helper(
     return t;
 }
 
+// run fn(ith, nth) on n_threads threads
+// the work is expressed as a single custom op, so that it can run on the threads of a persistent threadpool
+// without a threadpool, ggml starts temporary threads for it
+static bool ggml_parallel_for_helper(
+                               int   n_threads,
+                ggml_threadpool_t    threadpool,
+    const std::function<void(int, int)> & fn) {
+    if (n_threads <= 1) {
+        fn(0, 1);
+        return true;
+    }
+
+    // the one-node graph is rebuilt on every call, in a buffer kept by the calling thread
+    static thread_local std::vector<uint8_t> meta(2*ggml_tensor_overhead() + ggml_graph_overhead_custom(1, false) + 2*GGML_MEM_ALIGN + 64);
+
+    struct ggml_init_params params = {
+        /*.mem_size   =*/ meta.size(),
+        /*.mem_buffer =*/ meta.data(),
+        /*.no_alloc   =*/ false,
+    };
+
+    struct ggml_context * ctx = ggml_init(params);
+    if (!ctx) {
+        return false;
+    }
+
+    struct ggml_tensor * dummy = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, 1);
+
+    struct ggml_tensor * op = ggml_map_custom1(ctx, dummy,
+            [](struct ggml_tensor * /*dst*/, const struct ggml_tensor * /*a*/, int ith, int nth, void * userdata) {
+                (*(const std::function<void(int, int)> *) userdata)(ith, nth);
+            }, GGML_N_TASKS_MAX, (void *) &fn);
+
+    struct ggml_cgraph * gf = ggml_new_graph_custom(ctx, 1, false);
+    ggml_build_forward_expand(gf, op);
+
+    struct ggml_cplan plan = ggml_graph_plan(gf, n_threads, threadpool);
+    const bool ok = plan.work_size == 0 && ggml_graph_compute(gf, &plan) == GGML_STATUS_SUCCESS;
+
+    ggml_free(ctx);
+
+    return ok;
+}
+
 // faster matrix multiplications for tensors that do not have dimension 0 divisible by "pad"
 // the idea is to represent the original matrix multiplication:
 //
@@ -387,21 +512,49 @@ struct whisper_mel {
     std::vector<float> data;
 };
 
+// [EXPERIMENTAL] incremental log mel spectrogram of a stream of audio
+// see whisper_mel_stream_push_with_state()
+struct whisper_mel_stream {
+    // the first frames need the reflective pad, so nothing is framed before that many samples arrived
+    bool started = false;
+
+    // samples that are not yet covered by a complete frame (incl. the reflective pad at the start)
+    std::vector<float> pending;
+
+    // number of frames computed since the last reset
+    int64_t n_frames = 0;
+
+    // ring buffer of the last n_cap frames of raw log10 mel energies, [n_cap][n_mel]
+    int n_cap = 0;
+    int n_mel = 0;
+
+    std::vector<float> ring;
+};
+
 struct whisper_filters {
     int32_t n_mel;
     int32_t n_fft;
 
     std::vector<float> data;
+
+    // [band_beg[j], band_end[j]) is the range of non-zero coefficients of filter j
+    std::vector<int32_t> band_beg;
+    std::vector<int32_t> band_end;
 };
 
 struct whisper_vocab {
-    using id    = int32_t;
-    using token = std::string;
+    using id = int32_t;
 
     int n_vocab = 51864;
 
-    std::map<token, id> token_to_id;
-    std::map<id, token> id_to_token;
+    // the text of token i is the 0-terminated string at pool.data() + offsets[i], of length offsets[i + 1] - offsets[i] - 1
+    std::string           pool;
+    std::vector<uint32_t> offsets = { 0 };
+
+    // token ids by text, open addressing with linear probing (-1 = empty slot), see whisper_vocab_find()
+    std::vector<id> index;
+
+    uint32_t max_token_len = 0;
 
     // reference: https://github.com/openai/whisper/blob/248b6cb124225dd263bb9bd32d060b6517e067f8/whisper/tokenizer.py#L334-L349
     id token_eot        = 50256;
@@ -423,8 +576,79 @@ struct whisper_vocab {
     int num_languages() const {
         return n_vocab - 51765 - (is_multilingual() ? 1 : 0);
     }
+
+    // number of tokens in the vocabulary
+    int size() const {
+        return (int) offsets.size() - 1;
+    }
+
+    const char * text(id i) const {
+        return pool.data() + offsets[i];
+    }
+
+    uint32_t text_len(id i) const {
+        return offsets[i + 1] - offsets[i] - 1;
+    }
 };
 
+// FNV-1a
+static inline uint32_t whisper_vocab_hash(const char * s, size_t n) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < n; ++i) {
+        h = (h ^ (uint8_t) s[i])*16777619u;
+    }
+    return h;
+}
+
+static void whisper_vocab_add(whisper_vocab & vocab, const char * s, size_t n) {
+    vocab.pool.append(s, n);
+    vocab.pool.push_back('\0');
+    vocab.offsets.push_back(vocab.pool.size());
+
+    vocab.max_token_len = std::max(vocab.max_token_len, (uint32_t) n);
+}
+
+// builds the lookup table once all tokens are added
+// when several tokens have the same text, the one with the largest id is found
+static void whisper_vocab_build_index(whisper_vocab & vocab) {
+    size_t n_slots = 1;
+    while (n_slots < 2*(size_t) vocab.size()) {
+        n_slots *= 2;
+    }
+
+    vocab.index.assign(n_slots, -1);
+
+    for (whisper_vocab::id i = 0; i < vocab.size(); ++i) {
+        size_t slot = whisper_vocab_hash(vocab.text(i), vocab.text_len(i)) & (n_slots - 1);
+        while (vocab.index[slot] >= 0 && strcmp(vocab.text(vocab.index[slot]), vocab.text(i)) != 0) {
+            slot = (slot + 1) & (n_slots - 1);
+        }
+        vocab.index[slot] = i;
+    }
+}
+
+// the id of the token with the given text, -1 if there is none
+static whisper_vocab::id whisper_vocab_find(const whisper_vocab & vocab, const char * s, size_t n) {
+    if (vocab.index.empty() || n > vocab.max_token_len) {
+        return -1;
+    }
+
+    const size_t mask = vocab.index.size() - 1;
+
+    for (size_t slot = whisper_vocab_hash(s, n) & mask; vocab.index[slot] >= 0; slot = (slot + 1) & mask) {
+        const whisper_vocab::id i = vocab.index[slot];
+        if (vocab.text_len(i) == n && memcmp(vocab.text(i), s, n) == 0) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+static whisper_vocab::id whisper_vocab_find(const whisper_vocab & vocab, const std::string & s) {
+    return whisper_vocab_find(vocab, s.data(), s.size());
+}
+
 struct whisper_segment {
     int64_t t0;
     int64_t t1;
@@ -435,6 +659,8 @@ struct whisper_segment {
     std::vector<whisper_token_data> tokens;
 
     bool speaker_turn_next;
+
+    int lang_id; // language the segment was decoded with
 };
 
 struct whisper_batch {
@@ -442,7 +668,7 @@ struct whisper_batch {
 
     whisper_token  *  token;
     whisper_pos    *  pos;
-    int32_t        *  n_seq_id; // always 1, here for consistency with llama.cpp
+    int32_t        *  n_seq_id; // 1, except for the tokens shared by several candidates in whisper_score
     whisper_seq_id ** seq_id;   // null terminated
     int8_t         *  logits;
 };
@@ -502,11 +728,37 @@ struct whisper_pair {
     whisper_pair() : first(A()), second(B()) {}
 };
 
+// the shape a graph is built for, see whisper_sched_graph()
+using whisper_graph_key = std::array<int32_t, 6>;
+
 // ggml_backend_sched wrapper for whisper usage
 struct whisper_sched {
     ggml_backend_sched_t sched = nullptr;
 
     std::vector<uint8_t> meta;
+
+    // the last graph built in meta, reused as long as it is requested for the same shape
+    ggml_cgraph *     gf  = nullptr;
+    whisper_graph_key key = {};
+
+    uint32_t n_build = 0; // number of graphs built in meta, graphs that read the outputs of this one include it in their key
+
+    // decoder: the views of the graph that write into the KV cache at kv_head, with their offset per cell
+    // a graph reused at another kv_head has them moved instead of being built again
+    std::vector<std::pair<struct ggml_tensor *, size_t>> kv_views;
+    int32_t kv_head = 0;
+
+    int n_nodes_plan = -1; // number of nodes of the graph the compute buffer is planned for
+};
+
+// [EXPERIMENTAL] schedulers of the conv, encoder and cross graphs reserved for a smaller audio context
+// see whisper_context_params.audio_ctx_buckets
+struct whisper_sched_audio {
+    int n_ctx = 0;
+
+    whisper_sched conv;
+    whisper_sched encode;
+    whisper_sched cross;
 };
 
 static size_t whisper_sched_size(struct whisper_sched & allocr) {
@@ -529,12 +781,17 @@ static bool whisper_sched_graph_init(struct whisper_sched & allocr, std::vector<
 
     // since there are dependencies between the different graphs,
     // we need to allocate them instead of only reserving to get the correct compute buffer size
-    if (!ggml_backend_sched_alloc_graph(sched, get_graph())) {
+    ggml_cgraph * gf = get_graph();
+    if (!ggml_backend_sched_alloc_graph(sched, gf)) {
         // failed to allocate the compute buffer
         WHISPER_LOG_ERROR("%s: failed to allocate the compute buffer\n", __func__);
         return false;
     }
 
+    allocr.gf           = nullptr;
+    allocr.n_build     += 1;
+    allocr.n_nodes_plan = ggml_graph_n_nodes(gf);
+
     ggml_backend_sched_reset(sched);
 
     return true;
@@ -657,25 +914,41 @@ struct whisper_layer_decoder {
     struct ggml_tensor * mlp_1_b;
 };
 
+// a cell is in use iff at least one sequence has it (seq_mask != 0), in which case pos >= 0
 struct whisper_kv_cell {
     whisper_pos pos = -1;
 
-    std::set<whisper_seq_id> seq_id;
+    uint32_t seq_mask = 0; // bit i is set if the sequence i has the cell
 
-    bool has_seq_id(const whisper_seq_id & id) const {
-        return seq_id.find(id) != seq_id.end();
+    bool has_seq_id(whisper_seq_id id) const {
+        return (seq_mask >> id) & 1;
     }
 };
 
+static_assert(WHISPER_MAX_SEQ <= 32, "whisper_kv_cell.seq_mask is too small");
+
 struct whisper_kv_cache {
     uint32_t head = 0;
     uint32_t size = 0;
 
+    // bumped each time the buffer is allocated, part of the key of the graphs that view it
+    uint32_t gen = 0;
+
     // computed before each graph build
     uint32_t n = 0;
 
     std::vector<whisper_kv_cell> cells;
 
+    // the cells from cell_max on are not in use
+    uint32_t cell_max = 0;
+
+    // one bit per cell, set if the cell is in use - lets whisper_kv_cache_find_slot() skip 64 used cells at a time
+    std::vector<uint64_t> used;
+
+    // every cell of the sequence i is in [seq_lo[i], seq_hi[i]), the range is empty if the sequence has no cells
+    uint32_t seq_lo[WHISPER_MAX_SEQ];
+    uint32_t seq_hi[WHISPER_MAX_SEQ];
+
     struct ggml_tensor * k;
     struct ggml_tensor * v;
 
@@ -684,6 +957,93 @@ struct whisper_kv_cache {
     std::vector<uint8_t> ctx_buf;
 };
 
+// read-only memory map of a model file
+// the loader parses the header through `pos`; with the CPU backend the weight tensors are then
+// placed directly at their file offsets so no copy of the weights is made
+struct whisper_mmap {
+    void * addr = nullptr;
+    size_t size = 0;
+    size_t pos  = 0;
+
+    bool locked = false;
+
+    whisper_mmap() = default;
+    whisper_mmap(const whisper_mmap &) = delete;
+    whisper_mmap & operator=(const whisper_mmap &) = delete;
+
+#ifdef _POSIX_MAPPED_FILES
+    ~whisper_mmap() {
+        if (locked) {
+            munlock(addr, size);
+        }
+        if (addr) {
+            munmap(addr, size);
+        }
+    }
+
+    bool map(const char * path, bool prefetch) {
+        const int fd = open(path, O_RDONLY);
+        if (fd < 0) {
+            WHISPER_LOG_ERROR("%s: failed to open '%s': %s\n", __func__, path, strerror(errno));
+            return false;
+        }
+
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+            WHISPER_LOG_ERROR("%s: failed to stat '%s'\n", __func__, path);
+            close(fd);
+            return false;
+        }
+
+        int flags = MAP_SHARED;
+#ifdef __linux__
+        if (prefetch) {
+            flags |= MAP_POPULATE;
+        }
+#endif
+        void * ptr = mmap(NULL, st.st_size, PROT_READ, flags, fd, 0);
+        close(fd);
+
+        if (ptr == MAP_FAILED) {
+            WHISPER_LOG_ERROR("%s: mmap failed: %s\n", __func__, strerror(errno));
+            return false;
+        }
+
+        addr = ptr;
+        size = st.st_size;
+
+        if (prefetch && posix_madvise(addr, size, POSIX_MADV_WILLNEED) != 0) {
+            WHISPER_LOG_WARN("%s: posix_madvise(.., POSIX_MADV_WILLNEED) failed\n", __func__);
+        }
+
+        return true;
+    }
+
+    bool lock() {
+        if (!locked && mlock(addr, size) != 0) {
+            WHISPER_LOG_WARN("%s: failed to mlock %zu bytes: %s (check RLIMIT_MEMLOCK)\n", __func__, size, strerror(errno));
+            return false;
+        }
+        locked = true;
+        return true;
+    }
+
+    static bool supported() { return true; }
+#else
+    bool map(const char * /*path*/, bool /*prefetch*/) { return false; }
+    bool lock() { return false; }
+
+    static bool supported() { return false; }
+#endif
+
+    size_t read(void * dst, size_t n) {
+        n = std::min(n, size - pos);
+        memcpy(dst, (const char *) addr + pos, n);
+        pos += n;
+        return n;
+    }
+};
+
 struct whisper_model {
     e_model type = MODEL_UNKNOWN;
 
@@ -724,6 +1084,9 @@ struct whisper_model {
     // the model backend data is read-only and can be shared between processors
     ggml_backend_buffer_t buffer = nullptr;
 
+    // set when the model was loaded with use_mmap and the weights live in the mapping
+    std::unique_ptr<whisper_mmap> mapping;
+
     // tensors
     int n_loaded;
     std::map<std::string, struct ggml_tensor *> tensors;
@@ -759,6 +1122,10 @@ struct whisper_sequence {
     double avg_logprobs;     // the average log probability of the tokens
     double entropy;          // the entropy of the tokens
     double score;            // likelihood rank score
+
+    // [EXPERIMENTAL] Token-level timestamps with DTW
+    // the workspace row holding the alignment heads QKs of each token decoded so far, see whisper_dtw_capture()
+    std::vector<int32_t> aheads_rows;
 };
 
 // TAGS: WHISPER_DECODER_INIT
@@ -769,6 +1136,12 @@ struct whisper_decoder {
     // grammar parse state of generated sequence of tokens
     whisper_grammar  grammar;
 
+    // beam search: the sequence and the grammar state selected for the next step
+    // they are swapped in once all decoders are assigned, so that both buffers keep their capacity
+    whisper_sequence     sequence_next;
+    whisper_partial_utf8 partial_utf8_next;
+    std::vector<std::vector<const whisper_grammar_element *>> stacks_next;
+
     int i_batch;    // the index of the token in the current batch
     int seek_delta; // the window shift found so far based on the decoded timestamp tokens
 
@@ -784,9 +1157,32 @@ struct whisper_decoder {
     // work container used to avoid memory allocations
     std::vector<whisper_pair<double, whisper_vocab::id>> logits_id;
 
+    // work bitmask of the tokens suppressed at the current step
+    std::vector<uint32_t> suppress;
+
+    // beam search: the tokens sampled at the current step
+    std::vector<whisper_token_data> tokens_topk;
+
+    // work container of whisper_suppress_invalid_grammar()
+    std::vector<whisper_grammar_candidate> grammar_candidates;
+
+    // sampling at t > 0.0: the candidate tokens and their cumulative probabilities, see whisper_sampler_init()
+    std::vector<whisper_token> sampler_ids;
+    std::vector<double>        sampler_cdf;
+
     mutable std::mt19937 rng; // used for sampling at t > 0.0
 };
 
+// tokens suppressed at every step of a whisper_full() call, one bit per token
+// the static logit filters are evaluated once per call instead of once per decoded token
+struct whisper_suppress_mask {
+    std::vector<uint32_t> pre;  // filters applied before the logits_filter_callback
+    std::vector<uint32_t> post; // filters applied after it (suppress_regex, suppress_nst, suppress_masks)
+    std::vector<uint32_t> all;  // pre | post, used when there is no callback
+
+    whisper_token id_blank = -1; // " ", suppressed at the first step with suppress_blank
+};
+
 // [EXPERIMENTAL] Token-level timestamps with DTW
 struct whisper_aheads_masks {
     std::vector<struct ggml_tensor *> m;    // One mask per text layer.
@@ -794,6 +1190,61 @@ struct whisper_aheads_masks {
     ggml_backend_buffer_t buffer = nullptr;
 };
 
+// [EXPERIMENTAL] Token-level timestamps with DTW
+// kept by the state and reused for every window, the buffers only grow
+struct whisper_dtw_workspace {
+    // alignment heads QKs captured while decoding the current window: n_rows rows of [n_heads][n_ctx]
+    // the rows no sequence refers to any more are reused before the buffer grows
+    int32_t n_heads = 0;
+    int32_t n_ctx   = 0;
+    int32_t n_rows  = 0;
+    std::vector<float>   rows;
+    std::vector<int32_t> rows_free;
+    std::vector<int32_t> rows_new;  // the rows of the tokens of the last capture
+    std::vector<uint8_t> rows_live;
+
+    // rows of the sot sequence of the last prompt (sot, language, task)
+    std::vector<int32_t> rows_sot;
+
+    std::vector<const float *> src; // the row of each token to align
+    std::vector<float>   w;         // [n_heads][n_tokens][n_audio], normalized over the tokens
+    std::vector<float>   m;         // same, after the median filter
+    std::vector<double>  acc;       // [2][n_audio] sums of the normalization
+    std::vector<float>   lanes;     // [width][n_audio] median filter sorting network
+    std::vector<float>   x;         // DTW input, one anti-diagonal after the other
+    std::vector<int8_t>  trace;     // DTW step of each cell, same layout as x
+    std::vector<int32_t> diag;      // offset of each anti-diagonal in x and trace
+    std::vector<float>   cost;      // the 3 anti-diagonals of the cost matrix in use
+    std::vector<int32_t> path;      // [2][n_tokens + n_audio] token and audio index of each step of the path
+};
+
+// [EXPERIMENTAL] the last prompt decoded by whisper_full() on a state
+// its self-attention KV stays in the cells of WHISPER_PROMPT_SEQ, which depend on the cross-attention KV too, so they
+// are only reused while the same window is encoded (enc_key)
+struct whisper_prompt_cache {
+    uint64_t enc_key = 0;
+
+    std::vector<whisper_token> tokens;
+    std::vector<float>         logits; // of the last token
+
+    int64_t t_decode_us = 0; // time it took to decode the tokens
+};
+
+// [EXPERIMENTAL] speculative decoding with a draft model, see whisper_full_params.draft_ctx
+// the draft model decodes the same window on a state of its own, its self-attention KV holds the tokens in past
+struct whisper_draft {
+    whisper_context * ctx   = nullptr;
+    whisper_state   * state = nullptr; // created on first use, recreated when the draft model changes
+
+    std::vector<whisper_token> past; // tokens of the draft KV cache, from position 0 (prompt included)
+    std::vector<whisper_token> seq;  // scratch: the prompt and the tokens of the verified sequence
+
+    // the tokens of the last verification batch that followed the sampled token
+    // their logits are in the rows 1.. of state->logits, as long as the sampled tokens match them
+    std::vector<whisper_token> tokens;
+    int i_next = 0;
+};
+
 struct whisper_state {
     int64_t t_sample_us = 0;
     int64_t t_encode_us = 0;
@@ -810,12 +1261,50 @@ struct whisper_state {
     int32_t n_fail_p = 0; // number of logprob threshold failures
     int32_t n_fail_h = 0; // number of entropy threshold failures
 
+    int64_t t_threadpool_us = 0; // time spent creating threadpools
+    int32_t n_threadpool    = 0; // number of threadpools created
+    int32_t n_compute       = 0; // number of computations (graphs and mel) on the CPU threads
+
+    int64_t t_enc_cache_saved_us = 0; // encoder time saved by cache hits
+    int32_t n_enc_cache_hit      = 0; // number of encoder calls served from the encoder cache
+    int32_t n_enc_cache_miss     = 0; // number of encoder calls computed and added to the encoder cache
+
+    int32_t n_silence_skip   = 0; // number of silent stretches skipped before encoding
+    int32_t n_silence_frames = 0; // number of mel frames skipped
+
+    int64_t t_dtw_us       = 0; // [EXPERIMENTAL] DTW, time spent capturing the QKs and aligning the tokens
+    int32_t n_dtw          = 0; // number of windows aligned with DTW
+    int32_t n_dtw_redecode = 0; // of which the text had to be decoded again
+
+    int64_t t_prompt_cache_saved_us = 0; // [EXPERIMENTAL] prompt cache, estimated decoder time saved by the hits
+    int32_t n_prompt_cache_hit      = 0; // number of prompts decoded past a cached prefix
+    int32_t n_prompt_cache_miss     = 0; // number of prompts decoded from scratch
+
+    int64_t t_draft_us     = 0; // [EXPERIMENTAL] speculative decoding, time spent in the draft model
+    int32_t n_draft        = 0; // number of tokens proposed by the draft model
+    int32_t n_draft_accept = 0; // number of them that were sampled by the model
+
+    // per-frame maximum of the log mel spectrogram over the mel bins, for the silence gate
+    std::vector<float> mel_level;
+    float mel_level_max = 0.0f;
+
+    // persistent CPU threadpool used by all computations of the state
+    // it is created on first use and only recreated when more threads are requested
+    bool use_threadpool = false;
+    struct ggml_threadpool_params threadpool_params;
+    struct ggml_threadpool * threadpool = nullptr;
+    int threadpool_n_threads = 0;
+
     // number of decoders for which we have constructed the KV cache
     int32_t kv_self_n_dec = 0;
 
     // unified self-attention KV cache for all decoders
     whisper_kv_cache kv_self;
 
+    whisper_prompt_cache prompt_cache;
+
+    whisper_draft draft;
+
     // cross-attention KV cache for the decoders
     // shared between all decoders
     whisper_kv_cache kv_cross;
@@ -825,10 +1314,17 @@ struct whisper_state {
 
     whisper_mel mel;
 
+    whisper_mel_stream mel_stream;
+
     whisper_batch batch;
 
+    // tokens of the candidate trie decoded by whisper_score, allocated on first use
+    whisper_batch batch_score = { 0, nullptr, nullptr, nullptr, nullptr, nullptr, };
+
     whisper_decoder decoders[WHISPER_MAX_DECODERS];
 
+    whisper_suppress_mask suppress;
+
     std::vector<ggml_backend_t> backends;
 
     // - stores meta info about the intermediate tensors into the `meta` buffers
@@ -836,11 +1332,32 @@ struct whisper_state {
     whisper_sched sched_encode;
     whisper_sched sched_cross;
     whisper_sched sched_decode;
+    whisper_sched sched_decode_aheads; // [EXPERIMENTAL] DTW, the decoder graph that saves the alignment heads QKs
+
+    // number of graphs built and reused, and of compute buffer re-plans in the last whisper_full() call
+    int32_t n_graph_build   = 0;
+    int32_t n_graph_reuse   = 0;
+    int32_t n_graph_realloc = 0;
+
+    // [EXPERIMENTAL] adaptive audio context, one set of schedulers per bucket smaller than n_audio_ctx, in ascending order
+    std::vector<whisper_sched_audio> sched_audio;
 
     // result of the encoder
     struct ggml_tensor * embd_conv = nullptr;
     struct ggml_tensor * embd_enc  = nullptr;
 
+    // encoder cache keys of the windows encoded since the start of the last whisper_full()
+    std::vector<uint64_t> enc_cache_keys;
+
+    // mel offset and audio context of the window currently held by embd_enc and kv_cross (-1 - none)
+    // invalidated whenever the mel spectrogram changes
+    int32_t enc_seek  = -1;
+    int32_t enc_n_ctx = 0;
+
+    // hash of the mel window, the audio context and the model behind the current kv_cross (0 - none)
+    // unlike enc_seek, it stays valid when the mel spectrogram changes
+    uint64_t enc_key = 0;
+
     // helpers for GPU offloading
     std::vector<float> inp_mel;
     std::vector<float> inp_mask;
@@ -876,11 +1393,56 @@ struct whisper_state {
     whisper_aheads_masks aheads_masks;
     ggml_tensor * aheads_cross_QKs = nullptr;
     std::vector<float> aheads_cross_QKs_data;
+    whisper_dtw_workspace dtw;
 
     // [EXPERIMENTAL] speed-up techniques
     int32_t exp_n_audio_ctx = 0; // 0 - use default
 };
 
+// encoder output for one mel window, see whisper_encode_internal()
+struct whisper_encoder_cache_entry {
+    uint64_t key   = 0;
+    uint64_t check = 0; // second hash of the window, guards against key collisions
+
+    int  n_ctx  = 0;
+    bool pinned = false;
+
+    int64_t t_compute_us = 0; // time it took to compute the cached tensors
+
+    std::vector<uint8_t> embd_enc;
+    std::vector<uint8_t> k_cross; // empty unless the cross-attention KV is cached too
+    std::vector<uint8_t> v_cross;
+
+    size_t size() const {
+        return embd_enc.size() + k_cross.size() + v_cross.size();
+    }
+};
+
+// LRU cache of encoder outputs, shared by all states of a context
+// entries are keyed by a hash of the mel window, the audio context size and the model identity
+struct whisper_encoder_cache {
+    size_t   budget   = 0;     // memory budget in bytes, 0 - disabled
+    bool     cross    = false; // also cache the cross-attention KV
+    uint64_t model_id = 0;
+
+    std::mutex mutex;
+
+    size_t used = 0;
+
+    std::list<whisper_encoder_cache_entry> entries; // most recently used first
+    std::unordered_map<uint64_t, std::list<whisper_encoder_cache_entry>::iterator> index;
+};
+
+// token masks shared by all states of the context, one bit per token
+struct whisper_token_masks {
+    std::mutex mutex;
+
+    std::vector<uint32_t> nst; // non-speech tokens, see whisper_full_params.suppress_nst
+
+    std::map<std::string, std::vector<uint32_t>> named;           // whisper_suppress_mask_register*()
+    std::unordered_map<std::string, std::vector<uint32_t>> regex; // whisper_full_params.suppress_regex by expression
+};
+
 struct whisper_context {
     int64_t t_load_us  = 0;
     int64_t t_start_us = 0;
@@ -895,9 +1457,18 @@ struct whisper_context {
 
     whisper_state * state = nullptr;
 
+    whisper_encoder_cache encoder_cache;
+    whisper_token_masks   token_masks;
+
+    // the text tokens decoded to code points for the grammar, computed on first use
+    std::once_flag grammar_vocab_once;
+    std::vector<std::pair<std::vector<uint32_t>, whisper_partial_utf8>> grammar_vocab;
+
     std::string path_model; // populated by whisper_init_from_file_with_params()
 };
 
+static void whisper_token_masks_init(whisper_context & ctx);
+
 struct whisper_global {
     // We save the log callback globally
     ggml_log_callback log_callback = whisper_log_callback_default;
@@ -906,16 +1477,78 @@ struct whisper_global {
 
 static whisper_global g_state;
 
+// the threadpool for the next computation of the state with n_threads threads
+// returns nullptr if the state does not use a persistent threadpool
+static ggml_threadpool_t whisper_threadpool_acquire(whisper_state & wstate, int n_threads) {
+    wstate.n_compute++;
+
+    if (!wstate.use_threadpool) {
+        return nullptr;
+    }
+
+    n_threads = std::max(1, std::min(n_threads, GGML_MAX_N_THREADS));
+
+    if (wstate.threadpool && wstate.threadpool_n_threads >= n_threads) {
+        return wstate.threadpool;
+    }
+
+    const int64_t t_start_us = ggml_time_us();
+
+    // the CPU backends keep a reference to the current threadpool
+    for (auto & backend : wstate.backends) {
+        if (ggml_backend_is_cpu(backend)) {
+            ggml_backend_cpu_set_threadpool(backend, nullptr);
+        }
+    }
+
+    if (wstate.threadpool) {
+        ggml_threadpool_free(wstate.threadpool);
+        wstate.threadpool = nullptr;
+    }
+
+    struct ggml_threadpool_params params = wstate.threadpool_params;
+    params.n_threads = n_threads;
+
+    wstate.threadpool = ggml_threadpool_new(&params);
+    if (!wstate.threadpool) {
+        WHISPER_LOG_WARN("%s: failed to create a threadpool with %d threads\n", __func__, n_threads);
+        wstate.use_threadpool = false;
+        return nullptr;
+    }
+
+    wstate.threadpool_n_threads = n_threads;
+
+    wstate.t_threadpool_us += ggml_time_us() - t_start_us;
+    wstate.n_threadpool++;
+
+    return wstate.threadpool;
+}
+
 template<typename T>
 static void read_safe(whisper_model_loader * loader, T & dest) {
     loader->read(loader->context, &dest, sizeof(T));
     BYTESWAP_VALUE(dest);
 }
 
+static void whisper_kv_cache_reset_cells(struct whisper_kv_cache & cache) {
+    for (auto & cell : cache.cells) {
+        cell.pos      = -1;
+        cell.seq_mask = 0;
+    }
+    std::fill(cache.used.begin(), cache.used.end(), 0);
+
+    cache.head     = 0;
+    cache.cell_max = 0;
+
+    std::fill(cache.seq_lo, cache.seq_lo + WHISPER_MAX_SEQ, cache.size);
+    std::fill(cache.seq_hi, cache.seq_hi + WHISPER_MAX_SEQ, 0);
+}
+
 static bool whisper_kv_cache_init(
              struct whisper_kv_cache & cache,
                       ggml_backend_t   backend,
-                           ggml_type   wtype,
+                           ggml_type   type_k,
+                           ggml_type   type_v,
                              int64_t   n_text_state,
                              int64_t   n_text_layer,
                                  int   n_ctx) {
@@ -930,11 +1563,13 @@ static bool whisper_kv_cache_init(
         /*.no_alloc   =*/ true,
     };
 
-    cache.head = 0;
     cache.size = n_ctx;
+    cache.gen++;
 
-    cache.cells.clear();
     cache.cells.resize(n_ctx);
+    cache.used.resize((n_ctx + 63)/64);
+
+    whisper_kv_cache_reset_cells(cache);
 
     struct ggml_context * ctx = ggml_init(params);
 
@@ -943,8 +1578,8 @@ static bool whisper_kv_cache_init(
         return false;
     }
 
-    cache.k = ggml_new_tensor_1d(ctx, wtype, n_elements);
-    cache.v = ggml_new_tensor_1d(ctx, wtype, n_elements);
+    cache.k = ggml_new_tensor_1d(ctx, type_k, n_elements);
+    cache.v = ggml_new_tensor_1d(ctx, type_v, n_elements);
 
     cache.buffer = ggml_backend_alloc_ctx_tensors(ctx, backend);
     if (!cache.buffer) {
@@ -963,74 +1598,97 @@ static void whisper_kv_cache_free(struct whisper_kv_cache & cache) {
     ggml_backend_buffer_free(cache.buffer);
 }
 
-static bool whisper_kv_cache_find_slot(
-           struct whisper_kv_cache & cache,
-        const struct whisper_batch & batch) {
-    const uint32_t n_ctx    = cache.size;
-    const uint32_t n_tokens = batch.n_tokens;
+static inline bool whisper_kv_cache_is_used(const struct whisper_kv_cache & cache, uint32_t i) {
+    return (cache.used[i >> 6] >> (i & 63)) & 1;
+}
 
-    if (n_tokens > n_ctx) {
-        WHISPER_LOG_ERROR("%s: n_tokens=%d > n_ctx=%d\n", __func__, n_tokens, n_ctx);
-        return false;
-    }
+static inline void whisper_kv_cache_seq_add_cell(struct whisper_kv_cache & cache, whisper_seq_id seq_id, uint32_t i) {
+    cache.cells[i].seq_mask |= 1u << seq_id;
+    cache.seq_lo[seq_id] = std::min(cache.seq_lo[seq_id], i);
+    cache.seq_hi[seq_id] = std::max(cache.seq_hi[seq_id], i + 1);
+}
 
-    uint32_t n_tested = 0;
+static inline void whisper_kv_cache_free_cell(struct whisper_kv_cache & cache, uint32_t i) {
+    cache.cells[i].pos = -1;
+    cache.used[i >> 6] &= ~(uint64_t(1) << (i & 63));
+}
 
-    while (true) {
-        if (cache.head + n_tokens > n_ctx) {
-            n_tested += n_ctx - cache.head;
-            cache.head = 0;
-            continue;
-        }
+// the first n_tokens consecutive free cells starting in [i0, n_ctx), -1 if there are none
+static int32_t whisper_kv_cache_find_free(const struct whisper_kv_cache & cache, uint32_t i0, uint32_t n_tokens) {
+    uint32_t i = i0;
 
-        bool found = true;
-        for (uint32_t i = 0; i < n_tokens; i++) {
-            if (cache.cells[cache.head + i].pos >= 0) {
-                found = false;
-                cache.head += i + 1;
-                n_tested   += i + 1;
-                break;
-            }
+    while (i + n_tokens <= cache.size) {
+        if (i >= cache.cell_max) {
+            return i;
         }
 
-        if (found) {
-            break;
+        if (whisper_kv_cache_is_used(cache, i)) {
+            i += (i & 63) == 0 && cache.used[i >> 6] == ~uint64_t(0) ? 64 : 1;
+            continue;
         }
 
-        if (n_tested >= n_ctx) {
-            //WHISPER_LOG_ERROR("%s: failed to find a slot for %d tokens\n", __func__, n_tokens);
-            return false;
+        uint32_t j = i + 1;
+        while (j < i + n_tokens && j < cache.cell_max && !whisper_kv_cache_is_used(cache, j)) {
+            ++j;
         }
-    }
 
-    for (uint32_t i = 0; i < n_tokens; i++) {
-        cache.cells[cache.head + i].pos = batch.pos[i];
-
-        for (int32_t j = 0; j < batch.n_seq_id[i]; j++) {
-            cache.cells[cache.head + i].seq_id.insert(batch.seq_id[i][j]);
+        if (j == i + n_tokens || j == cache.cell_max) {
+            return i;
         }
-    }
 
-    return true;
-}
-
-// find how many cells are currently in use
-static int32_t whisper_kv_cache_cell_max(const struct whisper_kv_cache & cache) {
-    for (uint32_t i = cache.size - 1; i > 0; --i) {
-        if (cache.cells[i].pos >= 0 && !cache.cells[i].seq_id.empty()) {
-            return i + 1;
-        }
+        i = j + 1;
     }
 
-    return 1;
+    return -1;
 }
 
-static void whisper_kv_cache_clear(struct whisper_kv_cache & cache) {
-    for (int32_t i = 0; i < (int32_t) cache.size; ++i) {
-        cache.cells[i].pos = -1;
-        cache.cells[i].seq_id.clear();
+// first fit from the head, then from the start of the cache
+static bool whisper_kv_cache_find_slot(
+           struct whisper_kv_cache & cache,
+        const struct whisper_batch & batch) {
+    const uint32_t n_ctx    = cache.size;
+    const uint32_t n_tokens = batch.n_tokens;
+
+    if (n_tokens > n_ctx) {
+        WHISPER_LOG_ERROR("%s: n_tokens=%d > n_ctx=%d\n", __func__, n_tokens, n_ctx);
+        return false;
     }
-    cache.head = 0;
+
+    int32_t head = whisper_kv_cache_find_free(cache, cache.head, n_tokens);
+    if (head < 0) {
+        head = whisper_kv_cache_find_free(cache, 0, n_tokens);
+    }
+    if (head < 0) {
+        //WHISPER_LOG_ERROR("%s: failed to find a slot for %d tokens\n", __func__, n_tokens);
+        return false;
+    }
+
+    cache.head = head;
+
+    for (uint32_t i = 0; i < n_tokens; i++) {
+        const uint32_t ic = cache.head + i;
+
+        cache.cells[ic].pos = batch.pos[i];
+        cache.used[ic >> 6] |= uint64_t(1) << (ic & 63);
+
+        for (int32_t j = 0; j < batch.n_seq_id[i]; j++) {
+            WHISPER_ASSERT(batch.seq_id[i][j] >= 0 && batch.seq_id[i][j] < WHISPER_MAX_SEQ);
+            whisper_kv_cache_seq_add_cell(cache, batch.seq_id[i][j], ic);
+        }
+    }
+
+    cache.cell_max = std::max(cache.cell_max, cache.head + n_tokens);
+
+    return true;
+}
+
+// find how many cells are currently in use
+static int32_t whisper_kv_cache_cell_max(const struct whisper_kv_cache & cache) {
+    return std::max(1u, cache.cell_max);
+}
+
+static void whisper_kv_cache_clear(struct whisper_kv_cache & cache) {
+    whisper_kv_cache_reset_cells(cache);
 
     ggml_backend_buffer_clear(cache.buffer, 0);
 }
@@ -1045,26 +1703,85 @@ static void whisper_kv_cache_seq_rm(
     if (p0 < 0) p0 = 0;
     if (p1 < 0) p1 = std::numeric_limits<whisper_pos>::max();
 
-    for (uint32_t i = 0; i < cache.size; ++i) {
-        if (cache.cells[i].pos >= p0 && cache.cells[i].pos < p1) {
-            if (seq_id < 0) {
-                cache.cells[i].seq_id.clear();
-            } else if (cache.cells[i].has_seq_id(seq_id)) {
-                cache.cells[i].seq_id.erase(seq_id);
-            } else {
-                continue;
-            }
-            if (cache.cells[i].seq_id.empty()) {
-                cache.cells[i].pos = -1;
+    // only the cells of the sequence are visited
+    const uint32_t i0 = seq_id < 0 ? 0              : cache.seq_lo[seq_id];
+    const uint32_t i1 = seq_id < 0 ? cache.cell_max : std::min(cache.seq_hi[seq_id], cache.cell_max);
+
+    const uint32_t rm_mask = seq_id < 0 ? ~0u : 1u << seq_id;
+
+    // the range of the cells that the sequence keeps
+    uint32_t lo = cache.size;
+    uint32_t hi = 0;
+
+    for (uint32_t i = i0; i < i1; ++i) {
+        auto & cell = cache.cells[i];
+
+        if ((cell.seq_mask & rm_mask) == 0) {
+            continue;
+        }
+
+        if (cell.pos >= p0 && cell.pos < p1) {
+            cell.seq_mask &= ~rm_mask;
+            if (cell.seq_mask == 0) {
+                whisper_kv_cache_free_cell(cache, i);
                 if (new_head == cache.size) new_head = i;
             }
+        } else {
+            lo = std::min(lo, i);
+            hi = i + 1;
         }
     }
 
+    if (seq_id >= 0) {
+        cache.seq_lo[seq_id] = lo;
+        cache.seq_hi[seq_id] = hi;
+    }
+
+    while (cache.cell_max > 0 && cache.cells[cache.cell_max - 1].seq_mask == 0) {
+        cache.cell_max--;
+    }
+
     // If we freed up a slot, set head to it so searching can start there.
     if (new_head != cache.size) cache.head = new_head;
 }
 
+// drop every cell that the sequence does not have
+static void whisper_kv_cache_seq_keep(
+        struct whisper_kv_cache & cache,
+                 whisper_seq_id   seq_id) {
+    const uint32_t keep_mask = 1u << seq_id;
+
+    for (uint32_t i = 0; i < cache.cell_max; ++i) {
+        auto & cell = cache.cells[i];
+
+        if (cell.seq_mask == 0) {
+            continue;
+        }
+
+        if (cell.seq_mask & keep_mask) {
+            cell.seq_mask = keep_mask;
+        } else {
+            cell.seq_mask = 0;
+            whisper_kv_cache_free_cell(cache, i);
+        }
+    }
+
+    const uint32_t lo = cache.seq_lo[seq_id];
+    const uint32_t hi = cache.seq_hi[seq_id];
+
+    std::fill(cache.seq_lo, cache.seq_lo + WHISPER_MAX_SEQ, cache.size);
+    std::fill(cache.seq_hi, cache.seq_hi + WHISPER_MAX_SEQ, 0);
+
+    cache.seq_lo[seq_id] = lo;
+    cache.seq_hi[seq_id] = hi;
+
+    while (cache.cell_max > 0 && cache.cells[cache.cell_max - 1].seq_mask == 0) {
+        cache.cell_max--;
+    }
+
+    cache.head = 0;
+}
+
 static void whisper_kv_cache_seq_cp(
         struct whisper_kv_cache & cache,
                  whisper_seq_id   seq_id_src,
@@ -1076,16 +1793,30 @@ static void whisper_kv_cache_seq_cp(
 
     cache.head = 0;
 
-    for (uint32_t i = 0; i < cache.size; ++i) {
+    const uint32_t i1 = std::min(cache.seq_hi[seq_id_src], cache.cell_max);
+
+    for (uint32_t i = cache.seq_lo[seq_id_src]; i < i1; ++i) {
         if (cache.cells[i].has_seq_id(seq_id_src) && cache.cells[i].pos >= p0 && cache.cells[i].pos < p1) {
-            cache.cells[i].seq_id.insert(seq_id_dst);
+            whisper_kv_cache_seq_add_cell(cache, seq_id_dst, i);
         }
     }
 }
 
+// types of the K and V tensors of the self- and cross-attention KV caches
+// without flash attention, V is written transposed one element at a time, so it cannot be block-quantized
+static ggml_type whisper_kv_type_k(const struct whisper_context & wctx) {
+    return wctx.params.kv_type;
+}
+
+static ggml_type whisper_kv_type_v(const struct whisper_context & wctx) {
+    return wctx.params.flash_attn || !ggml_is_quantized(wctx.params.kv_type) ? wctx.params.kv_type : wctx.itype;
+}
+
 static uint32_t whisper_kv_cache_get_padding(const struct whisper_context & wctx) {
+    // the masked cells past cell_max do not change the result, padding the view only lets
+    // whisper_sched_graph() reuse the decoder graph for several steps in a row
     if (!wctx.params.flash_attn || !wctx.params.use_gpu) {
-        return 1u;
+        return 32u;
     }
 
 #ifdef GGML_USE_METAL
@@ -1170,7 +1901,7 @@ static bool aheads_masks_init(
     for (int64_t il = 0; il < n_text_layer; ++il) {
         auto aheads = get_alignment_heads_by_layer(cparams, il, n_text_layer, n_head);
         if (!aheads.empty()) {
-            aheads_masks.m.push_back(ggml_new_tensor_2d(aheads_masks.ctx, GGML_TYPE_F32, n_head, aheads.size()));
+            aheads_masks.m.push_back(ggml_new_tensor_1d(aheads_masks.ctx, GGML_TYPE_I32, aheads.size()));
         } else {
             aheads_masks.m.push_back(nullptr);
         }
@@ -1183,31 +1914,15 @@ static bool aheads_masks_init(
     }
 
     // Set data on mask tensors
-    // Since this must be backend agnostic, we write our desired values on mask_data,
-    // and send it to backend with ggml_backend_tensor_set.
-    // Each mask in N_HEADS*N_ALIGNMENT_HEADS, one per text layer containing alignment
-    // heads. Each row of the mask "marks" one alignment head. E.g. if some text layer
-    // has a total of 10 heads and of those, heads 0,5,6 are alignment heads, the mask
-    // should read:
-    // 1 0 0 0 0 0 0 0 0 0
-    // 0 0 0 0 0 1 0 0 0 0
-    // 0 0 0 0 0 0 1 0 0 0
-    std::vector<float> mask_data;
+    // Since this must be backend agnostic, we send the values with ggml_backend_tensor_set.
+    // Each mask holds the indices of the alignment heads of one text layer, the decoder
+    // picks their rows out of the cross-attention QKs with ggml_get_rows. E.g. if heads
+    // 0,5,6 of some text layer are alignment heads, the mask reads: 0 5 6
     for (int64_t il = 0; il < n_text_layer; ++il) {
         if (aheads_masks.m[il] != nullptr) {
-            auto aheads = get_alignment_heads_by_layer(cparams, il, n_text_layer, n_head);
-
-            size_t data_size = aheads_masks.m[il]->ne[0] * aheads_masks.m[il]->ne[1];
-            size_t data_size_bytes = data_size * sizeof(float);
-            mask_data.resize(data_size);
+            const auto aheads = get_alignment_heads_by_layer(cparams, il, n_text_layer, n_head);
 
-            std::fill(mask_data.begin(), mask_data.end(), 0);
-            for (size_t ih = 0; ih < aheads.size(); ++ih) {
-                size_t pos = (aheads[ih] + (ih * aheads_masks.m[il]->ne[0]));
-                mask_data[pos] = 1.0f;
-            }
-
-            ggml_backend_tensor_set(aheads_masks.m[il], mask_data.data(), 0, data_size_bytes);
+            ggml_backend_tensor_set(aheads_masks.m[il], aheads.data(), 0, aheads.size()*sizeof(uint32_t));
         }
     }
 
@@ -1435,6 +2150,21 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
         filters.data.resize(filters.n_mel * filters.n_fft);
         loader->read(loader->context, filters.data.data(), filters.data.size() * sizeof(float));
         BYTESWAP_FILTERS(filters);
+
+        // the filters are triangular - find the range of each one to skip the zero coefficients
+        filters.band_beg.assign(filters.n_mel, 0);
+        filters.band_end.assign(filters.n_mel, 0);
+        for (int j = 0; j < filters.n_mel; ++j) {
+            const float * f = filters.data.data() + j*filters.n_fft;
+
+            int k0 = 0;
+            int k1 = filters.n_fft;
+            while (k0 < k1 && f[k0]     == 0.0f) k0++;
+            while (k1 > k0 && f[k1 - 1] == 0.0f) k1--;
+
+            filters.band_beg[j] = k0;
+            filters.band_end[j] = k1;
+        }
     }
 
     // load vocab
@@ -1453,24 +2183,22 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
 
         tmp.reserve(128);
 
+        vocab.pool.reserve(8*std::max(n_vocab, model.hparams.n_vocab));
+        vocab.offsets.reserve(std::max(n_vocab, model.hparams.n_vocab) + 1);
+
         for (int i = 0; i < n_vocab; i++) {
             uint32_t len;
             read_safe(loader, len);
 
+            // seems like we have an empty-string token in multi-language models (i = 50256)
+            tmp.resize(len);
             if (len > 0) {
-                tmp.resize(len);
                 loader->read(loader->context, &tmp[0], tmp.size()); // read to buffer
-                word.assign(&tmp[0], tmp.size());
-            } else {
-                // seems like we have an empty-string token in multi-language models (i = 50256)
-                //WHISPER_LOG_WARN("%s: warning: empty-string token in vocab, i = %d\n", __func__, i);
-                word = "";
             }
 
-            vocab.token_to_id[word] = i;
-            vocab.id_to_token[i] = word;
+            whisper_vocab_add(vocab, tmp.data(), len);
 
-            //printf("%s: vocab[%d] = '%s'\n", __func__, i, word.c_str());
+            //printf("%s: vocab[%d] = '%s'\n", __func__, i, vocab.text(i));
         }
 
         vocab.n_vocab = model.hparams.n_vocab;
@@ -1518,11 +2246,12 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
                 } else {
                     word = "[_extra_token_" + std::to_string(i) + "]";
                 }
-                vocab.token_to_id[word] = i;
-                vocab.id_to_token[i] = word;
+                whisper_vocab_add(vocab, word.data(), word.size());
             }
         }
 
+        whisper_vocab_build_index(vocab);
+
         WHISPER_LOG_INFO("%s: n_langs       = %d\n", __func__, vocab.num_languages());
     }
 
@@ -1747,8 +2476,24 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
         }
     }
 
+    ggml_backend_buffer_type_t buft = whisper_default_buffer_type(wctx.params);
+
+    // with a mapped model file and the CPU backend, the weights are used in place
+    bool use_mapping = model.mapping && buft == ggml_backend_cpu_buffer_type();
+#if defined(GGML_BIG_ENDIAN)
+    use_mapping = false; // the weights need to be byte-swapped
+#endif
+
     // allocate tensors in the backend buffers
-    model.buffer = ggml_backend_alloc_ctx_tensors_from_buft(model.ctx, whisper_default_buffer_type(wctx.params));
+    if (use_mapping) {
+        model.buffer = ggml_backend_cpu_buffer_from_ptr(model.mapping->addr, model.mapping->size);
+
+        if (wctx.params.use_mlock) {
+            model.mapping->lock();
+        }
+    } else {
+        model.buffer = ggml_backend_alloc_ctx_tensors_from_buft(model.ctx, buft);
+    }
     if (!model.buffer) {
         WHISPER_LOG_ERROR("%s: failed to allocate memory for the model\n", __func__);
         return false;
@@ -1822,7 +2567,17 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
 
             //printf("%s: [%5.5s] %s\n", __func__, ggml_backend_name(backend), name.c_str());
 
-            if (ggml_backend_buffer_is_host(model.buffer)) {
+            if (use_mapping) {
+                // point the tensor at its data inside the mapped file
+                whisper_mmap & mapping = *model.mapping;
+                if (mapping.pos + ggml_nbytes(tensor) > mapping.size) {
+                    WHISPER_LOG_ERROR("%s: tensor '%s' data is out of file bounds\n", __func__, name.data());
+                    return false;
+                }
+
+                ggml_backend_tensor_alloc(model.buffer, tensor, (char *) mapping.addr + mapping.pos);
+                mapping.pos += ggml_nbytes(tensor);
+            } else if (ggml_backend_buffer_is_host(model.buffer)) {
                 // for the CPU and Metal backend, we can read directly into the tensor
                 loader->read(loader->context, tensor->data, ggml_nbytes(tensor));
                 BYTESWAP_TENSOR(tensor);
@@ -1844,12 +2599,28 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
 
         if (model.n_loaded == 0) {
             WHISPER_LOG_WARN("%s: WARN no tensors loaded from model file - assuming empty model for testing\n", __func__);
+
+            if (use_mapping) {
+                // nothing was placed in the mapping - give the tensors their own memory
+                ggml_backend_buffer_free(model.buffer);
+                model.buffer = ggml_backend_alloc_ctx_tensors_from_buft(model.ctx, buft);
+                if (!model.buffer) {
+                    WHISPER_LOG_ERROR("%s: failed to allocate memory for the model\n", __func__);
+                    return false;
+                }
+                model.mapping.reset();
+            }
         } else if (model.n_loaded != (int) model.tensors.size()) {
             WHISPER_LOG_ERROR("%s: ERROR not all tensors loaded from model file - expected %zu, got %d\n", __func__, model.tensors.size(), model.n_loaded);
             return false;
         }
     }
 
+    if (!use_mapping) {
+        // the weights were copied out of the mapping - it is no longer needed
+        model.mapping.reset();
+    }
+
     ggml_backend_buffer_set_usage(model.buffer, GGML_BACKEND_BUFFER_USAGE_WEIGHTS);
 
     wctx.t_load_us = ggml_time_us() - t_start_us;
@@ -1875,6 +2646,72 @@ static bool whisper_encode_external(const whisper_state & wstate) {
     return use_coreml || use_openvino;
 }
 
+// the schedulers of the audio graphs for the current audio context: those of its bucket or the full size ones
+static whisper_sched_audio * whisper_sched_audio_find(whisper_state & wstate, int n_ctx) {
+    for (auto & sa : wstate.sched_audio) {
+        if (sa.n_ctx == n_ctx) {
+            return &sa;
+        }
+    }
+    return nullptr;
+}
+
+static whisper_sched & whisper_sched_conv(whisper_state & wstate, int n_ctx) {
+    auto * sa = whisper_sched_audio_find(wstate, n_ctx);
+    return sa ? sa->conv : wstate.sched_conv;
+}
+
+static whisper_sched & whisper_sched_encode(whisper_state & wstate, int n_ctx) {
+    auto * sa = whisper_sched_audio_find(wstate, n_ctx);
+    return sa ? sa->encode : wstate.sched_encode;
+}
+
+static whisper_sched & whisper_sched_cross(whisper_state & wstate, int n_ctx) {
+    auto * sa = whisper_sched_audio_find(wstate, n_ctx);
+    return sa ? sa->cross : wstate.sched_cross;
+}
+
+// the decoder graph that saves the alignment heads QKs has more nodes, it gets its own scheduler (DTW only)
+static whisper_sched & whisper_sched_decode(whisper_state & wstate, bool save_alignment_heads_QKs) {
+    return save_alignment_heads_QKs && wstate.sched_decode_aheads.sched ? wstate.sched_decode_aheads : wstate.sched_decode;
+}
+
+// the graph for the given shape: the last one built with the scheduler if it was built for the same shape, or a new one
+static ggml_cgraph * whisper_sched_graph(
+          whisper_state & wstate,
+          whisper_sched & s,
+    const whisper_graph_key & key,
+    const std::function<ggml_cgraph *()> & build) {
+    if (s.gf != nullptr && s.key == key) {
+        wstate.n_graph_reuse++;
+        return s.gf;
+    }
+
+    s.gf  = build();
+    s.key = key;
+    s.n_build++;
+
+    wstate.n_graph_build++;
+
+    return s.gf;
+}
+
+// allocate a graph in the compute buffer of the scheduler
+// the buffer is planned once for the worst case of each scheduler, a graph with another topology makes ggml plan it again
+static bool whisper_sched_alloc_graph(whisper_state & wstate, whisper_sched & s, ggml_cgraph * gf) {
+    if (ggml_graph_n_nodes(gf) != s.n_nodes_plan) {
+        s.n_nodes_plan = ggml_graph_n_nodes(gf);
+        wstate.n_graph_realloc++;
+    }
+
+    if (!ggml_backend_sched_alloc_graph(s.sched, gf)) {
+        s.gf = nullptr;
+        return false;
+    }
+
+    return true;
+}
+
 static struct ggml_cgraph * whisper_build_graph_conv(
         whisper_context & wctx,
           whisper_state & wstate) {
@@ -1886,9 +2723,11 @@ static struct ggml_cgraph * whisper_build_graph_conv(
 
     const int n_mels = hparams.n_mels;
 
+    auto & meta = whisper_sched_conv(wstate, n_ctx).meta;
+
     struct ggml_init_params params = {
-        /*.mem_size   =*/ wstate.sched_conv.meta.size(),
-        /*.mem_buffer =*/ wstate.sched_conv.meta.data(),
+        /*.mem_size   =*/ meta.size(),
+        /*.mem_buffer =*/ meta.data(),
         /*.no_alloc   =*/ true,
     };
 
@@ -1956,9 +2795,11 @@ static struct ggml_cgraph * whisper_build_graph_encoder(
 
     const int n_ctx_pad = GGML_PAD(n_ctx, 256);
 
+    auto & meta = whisper_sched_encode(wstate, n_ctx).meta;
+
     struct ggml_init_params params = {
-        /*.mem_size   =*/ wstate.sched_encode.meta.size(),
-        /*.mem_buffer =*/ wstate.sched_encode.meta.data(),
+        /*.mem_size   =*/ meta.size(),
+        /*.mem_buffer =*/ meta.data(),
         /*.no_alloc   =*/ true,
     };
 
@@ -2150,6 +2991,8 @@ static struct ggml_cgraph * whisper_build_graph_encoder(
                 model.e_ln_b);
     }
 
+    ggml_set_name(cur, "embd_enc");
+
     ggml_build_forward_expand(gf, cur);
 
     wstate.embd_enc = cur;
@@ -2185,9 +3028,11 @@ static struct ggml_cgraph * whisper_build_graph_cross(
 
     const int n_ctx_pad = GGML_PAD(n_ctx, 256);
 
+    auto & meta = whisper_sched_cross(wstate, n_ctx).meta;
+
     struct ggml_init_params params = {
-        /*.mem_size   =*/ wstate.sched_cross.meta.size(),
-        /*.mem_buffer =*/ wstate.sched_cross.meta.data(),
+        /*.mem_size   =*/ meta.size(),
+        /*.mem_buffer =*/ meta.data(),
         /*.no_alloc   =*/ true,
     };
 
@@ -2219,17 +3064,18 @@ static struct ggml_cgraph * whisper_build_graph_cross(
         struct ggml_tensor * k;
         struct ggml_tensor * v;
 
+        // the offsets are in rows, K (and V with flash attention) can be block-quantized - see whisper_context_params.kv_type
         if (wctx.params.flash_attn) {
             k = ggml_view_1d(ctx0, wstate.kv_cross.k, n_state*n_ctx,
-                    (ggml_element_size(wstate.kv_cross.k)*n_state)*(il*n_ctx_pad));
+                    ggml_row_size(wstate.kv_cross.k->type, n_state)*(il*n_ctx_pad));
 
             v = ggml_view_1d(ctx0, wstate.kv_cross.v, n_state*n_ctx,
-                    (ggml_element_size(wstate.kv_cross.v)*n_state)*(il*n_ctx_pad));
+                    ggml_row_size(wstate.kv_cross.v->type, n_state)*(il*n_ctx_pad));
         } else {
             Vcross = ggml_transpose(ctx0, ggml_reshape_2d(ctx0, Vcross, n_state, n_ctx));
 
             k = ggml_view_1d(ctx0, wstate.kv_cross.k, n_state*n_ctx,
-                    (ggml_element_size(wstate.kv_cross.k)*n_state)*(il*n_ctx));
+                    ggml_row_size(wstate.kv_cross.k->type, n_state)*(il*n_ctx));
 
             v = ggml_view_2d(ctx0, wstate.kv_cross.v, n_ctx, n_state,
                     (   n_ctx)*ggml_element_size(wstate.kv_cross.v),
@@ -2247,6 +3093,174 @@ static struct ggml_cgraph * whisper_build_graph_cross(
     return gf;
 }
 
+static inline uint64_t whisper_hash_fmix(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+// two independent 64-bit hashes of a buffer in a single pass (not cryptographic)
+static void whisper_hash(const void * data, size_t size, uint64_t seed, uint64_t & h0, uint64_t & h1) {
+    const uint8_t * p = (const uint8_t *) data;
+
+    h0 = seed ^ (size*0x9e3779b97f4a7c15ULL);
+    h1 = whisper_hash_fmix(seed + size);
+
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t w;
+        memcpy(&w, p + i, 8);
+
+        h0 = (h0 ^ (w*0x87c37b91114253d5ULL))*0x9e3779b97f4a7c15ULL;
+        h0 = (h0 << 29) | (h0 >> 35);
+        h1 = (h1 + w)*0x4cf5ad432745937fULL;
+        h1 ^= h1 >> 31;
+    }
+
+    uint64_t w = 0;
+    memcpy(&w, p + i, size - i);
+
+    h0 = whisper_hash_fmix(h0 ^ w);
+    h1 = whisper_hash_fmix(h1 + w);
+}
+
+// identifies the model for the encoder cache: hyperparameters and the layout of the weights
+static uint64_t whisper_model_id(const whisper_model & model) {
+    uint64_t id = 0;
+    uint64_t unused;
+
+    const whisper_hparams & hparams = model.hparams;
+    whisper_hash(&hparams, sizeof(hparams), id, id, unused);
+
+    for (const auto & kv : model.tensors) {
+        const int64_t nbytes = ggml_nbytes(kv.second);
+
+        whisper_hash(kv.first.data(), kv.first.size(), id, id, unused);
+        whisper_hash(&nbytes, sizeof(nbytes), id, id, unused);
+    }
+
+    return id;
+}
+
+// restore the encoder output (and the cross-attention KV if it was cached) of the window with the given key
+// wstate.embd_enc must already be allocated
+static bool whisper_encoder_cache_restore(
+        whisper_encoder_cache & cache,
+        whisper_state & wstate,
+        uint64_t key,
+        uint64_t check,
+        int n_ctx,
+        bool & restored_cross,
+        int64_t & t_compute_us) {
+    std::lock_guard<std::mutex> lock(cache.mutex);
+
+    auto it = cache.index.find(key);
+    if (it == cache.index.end() || it->second->check != check || it->second->n_ctx != n_ctx) {
+        return false;
+    }
+
+    cache.entries.splice(cache.entries.begin(), cache.entries, it->second);
+
+    const whisper_encoder_cache_entry & entry = *it->second;
+
+    if (entry.embd_enc.size() != ggml_nbytes(wstate.embd_enc)) {
+        return false;
+    }
+
+    ggml_backend_tensor_set(wstate.embd_enc, entry.embd_enc.data(), 0, entry.embd_enc.size());
+
+    restored_cross = !entry.k_cross.empty();
+    if (restored_cross) {
+        ggml_backend_tensor_set(wstate.kv_cross.k, entry.k_cross.data(), 0, entry.k_cross.size());
+        ggml_backend_tensor_set(wstate.kv_cross.v, entry.v_cross.data(), 0, entry.v_cross.size());
+    }
+
+    t_compute_us = entry.t_compute_us;
+
+    return true;
+}
+
+// drop least recently used entries that are not pinned until size more bytes fit in the budget
+static bool whisper_encoder_cache_make_room(whisper_encoder_cache & cache, size_t size) {
+    auto it = cache.entries.end();
+    while (cache.used + size > cache.budget && it != cache.entries.begin()) {
+        --it;
+        if (it->pinned) {
+            continue;
+        }
+        cache.used -= it->size();
+        cache.index.erase(it->key);
+        it = cache.entries.erase(it);
+    }
+
+    return cache.used + size <= cache.budget;
+}
+
+// add the freshly computed encoder output of the window to the cache
+static void whisper_encoder_cache_store(
+        const whisper_context & wctx,
+        whisper_encoder_cache & cache,
+        whisper_state & wstate,
+        uint64_t key,
+        uint64_t check,
+        int n_ctx,
+        int64_t t_compute_us) {
+    const auto & hparams = wctx.model.hparams;
+
+    const size_t embd_size = ggml_nbytes(wstate.embd_enc);
+
+    // the cross graph fills a prefix of each KV tensor: n_text_layer rows of n_ctx positions, padded with flash attention
+    size_t k_size = 0;
+    size_t v_size = 0;
+    if (cache.cross) {
+        const int64_t n_ctx_row = wctx.params.flash_attn ? GGML_PAD(n_ctx, 256) : n_ctx;
+        k_size = ggml_row_size(wstate.kv_cross.k->type, hparams.n_text_state)*((hparams.n_text_layer - 1)*n_ctx_row + n_ctx);
+        v_size = ggml_row_size(wstate.kv_cross.v->type, hparams.n_text_state)*((hparams.n_text_layer - 1)*n_ctx_row + n_ctx);
+    }
+
+    if (embd_size + k_size + v_size > cache.budget) {
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(cache.mutex);
+        if (cache.index.count(key) > 0) {
+            // another state already added the same window
+            return;
+        }
+    }
+
+    whisper_encoder_cache_entry entry;
+
+    entry.key          = key;
+    entry.check        = check;
+    entry.n_ctx        = n_ctx;
+    entry.t_compute_us = t_compute_us;
+
+    entry.embd_enc.resize(embd_size);
+    ggml_backend_tensor_get(wstate.embd_enc, entry.embd_enc.data(), 0, embd_size);
+
+    if (k_size > 0) {
+        entry.k_cross.resize(k_size);
+        entry.v_cross.resize(v_size);
+        ggml_backend_tensor_get(wstate.kv_cross.k, entry.k_cross.data(), 0, k_size);
+        ggml_backend_tensor_get(wstate.kv_cross.v, entry.v_cross.data(), 0, v_size);
+    }
+
+    std::lock_guard<std::mutex> lock(cache.mutex);
+
+    if (cache.index.count(key) > 0 || !whisper_encoder_cache_make_room(cache, entry.size())) {
+        return;
+    }
+
+    cache.used += entry.size();
+    cache.entries.push_front(std::move(entry));
+    cache.index[key] = cache.entries.begin();
+}
+
 // evaluate the encoder with the given state
 //
 // given audio recording (more specifically, its log mel spectrogram), runs forward pass of the encoder
@@ -2266,46 +3280,112 @@ static bool whisper_encode_internal(
                    void * abort_callback_data) {
     const int64_t t_start_us = ggml_time_us();
 
+    const int n_ctx = wstate.exp_n_audio_ctx > 0 ? wstate.exp_n_audio_ctx : wctx.model.hparams.n_audio_ctx;
+
+    wstate.enc_seek = -1;
+    wstate.enc_key  = 0;
+
+    auto & cache = wctx.encoder_cache;
+
+    uint64_t cache_key   = 0;
+    uint64_t cache_check = 0;
+
     // conv
+    auto & s_conv     = whisper_sched_conv(wstate, n_ctx);
+    auto & sched_conv = s_conv.sched;
+
+    ggml_cgraph * gf_conv = whisper_sched_graph(wstate, s_conv, { n_ctx }, [&]() {
+        return whisper_build_graph_conv(wctx, wstate);
+    });
+
+    if (whisper_encode_external(wstate)) {
+        wstate.embd_enc  = ggml_graph_get_tensor(gf_conv, "embd_enc");
+    } else {
+        wstate.embd_conv = ggml_graph_get_tensor(gf_conv, "embd_conv");
+    }
+
+    if (!whisper_sched_alloc_graph(wstate, s_conv, gf_conv)) {
+        // should never happen as we pre-allocate the memory
+        return false;
+    }
+
+    struct ggml_tensor * mel = ggml_graph_get_tensor(gf_conv, "mel");
+
+    // set the input
     {
-        auto & sched = wstate.sched_conv.sched;
+        const auto & mel_inp = wstate.mel;
 
-        ggml_cgraph * gf = whisper_build_graph_conv(wctx, wstate);
+        assert(mel->type == GGML_TYPE_F32);
+        assert(mel_inp.n_mel == wctx.model.hparams.n_mels);
 
-        if (!ggml_backend_sched_alloc_graph(sched, gf)) {
-            // should never happen as we pre-allocate the memory
-            return false;
+        wstate.inp_mel.resize(ggml_nelements(mel));
+
+        float * dst = wstate.inp_mel.data();
+        memset(dst, 0, ggml_nbytes(mel));
+
+        const int i0 = std::min(mel_offset,           mel_inp.n_len);
+        const int i1 = std::min(mel_offset + 2*n_ctx, mel_inp.n_len);
+
+        for (int j = 0; j < mel_inp.n_mel; ++j) {
+            for (int i = i0; i < i1; ++i) {
+                dst[j*2*n_ctx + (i - i0)] = mel_inp.data[j*mel_inp.n_len + i];
+            }
         }
 
-        struct ggml_tensor * mel = ggml_graph_get_tensor(gf, "mel");
+        ggml_backend_tensor_set(mel, wstate.inp_mel.data(), 0, ggml_nelements(mel)*sizeof(float));
 
-        // set the input
+        // the key also identifies the window for the prompt cache, so it is computed without the encoder cache too
         {
-            const auto & mel_inp = wstate.mel;
-            const int n_ctx      = wstate.exp_n_audio_ctx > 0 ? wstate.exp_n_audio_ctx : wctx.model.hparams.n_audio_ctx;
+            const uint64_t seed = cache.model_id ^ ((uint64_t) n_ctx << 1 | (wctx.params.flash_attn ? 1 : 0));
+            whisper_hash(wstate.inp_mel.data(), wstate.inp_mel.size()*sizeof(float), seed, cache_key, cache_check);
+        }
 
-            assert(mel->type == GGML_TYPE_F32);
-            assert(mel_inp.n_mel == wctx.model.hparams.n_mels);
+        if (cache.budget > 0) {
+            if (std::find(wstate.enc_cache_keys.begin(), wstate.enc_cache_keys.end(), cache_key) == wstate.enc_cache_keys.end()) {
+                wstate.enc_cache_keys.push_back(cache_key);
+            }
+        }
+    }
 
-            wstate.inp_mel.resize(ggml_nelements(mel));
+    // encoder
+    auto & s_encode     = whisper_sched_encode(wstate, n_ctx);
+    auto & sched_encode = s_encode.sched;
 
-            float * dst = wstate.inp_mel.data();
-            memset(dst, 0, ggml_nbytes(mel));
+    ggml_cgraph * gf_encode = nullptr;
 
-            const int i0 = std::min(mel_offset,           mel_inp.n_len);
-            const int i1 = std::min(mel_offset + 2*n_ctx, mel_inp.n_len);
+    if (!whisper_encode_external(wstate)) {
+        gf_encode = whisper_sched_graph(wstate, s_encode, { n_ctx, (int32_t) s_conv.n_build }, [&]() {
+            return whisper_build_graph_encoder(wctx, wstate);
+        });
 
-            for (int j = 0; j < mel_inp.n_mel; ++j) {
-                for (int i = i0; i < i1; ++i) {
-                    dst[j*2*n_ctx + (i - i0)] = mel_inp.data[j*mel_inp.n_len + i];
-                }
-            }
+        wstate.embd_enc = ggml_graph_get_tensor(gf_encode, "embd_enc");
 
-            ggml_backend_tensor_set(mel, wstate.inp_mel.data(), 0, ggml_nelements(mel)*sizeof(float));
+        if (!whisper_sched_alloc_graph(wstate, s_encode, gf_encode)) {
+            // should never happen as we pre-allocate the memory
+            return false;
         }
+    }
 
+    // with both graphs allocated, embd_enc can be restored from the cache instead of computing them
+    bool    cached       = false;
+    bool    cached_cross = false;
+    int64_t t_compute_us = 0;
+    int64_t t_restore_us = 0;
+
+    if (cache.budget > 0) {
+        const int64_t t_restore_start_us = ggml_time_us();
+        cached = whisper_encoder_cache_restore(cache, wstate, cache_key, cache_check, n_ctx, cached_cross, t_compute_us);
+        t_restore_us = ggml_time_us() - t_restore_start_us;
+    }
+
+    if (cached) {
+        ggml_backend_sched_reset(sched_conv);
+        if (gf_encode) {
+            ggml_backend_sched_reset(sched_encode);
+        }
+    } else {
         if (!whisper_encode_external(wstate)) {
-            if (!ggml_graph_compute_helper(sched, gf, n_threads)) {
+            if (!ggml_graph_compute_helper(sched_conv, gf_conv, n_threads, whisper_threadpool_acquire(wstate, n_threads))) {
                 return false;
             }
         } else {
@@ -2315,40 +3395,58 @@ static bool whisper_encode_internal(
             whisper_openvino_encode(wstate.ctx_openvino, mel, wstate.embd_enc);
 #endif
         }
-    }
-
-    // encoder
-    if (!whisper_encode_external(wstate)) {
-        auto & sched = wstate.sched_encode.sched;
-
-        ggml_cgraph * gf = whisper_build_graph_encoder(wctx, wstate);
 
-        if (!ggml_backend_sched_alloc_graph(sched, gf)) {
-            // should never happen as we pre-allocate the memory
-            return false;
+        if (gf_encode) {
+            if (!ggml_graph_compute_helper(sched_encode, gf_encode, n_threads, whisper_threadpool_acquire(wstate, n_threads))) {
+                return false;
+            }
         }
 
-        if (!ggml_graph_compute_helper(sched, gf, n_threads)) {
-            return false;
-        }
+        t_compute_us = ggml_time_us() - t_start_us;
     }
 
     // cross
-    {
-        auto & sched = wstate.sched_cross.sched;
+    if (!cached_cross) {
+        const int64_t t_cross_start_us = ggml_time_us();
+
+        auto & s_cross = whisper_sched_cross(wstate, n_ctx);
+        auto & sched   = s_cross.sched;
 
-        ggml_cgraph * gf = whisper_build_graph_cross(wctx, wstate);
+        // the cross graph reads embd_enc of the graph that produced it
+        const int32_t n_build_src = whisper_encode_external(wstate) ? s_conv.n_build : s_encode.n_build;
+
+        ggml_cgraph * gf = whisper_sched_graph(wstate, s_cross, { n_ctx, n_build_src }, [&]() {
+            return whisper_build_graph_cross(wctx, wstate);
+        });
 
-        if (!ggml_backend_sched_alloc_graph(sched, gf)) {
+        if (!whisper_sched_alloc_graph(wstate, s_cross, gf)) {
             // should never happen as we pre-allocate the memory
             return false;
         }
 
-        if (!ggml_graph_compute_helper(sched, gf, n_threads)) {
+        if (!ggml_graph_compute_helper(sched, gf, n_threads, whisper_threadpool_acquire(wstate, n_threads))) {
             return false;
         }
+
+        if (!cached && cache.cross) {
+            t_compute_us += ggml_time_us() - t_cross_start_us;
+        }
+    }
+
+    if (cache.budget > 0) {
+        if (cached) {
+            wstate.t_enc_cache_saved_us += std::max<int64_t>(0, t_compute_us - t_restore_us);
+            wstate.n_enc_cache_hit++;
+        } else {
+            whisper_encoder_cache_store(wctx, cache, wstate, cache_key, cache_check, n_ctx, t_compute_us);
+            wstate.n_enc_cache_miss++;
+        }
     }
 
+    wstate.enc_seek  = mel_offset;
+    wstate.enc_n_ctx = n_ctx;
+    wstate.enc_key   = cache_key;
+
     wstate.t_encode_us += ggml_time_us() - t_start_us;
     wstate.n_encode++;
 
@@ -2385,9 +3483,14 @@ static struct ggml_cgraph * whisper_build_graph_decoder(
 
     //WHISPER_LOG_DEBUG("%s: n_past = %d, n_tokens = %d, n_audio_ctx = %d, n_ctx = %d\n", __func__, n_past, n_tokens, n_audio_ctx, n_ctx);
 
+    auto & s_decode = whisper_sched_decode(wstate, save_alignment_heads_QKs);
+
+    s_decode.kv_views.clear();
+    s_decode.kv_head = kv_head;
+
     struct ggml_init_params params = {
-        /*.mem_size   =*/ wstate.sched_decode.meta.size(),
-        /*.mem_buffer =*/ wstate.sched_decode.meta.data(),
+        /*.mem_size   =*/ s_decode.meta.size(),
+        /*.mem_buffer =*/ s_decode.meta.data(),
         /*.no_alloc   =*/ true,
     };
 
@@ -2471,23 +3574,34 @@ static struct ggml_cgraph * whisper_build_graph_decoder(
 
                 if (wctx.params.flash_attn) {
                     k = ggml_view_1d(ctx0, kv_self.k, n_tokens*n_state,
-                            (ggml_element_size(kv_self.k)*n_state)*(il*n_ctx + kv_head));
+                            ggml_row_size(kv_self.k->type, n_state)*(il*n_ctx + kv_head));
 
                     v = ggml_view_1d(ctx0, kv_self.v, n_tokens*n_state,
-                            (ggml_element_size(kv_self.v)*n_state)*(il*n_ctx + kv_head));
+                            ggml_row_size(kv_self.v->type, n_state)*(il*n_ctx + kv_head));
                 } else {
                     Vcur = ggml_transpose(ctx0, ggml_reshape_2d(ctx0, Vcur, n_state, n_tokens));
 
                     k = ggml_view_1d(ctx0, kv_self.k, n_tokens*n_state,
-                            (ggml_element_size(kv_self.k)*n_state)*(il*n_ctx + kv_head));
+                            ggml_row_size(kv_self.k->type, n_state)*(il*n_ctx + kv_head));
 
                     v = ggml_view_2d(ctx0, kv_self.v, n_tokens, n_state,
                             (   n_ctx)*ggml_element_size(kv_self.v),
                             (il*n_ctx)*ggml_element_size(kv_self.v)*n_state + kv_head*ggml_element_size(kv_self.v));
                 }
 
-                ggml_build_forward_expand(gf, ggml_cpy(ctx0, Kcur, k));
-                ggml_build_forward_expand(gf, ggml_cpy(ctx0, Vcur, v));
+                struct ggml_tensor * k_cpy = ggml_cpy(ctx0, Kcur, k);
+                struct ggml_tensor * v_cpy = ggml_cpy(ctx0, Vcur, v);
+
+                ggml_build_forward_expand(gf, k_cpy);
+                ggml_build_forward_expand(gf, v_cpy);
+
+                const size_t k_cell = ggml_row_size(kv_self.k->type, n_state);
+                const size_t v_cell = wctx.params.flash_attn ? ggml_row_size(kv_self.v->type, n_state) : ggml_element_size(kv_self.v);
+
+                s_decode.kv_views.push_back({ k,     k_cell });
+                s_decode.kv_views.push_back({ k_cpy, k_cell });
+                s_decode.kv_views.push_back({ v,     v_cell });
+                s_decode.kv_views.push_back({ v_cpy, v_cell });
             }
 
             // ------
@@ -2500,17 +3614,17 @@ static struct ggml_cgraph * whisper_build_graph_decoder(
             struct ggml_tensor * K =
                 ggml_view_3d(ctx0, kv_self.k,
                         n_state_head, n_kv, n_head,
-                        ggml_element_size(kv_self.k)*n_state,
-                        ggml_element_size(kv_self.k)*n_state_head,
-                        ggml_element_size(kv_self.k)*n_state*n_ctx*il);
+                        ggml_row_size(kv_self.k->type, n_state),
+                        ggml_row_size(kv_self.k->type, n_state_head),
+                        ggml_row_size(kv_self.k->type, n_state)*n_ctx*il);
 
             if (wctx.params.flash_attn) {
                 struct ggml_tensor * V =
                     ggml_view_3d(ctx0, kv_self.v,
                             n_state_head, n_kv, n_head,
-                            ggml_element_size(kv_self.v)*n_state,
-                            ggml_element_size(kv_self.v)*n_state_head,
-                            ggml_element_size(kv_self.v)*n_state*n_ctx*il);
+                            ggml_row_size(kv_self.v->type, n_state),
+                            ggml_row_size(kv_self.v->type, n_state_head),
+                            ggml_row_size(kv_self.v->type, n_state)*n_ctx*il);
 
                 cur = ggml_flash_attn_ext(ctx0, Q, K, V, KQ_mask_f16, 1.0f, 0.0f, 0.0f);
 
@@ -2581,16 +3695,16 @@ static struct ggml_cgraph * whisper_build_graph_decoder(
                 struct ggml_tensor * Kcross =
                     ggml_view_3d(ctx0, wstate.kv_cross.k,
                             n_state_head, n_audio_ctx_pad, n_head,
-                            ggml_element_size(wstate.kv_cross.k)*n_state,
-                            ggml_element_size(wstate.kv_cross.k)*n_state_head,
-                            ggml_element_size(wstate.kv_cross.k)*n_state*n_audio_ctx_pad*il);
+                            ggml_row_size(wstate.kv_cross.k->type, n_state),
+                            ggml_row_size(wstate.kv_cross.k->type, n_state_head),
+                            ggml_row_size(wstate.kv_cross.k->type, n_state)*n_audio_ctx_pad*il);
 
                 struct ggml_tensor * Vcross =
                     ggml_view_3d(ctx0, wstate.kv_cross.v,
                             n_state_head, n_audio_ctx_pad, n_head,
-                            ggml_element_size(wstate.kv_cross.v)*n_state,
-                            ggml_element_size(wstate.kv_cross.v)*n_state_head,
-                            ggml_element_size(wstate.kv_cross.v)*n_state*n_audio_ctx_pad*il);
+                            ggml_row_size(wstate.kv_cross.v->type, n_state),
+                            ggml_row_size(wstate.kv_cross.v->type, n_state_head),
+                            ggml_row_size(wstate.kv_cross.v->type, n_state)*n_audio_ctx_pad*il);
 
                 cur = ggml_flash_attn_ext(ctx0, Q, Kcross, Vcross, nullptr, KQscale, 0.0f, 0.0f);
 
@@ -2599,9 +3713,9 @@ static struct ggml_cgraph * whisper_build_graph_decoder(
                 struct ggml_tensor * Kcross =
                     ggml_view_3d(ctx0, wstate.kv_cross.k,
                             n_state_head, n_audio_ctx, n_head,
-                            ggml_element_size(wstate.kv_cross.k)*n_state,
-                            ggml_element_size(wstate.kv_cross.k)*n_state_head,
-                            ggml_element_size(wstate.kv_cross.k)*n_state*n_audio_ctx*il);
+                            ggml_row_size(wstate.kv_cross.k->type, n_state),
+                            ggml_row_size(wstate.kv_cross.k->type, n_state_head),
+                            ggml_row_size(wstate.kv_cross.k->type, n_state)*n_audio_ctx*il);
 
                 struct ggml_tensor * Vcross =
                     ggml_view_3d(ctx0, wstate.kv_cross.v,
@@ -2621,12 +3735,8 @@ static struct ggml_cgraph * whisper_build_graph_decoder(
                 if (wctx.params.dtw_token_timestamps) {
                     if (wstate.aheads_masks.m[il] != nullptr) {
                         struct ggml_tensor * aheads_KQs = ggml_reshape_2d(ctx0, KQ_soft_max, KQ_soft_max->ne[0] * KQ_soft_max->ne[1], KQ_soft_max->ne[2]);
-                        aheads_KQs = ggml_transpose(ctx0, aheads_KQs);
-                        aheads_KQs = ggml_cont(ctx0, aheads_KQs);
-                        aheads_KQs = ggml_mul_mat(ctx0, wstate.aheads_masks.m[il], aheads_KQs);
-                        aheads_KQs = ggml_transpose(ctx0, aheads_KQs);
-                        aheads_KQs = ggml_cont(ctx0, aheads_KQs);
-                        aheads_KQs = ggml_reshape_3d(ctx0, aheads_KQs, KQ_soft_max->ne[0], KQ_soft_max->ne[1], wstate.aheads_masks.m[il]->ne[1]);
+                        aheads_KQs = ggml_get_rows(ctx0, aheads_KQs, wstate.aheads_masks.m[il]);
+                        aheads_KQs = ggml_reshape_3d(ctx0, aheads_KQs, KQ_soft_max->ne[0], KQ_soft_max->ne[1], wstate.aheads_masks.m[il]->ne[0]);
                         if (aheads_cross_QKs == NULL) {
                             aheads_cross_QKs = aheads_KQs;
                         } else {
@@ -2719,10 +3829,10 @@ static struct ggml_cgraph * whisper_build_graph_decoder(
     struct ggml_tensor * logits = ggml_mul_mat(ctx0, model.d_te, cur);
 
     // [EXPERIMENTAL] Token-level timestamps with DTW
+    // [n_audio_ctx, n_tokens, n_aheads], the QKs of each token stay contiguous for whisper_dtw_capture()
     if (wctx.params.dtw_token_timestamps && aheads_cross_QKs != nullptr) {
-        aheads_cross_QKs = ggml_transpose(ctx0, aheads_cross_QKs);
-        aheads_cross_QKs = ggml_cont(ctx0, aheads_cross_QKs);
         if (save_alignment_heads_QKs) {
+            ggml_set_name(aheads_cross_QKs, "aheads_cross_QKs");
             ggml_build_forward_expand(gf, aheads_cross_QKs);
             wstate.aheads_cross_QKs = aheads_cross_QKs;
         }
@@ -2782,16 +3892,38 @@ static bool whisper_decode_internal(
 
     // decoder
     {
-        auto & sched = wstate.sched_decode.sched;
+        auto & s_decode = whisper_sched_decode(wstate, save_alignment_heads_QKs);
+        auto & sched    = s_decode.sched;
 
-        ggml_cgraph * gf = whisper_build_graph_decoder(wctx, wstate, batch, save_alignment_heads_QKs, false);
+        const int n_audio_ctx = wstate.exp_n_audio_ctx > 0 ? wstate.exp_n_audio_ctx : hparams.n_audio_ctx;
 
-        if (!ggml_backend_sched_alloc_graph(sched, gf)) {
-            // should never happen as we pre-allocate the memory
-            return false;
-        }
+        // a graph built before the KV cache was recreated views the old buffer with the old strides
+        const whisper_graph_key key = { n_tokens, (int32_t) wstate.kv_self.n, n_audio_ctx, (int32_t) wstate.kv_self.gen };
 
-        // set the inputs
+        ggml_cgraph * gf = whisper_sched_graph(wstate, s_decode, key, [&]() {
+            return whisper_build_graph_decoder(wctx, wstate, batch, save_alignment_heads_QKs, false);
+        });
+
+        // a reused graph writes the new K and V at the slot of this batch
+        const int32_t kv_head = wstate.kv_self.head;
+        if (s_decode.kv_head != kv_head) {
+            for (auto & view : s_decode.kv_views) {
+                view.first->view_offs += (kv_head - s_decode.kv_head)*(int64_t) view.second;
+                view.first->data       = (char *) view.first->view_src->data + view.first->view_offs;
+            }
+            s_decode.kv_head = kv_head;
+        }
+
+        if (save_alignment_heads_QKs) {
+            wstate.aheads_cross_QKs = ggml_graph_get_tensor(gf, "aheads_cross_QKs");
+        }
+
+        if (!whisper_sched_alloc_graph(wstate, s_decode, gf)) {
+            // should never happen as we pre-allocate the memory
+            return false;
+        }
+
+        // set the inputs
         {
             struct ggml_tensor * embd = ggml_graph_get_tensor(gf, "embd");
             ggml_backend_tensor_set(embd, batch.token, 0, n_tokens*ggml_element_size(embd));
@@ -2841,7 +3973,7 @@ static bool whisper_decode_internal(
 
         logits = ggml_graph_node(gf, -1);
 
-        if (!ggml_graph_compute_helper(sched, gf, n_threads)) {
+        if (!ggml_graph_compute_helper(sched, gf, n_threads, whisper_threadpool_acquire(wstate, n_threads))) {
             return false;
         }
     }
@@ -2894,30 +4026,40 @@ static std::string to_timestamp(int64_t t, bool comma = false) {
     return std::string(buf);
 }
 
-#define SIN_COS_N_COUNT WHISPER_N_FFT
+// real-input FFT of size WHISPER_N_FFT
+//
+// the N real samples are treated as N/2 complex values (even samples as the real part, odd samples as the imaginary
+// part) and transformed with a mixed-radix Stockham FFT - no recursion, no bit reversal and no scratch allocations.
+// a final split step recovers the first N/2 + 1 bins of the spectrum of the real input.
+// all twiddle factors are precomputed once in the plan
+#define WHISPER_RFFT_N (WHISPER_N_FFT)
+#define WHISPER_RFFT_M (WHISPER_N_FFT/2)
+#define WHISPER_RFFT_MAX_STAGES 16
+
 namespace {
 struct whisper_global_cache {
-    // In FFT, we frequently use sine and cosine operations with the same values.
-    // We can use precalculated values to speed up the process.
-    float sin_vals[SIN_COS_N_COUNT];
-    float cos_vals[SIN_COS_N_COUNT];
-
     // Hann window (Use cosf to eliminate difference)
     // ref: https://pytorch.org/docs/stable/generated/torch.hann_window.html
     // ref: https://github.com/openai/whisper/blob/main/whisper/audio.py#L147
     float hann_window[WHISPER_N_FFT];
 
+    // radix of each stage of the complex FFT of size WHISPER_RFFT_M
+    int rfft_n_stages = 0;
+    int rfft_radix[WHISPER_RFFT_MAX_STAGES];
+
+    // per stage, w^(j*q) for q in [0, n/p) and j in [1, p), with w = exp(-2*pi*i/n) (interleaved re, im)
+    std::vector<float> rfft_twiddles;
+    int rfft_twiddles_offs[WHISPER_RFFT_MAX_STAGES];
+
+    // exp(-2*pi*i*k/p) for the butterflies, indexed by [p][k]
+    float rfft_roots[6][5][2];
+
+    // exp(-2*pi*i*k/N) for the split step, k in [0, N/2]
+    float rfft_split[WHISPER_RFFT_M + 1][2];
+
     whisper_global_cache() {
-        fill_sin_cos_table();
         fill_hann_window(sizeof(hann_window)/sizeof(hann_window[0]), true, hann_window);
-    }
-
-    void fill_sin_cos_table() {
-        for (int i = 0; i < SIN_COS_N_COUNT; i++) {
-            double theta = (2 * M_PI * i) / SIN_COS_N_COUNT;
-            sin_vals[i] = sinf(theta);
-            cos_vals[i] = cosf(theta);
-        }
+        fill_rfft_plan();
     }
 
     void fill_hann_window(int length, bool periodic, float * output) {
@@ -2929,132 +4071,284 @@ struct whisper_global_cache {
             output[i] = 0.5 * (1.0 - cosf((2.0 * M_PI * i) / (length + offset)));
         }
     }
+
+    void fill_rfft_plan() {
+        static_assert(WHISPER_RFFT_N % 2 == 0, "the real FFT size must be even");
+
+        // factorize - radix 4 first, as it needs no multiplications in the butterfly
+        int n = WHISPER_RFFT_M;
+        while (n > 1) {
+            int p = 0;
+            for (int r : { 4, 2, 3, 5 }) {
+                if (n % r == 0) {
+                    p = r;
+                    break;
+                }
+            }
+            WHISPER_ASSERT(p != 0 && "unsupported FFT size");
+            WHISPER_ASSERT(rfft_n_stages < WHISPER_RFFT_MAX_STAGES);
+
+            rfft_radix[rfft_n_stages++] = p;
+            n /= p;
+        }
+
+        n = WHISPER_RFFT_M;
+        for (int st = 0; st < rfft_n_stages; ++st) {
+            const int p = rfft_radix[st];
+            const int m = n / p;
+
+            rfft_twiddles_offs[st] = rfft_twiddles.size();
+            for (int q = 0; q < m; ++q) {
+                for (int j = 1; j < p; ++j) {
+                    const double theta = (2.0 * M_PI * j * q) / n;
+                    rfft_twiddles.push_back( cos(theta));
+                    rfft_twiddles.push_back(-sin(theta));
+                }
+            }
+            n = m;
+        }
+
+        for (int p = 1; p <= 5; ++p) {
+            for (int k = 0; k < p; ++k) {
+                const double theta = (2.0 * M_PI * k) / p;
+                rfft_roots[p][k][0] =  cos(theta);
+                rfft_roots[p][k][1] = -sin(theta);
+            }
+        }
+
+        for (int k = 0; k <= WHISPER_RFFT_M; ++k) {
+            const double theta = (2.0 * M_PI * k) / WHISPER_RFFT_N;
+            rfft_split[k][0] =  cos(theta);
+            rfft_split[k][1] = -sin(theta);
+        }
+    }
 } global_cache;
 }
 
-// naive Discrete Fourier Transform
-// input is real-valued
-// output is complex-valued
-static void dft(const float* in, int N, float* out) {
-    const int sin_cos_step = SIN_COS_N_COUNT / N;
+// complex FFT of size WHISPER_RFFT_M using the precomputed plan
+// x and y hold WHISPER_RFFT_M interleaved complex values, x is the input and both are used as scratch
+// returns the buffer that holds the result
+static float * whisper_cfft(float * x, float * y) {
+    const auto & gc = global_cache;
+
+    int n = WHISPER_RFFT_M;
+    int s = 1;
+
+    for (int st = 0; st < gc.rfft_n_stages; ++st) {
+        const int p = gc.rfft_radix[st];
+        const int m = n / p;
+
+        const float * tw = gc.rfft_twiddles.data() + gc.rfft_twiddles_offs[st];
+
+        for (int q = 0; q < m; ++q) {
+            const float * wq = tw + 2*(p - 1)*q;
+
+            for (int k = 0; k < s; ++k) {
+                const float * a = x + 2*(k + s*q);
+                float       * b = y + 2*(k + s*p*q);
+
+                const int sa = 2*s*m; // stride between the inputs of the butterfly
+                const int sb = 2*s;   // stride between the outputs of the butterfly
+
+                if (p == 2) {
+                    const float r0 = a[0] + a[sa + 0];
+                    const float i0 = a[1] + a[sa + 1];
+                    const float r1 = a[0] - a[sa + 0];
+                    const float i1 = a[1] - a[sa + 1];
+
+                    b[0] = r0;
+                    b[1] = i0;
+                    b[sb + 0] = r1*wq[0] - i1*wq[1];
+                    b[sb + 1] = r1*wq[1] + i1*wq[0];
+                } else if (p == 4) {
+                    const float t0r = a[0*sa + 0] + a[2*sa + 0];
+                    const float t0i = a[0*sa + 1] + a[2*sa + 1];
+                    const float t1r = a[0*sa + 0] - a[2*sa + 0];
+                    const float t1i = a[0*sa + 1] - a[2*sa + 1];
+                    const float t2r = a[1*sa + 0] + a[3*sa + 0];
+                    const float t2i = a[1*sa + 1] + a[3*sa + 1];
+                    const float t3r = a[1*sa + 0] - a[3*sa + 0];
+                    const float t3i = a[1*sa + 1] - a[3*sa + 1];
+
+                    // y1 = t1 - i*t3, y2 = t0 - t2, y3 = t1 + i*t3
+                    const float r1 = t1r + t3i;
+                    const float i1 = t1i - t3r;
+                    const float r2 = t0r - t2r;
+                    const float i2 = t0i - t2i;
+                    const float r3 = t1r - t3i;
+                    const float i3 = t1i + t3r;
+
+                    b[0] = t0r + t2r;
+                    b[1] = t0i + t2i;
+                    b[1*sb + 0] = r1*wq[0] - i1*wq[1];
+                    b[1*sb + 1] = r1*wq[1] + i1*wq[0];
+                    b[2*sb + 0] = r2*wq[2] - i2*wq[3];
+                    b[2*sb + 1] = r2*wq[3] + i2*wq[2];
+                    b[3*sb + 0] = r3*wq[4] - i3*wq[5];
+                    b[3*sb + 1] = r3*wq[5] + i3*wq[4];
+                } else {
+                    const float (*roots)[2] = gc.rfft_roots[p];
+
+                    for (int j = 0; j < p; ++j) {
+                        float re = 0.0f;
+                        float im = 0.0f;
+                        for (int r = 0; r < p; ++r) {
+                            const float * c = roots[(j*r) % p];
+                            re += a[r*sa + 0]*c[0] - a[r*sa + 1]*c[1];
+                            im += a[r*sa + 0]*c[1] + a[r*sa + 1]*c[0];
+                        }
+                        if (j == 0) {
+                            b[0] = re;
+                            b[1] = im;
+                        } else {
+                            const float * w = wq + 2*(j - 1);
+                            b[j*sb + 0] = re*w[0] - im*w[1];
+                            b[j*sb + 1] = re*w[1] + im*w[0];
+                        }
+                    }
+                }
+            }
+        }
+
+        n = m;
+        s *= p;
+        std::swap(x, y);
+    }
+
+    return x;
+}
+
+// power spectrum |X[k]|^2, k in [0, N/2], of a real frame of WHISPER_RFFT_N samples
+// `in` and `work` are WHISPER_RFFT_N floats of scratch, the input frame is overwritten
+static void whisper_rfft_power(float * in, float * work, float * power) {
+    const float * z = whisper_cfft(in, work);
 
-    for (int k = 0; k < N; k++) {
-        float re = 0;
-        float im = 0;
+    const auto & split = global_cache.rfft_split;
 
-        for (int n = 0; n < N; n++) {
-            int idx = (k * n * sin_cos_step) % (SIN_COS_N_COUNT); // t = 2*M_PI*k*n/N
-            re += in[n]*global_cache.cos_vals[idx]; // cos(t)
-            im -= in[n]*global_cache.sin_vals[idx]; // sin(t)
-        }
+    for (int k = 0; k <= WHISPER_RFFT_M; ++k) {
+        const int k0 = k % WHISPER_RFFT_M;
+        const int k1 = (WHISPER_RFFT_M - k) % WHISPER_RFFT_M;
+
+        // even part: (Z[k] + conj(Z[M - k]))/2, odd part: (Z[k] - conj(Z[M - k]))/(2i)
+        const float er = 0.5f*(z[2*k0 + 0] + z[2*k1 + 0]);
+        const float ei = 0.5f*(z[2*k0 + 1] - z[2*k1 + 1]);
+        const float or_ = 0.5f*(z[2*k0 + 1] + z[2*k1 + 1]);
+        const float oi = -0.5f*(z[2*k0 + 0] - z[2*k1 + 0]);
 
-        out[k*2 + 0] = re;
-        out[k*2 + 1] = im;
+        const float re = er + or_*split[k][0] - oi*split[k][1];
+        const float im = ei + or_*split[k][1] + oi*split[k][0];
+
+        power[k] = re*re + im*im;
     }
 }
 
-// Cooley-Tukey FFT
-// poor man's implementation - use something better
-// input is real-valued
-// output is complex-valued
-static void fft(float* in, int N, float* out) {
-    if (N == 1) {
-        out[0] = in[0];
-        out[1] = 0;
-        return;
+#if defined(WHISPER_SIMD_AVX2)
+WHISPER_TARGET_AVX2
+static float whisper_mel_dot_avx2(const float * x, const float * y, int n) {
+    int i = 0;
+
+    __m256 acc = _mm256_setzero_ps();
+    for (; i + 8 <= n; i += 8) {
+        acc = _mm256_fmadd_ps(_mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i), acc);
     }
+    __m128 acc4 = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+    acc4 = _mm_add_ps(acc4, _mm_movehl_ps(acc4, acc4));
+    acc4 = _mm_add_ss(acc4, _mm_movehdup_ps(acc4));
+    float sum = _mm_cvtss_f32(acc4);
 
-    const int half_N = N / 2;
-    if (N - half_N*2 == 1) {
-        dft(in, N, out);
-        return;
+    for (; i < n; ++i) {
+        sum += x[i]*y[i];
+    }
+
+    return sum;
+}
+#endif
+
+// dot product of the power spectrum with a mel filter
+static inline float whisper_mel_dot(const float * x, const float * y, int n) {
+#if defined(WHISPER_SIMD_AVX2)
+    if (g_simd_level >= WHISPER_SIMD_LEVEL_AVX2) {
+        return whisper_mel_dot_avx2(x, y, n);
+    }
+#endif
+
+    int i = 0;
+    float sum = 0.0f;
+
+#if defined(__ARM_NEON)
+    float32x4_t acc = vdupq_n_f32(0.0f);
+    for (; i + 4 <= n; i += 4) {
+        acc = vmlaq_f32(acc, vld1q_f32(x + i), vld1q_f32(y + i));
+    }
+    sum = vgetq_lane_f32(acc, 0) + vgetq_lane_f32(acc, 1) + vgetq_lane_f32(acc, 2) + vgetq_lane_f32(acc, 3);
+#endif
+
+    for (; i < n; ++i) {
+        sum += x[i]*y[i];
     }
 
-    float* even = in + N;
-    for (int i = 0; i < half_N; ++i) {
-        even[i]= in[2*i];
+    return sum;
+}
+
+// log10 mel energies of the frame of WHISPER_N_FFT samples starting at `samples`, of which only the first `n` are
+// valid - the rest of the frame is zero
+// fft_in and fft_work hold WHISPER_N_FFT floats, power holds WHISPER_N_FFT/2 + 1 floats of scratch
+static void log_mel_frame(
+        const float * samples,
+                int   n,
+        const float * hann,
+        const whisper_filters & filters,
+              float * fft_in,
+              float * fft_work,
+              float * power,
+              float * out,
+                int   out_stride) {
+    const int frame_size = WHISPER_N_FFT;
+    const int n_fft = filters.n_fft;
+
+    // make sure n_fft == 1 + (WHISPER_N_FFT / 2), bin_0 to bin_nyquist
+    assert(n_fft == 1 + (frame_size / 2));
+
+    // apply Hann window (~10% faster)
+    for (int j = 0; j < std::min(frame_size, n); j++) {
+        fft_in[j] = hann[j] * samples[j];
     }
-    float* even_fft = out + 2 * N;
-    fft(even, half_N, even_fft);
 
-    float* odd = even;
-    for (int i = 0; i < half_N; ++i) {
-        odd[i] = in[2*i + 1];
+    // fill the rest with zeros
+    if (n < frame_size) {
+        std::fill(fft_in + std::max(n, 0), fft_in + frame_size, 0.0f);
     }
-    float* odd_fft = even_fft + N;
-    fft(odd, half_N, odd_fft);
 
-    const int sin_cos_step = SIN_COS_N_COUNT / N;
-    for (int k = 0; k < half_N; k++) {
-        int idx = k * sin_cos_step; // t = 2*M_PI*k/N
-        float re = global_cache.cos_vals[idx]; // cos(t)
-        float im = -global_cache.sin_vals[idx]; // sin(t)
+    // FFT -> modulus^2 of complex numbers
+    whisper_rfft_power(fft_in, fft_work, power);
 
-        float re_odd = odd_fft[2*k + 0];
-        float im_odd = odd_fft[2*k + 1];
+    // mel spectrogram - only the non-zero range of each filter contributes
+    for (int j = 0; j < filters.n_mel; j++) {
+        const int k0 = filters.band_beg[j];
+        const int k1 = filters.band_end[j];
 
-        out[2*k + 0] = even_fft[2*k + 0] + re*re_odd - im*im_odd;
-        out[2*k + 1] = even_fft[2*k + 1] + re*im_odd + im*re_odd;
+        double sum = whisper_mel_dot(power + k0, filters.data.data() + j*n_fft + k0, k1 - k0);
 
-        out[2*(k + half_N) + 0] = even_fft[2*k + 0] - re*re_odd + im*im_odd;
-        out[2*(k + half_N) + 1] = even_fft[2*k + 1] - re*im_odd - im*re_odd;
+        sum = log10(std::max(sum, 1e-10));
+        out[j*out_stride] = sum;
     }
 }
 
 static void log_mel_spectrogram_worker_thread(int ith, const float * hann, const std::vector<float> & samples,
                                               int n_samples, int frame_size, int frame_step, int n_threads,
                                               const whisper_filters & filters, whisper_mel & mel) {
-    std::vector<float> fft_in(frame_size * 2, 0.0);
-    std::vector<float> fft_out(frame_size * 2 * 2 * 2);
+    std::vector<float> fft_in(frame_size, 0.0);
+    std::vector<float> fft_work(frame_size);
+    std::vector<float> power(frame_size/2 + 1);
 
-    int n_fft = filters.n_fft;
     int i = ith;
 
-    // make sure n_fft == 1 + (WHISPER_N_FFT / 2), bin_0 to bin_nyquist
-    assert(n_fft == 1 + (frame_size / 2));
-
     // calculate FFT only when fft_in are not all zero
     for (; i < std::min(n_samples / frame_step + 1, mel.n_len); i += n_threads) {
         const int offset = i * frame_step;
 
-        // apply Hann window (~10% faster)
-        for (int j = 0; j < std::min(frame_size, n_samples - offset); j++) {
-            fft_in[j] = hann[j] * samples[offset + j];
-        }
-
-        // fill the rest with zeros
-        if (n_samples - offset < frame_size) {
-            std::fill(fft_in.begin() + (n_samples - offset), fft_in.end(), 0.0);
-        }
-
-        // FFT
-        fft(fft_in.data(), frame_size, fft_out.data());
-
-        // Calculate modulus^2 of complex numbers
-        // Use pow(fft_out[2 * j + 0], 2) + pow(fft_out[2 * j + 1], 2) causes inference quality problem? Interesting.
-        for (int j = 0; j < n_fft; j++) {
-            fft_out[j] = (fft_out[2 * j + 0] * fft_out[2 * j + 0] + fft_out[2 * j + 1] * fft_out[2 * j + 1]);
-        }
-
-        // mel spectrogram
-        for (int j = 0; j < mel.n_mel; j++) {
-            double sum = 0.0;
-            // unroll loop (suggested by GH user @lunixbochs)
-            int k = 0;
-            for (k = 0; k < n_fft - 3; k += 4) {
-                sum +=
-                        fft_out[k + 0] * filters.data[j * n_fft + k + 0] +
-                        fft_out[k + 1] * filters.data[j * n_fft + k + 1] +
-                        fft_out[k + 2] * filters.data[j * n_fft + k + 2] +
-                        fft_out[k + 3] * filters.data[j * n_fft + k + 3];
-            }
-            // handle n_fft remainder
-            for (; k < n_fft; k++) {
-                sum += fft_out[k] * filters.data[j * n_fft + k];
-            }
-            sum = log10(std::max(sum, 1e-10));
-            mel.data[j * mel.n_len + i] = sum;
-        }
+        log_mel_frame(samples.data() + offset, n_samples - offset, hann, filters,
+                fft_in.data(), fft_work.data(), power.data(), mel.data.data() + i, mel.n_len);
     }
 
     // Otherwise fft_out are all zero
@@ -3109,19 +4403,13 @@ static bool log_mel_spectrogram(
     mel.data.resize(mel.n_mel * mel.n_len);
 
     {
-        std::vector<std::thread> workers(n_threads - 1);
-        for (int iw = 0; iw < n_threads - 1; ++iw) {
-            workers[iw] = std::thread(
-                    log_mel_spectrogram_worker_thread, iw + 1, hann, std::cref(samples_padded),
-                    n_samples + stage_2_pad, frame_size, frame_step, n_threads,
-                    std::cref(filters), std::ref(mel));
-        }
-
-        // main thread
-        log_mel_spectrogram_worker_thread(0, hann, samples_padded, n_samples + stage_2_pad, frame_size, frame_step, n_threads, filters, mel);
+        auto worker = [&](int ith, int nth) {
+            log_mel_spectrogram_worker_thread(ith, hann, samples_padded, n_samples + stage_2_pad, frame_size, frame_step, nth, filters, mel);
+        };
 
-        for (int iw = 0; iw < n_threads - 1; ++iw) {
-            workers[iw].join();
+        if (!ggml_parallel_for_helper(n_threads, whisper_threadpool_acquire(wstate, n_threads), worker)) {
+            WHISPER_LOG_ERROR("%s: failed to compute the mel spectrogram\n", __func__);
+            return false;
         }
     }
 
@@ -3169,40 +4457,80 @@ static bool log_mel_spectrogram(
 // Regex (C++):
 // R"('s|'t|'re|'ve|'m|'ll|'d| ?[[:alpha:]]+| ?[[:digit:]]+| ?[^\s[:alpha:][:digit:]]+|\s+(?!\S)|\s+)"
 //
-static std::vector<whisper_vocab::id> tokenize(const whisper_vocab & vocab, const std::string & text) {
-    std::vector<std::string> words;
+// the pre-tokenizer below is a hand-written equivalent of the C++ regex, matched in the "C" locale:
+// letters and digits are ASCII, all bytes >= 0x80 fall into the [^\s[:alpha:][:digit:]] class
+//
+
+static inline bool whisper_tok_is_space(char c) { return c == ' ' || (c >= '\t' && c <= '\r'); }
+static inline bool whisper_tok_is_alpha(char c) { return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z'); }
+static inline bool whisper_tok_is_digit(char c) { return c >= '0' && c <= '9'; }
+static inline bool whisper_tok_is_other(char c) { return !whisper_tok_is_space(c) && !whisper_tok_is_alpha(c) && !whisper_tok_is_digit(c); }
+
+// length of the word starting at s[0], trying the alternatives of the regex in order
+static size_t whisper_tok_word_len(const char * s, size_t n) {
+    if (s[0] == '\'' && n > 1) {
+        switch (s[1]) {
+            case 's': case 't': case 'm': case 'd':
+                return 2;
+            case 'r':
+                if (n > 2 && s[2] == 'e') return 3;
+                break;
+            case 'v':
+                if (n > 2 && s[2] == 'e') return 3;
+                break;
+            case 'l':
+                if (n > 2 && s[2] == 'l') return 3;
+                break;
+        }
+    }
 
-    // first split the text into words
+    // " ?[[:alpha:]]+", " ?[[:digit:]]+", " ?[^\s[:alpha:][:digit:]]+"
     {
-        std::string str = text;
-        std::string pat = R"('s|'t|'re|'ve|'m|'ll|'d| ?[[:alpha:]]+| ?[[:digit:]]+| ?[^\s[:alpha:][:digit:]]+|\s+(?!\S)|\s+)";
+        const size_t i0 = (s[0] == ' ' && n > 1) ? 1 : 0;
 
-        std::regex re(pat);
-        std::smatch m;
+        bool (*cls)(char) = nullptr;
+        if      (whisper_tok_is_alpha(s[i0])) cls = whisper_tok_is_alpha;
+        else if (whisper_tok_is_digit(s[i0])) cls = whisper_tok_is_digit;
+        else if (whisper_tok_is_other(s[i0])) cls = whisper_tok_is_other;
 
-        while (std::regex_search(str, m, re)) {
-            for (auto x : m) {
-                words.push_back(x);
+        if (cls) {
+            size_t i = i0 + 1;
+            while (i < n && cls(s[i])) {
+                ++i;
             }
-            str = m.suffix();
+            return i;
         }
     }
 
-    // find the longest tokens that form the words:
+    // "\s+(?!\S)|\s+"
+    size_t i = 1;
+    while (i < n && whisper_tok_is_space(s[i])) {
+        ++i;
+    }
+
+    // leave the last whitespace in front of the next word
+    return (i < n && i > 1) ? i - 1 : i;
+}
+
+static std::vector<whisper_vocab::id> tokenize(const whisper_vocab & vocab, const std::string & text) {
     std::vector<whisper_vocab::id> tokens;
-    for (const auto & word : words) {
-        if (word.empty()) continue;
 
-        int i = 0;
-        int n = word.size();
-        while (i < n) {
-            int j = n;
+    const char * str = text.data();
+    const size_t n   = text.size();
+
+    for (size_t w0 = 0; w0 < n; ) {
+        // first split the text into words
+        const size_t w1 = w0 + whisper_tok_word_len(str + w0, n - w0);
+
+        // find the longest tokens that form the word
+        size_t i = w0;
+        while (i < w1) {
+            size_t j = std::min(w1, i + vocab.max_token_len);
             bool found = false;
             while (j > i) {
-                auto sub = word.substr(i, j-i);
-                auto it = vocab.token_to_id.find(sub);
-                if (it != vocab.token_to_id.end()) {
-                    tokens.push_back(it->second);
+                const whisper_vocab::id id = whisper_vocab_find(vocab, str + i, j - i);
+                if (id >= 0) {
+                    tokens.push_back(id);
                     i = j;
                     found = true;
                     break;
@@ -3214,6 +4542,8 @@ static std::vector<whisper_vocab::id> tokenize(const whisper_vocab & vocab, cons
                 ++i;
             }
         }
+
+        w0 = w1;
     }
 
     return tokens;
@@ -3281,10 +4611,26 @@ struct whisper_state * whisper_init_state(whisper_context * ctx) {
         return nullptr;
     }
 
+    state->use_threadpool = ctx->params.use_threadpool;
+    if (state->use_threadpool) {
+        auto & tpp = state->threadpool_params;
+
+        ggml_threadpool_params_init(&tpp, 1);
+
+        tpp.poll       = ctx->params.threadpool_poll;
+        tpp.prio       = ctx->params.threadpool_prio;
+        tpp.strict_cpu = ctx->params.threadpool_strict_cpu;
+
+        if (ctx->params.threadpool_cpumask) {
+            const int n_cpumask = std::min(ctx->params.threadpool_n_cpumask, GGML_MAX_N_THREADS);
+            std::copy(ctx->params.threadpool_cpumask, ctx->params.threadpool_cpumask + n_cpumask, tpp.cpumask);
+        }
+    }
+
     // at this point, we don't know yet how many decoders will be used
     // later during decoding, if more decoders are used, we will recreate the KV cache respectively
     state->kv_self_n_dec = 1;
-    if (!whisper_kv_cache_init(state->kv_self, state->backends[0], ctx->itype,
+    if (!whisper_kv_cache_init(state->kv_self, state->backends[0], whisper_kv_type_k(*ctx), whisper_kv_type_v(*ctx),
                 ctx->model.hparams.n_text_state,
                 ctx->model.hparams.n_text_layer,
                 GGML_PAD(ctx->model.hparams.n_text_ctx, 256))) {
@@ -3295,10 +4641,11 @@ struct whisper_state * whisper_init_state(whisper_context * ctx) {
 
     {
         const size_t memory_size = ggml_nbytes(state->kv_self.k) + ggml_nbytes(state->kv_self.v);
-        WHISPER_LOG_INFO("%s: kv self size  = %7.2f MB\n", __func__, memory_size / 1e6);
+        WHISPER_LOG_INFO("%s: kv self size  = %7.2f MB (K %s, V %s)\n", __func__, memory_size / 1e6,
+                ggml_type_name(state->kv_self.k->type), ggml_type_name(state->kv_self.v->type));
     }
 
-    if (!whisper_kv_cache_init(state->kv_cross, state->backends[0], ctx->itype,
+    if (!whisper_kv_cache_init(state->kv_cross, state->backends[0], whisper_kv_type_k(*ctx), whisper_kv_type_v(*ctx),
                 ctx->model.hparams.n_text_state,
                 ctx->model.hparams.n_text_layer,
                 GGML_PAD(ctx->model.hparams.n_audio_ctx, 256))) {
@@ -3312,7 +4659,7 @@ struct whisper_state * whisper_init_state(whisper_context * ctx) {
         WHISPER_LOG_INFO("%s: kv cross size = %7.2f MB\n", __func__, memory_size / 1e6);
     }
 
-    if (!whisper_kv_cache_init(state->kv_pad, state->backends[0], ctx->itype,
+    if (!whisper_kv_cache_init(state->kv_pad, state->backends[0], ctx->itype, ctx->itype,
                 ctx->model.hparams.n_audio_state,
                 1,
                 GGML_PAD(ctx->model.hparams.n_audio_ctx, 256))) {
@@ -3417,6 +4764,46 @@ struct whisper_state * whisper_init_state(whisper_context * ctx) {
         WHISPER_LOG_INFO("%s: compute buffer (cross)  = %7.2f MB\n", __func__, whisper_sched_size(state->sched_cross) / 1e6);
     }
 
+    // [EXPERIMENTAL] adaptive audio context: the conv, encoder and cross graphs of each bucket get their own
+    // schedulers, so that switching between the buckets never reallocates a compute buffer
+    if (ctx->params.audio_ctx_buckets > 1 && !whisper_encode_external(*state)) {
+        const int n_audio_ctx = ctx->model.hparams.n_audio_ctx;
+        const int n_buckets   = ctx->params.audio_ctx_buckets;
+
+        size_t size = 0;
+
+        for (int k = 1; k < n_buckets; ++k) {
+            const int n_ctx = GGML_PAD(n_audio_ctx*k/n_buckets, 64);
+            if (n_ctx >= n_audio_ctx || (!state->sched_audio.empty() && state->sched_audio.back().n_ctx == n_ctx)) {
+                continue;
+            }
+
+            state->sched_audio.emplace_back();
+            state->sched_audio.back().n_ctx = n_ctx;
+
+            auto & sa = state->sched_audio.back();
+
+            state->exp_n_audio_ctx = n_ctx;
+
+            const bool ok =
+                whisper_sched_graph_init(sa.conv,   state->backends, [&]() { return whisper_build_graph_conv   (*ctx, *state); }) &&
+                whisper_sched_graph_init(sa.encode, state->backends, [&]() { return whisper_build_graph_encoder(*ctx, *state); }) &&
+                whisper_sched_graph_init(sa.cross,  state->backends, [&]() { return whisper_build_graph_cross  (*ctx, *state); });
+
+            state->exp_n_audio_ctx = 0;
+
+            if (!ok) {
+                WHISPER_LOG_ERROR("%s: failed to init the allocators for audio_ctx = %d\n", __func__, n_ctx);
+                whisper_free_state(state);
+                return nullptr;
+            }
+
+            size += whisper_sched_size(sa.conv) + whisper_sched_size(sa.encode) + whisper_sched_size(sa.cross);
+        }
+
+        WHISPER_LOG_INFO("%s: compute buffer (audio)  = %7.2f MB (%d buckets)\n", __func__, size / 1e6, (int) state->sched_audio.size());
+    }
+
     // decoder allocator
     {
         bool ok = whisper_sched_graph_init(state->sched_decode, state->backends,
@@ -3429,7 +4816,7 @@ struct whisper_state * whisper_init_state(whisper_context * ctx) {
 
                     whisper_batch_prep_legacy(state->batch, nullptr, n_tokens, n_past, 0);
 
-                    return whisper_build_graph_decoder(*ctx, *state, state->batch, ctx->params.dtw_token_timestamps, true);
+                    return whisper_build_graph_decoder(*ctx, *state, state->batch, false, true);
                 });
 
         if (!ok) {
@@ -3441,6 +4828,28 @@ struct whisper_state * whisper_init_state(whisper_context * ctx) {
         WHISPER_LOG_INFO("%s: compute buffer (decode) = %7.2f MB\n", __func__, whisper_sched_size(state->sched_decode) / 1e6);
     }
 
+    // [EXPERIMENTAL] DTW decoder allocator
+    if (ctx->params.dtw_token_timestamps) {
+        // whisper_sched_graph_init() creates the scheduler before the graph is built, so whisper_sched_decode() picks it
+        bool ok = whisper_sched_graph_init(state->sched_decode_aheads, state->backends,
+                [&]() {
+                    const int n_tokens = ctx->model.hparams.n_text_ctx;
+                    const int n_past   = 0;
+
+                    whisper_batch_prep_legacy(state->batch, nullptr, n_tokens, n_past, 0);
+
+                    return whisper_build_graph_decoder(*ctx, *state, state->batch, true, true);
+                });
+
+        if (!ok) {
+            WHISPER_LOG_ERROR("%s: failed to init DTW decoder allocator\n", __func__);
+            whisper_free_state(state);
+            return nullptr;
+        }
+
+        WHISPER_LOG_INFO("%s: compute buffer (dtw)    = %7.2f MB\n", __func__, whisper_sched_size(state->sched_decode_aheads) / 1e6);
+    }
+
     return state;
 }
 
@@ -3508,6 +4917,23 @@ struct whisper_context_params whisper_context_default_params() {
         /*.use_gpu              =*/ true,
         /*.flash_attn           =*/ false,
         /*.gpu_device           =*/ 0,
+        /*.use_mmap             =*/ false,
+        /*.mmap_prefetch        =*/ false,
+        /*.use_mlock            =*/ false,
+
+        /*.use_threadpool        =*/ true,
+        /*.threadpool_poll       =*/ 0,
+        /*.threadpool_prio       =*/ GGML_SCHED_PRIO_NORMAL,
+        /*.threadpool_strict_cpu =*/ false,
+        /*.threadpool_cpumask    =*/ nullptr,
+        /*.threadpool_n_cpumask  =*/ 0,
+
+        /*.encoder_cache_size   =*/ 0,
+        /*.encoder_cache_cross  =*/ false,
+
+        /*.audio_ctx_buckets    =*/ 0,
+
+        /*.kv_type              =*/ GGML_TYPE_F16,
 
         /*.dtw_token_timestamps =*/ false,
         /*.dtw_aheads_preset    =*/ WHISPER_AHEADS_NONE,
@@ -3521,8 +4947,52 @@ struct whisper_context_params whisper_context_default_params() {
     return result;
 }
 
+static struct whisper_context * whisper_init_with_params_no_state_impl(
+        struct whisper_model_loader * loader,
+       struct whisper_context_params   params,
+       std::unique_ptr<whisper_mmap>   mapping);
+
+static struct whisper_context * whisper_init_from_mmap_no_state(const char * path_model, struct whisper_context_params params) {
+    std::unique_ptr<whisper_mmap> mapping(new whisper_mmap());
+    if (!mapping->map(path_model, params.mmap_prefetch)) {
+        return nullptr;
+    }
+
+    whisper_model_loader loader = {};
+
+    loader.context = mapping.get();
+
+    loader.read = [](void * ctx, void * output, size_t read_size) {
+        return ((whisper_mmap *) ctx)->read(output, read_size);
+    };
+
+    loader.eof = [](void * ctx) {
+        whisper_mmap * mapping = (whisper_mmap *) ctx;
+        return mapping->pos >= mapping->size;
+    };
+
+    loader.close = [](void * /*ctx*/) { };
+
+    return whisper_init_with_params_no_state_impl(&loader, params, std::move(mapping));
+}
+
 struct whisper_context * whisper_init_from_file_with_params_no_state(const char * path_model, struct whisper_context_params params) {
     WHISPER_LOG_INFO("%s: loading model from '%s'\n", __func__, path_model);
+
+    if (params.use_mmap) {
+        if (whisper_mmap::supported()) {
+            auto ctx = whisper_init_from_mmap_no_state(path_model, params);
+
+            if (ctx) {
+                ctx->path_model = path_model;
+            }
+
+            return ctx;
+        }
+
+        WHISPER_LOG_WARN("%s: mmap is not supported on this platform - reading the model file instead\n", __func__);
+    }
+
 #ifdef _MSC_VER
     // Convert UTF-8 path to wide string (UTF-16) for Windows, resolving character encoding issues.
     std::wstring_convert<std::codecvt_utf8<wchar_t>> converter;
@@ -3603,6 +5073,13 @@ struct whisper_context * whisper_init_from_buffer_with_params_no_state(void * bu
 }
 
 struct whisper_context * whisper_init_with_params_no_state(struct whisper_model_loader * loader, struct whisper_context_params params) {
+    return whisper_init_with_params_no_state_impl(loader, params, nullptr);
+}
+
+static struct whisper_context * whisper_init_with_params_no_state_impl(
+        struct whisper_model_loader * loader,
+       struct whisper_context_params   params,
+       std::unique_ptr<whisper_mmap>   mapping) {
     ggml_time_init();
 
     if (params.flash_attn && params.dtw_token_timestamps) {
@@ -3614,11 +5091,13 @@ struct whisper_context * whisper_init_with_params_no_state(struct whisper_model_
     WHISPER_LOG_INFO("%s: flash attn = %d\n", __func__, params.flash_attn);
     WHISPER_LOG_INFO("%s: gpu_device = %d\n", __func__, params.gpu_device);
     WHISPER_LOG_INFO("%s: dtw        = %d\n", __func__, params.dtw_token_timestamps);
+    WHISPER_LOG_INFO("%s: mmap       = %d\n", __func__, mapping != nullptr);
     WHISPER_LOG_INFO("%s: devices    = %zu\n", __func__, ggml_backend_dev_count());
     WHISPER_LOG_INFO("%s: backends   = %zu\n", __func__, ggml_backend_reg_count());
 
     whisper_context * ctx = new whisper_context;
     ctx->params = params;
+    ctx->model.mapping = std::move(mapping);
 
     if (!whisper_model_load(loader, *ctx)) {
         loader->close(loader->context);
@@ -3629,6 +5108,35 @@ struct whisper_context * whisper_init_with_params_no_state(struct whisper_model_
 
     loader->close(loader->context);
 
+    // [EXPERIMENTAL] quantized KV cache
+    {
+        const ggml_type kv_type = ctx->params.kv_type;
+
+        const int64_t n_state_head = ctx->model.hparams.n_text_state/ctx->model.hparams.n_text_head;
+
+        const bool supported = kv_type == GGML_TYPE_F16 || kv_type == GGML_TYPE_F32 ||
+                               kv_type == GGML_TYPE_Q8_0 || kv_type == GGML_TYPE_Q5_1 || kv_type == GGML_TYPE_Q5_0 ||
+                               kv_type == GGML_TYPE_Q4_1 || kv_type == GGML_TYPE_Q4_0;
+
+        if (!supported || n_state_head % ggml_blck_size(kv_type) != 0) {
+            WHISPER_LOG_WARN("%s: kv_type %s is not supported with a head size of %d - using f16\n", __func__,
+                    kv_type < GGML_TYPE_COUNT ? ggml_type_name(kv_type) : "?", (int) n_state_head);
+            ctx->params.kv_type = GGML_TYPE_F16;
+        } else if (kv_type != GGML_TYPE_F16) {
+            WHISPER_LOG_INFO("%s: kv type    = %s (V %s)\n", __func__, ggml_type_name(kv_type), ggml_type_name(whisper_kv_type_v(*ctx)));
+        }
+    }
+
+    if (params.encoder_cache_size > 0) {
+        ctx->encoder_cache.budget   = params.encoder_cache_size;
+        ctx->encoder_cache.cross    = params.encoder_cache_cross;
+        ctx->encoder_cache.model_id = whisper_model_id(ctx->model);
+
+        WHISPER_LOG_INFO("%s: encoder cache = %7.2f MB%s\n", __func__, params.encoder_cache_size/1e6, params.encoder_cache_cross ? " (with cross-attention KV)" : "");
+    }
+
+    whisper_token_masks_init(*ctx);
+
     return ctx;
 }
 
@@ -3722,16 +5230,30 @@ void whisper_free_state(struct whisper_state * state) {
 #endif
 
         whisper_batch_free(state->batch);
+        whisper_batch_free(state->batch_score);
+
+        whisper_free_state(state->draft.state);
 
         ggml_backend_sched_free(state->sched_conv.sched);
         ggml_backend_sched_free(state->sched_encode.sched);
         ggml_backend_sched_free(state->sched_cross.sched);
         ggml_backend_sched_free(state->sched_decode.sched);
+        ggml_backend_sched_free(state->sched_decode_aheads.sched);
+
+        for (auto & sa : state->sched_audio) {
+            ggml_backend_sched_free(sa.conv.sched);
+            ggml_backend_sched_free(sa.encode.sched);
+            ggml_backend_sched_free(sa.cross.sched);
+        }
 
         for (auto & backend : state->backends) {
             ggml_backend_free(backend);
         }
 
+        if (state->threadpool) {
+            ggml_threadpool_free(state->threadpool);
+        }
+
         // [EXPERIMENTAL] Token-level timestamps with DTW
         aheads_masks_free(state->aheads_masks);
 
@@ -3751,6 +5273,48 @@ void whisper_free(struct whisper_context * ctx) {
     }
 }
 
+size_t whisper_state_kv_size(struct whisper_state * state) {
+    size_t size = 0;
+    for (const auto * cache : { &state->kv_self, &state->kv_cross }) {
+        if (cache->buffer) {
+            size += ggml_backend_buffer_get_size(cache->buffer);
+        }
+    }
+    return size;
+}
+
+size_t whisper_state_memory_size(struct whisper_state * state) {
+    size_t size = whisper_state_kv_size(state);
+
+    if (state->kv_pad.buffer) {
+        size += ggml_backend_buffer_get_size(state->kv_pad.buffer);
+    }
+
+    std::vector<whisper_sched *> scheds = {
+        &state->sched_conv, &state->sched_encode, &state->sched_cross, &state->sched_decode, &state->sched_decode_aheads,
+    };
+    for (auto & sa : state->sched_audio) {
+        scheds.push_back(&sa.conv);
+        scheds.push_back(&sa.encode);
+        scheds.push_back(&sa.cross);
+    }
+    for (auto * sched : scheds) {
+        if (sched->sched) {
+            size += whisper_sched_size(*sched);
+        }
+    }
+
+    // the logits of a whole batch are kept on the host
+    size += state->logits.capacity()*sizeof(float);
+
+    // the state of the draft model for speculative decoding
+    if (state->draft.state) {
+        size += whisper_state_memory_size(state->draft.state);
+    }
+
+    return size;
+}
+
 void whisper_free_context_params(struct whisper_context_params * params) {
     if (params) {
         delete params;
@@ -3764,6 +5328,8 @@ void whisper_free_params(struct whisper_full_params * params) {
 }
 
 int whisper_pcm_to_mel_with_state(struct whisper_context * ctx, struct whisper_state * state, const float * samples, int n_samples, int n_threads) {
+    state->enc_seek = -1;
+
     if (!log_mel_spectrogram(*state, samples, n_samples, WHISPER_SAMPLE_RATE, WHISPER_N_FFT, WHISPER_HOP_LENGTH, ctx->model.filters.n_mel, n_threads, ctx->model.filters, false, state->mel)) {
         WHISPER_LOG_ERROR("%s: failed to compute mel spectrogram\n", __func__);
         return -1;
@@ -3794,6 +5360,8 @@ int whisper_set_mel_with_state(
     state->mel.data.resize(n_len*n_mel);
     memcpy(state->mel.data.data(), data, n_len*n_mel*sizeof(float));
 
+    state->enc_seek = -1;
+
     return 0;
 }
 
@@ -3805,48 +5373,221 @@ int whisper_set_mel(
     return whisper_set_mel_with_state(ctx, ctx->state, data, n_len, n_mel);
 }
 
-int whisper_encode_with_state(struct whisper_context * ctx, struct whisper_state * state, int offset, int n_threads) {
-    if (!whisper_encode_internal(*ctx, *state, offset, n_threads, nullptr, nullptr)) {
-        WHISPER_LOG_ERROR("%s: failed to eval\n", __func__);
-        return -1;
-    }
+int whisper_mel_stream_reset_with_state(
+        struct whisper_context * ctx,
+          struct whisper_state * state,
+                           int   n_max_frames) {
+    auto & ms = state->mel_stream;
 
-    return 0;
-}
+    ms.started  = false;
+    ms.n_frames = 0;
+    ms.n_cap    = n_max_frames > 0 ? n_max_frames : WHISPER_CHUNK_SIZE*WHISPER_SAMPLE_RATE/WHISPER_HOP_LENGTH;
+    ms.n_mel    = ctx->model.filters.n_mel;
 
-int whisper_encode(struct whisper_context * ctx, int offset, int n_threads) {
-    if (!whisper_encode_internal(*ctx, *ctx->state, offset, n_threads, nullptr, nullptr)) {
-        WHISPER_LOG_ERROR("%s: failed to eval\n", __func__);
-        return -1;
-    }
+    ms.pending.clear();
+    ms.ring.assign((size_t) ms.n_cap*ms.n_mel, 0.0f);
 
     return 0;
 }
 
-int whisper_decode_with_state(struct whisper_context * ctx, struct whisper_state * state, const whisper_token * tokens, int n_tokens, int n_past, int n_threads) {
-    whisper_batch_prep_legacy(state->batch, tokens, n_tokens, n_past, 0);
+int whisper_mel_stream_reset(struct whisper_context * ctx, int n_max_frames) {
+    return whisper_mel_stream_reset_with_state(ctx, ctx->state, n_max_frames);
+}
 
-    whisper_kv_cache_seq_rm(state->kv_self, 0, n_past, -1);
+int whisper_mel_stream_push_with_state(
+        struct whisper_context * ctx,
+          struct whisper_state * state,
+                   const float * samples,
+                           int   n_samples,
+                           int   n_threads) {
+    const int64_t t_start_us = ggml_time_us();
 
-    if (!whisper_decode_internal(*ctx, *state, state->batch, n_threads, false, nullptr, nullptr)) {
-        WHISPER_LOG_ERROR("%s: failed to eval\n", __func__);
-        return 1;
-    }
+    const int frame_size = WHISPER_N_FFT;
+    const int frame_step = WHISPER_HOP_LENGTH;
+    const int pad        = frame_size / 2;
 
-    return 0;
-}
+    auto & ms = state->mel_stream;
 
-int whisper_decode(struct whisper_context * ctx, const whisper_token * tokens, int n_tokens, int n_past, int n_threads) {
-    if (ctx->state == nullptr) {
-        WHISPER_LOG_ERROR("%s: ERROR state was not loaded.\n", __func__);
+    if (ms.ring.empty()) {
+        whisper_mel_stream_reset_with_state(ctx, state, 0);
+    }
+
+    if (n_samples < 0 || (n_samples > 0 && samples == nullptr)) {
+        WHISPER_LOG_ERROR("%s: invalid samples\n", __func__);
         return -1;
     }
 
-    return whisper_decode_with_state(ctx, ctx->state, tokens, n_tokens, n_past, n_threads);
-}
+    ms.pending.insert(ms.pending.end(), samples, samples + n_samples);
 
-int whisper_tokenize(struct whisper_context * ctx, const char * text, whisper_token * tokens, int n_max_tokens) {
-    const auto res = tokenize(ctx->vocab, text);
+    if (!ms.started) {
+        // same as the offline path: reflective pad with samples [1, pad] at the beginning of the audio
+        if ((int) ms.pending.size() <= pad) {
+            return 0;
+        }
+
+        std::vector<float> head(pad);
+        std::reverse_copy(ms.pending.begin() + 1, ms.pending.begin() + 1 + pad, head.begin());
+        ms.pending.insert(ms.pending.begin(), head.begin(), head.end());
+
+        ms.started = true;
+    }
+
+    // only the frames that are complete - the frames overlapping the end of the audio are computed once the next
+    // samples arrive
+    const int n_new = (int) ms.pending.size() < frame_size ? 0 : ((int) ms.pending.size() - frame_size)/frame_step + 1;
+    if (n_new == 0) {
+        return 0;
+    }
+
+    // frames that would be overwritten in the ring buffer right away are not computed
+    const int i0 = std::max(0, n_new - ms.n_cap);
+
+    const float * hann = global_cache.hann_window;
+    const whisper_filters & filters = ctx->model.filters;
+
+    auto worker = [&](int ith, int nth) {
+        std::vector<float> fft_in(frame_size);
+        std::vector<float> fft_work(frame_size);
+        std::vector<float> power(frame_size/2 + 1);
+
+        for (int i = i0 + ith; i < n_new; i += nth) {
+            float * out = ms.ring.data() + ((ms.n_frames + i) % ms.n_cap)*ms.n_mel;
+
+            log_mel_frame(ms.pending.data() + i*frame_step, frame_size, hann, filters,
+                    fft_in.data(), fft_work.data(), power.data(), out, 1);
+        }
+    };
+
+    // a typical push adds a few dozen frames - only spawn threads for large pushes
+    const int nth = std::max(1, std::min(n_threads, (n_new - i0)/64));
+
+    if (!ggml_parallel_for_helper(nth, whisper_threadpool_acquire(*state, nth), worker)) {
+        WHISPER_LOG_ERROR("%s: failed to compute the mel frames\n", __func__);
+        return -2;
+    }
+
+    // keep the tail that the next frames overlap with
+    ms.pending.erase(ms.pending.begin(), ms.pending.begin() + (size_t) n_new*frame_step);
+    ms.n_frames += n_new;
+
+    state->t_mel_us += ggml_time_us() - t_start_us;
+
+    return n_new;
+}
+
+int whisper_mel_stream_push(
+        struct whisper_context * ctx,
+                   const float * samples,
+                           int   n_samples,
+                           int   n_threads) {
+    return whisper_mel_stream_push_with_state(ctx, ctx->state, samples, n_samples, n_threads);
+}
+
+int whisper_mel_stream_apply_with_state(
+        struct whisper_context * ctx,
+          struct whisper_state * state,
+                           int   n_frames) {
+    const auto & ms = state->mel_stream;
+
+    const int n_avail = (int) std::min<int64_t>(ms.n_frames, ms.n_cap);
+    if (n_avail == 0) {
+        WHISPER_LOG_ERROR("%s: no mel frames available\n", __func__);
+        return -1;
+    }
+
+    const int n      = n_frames > 0 ? std::min(n_frames, n_avail) : n_avail;
+    const int n_mel  = ms.n_mel;
+    const int n_pad  = WHISPER_CHUNK_SIZE*WHISPER_SAMPLE_RATE/WHISPER_HOP_LENGTH;
+
+    if (n_mel != ctx->model.filters.n_mel) {
+        WHISPER_LOG_ERROR("%s: the stream was reset with a different model\n", __func__);
+        return -2;
+    }
+
+    auto & mel = state->mel;
+
+    state->enc_seek = -1;
+
+    // same layout as the offline path: the frames followed by 30 s of padding
+    mel.n_mel     = n_mel;
+    mel.n_len     = n + n_pad;
+    mel.n_len_org = n;
+    mel.data.resize((size_t) mel.n_mel*mel.n_len);
+
+    const int64_t f0 = ms.n_frames - n;
+
+    // the dynamic range is clamped relative to the max of the applied window
+    double mmax = log10(1e-10);
+    for (int i = 0; i < n; ++i) {
+        const float * src = ms.ring.data() + ((f0 + i) % ms.n_cap)*n_mel;
+        for (int j = 0; j < n_mel; ++j) {
+            mmax = std::max<double>(mmax, src[j]);
+        }
+    }
+
+    mmax -= 8.0;
+
+    for (int i = 0; i < n; ++i) {
+        const float * src = ms.ring.data() + ((f0 + i) % ms.n_cap)*n_mel;
+        for (int j = 0; j < n_mel; ++j) {
+            mel.data[(size_t) j*mel.n_len + i] = (std::max<double>(src[j], mmax) + 4.0)/4.0;
+        }
+    }
+
+    const float pad_val = (std::max(log10(1e-10), mmax) + 4.0)/4.0;
+    for (int j = 0; j < n_mel; ++j) {
+        std::fill(mel.data.begin() + (size_t) j*mel.n_len + n, mel.data.begin() + (size_t) (j + 1)*mel.n_len, pad_val);
+    }
+
+    return 0;
+}
+
+int whisper_mel_stream_apply(struct whisper_context * ctx, int n_frames) {
+    return whisper_mel_stream_apply_with_state(ctx, ctx->state, n_frames);
+}
+
+int whisper_encode_with_state(struct whisper_context * ctx, struct whisper_state * state, int offset, int n_threads) {
+    if (!whisper_encode_internal(*ctx, *state, offset, n_threads, nullptr, nullptr)) {
+        WHISPER_LOG_ERROR("%s: failed to eval\n", __func__);
+        return -1;
+    }
+
+    return 0;
+}
+
+int whisper_encode(struct whisper_context * ctx, int offset, int n_threads) {
+    if (!whisper_encode_internal(*ctx, *ctx->state, offset, n_threads, nullptr, nullptr)) {
+        WHISPER_LOG_ERROR("%s: failed to eval\n", __func__);
+        return -1;
+    }
+
+    return 0;
+}
+
+int whisper_decode_with_state(struct whisper_context * ctx, struct whisper_state * state, const whisper_token * tokens, int n_tokens, int n_past, int n_threads) {
+    whisper_batch_prep_legacy(state->batch, tokens, n_tokens, n_past, 0);
+
+    whisper_kv_cache_seq_rm(state->kv_self, 0, n_past, -1);
+
+    if (!whisper_decode_internal(*ctx, *state, state->batch, n_threads, false, nullptr, nullptr)) {
+        WHISPER_LOG_ERROR("%s: failed to eval\n", __func__);
+        return 1;
+    }
+
+    return 0;
+}
+
+int whisper_decode(struct whisper_context * ctx, const whisper_token * tokens, int n_tokens, int n_past, int n_threads) {
+    if (ctx->state == nullptr) {
+        WHISPER_LOG_ERROR("%s: ERROR state was not loaded.\n", __func__);
+        return -1;
+    }
+
+    return whisper_decode_with_state(ctx, ctx->state, tokens, n_tokens, n_past, n_threads);
+}
+
+int whisper_tokenize(struct whisper_context * ctx, const char * text, whisper_token * tokens, int n_max_tokens) {
+    const auto res = tokenize(ctx->vocab, text);
 
     if (n_max_tokens < (int) res.size()) {
         WHISPER_LOG_ERROR("%s: too many resulting tokens: %d (max %d)\n", __func__, (int) res.size(), n_max_tokens);
@@ -3909,30 +5650,19 @@ const char * whisper_lang_str_full(int id) {
     return nullptr;
 }
 
-int whisper_lang_auto_detect_with_state(
+// true if embd_enc and kv_cross of the state hold the encoding of the window at the given mel offset
+static bool whisper_is_encoded(const whisper_context & wctx, const whisper_state & wstate, int seek) {
+    const int n_ctx = wstate.exp_n_audio_ctx > 0 ? wstate.exp_n_audio_ctx : wctx.model.hparams.n_audio_ctx;
+
+    return wstate.enc_seek == seek && wstate.enc_n_ctx == n_ctx;
+}
+
+// detect the language of the window that is currently encoded in the state
+static int whisper_lang_detect_encoded(
         struct whisper_context * ctx,
           struct whisper_state * state,
-                           int   offset_ms,
                            int   n_threads,
                          float * lang_probs) {
-    const int seek = offset_ms/10;
-
-    if (seek < 0) {
-        WHISPER_LOG_ERROR("%s: offset %dms is before the start of the audio\n", __func__, offset_ms);
-        return -1;
-    }
-
-    if (seek >= state->mel.n_len_org) {
-        WHISPER_LOG_ERROR("%s: offset %dms is past the end of the audio (%dms)\n", __func__, offset_ms, state->mel.n_len_org*10);
-        return -2;
-    }
-
-    // run the encoder
-    if (whisper_encode_with_state(ctx, state, seek, n_threads) != 0) {
-        WHISPER_LOG_ERROR("%s: failed to encode\n", __func__);
-        return -6;
-    }
-
     const std::vector<whisper_token> prompt = { whisper_token_sot(ctx) };
 
     if (whisper_decode_with_state(ctx, state, prompt.data(), prompt.size(), 0, n_threads) != 0) {
@@ -3984,6 +5714,33 @@ int whisper_lang_auto_detect_with_state(
     return logits_id[0].second;
 }
 
+int whisper_lang_auto_detect_with_state(
+        struct whisper_context * ctx,
+          struct whisper_state * state,
+                           int   offset_ms,
+                           int   n_threads,
+                         float * lang_probs) {
+    const int seek = offset_ms/10;
+
+    if (seek < 0) {
+        WHISPER_LOG_ERROR("%s: offset %dms is before the start of the audio\n", __func__, offset_ms);
+        return -1;
+    }
+
+    if (seek >= state->mel.n_len_org) {
+        WHISPER_LOG_ERROR("%s: offset %dms is past the end of the audio (%dms)\n", __func__, offset_ms, state->mel.n_len_org*10);
+        return -2;
+    }
+
+    // run the encoder, unless the window is already encoded
+    if (!whisper_is_encoded(*ctx, *state, seek) && whisper_encode_with_state(ctx, state, seek, n_threads) != 0) {
+        WHISPER_LOG_ERROR("%s: failed to encode\n", __func__);
+        return -6;
+    }
+
+    return whisper_lang_detect_encoded(ctx, state, n_threads, lang_probs);
+}
+
 int whisper_lang_auto_detect(
         struct whisper_context * ctx,
                            int   offset_ms,
@@ -4090,7 +5847,9 @@ float * whisper_get_logits_from_state(struct whisper_state * state) {
 }
 
 const char * whisper_token_to_str(struct whisper_context * ctx, whisper_token token) {
-    return ctx->vocab.id_to_token.at(token).c_str();
+    WHISPER_ASSERT(token >= 0 && token < ctx->vocab.size());
+
+    return ctx->vocab.text(token);
 }
 
 whisper_token whisper_token_eot(struct whisper_context * ctx) {
@@ -4143,6 +5902,38 @@ struct whisper_timings * whisper_get_timings(struct whisper_context * ctx) {
     timings->decode_ms = 1e-3f * ctx->state->t_decode_us / std::max(1, ctx->state->n_decode);
     timings->batchd_ms = 1e-3f * ctx->state->t_batchd_us / std::max(1, ctx->state->n_batchd);
     timings->prompt_ms = 1e-3f * ctx->state->t_prompt_us / std::max(1, ctx->state->n_prompt);
+
+    timings->n_compute     = ctx->state->n_compute;
+    timings->n_threadpool  = ctx->state->n_threadpool;
+    timings->threadpool_ms = 1e-3f * ctx->state->t_threadpool_us;
+
+    timings->n_encode_cache_hit    = ctx->state->n_enc_cache_hit;
+    timings->n_encode_cache_miss   = ctx->state->n_enc_cache_miss;
+    timings->encode_cache_saved_ms = 1e-3f * ctx->state->t_enc_cache_saved_us;
+
+    timings->n_silence_skip   = ctx->state->n_silence_skip;
+    timings->n_silence_frames = ctx->state->n_silence_frames;
+    timings->silence_saved_ms = timings->encode_ms * ctx->state->n_silence_frames / (WHISPER_CHUNK_SIZE*100);
+
+    timings->n_graph_build   = ctx->state->n_graph_build;
+    timings->n_graph_reuse   = ctx->state->n_graph_reuse;
+    timings->n_graph_realloc = ctx->state->n_graph_realloc;
+
+    timings->dtw_ms         = 1e-3f * ctx->state->t_dtw_us;
+    timings->n_dtw          = ctx->state->n_dtw;
+    timings->n_dtw_redecode = ctx->state->n_dtw_redecode;
+
+    timings->n_prompt_cache_hit    = ctx->state->n_prompt_cache_hit;
+    timings->n_prompt_cache_miss   = ctx->state->n_prompt_cache_miss;
+    timings->prompt_cache_saved_ms = 1e-3f * ctx->state->t_prompt_cache_saved_us;
+
+    timings->draft_ms          = 1e-3f * ctx->state->t_draft_us;
+    timings->n_draft           = ctx->state->n_draft;
+    timings->n_draft_accept    = ctx->state->n_draft_accept;
+    timings->draft_accept_rate = float(ctx->state->n_draft_accept) / std::max(1, ctx->state->n_draft);
+
+    const int64_t t_loop_us = ctx->state->t_sample_us + ctx->state->t_decode_us + ctx->state->t_batchd_us + ctx->state->t_draft_us;
+    timings->decode_tokens_per_s = t_loop_us > 0 ? 1e6f * ctx->state->n_sample / t_loop_us : 0.0f;
     return timings;
 }
 
@@ -4166,6 +5957,24 @@ void whisper_print_timings(struct whisper_context * ctx) {
         WHISPER_LOG_INFO("%s:   decode time = %8.2f ms / %5d runs (%8.2f ms per run)\n", __func__, 1e-3f * ctx->state->t_decode_us, n_decode, 1e-3f * ctx->state->t_decode_us / n_decode);
         WHISPER_LOG_INFO("%s:   batchd time = %8.2f ms / %5d runs (%8.2f ms per run)\n", __func__, 1e-3f * ctx->state->t_batchd_us, n_batchd, 1e-3f * ctx->state->t_batchd_us / n_batchd);
         WHISPER_LOG_INFO("%s:   prompt time = %8.2f ms / %5d runs (%8.2f ms per run)\n", __func__, 1e-3f * ctx->state->t_prompt_us, n_prompt, 1e-3f * ctx->state->t_prompt_us / n_prompt);
+        WHISPER_LOG_INFO("%s:   thread pool = %8.2f ms / %5d init (%5d computations)\n", __func__, 1e-3f * ctx->state->t_threadpool_us, ctx->state->n_threadpool, ctx->state->n_compute);
+        if (ctx->encoder_cache.budget > 0) {
+            WHISPER_LOG_INFO("%s:  encode cache = %8.2f ms saved / %5d hits / %5d misses\n", __func__, 1e-3f * ctx->state->t_enc_cache_saved_us, ctx->state->n_enc_cache_hit, ctx->state->n_enc_cache_miss);
+        }
+        WHISPER_LOG_INFO("%s:        graphs = %5d built / %5d reused / %5d re-planned (last call)\n", __func__, ctx->state->n_graph_build, ctx->state->n_graph_reuse, ctx->state->n_graph_realloc);
+        if (ctx->state->n_silence_skip > 0) {
+            WHISPER_LOG_INFO("%s:  silence gate = %8.2f ms saved / %5d skips (%8.2f s of audio)\n", __func__,
+                    1e-3f * ctx->state->t_encode_us / n_encode * ctx->state->n_silence_frames / (WHISPER_CHUNK_SIZE*100), ctx->state->n_silence_skip, ctx->state->n_silence_frames/100.0f);
+        }
+        if (ctx->state->n_dtw > 0) {
+            WHISPER_LOG_INFO("%s:      dtw time = %8.2f ms / %5d runs (%5d re-decoded)\n", __func__, 1e-3f * ctx->state->t_dtw_us, ctx->state->n_dtw, ctx->state->n_dtw_redecode);
+        }
+        if (ctx->state->n_prompt_cache_hit + ctx->state->n_prompt_cache_miss > 0) {
+            WHISPER_LOG_INFO("%s:  prompt cache = %8.2f ms saved / %5d hits / %5d misses\n", __func__, 1e-3f * ctx->state->t_prompt_cache_saved_us, ctx->state->n_prompt_cache_hit, ctx->state->n_prompt_cache_miss);
+        }
+        if (ctx->state->n_draft > 0) {
+            WHISPER_LOG_INFO("%s:    draft time = %8.2f ms / %5d tokens (%5d accepted, %5.1f%%)\n", __func__, 1e-3f * ctx->state->t_draft_us, ctx->state->n_draft, ctx->state->n_draft_accept, 100.0f * ctx->state->n_draft_accept / ctx->state->n_draft);
+        }
     }
     WHISPER_LOG_INFO("%s:    total time = %8.2f ms\n", __func__, (t_end_us - ctx->t_start_us)/1000.0f);
 }
@@ -4184,7 +5993,87 @@ void whisper_reset_timings(struct whisper_context * ctx) {
         ctx->state->n_decode = 0;
         ctx->state->n_batchd = 0;
         ctx->state->n_prompt = 0;
+        ctx->state->t_threadpool_us = 0;
+        ctx->state->n_threadpool    = 0;
+        ctx->state->n_compute       = 0;
+        ctx->state->t_enc_cache_saved_us = 0;
+        ctx->state->n_enc_cache_hit      = 0;
+        ctx->state->n_enc_cache_miss     = 0;
+        ctx->state->n_silence_skip       = 0;
+        ctx->state->n_silence_frames     = 0;
+        ctx->state->t_dtw_us             = 0;
+        ctx->state->n_dtw                = 0;
+        ctx->state->n_dtw_redecode       = 0;
+        ctx->state->t_prompt_cache_saved_us = 0;
+        ctx->state->n_prompt_cache_hit      = 0;
+        ctx->state->n_prompt_cache_miss     = 0;
+        ctx->state->t_draft_us              = 0;
+        ctx->state->n_draft                 = 0;
+        ctx->state->n_draft_accept          = 0;
+    }
+}
+
+const uint64_t * whisper_encoder_cache_keys_from_state(struct whisper_state * state, int * n_keys) {
+    *n_keys = (int) state->enc_cache_keys.size();
+    return state->enc_cache_keys.data();
+}
+
+int whisper_encoder_cache_pin(struct whisper_context * ctx, uint64_t key, bool pin) {
+    auto & cache = ctx->encoder_cache;
+
+    std::lock_guard<std::mutex> lock(cache.mutex);
+
+    auto it = cache.index.find(key);
+    if (it == cache.index.end()) {
+        return -1;
+    }
+
+    it->second->pinned = pin;
+
+    return 0;
+}
+
+int whisper_encoder_cache_evict(struct whisper_context * ctx, uint64_t key) {
+    auto & cache = ctx->encoder_cache;
+
+    std::lock_guard<std::mutex> lock(cache.mutex);
+
+    auto it = cache.index.find(key);
+    if (it == cache.index.end()) {
+        return -1;
     }
+
+    cache.used -= it->second->size();
+    cache.entries.erase(it->second);
+    cache.index.erase(it);
+
+    return 0;
+}
+
+void whisper_encoder_cache_clear(struct whisper_context * ctx) {
+    auto & cache = ctx->encoder_cache;
+
+    std::lock_guard<std::mutex> lock(cache.mutex);
+
+    cache.entries.clear();
+    cache.index.clear();
+    cache.used = 0;
+}
+
+int whisper_encoder_cache_n_entries(struct whisper_context * ctx) {
+    auto & cache = ctx->encoder_cache;
+
+    std::lock_guard<std::mutex> lock(cache.mutex);
+
+    return (int) cache.entries.size();
+}
+
+size_t whisper_encoder_cache_size(struct whisper_context * ctx) {
+    auto & cache = ctx->encoder_cache;
+
+    std::lock_guard<std::mutex> lock(cache.mutex);
+
+    return cache.used;
 }
 
 static int whisper_has_coreml(void) {
@@ -4575,7 +6464,8 @@ static void whisper_suppress_invalid_grammar(
              whisper_context  & ctx,
     const whisper_full_params & params,
            std::vector<float> & logits,
-    const     whisper_grammar & grammar) {
+    const     whisper_grammar & grammar,
+    std::vector<whisper_grammar_candidate> & candidates_grammar) {
 
     if (grammar.rules.empty() || grammar.stacks.empty()) {
         return;
@@ -4592,13 +6482,31 @@ static void whisper_suppress_invalid_grammar(
     const whisper_token eot = whisper_token_eot(&ctx);
 
     std::vector<std::pair<std::vector<uint32_t>, whisper_partial_utf8>> candidates_decoded;
-    std::vector<whisper_grammar_candidate>                              candidates_grammar;
 
-    for (whisper_token id = 0; id < eot; ++id) {
-        const std::string & text = ctx.vocab.id_to_token[id];
-        if (!text.empty()) {
-            candidates_decoded.push_back(decode_utf8(text.c_str(), grammar.partial_utf8));
-            candidates_grammar.push_back({ id, candidates_decoded.back().first.data(), candidates_decoded.back().second });
+    candidates_grammar.clear();
+
+    if (grammar.partial_utf8.n_remain == 0) {
+        // without a pending partial sequence, the tokens always decode the same way
+        std::call_once(ctx.grammar_vocab_once, [&]() {
+            ctx.grammar_vocab.resize(eot);
+            for (whisper_token id = 0; id < eot; ++id) {
+                ctx.grammar_vocab[id] = decode_utf8(ctx.vocab.text(id), {});
+            }
+        });
+
+        for (whisper_token id = 0; id < eot; ++id) {
+            if (ctx.vocab.text_len(id) > 0) {
+                candidates_grammar.push_back({ id, ctx.grammar_vocab[id].first.data(), ctx.grammar_vocab[id].second });
+            }
+        }
+    } else {
+        candidates_decoded.reserve(eot);
+
+        for (whisper_token id = 0; id < eot; ++id) {
+            if (ctx.vocab.text_len(id) > 0) {
+                candidates_decoded.push_back(decode_utf8(ctx.vocab.text(id), grammar.partial_utf8));
+                candidates_grammar.push_back({ id, candidates_decoded.back().first.data(), candidates_decoded.back().second });
+            }
         }
     }
 
@@ -4620,18 +6528,18 @@ static void whisper_grammar_accept_token(whisper_context & ctx, whisper_grammar
         return;
     }
 
-    //fprintf(stderr, "Accept: '%s'\n", ctx.vocab.id_to_token[token].c_str());
+    //fprintf(stderr, "Accept: '%s'\n", ctx.vocab.text(token));
 
-    const std::string & text = ctx.vocab.id_to_token[token];
+    const char * text = ctx.vocab.text(token);
 
-    if (text.rfind("[_", 0) == 0) {
+    if (strncmp(text, "[_", 2) == 0) {
         // fprintf(stderr, " (skipped)\n");
         return;
     }
     // fprintf(stderr, "\n");
 
     // Note terminating 0 in decoded string
-    const auto   decoded     = decode_utf8(text.c_str(), grammar.partial_utf8);
+    const auto   decoded     = decode_utf8(text, grammar.partial_utf8);
     const auto & code_points = decoded.first;
     for (auto it = code_points.begin(), end = code_points.end() - 1; it != end; ++it) {
         grammar.stacks = whisper_grammar_accept(grammar.rules, grammar.stacks, *it);
@@ -4688,10 +6596,13 @@ struct whisper_full_params whisper_full_default_params(enum whisper_sampling_str
 
         /*.debug_mode        =*/ false,
         /*.audio_ctx         =*/ 0,
+        /*.audio_ctx_adaptive =*/ false,
 
         /*.tdrz_enable       =*/ false,
 
         /* suppress_regex    =*/ nullptr,
+        /*.suppress_masks    =*/ nullptr,
+        /*.suppress_n_masks  =*/ 0,
 
         /*.initial_prompt    =*/ nullptr,
         /*.prompt_tokens     =*/ nullptr,
@@ -4699,6 +6610,7 @@ struct whisper_full_params whisper_full_default_params(enum whisper_sampling_str
 
         /*.language          =*/ "en",
         /*.detect_language   =*/ false,
+        /*.detect_language_per_window =*/ false,
 
         /*.suppress_blank    =*/ true,
         /*.suppress_nst      =*/ false,
@@ -4706,12 +6618,24 @@ struct whisper_full_params whisper_full_default_params(enum whisper_sampling_str
         /*.temperature       =*/  0.0f,
         /*.max_initial_ts    =*/  1.0f,
         /*.length_penalty    =*/ -1.0f,
+        /*.top_p             =*/ 1.0f,
+        /*.min_p             =*/ 0.0f,
+        /*.seed              =*/ -1,
 
         /*.temperature_inc   =*/  0.2f,
         /*.entropy_thold     =*/  2.4f,
         /*.logprob_thold     =*/ -1.0f,
         /*.no_speech_thold   =*/  0.6f,
 
+        /*.silence_gate      =*/ false,
+        /*.silence_thold_db  =*/ 50.0f,
+        /*.silence_min_ms    =*/ 1000,
+
+        /*.prompt_cache      =*/ true,
+
+        /*.draft_ctx         =*/ nullptr,
+        /*.draft_n_tokens    =*/ 4,
+
         /*.greedy            =*/ {
             /*.best_of   =*/ -1,
         },
@@ -4778,10 +6702,13 @@ static inline bool should_split_on_word(const char * txt, bool split_on_word) {
     return txt[0] == ' ';
 }
 
+static void whisper_dtw_reset(whisper_state & state);
+static bool whisper_dtw_capture(whisper_state & state, int i0, int n);
 static void whisper_exp_compute_token_level_timestamps_dtw(
             struct whisper_context * ctx,
               struct whisper_state * state,
         struct whisper_full_params   params,
+     const struct whisper_sequence * sequence,
                                int   i_segment,
                             size_t   n_segments,
                                int   seek,
@@ -4851,270 +6778,816 @@ static const std::vector<std::string> non_speech_tokens = {
     "♪♪♪","♩", "♪", "♫", "♬", "♭", "♮", "♯"
 };
 
-static void whisper_compute_logprobs(
-                const std::vector<float> & logits,
-                              const int    n_logits,
-                      std::vector<float> & logprobs) {
-    const float logit_max = *std::max_element(logits.begin(), logits.end());
-    float logsumexp = 0.0f;
-    for (int i = 0; i < n_logits; ++i) {
-        if (logits[i] > -INFINITY) {
-            logsumexp += expf(logits[i] - logit_max);
-        }
-    }
-    logsumexp = logf(logsumexp) + logit_max;
+//
+// logit kernels
+//
+// the logits of a decoder are processed in three vectorized passes over the vocabulary:
+//   - whisper_logits_mask:   temperature scaling and suppression, tracking the max
+//   - whisper_logits_sumexp: sum of exp(logit - max)
+//   - whisper_logits_write:  logprobs and probs
+//
 
-    for (int i = 0; i < n_logits; ++i) {
-        if (logits[i] > -INFINITY) {
-            logprobs[i] = logits[i] - logsumexp;
-        } else {
-            logprobs[i] = -INFINITY;
-        }
+static inline void whisper_bitmask_set(std::vector<uint32_t> & mask, int i) {
+    mask[i >> 5] |= 1u << (i & 31);
+}
+
+static void whisper_bitmask_set_range(std::vector<uint32_t> & mask, int i0, int i1) {
+    for (; i0 < i1 && (i0 & 31); ++i0) {
+        whisper_bitmask_set(mask, i0);
+    }
+    for (; i0 + 32 <= i1; i0 += 32) {
+        mask[i0 >> 5] = ~0u;
+    }
+    for (; i0 < i1; ++i0) {
+        whisper_bitmask_set(mask, i0);
     }
 }
 
-static void whisper_compute_probs(
-    const std::vector<float> & logits,
-                  const int    n_logits,
-    const std::vector<float> & logprobs,
-          std::vector<float> & probs)     {
-    for (int i = 0; i < n_logits; ++i) {
-        if (logits[i] == -INFINITY) {
-            probs[i] = 0.0f;
-        } else {
-            probs[i] = expf(logprobs[i]);
-        }
+static void whisper_bitmask_or(std::vector<uint32_t> & dst, const std::vector<uint32_t> & a, const std::vector<uint32_t> & b) {
+    dst.resize(a.size());
+    for (size_t i = 0; i < a.size(); ++i) {
+        dst[i] = a[i] | b[i];
     }
 }
 
-// process the logits for the selected decoder
-// - applies logit filters
-// - computes logprobs and probs
-// TODO: optimize
-static void whisper_process_logits(
-              struct whisper_context & ctx,
-               struct whisper_state  & state,
-              struct whisper_decoder & decoder,
-    const struct whisper_full_params   params,
-                               float   temperature) {
-    const auto & vocab      = ctx.vocab;
-    const auto & tokens_cur = decoder.sequence.tokens;
+// exp(x) with a degree 6 polynomial (cephes expf), 0 below -87.3 (including -INFINITY)
+#if defined(WHISPER_SIMD_AVX512)
+WHISPER_TARGET_AVX512
+static inline __m512 whisper_v_expf(__m512 x) {
+    const __mmask16 under = _mm512_cmp_ps_mask(x, _mm512_set1_ps(-87.3f), _CMP_LT_OQ);
 
-    const bool is_initial = tokens_cur.size() == 0;
-    const int  n_logits   = vocab.id_to_token.size();
+    x = _mm512_min_ps(_mm512_max_ps(x, _mm512_set1_ps(-87.3f)), _mm512_set1_ps(88.3f));
 
-    WHISPER_ASSERT(n_logits == ctx.vocab.n_vocab);
+    const __m512 fx = _mm512_roundscale_ps(_mm512_mul_ps(x, _mm512_set1_ps(1.44269504088896341f)), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
 
-    // extract the logits for the last token
-    // we will be mutating, and therefore we don't want to use the ctx.logits buffer directly
-    auto & probs    = decoder.probs;
-    auto & logits   = decoder.logits;
-    auto & logprobs = decoder.logprobs;
-    {
-        logits.resize(n_logits);
-        memcpy(logits.data(), state.logits.data() + decoder.i_batch*n_logits, n_logits*sizeof(float));
+    x = _mm512_fnmadd_ps(fx, _mm512_set1_ps(0.693359375f), x);
+    x = _mm512_fnmadd_ps(fx, _mm512_set1_ps(-2.12194440e-4f), x);
 
-        if (temperature > 0.0f) {
-            for (int i = 0; i < n_logits; i++) {
-                logits[i] /= temperature;
-            }
-        }
+    __m512 y = _mm512_set1_ps(1.9875691500e-4f);
+    y = _mm512_fmadd_ps(y, x, _mm512_set1_ps(1.3981999507e-3f));
+    y = _mm512_fmadd_ps(y, x, _mm512_set1_ps(8.3334519073e-3f));
+    y = _mm512_fmadd_ps(y, x, _mm512_set1_ps(4.1665795894e-2f));
+    y = _mm512_fmadd_ps(y, x, _mm512_set1_ps(1.6666665459e-1f));
+    y = _mm512_fmadd_ps(y, x, _mm512_set1_ps(5.0000001201e-1f));
+    y = _mm512_fmadd_ps(y, _mm512_mul_ps(x, x), _mm512_add_ps(x, _mm512_set1_ps(1.0f)));
 
-        // will be populated a bit later
-        probs.resize(n_logits);
-        logprobs.resize(n_logits);
-    }
+    const __m512i e = _mm512_slli_epi32(_mm512_add_epi32(_mm512_cvtps_epi32(fx), _mm512_set1_epi32(127)), 23);
 
-    // apply logit filters here
-    // ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L480-L493
-    {
-        // suppress blank
-        // https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L388-L390
-        if (params.suppress_blank) {
-            if (is_initial) {
-                logits[vocab.token_eot]           = -INFINITY;
-                logits[vocab.token_to_id.at(" ")] = -INFINITY;
-            }
-        }
+    return _mm512_maskz_mov_ps(~under, _mm512_mul_ps(y, _mm512_castsi512_ps(e)));
+}
+#endif
 
-        // suppress <|notimestamps|> token
-        // ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L410-L412
-        logits[vocab.token_not] = -INFINITY;
-        if (params.no_timestamps) {
-            for (int i = vocab.token_beg; i < n_logits; ++i) {
-                logits[i] = -INFINITY;
-            }
-        }
+#if defined(WHISPER_SIMD_AVX2)
+WHISPER_TARGET_AVX2
+static inline __m256 whisper_v_expf(__m256 x) {
+    const __m256 under = _mm256_cmp_ps(x, _mm256_set1_ps(-87.3f), _CMP_LT_OQ);
 
-        // suppress sot and nosp tokens
-        logits[vocab.token_sot]  = -INFINITY;
-        logits[vocab.token_nosp] = -INFINITY;
+    x = _mm256_min_ps(_mm256_max_ps(x, _mm256_set1_ps(-87.3f)), _mm256_set1_ps(88.3f));
 
-        // [TDRZ] when tinydiarize is disabled, suppress solm token
-        if (params.tdrz_enable == false) {
-            logits[vocab.token_solm] = -INFINITY;
-        }
+    const __m256 fx = _mm256_round_ps(_mm256_mul_ps(x, _mm256_set1_ps(1.44269504088896341f)), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
 
-        // suppress task tokens
-        logits[vocab.token_translate]  = -INFINITY;
-        logits[vocab.token_transcribe] = -INFINITY;
-        logits[vocab.token_prev]       = -INFINITY;
+    x = _mm256_fnmadd_ps(fx, _mm256_set1_ps(0.693359375f), x);
+    x = _mm256_fnmadd_ps(fx, _mm256_set1_ps(-2.12194440e-4f), x);
 
-        // suppress lang tokens
-        for (size_t i = 0; i < g_lang.size(); ++i) {
-            logits[whisper_token_lang(&ctx, i)] = -INFINITY;
-        }
+    __m256 y = _mm256_set1_ps(1.9875691500e-4f);
+    y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(1.3981999507e-3f));
+    y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(8.3334519073e-3f));
+    y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(4.1665795894e-2f));
+    y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(1.6666665459e-1f));
+    y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(5.0000001201e-1f));
+    y = _mm256_fmadd_ps(y, _mm256_mul_ps(x, x), _mm256_add_ps(x, _mm256_set1_ps(1.0f)));
 
-        // suppress prev token
-        logits[vocab.token_prev] = -INFINITY;
+    const __m256i e = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvtps_epi32(fx), _mm256_set1_epi32(127)), 23);
 
-        if (params.logits_filter_callback) {
-            params.logits_filter_callback(&ctx, &state, tokens_cur.data(), tokens_cur.size(), logits.data(), params.logits_filter_callback_user_data);
-        }
+    return _mm256_andnot_ps(under, _mm256_mul_ps(y, _mm256_castsi256_ps(e)));
+}
+#endif
 
-        // suppress any tokens matching a regular expression
-        // ref: https://github.com/openai/whisper/discussions/1041
-        if (params.suppress_regex != nullptr) {
-            std::regex re(params.suppress_regex);
-            for (std::pair<whisper_vocab::token, whisper_vocab::id> token_id : vocab.token_to_id) {
-                if (std::regex_match(token_id.first, re)) {
-                    logits[token_id.second] = -INFINITY;
-                }
-            }
-        }
+#if defined(__SSE2__)
+static inline __m128 whisper_v_expf(__m128 x) {
+    const __m128 under = _mm_cmplt_ps(x, _mm_set1_ps(-87.3f));
 
-        // suppress non-speech tokens
-        // ref: https://github.com/openai/whisper/blob/7858aa9c08d98f75575035ecd6481f462d66ca27/whisper/tokenizer.py#L224-L253
-        if (params.suppress_nst) {
-            for (const std::string & token : non_speech_tokens) {
-                const std::string suppress_tokens[] = {token, " " + token};
-                for (const std::string & suppress_token : suppress_tokens) {
-                    if (vocab.token_to_id.find(suppress_token) != vocab.token_to_id.end()) {
-                        logits[vocab.token_to_id.at(suppress_token)] = -INFINITY;
-                    }
-                }
-            }
+    x = _mm_min_ps(_mm_max_ps(x, _mm_set1_ps(-87.3f)), _mm_set1_ps(88.3f));
 
-            // allow hyphens "-" and single quotes "'" between words, but not at the beginning of a word
-            if (vocab.token_to_id.find(" -") != vocab.token_to_id.end()) {
-                logits[vocab.token_to_id.at(" -")] = -INFINITY;
-            }
-            if (vocab.token_to_id.find(" '") != vocab.token_to_id.end()) {
-                logits[vocab.token_to_id.at(" '")] = -INFINITY;
-            }
+    const __m128i n  = _mm_cvtps_epi32(_mm_mul_ps(x, _mm_set1_ps(1.44269504088896341f))); // round to nearest
+    const __m128  fx = _mm_cvtepi32_ps(n);
+
+    x = _mm_sub_ps(x, _mm_mul_ps(fx, _mm_set1_ps(0.693359375f)));
+    x = _mm_sub_ps(x, _mm_mul_ps(fx, _mm_set1_ps(-2.12194440e-4f)));
+
+    __m128 y = _mm_set1_ps(1.9875691500e-4f);
+    y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(1.3981999507e-3f));
+    y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(8.3334519073e-3f));
+    y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(4.1665795894e-2f));
+    y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(1.6666665459e-1f));
+    y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(5.0000001201e-1f));
+    y = _mm_add_ps(_mm_mul_ps(y, _mm_mul_ps(x, x)), _mm_add_ps(x, _mm_set1_ps(1.0f)));
+
+    const __m128i e = _mm_slli_epi32(_mm_add_epi32(n, _mm_set1_epi32(127)), 23);
+
+    return _mm_andnot_ps(under, _mm_mul_ps(y, _mm_castsi128_ps(e)));
+}
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+static inline float32x4_t whisper_v_expf(float32x4_t x) {
+    const uint32x4_t under = vcltq_f32(x, vdupq_n_f32(-87.3f));
+
+    x = vminq_f32(vmaxq_f32(x, vdupq_n_f32(-87.3f)), vdupq_n_f32(88.3f));
+
+    const int32x4_t   n  = vcvtnq_s32_f32(vmulq_n_f32(x, 1.44269504088896341f));
+    const float32x4_t fx = vcvtq_f32_s32(n);
+
+    x = vfmsq_f32(x, fx, vdupq_n_f32(0.693359375f));
+    x = vfmsq_f32(x, fx, vdupq_n_f32(-2.12194440e-4f));
+
+    float32x4_t y = vdupq_n_f32(1.9875691500e-4f);
+    y = vfmaq_f32(vdupq_n_f32(1.3981999507e-3f), y, x);
+    y = vfmaq_f32(vdupq_n_f32(8.3334519073e-3f), y, x);
+    y = vfmaq_f32(vdupq_n_f32(4.1665795894e-2f), y, x);
+    y = vfmaq_f32(vdupq_n_f32(1.6666665459e-1f), y, x);
+    y = vfmaq_f32(vdupq_n_f32(5.0000001201e-1f), y, x);
+    y = vfmaq_f32(vaddq_f32(x, vdupq_n_f32(1.0f)), y, vmulq_f32(x, x));
+
+    const int32x4_t e = vshlq_n_s32(vaddq_s32(n, vdupq_n_s32(127)), 23);
+
+    y = vmulq_f32(y, vreinterpretq_f32_s32(e));
+
+    return vreinterpretq_f32_u32(vbicq_u32(vreinterpretq_u32_f32(y), under));
+}
+#endif
+
+// dst[j] = src[j]/temperature (or src[j] if temperature <= 0), -INFINITY where the bit in mask is set - returns dst[j]
+static inline float whisper_logit_mask(float * dst, const float * src, const uint32_t * mask, int j, float temperature) {
+    float v = temperature > 0.0f ? src[j]/temperature : src[j];
+    if (mask && (mask[j >> 5] >> (j & 31) & 1)) {
+        v = -INFINITY;
+    }
+    dst[j] = v;
+
+    return v;
+}
+
+// the vectorized part of each kernel processes [i, i1) up to the last full vector and returns where it stopped
+// the callers finish the rest with the scalar code
+
+#if defined(WHISPER_SIMD_AVX512)
+WHISPER_TARGET_AVX512
+static int whisper_logits_mask_avx512(float * dst, const float * src, const uint32_t * mask, int i, int i1, float temperature, float & vmax) {
+    for (; i < i1 && (i & 15); ++i) {
+        vmax = std::max(vmax, whisper_logit_mask(dst, src, mask, i, temperature));
+    }
+
+    const bool   scale = temperature > 0.0f;
+    const __m512 vt    = _mm512_set1_ps(temperature);
+    const __m512 ninf  = _mm512_set1_ps(-INFINITY);
+    __m512 acc = ninf;
+
+    for (; i + 16 <= i1; i += 16) {
+        __m512 v = _mm512_loadu_ps(src + i);
+        if (scale) {
+            v = _mm512_div_ps(v, vt);
+        }
+        if (mask) {
+            v = _mm512_mask_mov_ps(v, (__mmask16) (mask[i >> 5] >> (i & 31)), ninf);
         }
+        _mm512_storeu_ps(dst + i, v);
+        acc = _mm512_max_ps(acc, v);
+    }
 
-        // timestamps have to appear in pairs, except directly before EOT; mask logits accordingly
-        // https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L414-L424
-        {
-            const bool last_was_timestamp        = tokens_cur.size() > 0 && tokens_cur.back().id >= vocab.token_beg;
-            const bool penultimate_was_timestamp = tokens_cur.size() < 2 || tokens_cur[tokens_cur.size() - 2].id >= vocab.token_beg;
+    vmax = std::max(vmax, _mm512_reduce_max_ps(acc));
 
-            //WHISPER_LOG_INFO("last_was_timestamp=%d penultimate_was_timestamp=%d\n", last_was_timestamp, penultimate_was_timestamp);
+    return i;
+}
 
-            if (last_was_timestamp) {
-                if (penultimate_was_timestamp) {
-                    for (int i = vocab.token_beg; i < n_logits; ++i) {
-                        logits[i] = -INFINITY;
-                    }
-                } else {
-                    for (int i = 0; i < vocab.token_eot; ++i) {
-                        logits[i] = -INFINITY;
-                    }
-                }
-            }
+WHISPER_TARGET_AVX512
+static int whisper_logits_sumexp_avx512(const float * x, int i, int i1, float max, float & sum) {
+    const __m512 vm = _mm512_set1_ps(max);
+    __m512 acc = _mm512_setzero_ps();
+    for (; i + 16 <= i1; i += 16) {
+        acc = _mm512_add_ps(acc, whisper_v_expf(_mm512_sub_ps(_mm512_loadu_ps(x + i), vm)));
+    }
+    sum = _mm512_reduce_add_ps(acc);
+
+    return i;
+}
+
+WHISPER_TARGET_AVX512
+static int whisper_logits_write_avx512(const float * x, float * logprobs, float * probs, int i, int i1, float lse) {
+    const __m512 vl = _mm512_set1_ps(lse);
+    for (; i + 16 <= i1; i += 16) {
+        const __m512 lp = _mm512_sub_ps(_mm512_loadu_ps(x + i), vl);
+        _mm512_storeu_ps(logprobs + i, lp);
+        _mm512_storeu_ps(probs    + i, whisper_v_expf(lp));
+    }
+
+    return i;
+}
+#endif
+
+#if defined(WHISPER_SIMD_AVX2)
+WHISPER_TARGET_AVX2
+static int whisper_logits_mask_avx2(float * dst, const float * src, const uint32_t * mask, int i, int i1, float temperature, float & vmax) {
+    for (; i < i1 && (i & 7); ++i) {
+        vmax = std::max(vmax, whisper_logit_mask(dst, src, mask, i, temperature));
+    }
+
+    const bool    scale = temperature > 0.0f;
+    const __m256  vt    = _mm256_set1_ps(temperature);
+    const __m256  ninf  = _mm256_set1_ps(-INFINITY);
+    const __m256i bits  = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+    __m256 acc = ninf;
+
+    for (; i + 8 <= i1; i += 8) {
+        __m256 v = _mm256_loadu_ps(src + i);
+        if (scale) {
+            v = _mm256_div_ps(v, vt);
+        }
+        if (mask) {
+            const __m256i m = _mm256_and_si256(_mm256_set1_epi32((mask[i >> 5] >> (i & 31)) & 0xff), bits);
+            v = _mm256_blendv_ps(v, ninf, _mm256_castsi256_ps(_mm256_cmpeq_epi32(m, bits)));
+        }
+        _mm256_storeu_ps(dst + i, v);
+        acc = _mm256_max_ps(acc, v);
+    }
+
+    __m128 acc4 = _mm_max_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+    acc4 = _mm_max_ps(acc4, _mm_movehl_ps(acc4, acc4));
+    acc4 = _mm_max_ss(acc4, _mm_shuffle_ps(acc4, acc4, 1));
+    vmax = std::max(vmax, _mm_cvtss_f32(acc4));
+
+    return i;
+}
+
+WHISPER_TARGET_AVX2
+static int whisper_logits_sumexp_avx2(const float * x, int i, int i1, float max, float & sum) {
+    const __m256 vm = _mm256_set1_ps(max);
+    __m256 acc = _mm256_setzero_ps();
+    for (; i + 8 <= i1; i += 8) {
+        acc = _mm256_add_ps(acc, whisper_v_expf(_mm256_sub_ps(_mm256_loadu_ps(x + i), vm)));
+    }
+    __m128 acc4 = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+    acc4 = _mm_add_ps(acc4, _mm_movehl_ps(acc4, acc4));
+    acc4 = _mm_add_ss(acc4, _mm_shuffle_ps(acc4, acc4, 1));
+    sum = _mm_cvtss_f32(acc4);
+
+    return i;
+}
+
+WHISPER_TARGET_AVX2
+static int whisper_logits_write_avx2(const float * x, float * logprobs, float * probs, int i, int i1, float lse) {
+    const __m256 vl = _mm256_set1_ps(lse);
+    for (; i + 8 <= i1; i += 8) {
+        const __m256 lp = _mm256_sub_ps(_mm256_loadu_ps(x + i), vl);
+        _mm256_storeu_ps(logprobs + i, lp);
+        _mm256_storeu_ps(probs    + i, whisper_v_expf(lp));
+    }
+
+    return i;
+}
+#endif
+
+// SSE2 or NEON, whichever the library is compiled for
+static int whisper_logits_mask_base(float * dst, const float * src, const uint32_t * mask, int i, int i1, float temperature, float & vmax) {
+#if defined(__SSE2__)
+    for (; i < i1 && (i & 3); ++i) {
+        vmax = std::max(vmax, whisper_logit_mask(dst, src, mask, i, temperature));
+    }
+
+    const bool    scale = temperature > 0.0f;
+    const __m128  vt    = _mm_set1_ps(temperature);
+    const __m128  ninf  = _mm_set1_ps(-INFINITY);
+    const __m128i bits  = _mm_setr_epi32(1, 2, 4, 8);
+    __m128 acc = ninf;
+
+    for (; i + 4 <= i1; i += 4) {
+        __m128 v = _mm_loadu_ps(src + i);
+        if (scale) {
+            v = _mm_div_ps(v, vt);
+        }
+        if (mask) {
+            const __m128i m = _mm_and_si128(_mm_set1_epi32((mask[i >> 5] >> (i & 31)) & 0xf), bits);
+            const __m128  k = _mm_castsi128_ps(_mm_cmpeq_epi32(m, bits));
+            v = _mm_or_ps(_mm_andnot_ps(k, v), _mm_and_ps(k, ninf));
+        }
+        _mm_storeu_ps(dst + i, v);
+        acc = _mm_max_ps(acc, v);
+    }
+
+    acc = _mm_max_ps(acc, _mm_movehl_ps(acc, acc));
+    acc = _mm_max_ss(acc, _mm_shuffle_ps(acc, acc, 1));
+    vmax = std::max(vmax, _mm_cvtss_f32(acc));
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    for (; i < i1 && (i & 3); ++i) {
+        vmax = std::max(vmax, whisper_logit_mask(dst, src, mask, i, temperature));
+    }
+
+    const bool        scale = temperature > 0.0f;
+    const float32x4_t vt    = vdupq_n_f32(temperature);
+    const float32x4_t ninf  = vdupq_n_f32(-INFINITY);
+    const uint32x4_t  bits  = { 1, 2, 4, 8 };
+    float32x4_t acc = ninf;
+
+    for (; i + 4 <= i1; i += 4) {
+        float32x4_t v = vld1q_f32(src + i);
+        if (scale) {
+            v = vdivq_f32(v, vt);
+        }
+        if (mask) {
+            const uint32x4_t k = vtstq_u32(vdupq_n_u32((mask[i >> 5] >> (i & 31)) & 0xf), bits);
+            v = vbslq_f32(k, ninf, v);
+        }
+        vst1q_f32(dst + i, v);
+        acc = vmaxq_f32(acc, v);
+    }
+
+    vmax = std::max(vmax, vmaxvq_f32(acc));
+#else
+    GGML_UNUSED(dst);
+    GGML_UNUSED(src);
+    GGML_UNUSED(mask);
+    GGML_UNUSED(i1);
+    GGML_UNUSED(temperature);
+    GGML_UNUSED(vmax);
+#endif
+
+    return i;
+}
+
+static int whisper_logits_sumexp_base(const float * x, int i, int i1, float max, float & sum) {
+#if defined(__SSE2__)
+    const __m128 vm = _mm_set1_ps(max);
+    __m128 acc = _mm_setzero_ps();
+    for (; i + 4 <= i1; i += 4) {
+        acc = _mm_add_ps(acc, whisper_v_expf(_mm_sub_ps(_mm_loadu_ps(x + i), vm)));
+    }
+    acc = _mm_add_ps(acc, _mm_movehl_ps(acc, acc));
+    acc = _mm_add_ss(acc, _mm_shuffle_ps(acc, acc, 1));
+    sum = _mm_cvtss_f32(acc);
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    const float32x4_t vm = vdupq_n_f32(max);
+    float32x4_t acc = vdupq_n_f32(0.0f);
+    for (; i + 4 <= i1; i += 4) {
+        acc = vaddq_f32(acc, whisper_v_expf(vsubq_f32(vld1q_f32(x + i), vm)));
+    }
+    sum = vaddvq_f32(acc);
+#else
+    GGML_UNUSED(x);
+    GGML_UNUSED(i1);
+    GGML_UNUSED(max);
+    GGML_UNUSED(sum);
+#endif
+
+    return i;
+}
+
+static int whisper_logits_write_base(const float * x, float * logprobs, float * probs, int i, int i1, float lse) {
+#if defined(__SSE2__)
+    const __m128 vl = _mm_set1_ps(lse);
+    for (; i + 4 <= i1; i += 4) {
+        const __m128 lp = _mm_sub_ps(_mm_loadu_ps(x + i), vl);
+        _mm_storeu_ps(logprobs + i, lp);
+        _mm_storeu_ps(probs    + i, whisper_v_expf(lp));
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    const float32x4_t vl = vdupq_n_f32(lse);
+    for (; i + 4 <= i1; i += 4) {
+        const float32x4_t lp = vsubq_f32(vld1q_f32(x + i), vl);
+        vst1q_f32(logprobs + i, lp);
+        vst1q_f32(probs    + i, whisper_v_expf(lp));
+    }
+#else
+    GGML_UNUSED(x);
+    GGML_UNUSED(logprobs);
+    GGML_UNUSED(probs);
+    GGML_UNUSED(i1);
+    GGML_UNUSED(lse);
+#endif
+
+    return i;
+}
+
+// dst[i] = src[i]/temperature (or src[i] if temperature <= 0) for i in [i0, i1), -INFINITY where the bit in mask is set
+// mask can be null, dst can be src - returns the max of dst[i0, i1)
+static float whisper_logits_mask(float * dst, const float * src, const uint32_t * mask, int i0, int i1, float temperature) {
+    float vmax = -INFINITY;
+
+    int i = i0;
+
+    switch (g_simd_level) {
+#if defined(WHISPER_SIMD_AVX512)
+        case WHISPER_SIMD_LEVEL_AVX512: i = whisper_logits_mask_avx512(dst, src, mask, i, i1, temperature, vmax); break;
+#endif
+#if defined(WHISPER_SIMD_AVX2)
+        case WHISPER_SIMD_LEVEL_AVX2:   i = whisper_logits_mask_avx2  (dst, src, mask, i, i1, temperature, vmax); break;
+#endif
+        default:                        i = whisper_logits_mask_base  (dst, src, mask, i, i1, temperature, vmax); break;
+    }
+
+    for (; i < i1; ++i) {
+        vmax = std::max(vmax, whisper_logit_mask(dst, src, mask, i, temperature));
+    }
+
+    return vmax;
+}
+
+// sum of exp(x[i] - max) for i in [i0, i1), -INFINITY entries contribute 0
+static float whisper_logits_sumexp(const float * x, int i0, int i1, float max) {
+    if (max == -INFINITY) {
+        return 0.0f;
+    }
+
+    int i = i0;
+    float sum = 0.0f;
+
+    switch (g_simd_level) {
+#if defined(WHISPER_SIMD_AVX512)
+        case WHISPER_SIMD_LEVEL_AVX512: i = whisper_logits_sumexp_avx512(x, i, i1, max, sum); break;
+#endif
+#if defined(WHISPER_SIMD_AVX2)
+        case WHISPER_SIMD_LEVEL_AVX2:   i = whisper_logits_sumexp_avx2  (x, i, i1, max, sum); break;
+#endif
+        default:                        i = whisper_logits_sumexp_base  (x, i, i1, max, sum); break;
+    }
+
+    for (; i < i1; ++i) {
+        if (x[i] > -INFINITY) {
+            sum += expf(x[i] - max);
+        }
+    }
+
+    return sum;
+}
+
+// logprobs[i] = x[i] - lse, probs[i] = exp(logprobs[i]) for i in [i0, i1)
+static void whisper_logits_write(const float * x, float * logprobs, float * probs, int i0, int i1, float lse) {
+    int i = i0;
+
+    switch (g_simd_level) {
+#if defined(WHISPER_SIMD_AVX512)
+        case WHISPER_SIMD_LEVEL_AVX512: i = whisper_logits_write_avx512(x, logprobs, probs, i, i1, lse); break;
+#endif
+#if defined(WHISPER_SIMD_AVX2)
+        case WHISPER_SIMD_LEVEL_AVX2:   i = whisper_logits_write_avx2  (x, logprobs, probs, i, i1, lse); break;
+#endif
+        default:                        i = whisper_logits_write_base  (x, logprobs, probs, i, i1, lse); break;
+    }
+
+    for (; i < i1; ++i) {
+        if (x[i] > -INFINITY) {
+            logprobs[i] = x[i] - lse;
+            probs[i]    = expf(logprobs[i]);
+        } else {
+            logprobs[i] = -INFINITY;
+            probs[i]    = 0.0f;
         }
+    }
+}
 
-        // the initial timestamp cannot be larger than max_initial_ts
-        // ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L426-L429
-        if (is_initial && params.max_initial_ts > 0.0f) {
-            const float precision = float(WHISPER_CHUNK_SIZE)/ctx.model.hparams.n_audio_ctx;
-            const int   tid0      = std::round(params.max_initial_ts/precision);
+// set the bits of the tokens matching the regular expression, false if the expression is invalid
+static bool whisper_regex_mask(const whisper_vocab & vocab, const char * regex, std::vector<uint32_t> & mask) {
+    mask.assign((vocab.size() + 31)/32, 0);
 
-            for (int i = vocab.token_beg + tid0 + 1; i < n_logits; ++i) {
-                logits[i] = -INFINITY;
+    try {
+        const std::regex re(regex);
+        for (whisper_vocab::id id = 0; id < vocab.size(); ++id) {
+            const char * text = vocab.text(id);
+            if (std::regex_match(text, text + vocab.text_len(id), re)) {
+                whisper_bitmask_set(mask, id);
             }
         }
+    } catch (const std::regex_error &) {
+        return false;
+    }
+
+    return true;
+}
 
-        // condition timestamp tokens to be increasing
-        // ref: https://github.com/openai/whisper/pull/831#issuecomment-1385910556
-        if (decoder.has_ts) {
-            const int tid0 = decoder.seek_delta/2;
+// the predefined masks, computed once the vocabulary is loaded
+static void whisper_token_masks_init(whisper_context & ctx) {
+    const auto & vocab = ctx.vocab;
+
+    auto & nst = ctx.token_masks.nst;
 
-            for (int i = vocab.token_beg; i < vocab.token_beg + tid0; ++i) {
-                logits[i] = -INFINITY;
+    nst.assign((vocab.size() + 31)/32, 0);
+
+    for (const std::string & token : non_speech_tokens) {
+        const std::string suppress_tokens[] = {token, " " + token};
+        for (const std::string & suppress_token : suppress_tokens) {
+            const whisper_vocab::id id = whisper_vocab_find(vocab, suppress_token);
+            if (id >= 0) {
+                whisper_bitmask_set(nst, id);
             }
         }
+    }
 
-        // populate the logprobs array (log_softmax)
-        whisper_compute_logprobs(logits, n_logits, logprobs);
+    // allow hyphens "-" and single quotes "'" between words, but not at the beginning of a word
+    for (const char * token : { " -", " '" }) {
+        const whisper_vocab::id id = whisper_vocab_find(vocab, token, strlen(token));
+        if (id >= 0) {
+            whisper_bitmask_set(nst, id);
+        }
+    }
 
-        // if sum of probability over timestamps is above any other token, sample timestamp
-        // ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L431-L437
-        {
-            // logsumexp over timestamps
-            float timestamp_logprob = -INFINITY;
-            {
-                float logsumexp = 0.0f;
-                const float logprob_max = *std::max_element(logprobs.begin() + vocab.token_beg, logprobs.end());
-                for (int i = vocab.token_beg; i < n_logits; ++i) {
-                    if (logprobs[i] > -INFINITY) {
-                        logsumexp += expf(logprobs[i] - logprob_max);
-                    }
-                }
-                if (logsumexp > 0.0f) {
-                    timestamp_logprob = logf(logsumexp) + logprob_max;
-                }
+    ctx.token_masks.named["non_speech_tokens"] = nst;
+}
+
+// the static logit filters of whisper_process_logits() for the given parameters
+// returns false if suppress_regex is invalid or suppress_masks names an unknown mask
+// ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L480-L493
+static bool whisper_suppress_mask_init(
+              struct whisper_context & ctx,
+    const struct whisper_full_params & params,
+              whisper_suppress_mask  & mask) {
+    const auto & vocab = ctx.vocab;
+
+    const int n_logits = vocab.size();
+    const int n_words  = (n_logits + 31)/32;
+
+    mask.pre .assign(n_words, 0);
+    mask.post.assign(n_words, 0);
+
+    mask.id_blank = whisper_vocab_find(vocab, " ", 1);
+
+    auto & pre = mask.pre;
+
+    // suppress <|notimestamps|> token
+    // ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L410-L412
+    whisper_bitmask_set(pre, vocab.token_not);
+    if (params.no_timestamps) {
+        whisper_bitmask_set_range(pre, vocab.token_beg, n_logits);
+    }
+
+    // suppress sot and nosp tokens
+    whisper_bitmask_set(pre, vocab.token_sot);
+    whisper_bitmask_set(pre, vocab.token_nosp);
+
+    // [TDRZ] when tinydiarize is disabled, suppress solm token
+    if (params.tdrz_enable == false) {
+        whisper_bitmask_set(pre, vocab.token_solm);
+    }
+
+    // suppress task tokens
+    whisper_bitmask_set(pre, vocab.token_translate);
+    whisper_bitmask_set(pre, vocab.token_transcribe);
+    whisper_bitmask_set(pre, vocab.token_prev);
+
+    // suppress lang tokens
+    for (size_t i = 0; i < g_lang.size(); ++i) {
+        whisper_bitmask_set(pre, whisper_token_lang(&ctx, i));
+    }
+
+    auto & post = mask.post;
+
+    auto & masks = ctx.token_masks;
+
+    std::lock_guard<std::mutex> lock(masks.mutex);
+
+    // suppress any tokens matching a regular expression
+    // ref: https://github.com/openai/whisper/discussions/1041
+    // the expression is matched against the vocabulary once and the result is kept on the context
+    if (params.suppress_regex != nullptr) {
+        auto it = masks.regex.find(params.suppress_regex);
+        if (it == masks.regex.end()) {
+            std::vector<uint32_t> re_mask;
+            if (!whisper_regex_mask(vocab, params.suppress_regex, re_mask)) {
+                WHISPER_LOG_ERROR("%s: invalid suppress_regex '%s'\n", __func__, params.suppress_regex);
+                return false;
+            }
+            if (masks.regex.size() >= WHISPER_MAX_CACHED_REGEX) {
+                masks.regex.clear();
             }
+            it = masks.regex.emplace(params.suppress_regex, std::move(re_mask)).first;
+        }
+        whisper_bitmask_or(post, post, it->second);
+    }
 
-            const float max_text_token_logprob = *std::max_element(logprobs.begin(), logprobs.begin() + vocab.token_beg);
+    // suppress non-speech tokens
+    // ref: https://github.com/openai/whisper/blob/7858aa9c08d98f75575035ecd6481f462d66ca27/whisper/tokenizer.py#L224-L253
+    if (params.suppress_nst) {
+        whisper_bitmask_or(post, post, masks.nst);
+    }
 
-            //WHISPER_LOG_INFO("timestamp_logprob=%f max_text_token_logprob=%f\n", timestamp_logprob, max_text_token_logprob);
+    // suppress the registered masks listed in the parameters
+    for (int i = 0; i < params.suppress_n_masks; ++i) {
+        auto it = masks.named.find(params.suppress_masks[i]);
+        if (it == masks.named.end()) {
+            WHISPER_LOG_ERROR("%s: unknown suppression mask '%s'\n", __func__, params.suppress_masks[i]);
+            return false;
+        }
+        whisper_bitmask_or(post, post, it->second);
+    }
 
-            if (timestamp_logprob > max_text_token_logprob) {
-                for (int i = 0; i < vocab.token_beg; ++i) {
-                    logits[i]   = -INFINITY;
-                    logprobs[i] = -INFINITY;
-                }
-            } else {
-                if (params.n_grammar_rules > 0) {
-                    whisper_suppress_invalid_grammar(ctx, params, logits, decoder.grammar);
+    whisper_bitmask_or(mask.all, mask.pre, mask.post);
 
-                    // populate the logprobs array (log_softmax)
-                    {
-                        const float logit_max = *std::max_element(logits.begin(), logits.end());
-                        float logsumexp = 0.0f;
-                        for (int i = 0; i < n_logits; ++i) {
-                            if (logits[i] > -INFINITY) {
-                                logsumexp += expf(logits[i] - logit_max);
-                            }
-                        }
-                        logsumexp = logf(logsumexp) + logit_max;
+    return true;
+}
 
-                        for (int i = 0; i < n_logits; ++i) {
-                            if (logits[i] > -INFINITY) {
-                                logprobs[i] = logits[i] - logsumexp;
-                            } else {
-                                logprobs[i] = -INFINITY;
-                            }
-                        }
-                    }
-                }
+int whisper_suppress_mask_register(struct whisper_context * ctx, const char * name, const whisper_token * tokens, int n_tokens) {
+    const int n_vocab = ctx->vocab.size();
+
+    std::vector<uint32_t> mask((n_vocab + 31)/32, 0);
+    for (int i = 0; i < n_tokens; ++i) {
+        if (tokens[i] < 0 || tokens[i] >= n_vocab) {
+            WHISPER_LOG_ERROR("%s: invalid token %d in mask '%s'\n", __func__, tokens[i], name);
+            return -1;
+        }
+        whisper_bitmask_set(mask, tokens[i]);
+    }
+
+    std::lock_guard<std::mutex> lock(ctx->token_masks.mutex);
+
+    ctx->token_masks.named[name] = std::move(mask);
+
+    return 0;
+}
+
+int whisper_suppress_mask_register_regex(struct whisper_context * ctx, const char * name, const char * regex) {
+    std::vector<uint32_t> mask;
+    if (!whisper_regex_mask(ctx->vocab, regex, mask)) {
+        WHISPER_LOG_ERROR("%s: invalid regular expression '%s' for mask '%s'\n", __func__, regex, name);
+        return -1;
+    }
+
+    std::lock_guard<std::mutex> lock(ctx->token_masks.mutex);
+
+    ctx->token_masks.named[name] = std::move(mask);
+
+    return 0;
+}
+
+int whisper_suppress_mask_remove(struct whisper_context * ctx, const char * name) {
+    std::lock_guard<std::mutex> lock(ctx->token_masks.mutex);
+
+    return ctx->token_masks.named.erase(name) > 0 ? 0 : -1;
+}
+
+int whisper_suppress_mask_n_tokens(struct whisper_context * ctx, const char * name) {
+    std::lock_guard<std::mutex> lock(ctx->token_masks.mutex);
+
+    auto it = ctx->token_masks.named.find(name);
+    if (it == ctx->token_masks.named.end()) {
+        return -1;
+    }
+
+    int n = 0;
+    for (uint32_t w : it->second) {
+        for (; w; w &= w - 1) {
+            ++n;
+        }
+    }
+
+    return n;
+}
+
+// process the logits for the selected decoder
+// - applies logit filters
+// - computes logprobs and probs
+static void whisper_process_logits(
+              struct whisper_context & ctx,
+               struct whisper_state  & state,
+              struct whisper_decoder & decoder,
+    const struct whisper_full_params   params,
+                               float   temperature) {
+    const auto & vocab      = ctx.vocab;
+    const auto & tokens_cur = decoder.sequence.tokens;
+    const auto & suppress   = state.suppress;
+
+    const bool is_initial = tokens_cur.size() == 0;
+    const int  n_logits   = vocab.size();
+    const int  n_text     = vocab.token_beg; // text tokens are [0, n_text), timestamps [n_text, n_logits)
+
+    WHISPER_ASSERT(n_logits == ctx.vocab.n_vocab);
+    WHISPER_ASSERT((int) suppress.all.size() == (n_logits + 31)/32);
+
+    auto & probs    = decoder.probs;
+    auto & logits   = decoder.logits;
+    auto & logprobs = decoder.logprobs;
+
+    logits.resize(n_logits);
+    probs.resize(n_logits);
+    logprobs.resize(n_logits);
+
+    // apply logit filters here
+    // ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L480-L493
+    //
+    // the static filters are in state.suppress, the ones that depend on the decoded tokens are added to a copy of it
+    // without a logits_filter_callback all of them are applied in the same pass that extracts and scales the logits
+    auto & mask = decoder.suppress;
+
+    const bool has_callback = params.logits_filter_callback != nullptr;
+
+    mask = has_callback ? suppress.pre : suppress.all;
+
+    // suppress blank
+    // https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L388-L390
+    if (params.suppress_blank && is_initial) {
+        whisper_bitmask_set(mask, vocab.token_eot);
+        if (suppress.id_blank >= 0) {
+            whisper_bitmask_set(mask, suppress.id_blank);
+        }
+    }
+
+    const float * logits_src = state.logits.data() + decoder.i_batch*n_logits;
+
+    if (has_callback) {
+        whisper_logits_mask(logits.data(), logits_src, mask.data(), 0, n_logits, temperature);
+
+        params.logits_filter_callback(&ctx, &state, tokens_cur.data(), tokens_cur.size(), logits.data(), params.logits_filter_callback_user_data);
+
+        mask = suppress.post;
+    }
+
+    // timestamps have to appear in pairs, except directly before EOT; mask logits accordingly
+    // https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L414-L424
+    {
+        const bool last_was_timestamp        = tokens_cur.size() > 0 && tokens_cur.back().id >= vocab.token_beg;
+        const bool penultimate_was_timestamp = tokens_cur.size() < 2 || tokens_cur[tokens_cur.size() - 2].id >= vocab.token_beg;
+
+        if (last_was_timestamp) {
+            if (penultimate_was_timestamp) {
+                whisper_bitmask_set_range(mask, vocab.token_beg, n_logits);
+            } else {
+                whisper_bitmask_set_range(mask, 0, vocab.token_eot);
             }
         }
     }
 
-    // compute probs
-    whisper_compute_probs(logits, n_logits, logprobs, probs);
+    // the initial timestamp cannot be larger than max_initial_ts
+    // ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L426-L429
+    if (is_initial && params.max_initial_ts > 0.0f) {
+        const float precision = float(WHISPER_CHUNK_SIZE)/ctx.model.hparams.n_audio_ctx;
+        const int   tid0      = std::round(params.max_initial_ts/precision);
+
+        whisper_bitmask_set_range(mask, std::min(vocab.token_beg + tid0 + 1, n_logits), n_logits);
+    }
+
+    // condition timestamp tokens to be increasing
+    // ref: https://github.com/openai/whisper/pull/831#issuecomment-1385910556
+    if (decoder.has_ts) {
+        const int tid0 = decoder.seek_delta/2;
+
+        whisper_bitmask_set_range(mask, vocab.token_beg, std::min(vocab.token_beg + tid0, n_logits));
+    }
+
+    // extract (and scale) the logits for the last token, or filter the output of the callback in place
+    float max_text;
+    float max_ts;
+    if (has_callback) {
+        max_text = whisper_logits_mask(logits.data(), logits.data(), mask.data(), 0,      n_text,   0.0f);
+        max_ts   = whisper_logits_mask(logits.data(), logits.data(), mask.data(), n_text, n_logits, 0.0f);
+    } else {
+        max_text = whisper_logits_mask(logits.data(), logits_src,    mask.data(), 0,      n_text,   temperature);
+        max_ts   = whisper_logits_mask(logits.data(), logits_src,    mask.data(), n_text, n_logits, temperature);
+    }
+
+    // log_softmax
+    float logit_max = std::max(max_text, max_ts);
+
+    if (logit_max == -INFINITY) {
+        std::fill(logprobs.begin(), logprobs.end(), -INFINITY);
+        std::fill(probs.begin(),    probs.end(),    0.0f);
+        return;
+    }
+
+    float sum_text = whisper_logits_sumexp(logits.data(), 0,      n_text,   logit_max);
+    float sum_ts   = whisper_logits_sumexp(logits.data(), n_text, n_logits, logit_max);
+
+    float logsumexp = logf(sum_text + sum_ts) + logit_max;
+
+    // if sum of probability over timestamps is above any other token, sample timestamp
+    // ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L431-L437
+    const float timestamp_logprob      = sum_ts > 0.0f ? logf(sum_ts) + logit_max - logsumexp : -INFINITY;
+    const float max_text_token_logprob = max_text - logsumexp;
+
+    //WHISPER_LOG_INFO("timestamp_logprob=%f max_text_token_logprob=%f\n", timestamp_logprob, max_text_token_logprob);
+
+    if (timestamp_logprob > max_text_token_logprob) {
+        // the logprobs of the timestamps are not renormalized
+        std::fill(logits.begin(),   logits.begin()   + n_text, -INFINITY);
+        std::fill(logprobs.begin(), logprobs.begin() + n_text, -INFINITY);
+        std::fill(probs.begin(),    probs.begin()    + n_text, 0.0f);
+
+        whisper_logits_write(logits.data(), logprobs.data(), probs.data(), n_text, n_logits, logsumexp);
+
+        return;
+    }
+
+    if (params.n_grammar_rules > 0) {
+        whisper_suppress_invalid_grammar(ctx, params, logits, decoder.grammar, decoder.grammar_candidates);
+
+        logit_max = whisper_logits_mask(logits.data(), logits.data(), nullptr, 0, n_logits, 0.0f);
+        logsumexp = logf(whisper_logits_sumexp(logits.data(), 0, n_logits, logit_max)) + logit_max;
+    }
+
+    whisper_logits_write(logits.data(), logprobs.data(), probs.data(), 0, n_logits, logsumexp);
 
 #if 0
     // print first 100 logits - token string : logit
     //for (int i = 0; i < 10; i++) {
-    //    const auto token   = vocab.id_to_token.at(i);
+    //    const char * token = vocab.text(i);
     //    const auto prob    = probs[i];
     //    const auto logit   = logits[i];
     //    const auto logprob = logprobs[i];
-    //    printf("%16s : prob=%9.5f logit=%9.5f logprob=%9.5f\n", token.c_str(), prob, logit, logprob);
+    //    printf("%16s : prob=%9.5f logit=%9.5f logprob=%9.5f\n", token, prob, logit, logprob);
     //}
 
     // print sorted
@@ -5130,34 +7603,34 @@ static void whisper_process_logits(
         });
 
         for (int i = 0; i < 10; i++) {
-            const auto token   = vocab.id_to_token.at(pairs[i].second);
+            const char * token = vocab.text(pairs[i].second);
             const auto prob    = pairs[i].first;
             const auto logit   = logits[pairs[i].second];
             const auto logprob = logprobs[pairs[i].second];
-            printf("%16s : id=%6d prob=%9.5f logit=%9.5f logprob=%9.5f '%s'\n", token.c_str(), pairs[i].second, prob, logit, logprob, token.c_str());
+            printf("%16s : id=%6d prob=%9.5f logit=%9.5f logprob=%9.5f '%s'\n", token, pairs[i].second, prob, logit, logprob, token);
         }
 
         printf("----------------\n");
     }
 
     // "And", "and", " And", " and"
-    //printf("logits[\"and\"]  = %f\n", logits[vocab.token_to_id.at("and")]);
-    //printf("logits[\"And\"]  = %f\n", logits[vocab.token_to_id.at("And")]);
-    //printf("logits[\" and\"] = %f\n", logits[vocab.token_to_id.at(" and")]);
-    //printf("logits[\" And\"] = %f\n", logits[vocab.token_to_id.at(" And")]);
-    //printf("logits[\" so\"]  = %f\n", logits[vocab.token_to_id.at(" so")]);
-
-    //printf("logprobs[\"and\"]  = %f\n", logprobs[vocab.token_to_id.at("and")]);
-    //printf("logprobs[\"And\"]  = %f\n", logprobs[vocab.token_to_id.at("And")]);
-    //printf("logprobs[\" and\"] = %f\n", logprobs[vocab.token_to_id.at(" and")]);
-    //printf("logprobs[\" And\"] = %f\n", logprobs[vocab.token_to_id.at(" And")]);
-    //printf("logprobs[\" so\"]  = %f\n", logprobs[vocab.token_to_id.at(" so")]);
-
-    //printf("probs[\"and\"]  = %f\n", probs[vocab.token_to_id.at("and")]);
-    //printf("probs[\"And\"]  = %f\n", probs[vocab.token_to_id.at("And")]);
-    //printf("probs[\" and\"] = %f\n", probs[vocab.token_to_id.at(" and")]);
-    //printf("probs[\" And\"] = %f\n", probs[vocab.token_to_id.at(" And")]);
-    //printf("probs[\" so\"]  = %f\n", probs[vocab.token_to_id.at(" so")]);
+    //printf("logits[\"and\"]  = %f\n", logits[whisper_vocab_find(vocab, "and")]);
+    //printf("logits[\"And\"]  = %f\n", logits[whisper_vocab_find(vocab, "And")]);
+    //printf("logits[\" and\"] = %f\n", logits[whisper_vocab_find(vocab, " and")]);
+    //printf("logits[\" And\"] = %f\n", logits[whisper_vocab_find(vocab, " And")]);
+    //printf("logits[\" so\"]  = %f\n", logits[whisper_vocab_find(vocab, " so")]);
+
+    //printf("logprobs[\"and\"]  = %f\n", logprobs[whisper_vocab_find(vocab, "and")]);
+    //printf("logprobs[\"And\"]  = %f\n", logprobs[whisper_vocab_find(vocab, "And")]);
+    //printf("logprobs[\" and\"] = %f\n", logprobs[whisper_vocab_find(vocab, " and")]);
+    //printf("logprobs[\" And\"] = %f\n", logprobs[whisper_vocab_find(vocab, " And")]);
+    //printf("logprobs[\" so\"]  = %f\n", logprobs[whisper_vocab_find(vocab, " so")]);
+
+    //printf("probs[\"and\"]  = %f\n", probs[whisper_vocab_find(vocab, "and")]);
+    //printf("probs[\"And\"]  = %f\n", probs[whisper_vocab_find(vocab, "And")]);
+    //printf("probs[\" and\"] = %f\n", probs[whisper_vocab_find(vocab, " and")]);
+    //printf("probs[\" And\"] = %f\n", probs[whisper_vocab_find(vocab, " And")]);
+    //printf("probs[\" so\"]  = %f\n", probs[whisper_vocab_find(vocab, " so")]);
 #endif
 }
 
@@ -5174,10 +7647,88 @@ static bool whisper_sequence_tokens_equal(const whisper_sequence & a, const whis
     return true;
 }
 
+// prepares the draws of whisper_sampler_draw() from decoder.probs
+// the candidates are the tokens with a non-zero probability, reduced to those at least min_p times as likely as the
+// most likely token and then to the smallest set of most likely tokens with a total probability >= top_p
+// without reduction, the draws are the same as with std::discrete_distribution (libstdc++) over the whole vocabulary
+static void whisper_sampler_init(
+                  whisper_decoder & decoder,
+                              int   n_logits,
+    const struct whisper_full_params & params) {
+    const auto & probs = decoder.probs;
+
+    auto & ids = decoder.sampler_ids;
+    auto & cdf = decoder.sampler_cdf;
+
+    float p_min = 0.0f;
+    if (params.min_p > 0.0f) {
+        float p_max = 0.0f;
+        for (int i = 0; i < n_logits; ++i) {
+            p_max = std::max(p_max, probs[i]);
+        }
+        p_min = params.min_p*p_max;
+    }
+
+    ids.clear();
+    for (int i = 0; i < n_logits; ++i) {
+        if (probs[i] > 0.0f && probs[i] >= p_min) {
+            ids.push_back(i);
+        }
+    }
+
+    if (params.top_p < 1.0f && ids.size() > 1) {
+        std::sort(ids.begin(), ids.end(), [&](whisper_token a, whisper_token b) {
+            return probs[a] != probs[b] ? probs[a] > probs[b] : a < b;
+        });
+
+        double sum = 0.0;
+        for (whisper_token id : ids) {
+            sum += probs[id];
+        }
+
+        double cum = 0.0;
+        size_t n   = 0;
+        while (n < ids.size() && cum < params.top_p*sum) {
+            cum += probs[ids[n++]];
+        }
+        ids.resize(std::max<size_t>(n, 1));
+    }
+
+    double sum = 0.0;
+    for (whisper_token id : ids) {
+        sum += probs[id];
+    }
+
+    cdf.resize(ids.size());
+
+    double cum = 0.0;
+    for (size_t i = 0; i < ids.size(); ++i) {
+        cum += probs[ids[i]]/sum;
+        cdf[i] = cum;
+    }
+    if (!cdf.empty()) {
+        cdf.back() = 1.0;
+    }
+}
+
+static whisper_token whisper_sampler_draw(whisper_decoder & decoder) {
+    const auto & ids = decoder.sampler_ids;
+    const auto & cdf = decoder.sampler_cdf;
+
+    if (ids.empty()) {
+        return 0;
+    }
+
+    const double u = std::generate_canonical<double, std::numeric_limits<double>::digits>(decoder.rng);
+
+    return ids[std::lower_bound(cdf.begin(), cdf.end(), u) - cdf.begin()];
+}
+
 static whisper_token_data whisper_sample_token(
-            whisper_context & ctx,
-      const whisper_decoder & decoder,
-                       bool   best) {
+                  whisper_context & ctx,
+                  whisper_decoder & decoder,
+    const struct whisper_full_params & params,
+                             bool   best) {
     whisper_token_data result = {
         0, 0, 0.0f, 0.0f, 0.0f, 0.0f, -1, -1, -1, 0.0f,
     };
@@ -5218,9 +7769,9 @@ static whisper_token_data whisper_sample_token(
             }
         }
     } else {
-        std::discrete_distribution<> dist(probs.begin(), probs.end());
+        whisper_sampler_init(decoder, n_logits, params);
 
-        result.id   = dist(decoder.rng);
+        result.id   = whisper_sampler_draw(decoder);
         result.p    = probs[result.id];
         result.plog = logprobs[result.id];
     }
@@ -5233,38 +7784,21 @@ static whisper_token_data whisper_sample_token(
     return result;
 }
 
-static std::vector<whisper_token_data> whisper_sample_token_topk(
-            whisper_context & ctx,
-            whisper_decoder & decoder,
-                        int   k) {
+// samples k tokens into decoder.tokens_topk
+static void whisper_sample_token_topk(
+                  whisper_context & ctx,
+                  whisper_decoder & decoder,
+    const struct whisper_full_params & params,
+                              int   k) {
     const auto & vocab = ctx.vocab;
 
     const auto & probs    = decoder.probs;
-    const auto & logits   = decoder.logits;
     const auto & logprobs = decoder.logprobs;
 
     const int n_logits = vocab.n_vocab;
 
-    auto & logits_id = decoder.logits_id;
-
-    logits_id.resize(n_logits);
-    for (int i = 0; i < n_logits; ++i) {
-        logits_id[i].first = logits[i];
-        logits_id[i].second = i;
-    }
-
-    {
-        using pair_type = std::remove_reference<decltype(logits_id)>::type::value_type;
-        std::partial_sort(
-                logits_id.begin(),
-                logits_id.begin() + k, logits_id.end(),
-                [](const pair_type & a, const pair_type & b) {
-            return a.first > b.first;
-        });
-    }
-
-    std::vector<whisper_token_data> result;
-    result.reserve(k);
+    auto & result = decoder.tokens_topk;
+    result.clear();
 
     whisper_token tid = vocab.token_beg;
 
@@ -5291,10 +7825,11 @@ static std::vector<whisper_token_data> whisper_sample_token_topk(
         ptsum = sum_ts;
     }
 
-    std::discrete_distribution<> dist(probs.begin(), probs.end());
+    // the k draws share the same candidates
+    whisper_sampler_init(decoder, n_logits, params);
 
     for (int i = 0; i < k; ++i) {
-        const auto id = dist(decoder.rng);
+        const auto id = whisper_sampler_draw(decoder);
         //printf("XXX %d %d %f %f %f %f\n", id, tid, probs[id], logprobs[id], pt, ptsum);
 
         result.push_back({ id, tid, probs[id], logprobs[id], pt, ptsum, -1, -1, -1, 0.0f, });
@@ -5304,8 +7839,6 @@ static std::vector<whisper_token_data> whisper_sample_token_topk(
             result[i].pt  = result[i].p;
         }
     }
-
-    return result;
 }
 
 // ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L178-L192
@@ -5357,6 +7890,257 @@ static void whisper_sequence_score(
     }
 }
 
+// the level of each frame of the mel spectrogram, for whisper_silence_len()
+// the normalized log mel is (log10(E) + 4)/4, so a level difference of 1 is 40 dB
+static void whisper_silence_gate_init(whisper_state & state) {
+    const auto & mel = state.mel;
+
+    const int n_len = mel.n_len_org;
+
+    auto & level = state.mel_level;
+
+    level.assign(n_len, -INFINITY);
+    for (int j = 0; j < mel.n_mel; ++j) {
+        const float * row = mel.data.data() + (size_t) j*mel.n_len;
+        for (int i = 0; i < n_len; ++i) {
+            level[i] = std::max(level[i], row[i]);
+        }
+    }
+
+    state.mel_level_max = n_len > 0 ? *std::max_element(level.begin(), level.end()) : 0.0f;
+}
+
+// number of frames to jump over at seek, 0 if there is no silence of at least params.silence_min_ms there
+static int whisper_silence_len(const whisper_state & state, const whisper_full_params & params, int seek, int seek_end) {
+    // margin left in front of the speech that follows, so that its onset is not cut
+    const int n_margin = 20;
+
+    const float thold = state.mel_level_max - params.silence_thold_db/40.0f;
+
+    const int n_end = std::min(seek_end, (int) state.mel_level.size());
+
+    int n = 0;
+    while (seek + n < n_end && state.mel_level[seek + n] < thold) {
+        ++n;
+    }
+
+    if (n < std::max(params.silence_min_ms/10, n_margin + 1)) {
+        return 0;
+    }
+
+    return seek + n >= n_end ? seek_end - seek : n - n_margin;
+}
+
+// the audio context to encode the window at seek with: with params.audio_ctx_adaptive, the smallest bucket reserved
+// on the state that covers the mel frames left in the window (2 frames per position), otherwise params.audio_ctx
+static int whisper_audio_ctx_for_window(const whisper_state & state, const whisper_full_params & params, int seek, int seek_end) {
+    if (!params.audio_ctx_adaptive || params.audio_ctx > 0) {
+        return params.audio_ctx;
+    }
+
+    const int n_ctx = (std::min(seek_end - seek, WHISPER_CHUNK_SIZE*100) + 1)/2;
+
+    for (const auto & sa : state.sched_audio) {
+        if (sa.n_ctx >= n_ctx) {
+            return sa.n_ctx;
+        }
+    }
+
+    return 0;
+}
+
+// number of leading tokens of the prompt whose KV can be restored from the prompt cache of the state
+static int whisper_prompt_cache_match(const whisper_state & state, const std::vector<whisper_token> & prompt) {
+    const auto & pcache  = state.prompt_cache;
+    const auto & kv_self = state.kv_self;
+
+    // the cells are gone if the KV cache was cleared or recreated since
+    if (pcache.tokens.empty() || pcache.enc_key != state.enc_key || state.enc_key == 0 ||
+        kv_self.seq_lo[WHISPER_PROMPT_SEQ] >= kv_self.seq_hi[WHISPER_PROMPT_SEQ]) {
+        return 0;
+    }
+
+    const size_t n = std::min(pcache.tokens.size(), prompt.size());
+
+    size_t n_past = 0;
+    while (n_past < n && pcache.tokens[n_past] == prompt[n_past]) {
+        ++n_past;
+    }
+
+    return n_past;
+}
+
+// [EXPERIMENTAL] speculative decoding
+// prepares the state of the draft model for a whisper_full() call: the same mel spectrogram and logit filters
+// returns false if the draft model cannot be used with the model
+static bool whisper_draft_init(
+                  whisper_context & ctx,
+                    whisper_state & state,
+    const struct whisper_full_params & params,
+                      const float * samples,
+                              int   n_samples) {
+    auto & draft = state.draft;
+
+    whisper_context * dctx = params.draft_ctx;
+
+    if (dctx->vocab.n_vocab != ctx.vocab.n_vocab || whisper_is_multilingual(dctx) != whisper_is_multilingual(&ctx)) {
+        WHISPER_LOG_WARN("%s: the draft model has a different vocabulary (%d vs %d tokens) - not used\n", __func__, dctx->vocab.n_vocab, ctx.vocab.n_vocab);
+        return false;
+    }
+
+    // the QKs of the alignment heads are captured one token at a time
+    if (ctx.params.dtw_token_timestamps) {
+        WHISPER_LOG_DEBUG("%s: speculative decoding is not used with DTW token timestamps\n", __func__);
+        return false;
+    }
+
+    if (draft.ctx != dctx) {
+        whisper_free_state(draft.state);
+
+        draft.ctx   = nullptr;
+        draft.state = whisper_init_state(dctx);
+        if (draft.state == nullptr) {
+            WHISPER_LOG_ERROR("%s: failed to initialize the state of the draft model\n", __func__);
+            return false;
+        }
+        draft.ctx = dctx;
+    }
+
+    auto & dstate = *draft.state;
+
+    // the mel spectrogram is shared if the models use the same number of mel bins
+    if (dctx->model.filters.n_mel == state.mel.n_mel) {
+        dstate.mel      = state.mel;
+        dstate.enc_seek = -1;
+    } else if (n_samples > 0) {
+        if (whisper_pcm_to_mel_with_state(dctx, &dstate, samples, n_samples, params.n_threads) != 0) {
+            return false;
+        }
+    } else {
+        WHISPER_LOG_WARN("%s: the draft model uses %d mel bins instead of %d and there are no samples - not used\n", __func__, dctx->model.filters.n_mel, state.mel.n_mel);
+        return false;
+    }
+
+    // same vocabulary, same static filters
+    dstate.suppress = state.suppress;
+
+    draft.past.clear();
+    draft.tokens.clear();
+    draft.i_next = 0;
+
+    whisper_kv_cache_clear(dstate.kv_self);
+
+    return true;
+}
+
+// [EXPERIMENTAL] speculative decoding
+// proposes up to n_draft tokens that continue the sequence of the decoder into state.draft.tokens, greedily with the
+// logit filters of the model. The draft KV cache keeps the prefix it shares with the prompt and the sequence, the
+// rest of them is decoded first - usually the last token sampled by the model
+static bool whisper_draft_propose(
+                  whisper_state & state,
+    const struct whisper_full_params & params,
+    const std::vector<whisper_token> & prompt,
+            const whisper_decoder & decoder,
+                              int   seek,
+                              int   n_draft) {
+    auto & draft  = state.draft;
+    auto & dctx   = *draft.ctx;
+    auto & dstate = *draft.state;
+
+    const int64_t t_start_us = ggml_time_us();
+
+    draft.tokens.clear();
+    draft.i_next = 0;
+
+    // the draft model encodes the window on first use, its KV cache is only valid for the encoded window
+    dstate.exp_n_audio_ctx = state.exp_n_audio_ctx;
+    if (!whisper_is_encoded(dctx, dstate, seek)) {
+        if (!whisper_encode_internal(dctx, dstate, seek, params.n_threads, params.abort_callback, params.abort_callback_user_data)) {
+            WHISPER_LOG_ERROR("%s: failed to encode with the draft model\n", __func__);
+            return false;
+        }
+
+        whisper_kv_cache_clear(dstate.kv_self);
+        draft.past.clear();
+    }
+
+    auto & seq = draft.seq;
+
+    seq.assign(prompt.begin(), prompt.end());
+    for (const auto & token : decoder.sequence.tokens) {
+        seq.push_back(token.id);
+    }
+
+    // the last token is always decoded, for its logits
+    size_t n_past = 0;
+    while (n_past < draft.past.size() && n_past + 1 < seq.size() && draft.past[n_past] == seq[n_past]) {
+        ++n_past;
+    }
+
+    whisper_kv_cache_seq_rm(dstate.kv_self, 0, n_past, -1);
+
+    whisper_batch_prep_legacy(dstate.batch, seq.data() + n_past, seq.size() - n_past, n_past, 0);
+
+    if (!whisper_decode_internal(dctx, dstate, dstate.batch, params.n_threads, false, params.abort_callback, params.abort_callback_user_data)) {
+        WHISPER_LOG_ERROR("%s: failed to decode with the draft model\n", __func__);
+        return false;
+    }
+
+    draft.past = seq;
+
+    // the draft decoder follows the sequence of the decoder, without its grammar and logits_filter_callback
+    auto & ddecoder = dstate.decoders[0];
+
+    ddecoder.sequence.tokens = decoder.sequence.tokens;
+    ddecoder.seek_delta      = decoder.seek_delta;
+    ddecoder.has_ts          = decoder.has_ts;
+    ddecoder.grammar         = {};
+    ddecoder.i_batch         = seq.size() - n_past - 1;
+
+    whisper_full_params dparams = params;
+
+    dparams.logits_filter_callback = nullptr;
+    dparams.grammar_rules          = nullptr;
+    dparams.n_grammar_rules        = 0;
+
+    for (int j = 0; j < n_draft; ++j) {
+        whisper_process_logits(dctx, dstate, ddecoder, dparams, 0.0f);
+
+        const auto token = whisper_sample_token(dctx, ddecoder, dparams, true);
+
+        draft.tokens.push_back(token.id);
+
+        // the last draft token is verified without being decoded by the draft model
+        if (token.id == whisper_token_eot(&dctx) || j == n_draft - 1) {
+            break;
+        }
+
+        ddecoder.sequence.tokens.push_back(token);
+
+        if (token.id > whisper_token_beg(&dctx)) {
+            ddecoder.seek_delta = 2*(token.id - whisper_token_beg(&dctx));
+            ddecoder.has_ts     = true;
+        }
+
+        whisper_batch_prep_legacy(dstate.batch, &token.id, 1, draft.past.size(), 0);
+
+        if (!whisper_decode_internal(dctx, dstate, dstate.batch, params.n_threads, false, params.abort_callback, params.abort_callback_user_data)) {
+            WHISPER_LOG_ERROR("%s: failed to decode with the draft model\n", __func__);
+            return false;
+        }
+
+        draft.past.push_back(token.id);
+
+        ddecoder.i_batch = 0;
+    }
+
+    state.t_draft_us += ggml_time_us() - t_start_us;
+    state.n_draft    += draft.tokens.size();
+
+    return true;
+}
+
 int whisper_full_with_state(
         struct whisper_context * ctx,
           struct whisper_state * state,
@@ -5367,6 +8151,11 @@ int whisper_full_with_state(
     auto & result_all = state->result_all;
 
     result_all.clear();
+    state->enc_cache_keys.clear();
+
+    state->n_graph_build   = 0;
+    state->n_graph_reuse   = 0;
+    state->n_graph_realloc = 0;
 
     if (n_samples > 0) {
         // compute log mel spectrogram
@@ -5376,11 +8165,42 @@ int whisper_full_with_state(
         }
     }
 
+    // overwrite audio_ctx, max allowed is hparams.n_audio_ctx
+    if (params.audio_ctx > whisper_n_audio_ctx(ctx)) {
+        WHISPER_LOG_ERROR("%s: audio_ctx is larger than the maximum allowed (%d > %d)\n", __func__, params.audio_ctx, whisper_n_audio_ctx(ctx));
+        return -5;
+    }
+    state->exp_n_audio_ctx = params.audio_ctx;
+
+    if (params.silence_gate) {
+        whisper_silence_gate_init(*state);
+    }
+
+    const bool lang_auto = params.language == nullptr || strlen(params.language) == 0 || strcmp(params.language, "auto") == 0;
+
+    // mel offset of the window the current language was detected in
+    int seek_lang = -1;
+
     // auto-detect language if not specified
-    if (params.language == nullptr || strlen(params.language) == 0 || strcmp(params.language, "auto") == 0 || params.detect_language) {
+    // the first window to transcribe is used, so that its encoding is reused by the main loop below
+    if (lang_auto || params.detect_language) {
         std::vector<float> probs(whisper_lang_max_id() + 1, 0.0f);
 
-        const auto lang_id = whisper_lang_auto_detect_with_state(ctx, state, 0, params.n_threads, probs.data());
+        int offset_ms = params.offset_ms/10 < whisper_n_len_from_state(state) ? params.offset_ms : 0;
+
+        // detect the language on the first window that the main loop encodes
+        if (params.silence_gate) {
+            const int n_skip = whisper_silence_len(*state, params, offset_ms/10, whisper_n_len_from_state(state));
+            if (offset_ms/10 + n_skip + 100 < whisper_n_len_from_state(state)) {
+                offset_ms += 10*n_skip;
+            }
+        }
+
+        seek_lang = offset_ms/10;
+
+        state->exp_n_audio_ctx = whisper_audio_ctx_for_window(*state, params, seek_lang, whisper_n_len_from_state(state));
+
+        const auto lang_id = whisper_lang_auto_detect_with_state(ctx, state, offset_ms, params.n_threads, probs.data());
         if (lang_id < 0) {
             WHISPER_LOG_ERROR("%s: failed to auto-detect language\n", __func__);
             return -3;
@@ -5451,15 +8271,32 @@ int whisper_full_with_state(
         auto & decoder = state->decoders[j];
 
         decoder.sequence.tokens.reserve(state->decoders[0].sequence.tokens.capacity());
+        decoder.sequence_next.tokens.reserve(state->decoders[0].sequence.tokens.capacity());
 
         decoder.probs.resize   (ctx->vocab.n_vocab);
         decoder.logits.resize  (ctx->vocab.n_vocab);
         decoder.logprobs.resize(ctx->vocab.n_vocab);
         decoder.logits_id.reserve(ctx->model.hparams.n_vocab);
 
-        decoder.rng = std::mt19937(0);
+        decoder.rng = std::mt19937(0);
+    }
+
+    if (params.seed >= 0) {
+        for (int j = 0; j < n_decoders; j++) {
+            state->decoders[j].rng = std::mt19937(uint32_t(params.seed) + j);
+        }
+    }
+
+    // the logit filters that stay the same for the whole call
+    if (!whisper_suppress_mask_init(*ctx, params, state->suppress)) {
+        return -10;
     }
 
+    // [EXPERIMENTAL] speculative decoding, greedy only
+    const bool use_draft =
+        params.draft_ctx != nullptr && params.draft_n_tokens > 0 && params.strategy == WHISPER_SAMPLING_GREEDY &&
+        whisper_draft_init(*ctx, *state, params, samples, n_samples);
+
     // the accumulated text context so far
     auto & prompt_past = state->prompt_past;
     if (params.no_context) {
@@ -5493,13 +8330,6 @@ int whisper_full_with_state(
         }
     }
 
-    // overwrite audio_ctx, max allowed is hparams.n_audio_ctx
-    if (params.audio_ctx > whisper_n_audio_ctx(ctx)) {
-        WHISPER_LOG_ERROR("%s: audio_ctx is larger than the maximum allowed (%d > %d)\n", __func__, params.audio_ctx, whisper_n_audio_ctx(ctx));
-        return -5;
-    }
-    state->exp_n_audio_ctx = params.audio_ctx;
-
     // these tokens determine the task that will be performed
     std::vector<whisper_token> prompt_init = { whisper_token_sot(ctx), };
 
@@ -5532,14 +8362,21 @@ int whisper_full_with_state(
     std::vector<whisper_token> prompt;
     prompt.reserve(whisper_n_text_ctx(ctx));
 
+    // the sequence of a candidate is the one of its decoder followed by the token
+    // it is only materialized for the candidates that are selected
     struct beam_candidate {
         int decoder_idx;
         int seek_delta;
 
         bool has_ts;
 
-        whisper_sequence sequence;
-        whisper_grammar grammar;
+        whisper_token_data token;
+        double sum_logprobs_all;
+    };
+
+    const auto beam_candidate_equal = [&](const beam_candidate & a, const beam_candidate & b) {
+        return a.token.id == b.token.id &&
+            (a.decoder_idx == b.decoder_idx || whisper_sequence_tokens_equal(state->decoders[a.decoder_idx].sequence, state->decoders[b.decoder_idx].sequence));
     };
 
     std::vector<std::vector<beam_candidate>> bc_per_dec(n_decoders);
@@ -5547,6 +8384,19 @@ int whisper_full_with_state(
 
     // main loop
     while (true) {
+        // jump over silence without encoding it
+        if (params.silence_gate) {
+            const int n_skip = whisper_silence_len(*state, params, seek, seek_end);
+            if (n_skip > 0) {
+                WHISPER_LOG_DEBUG("%s: skipping silence %.2f s - %.2f s\n", __func__, seek/100.0f, (seek + n_skip)/100.0f);
+
+                seek += n_skip;
+
+                state->n_silence_skip++;
+                state->n_silence_frames += n_skip;
+            }
+        }
+
         if (params.progress_callback) {
             const int progress_cur = (100*(seek - seek_start))/(seek_end - seek_start);
 
@@ -5566,12 +8416,34 @@ int whisper_full_with_state(
             }
         }
 
+        state->exp_n_audio_ctx = whisper_audio_ctx_for_window(*state, params, seek, seek_end);
+
         // encode audio features starting at offset seek
-        if (!whisper_encode_internal(*ctx, *state, seek, params.n_threads, params.abort_callback, params.abort_callback_user_data)) {
+        // the window may already be encoded by the language detection
+        if (!whisper_is_encoded(*ctx, *state, seek) &&
+            !whisper_encode_internal(*ctx, *state, seek, params.n_threads, params.abort_callback, params.abort_callback_user_data)) {
             WHISPER_LOG_ERROR("%s: failed to encode\n", __func__);
             return -6;
         }
 
+        // re-detect the language of each window from its encoding
+        if (lang_auto && params.detect_language_per_window && whisper_is_multilingual(ctx) && seek != seek_lang) {
+            const int lang_id = whisper_lang_detect_encoded(ctx, state, params.n_threads, nullptr);
+            if (lang_id < 0) {
+                WHISPER_LOG_ERROR("%s: failed to detect the language at %.2f s\n", __func__, seek/100.0f);
+                return -3;
+            }
+
+            if (lang_id != state->lang_id) {
+                WHISPER_LOG_INFO("%s: language at %.2f s: %s\n", __func__, seek/100.0f, whisper_lang_str(lang_id));
+
+                state->lang_id = lang_id;
+                prompt_init[1] = whisper_token_lang(ctx, lang_id);
+            }
+
+            seek_lang = seek;
+        }
+
         // if there is a very short audio segment left to process, we remove any past prompt since it tends
         // to confuse the decoder and often make it repeat or hallucinate stuff
         if (seek > seek_start && seek + 500 >= seek_end) {
@@ -5632,7 +8504,6 @@ int whisper_full_with_state(
             }
 
             // init prompt and kv cache for the current iteration
-            // TODO: do not recompute the prompt if it is the same as previous time
             {
                 prompt.clear();
 
@@ -5650,7 +8521,7 @@ int whisper_full_with_state(
                 // print the prompt
                 WHISPER_LOG_DEBUG("\n\n");
                 for (int i = 0; i < (int) prompt.size(); i++) {
-                    WHISPER_LOG_DEBUG("%s: prompt[%d] = %s\n", __func__, i, ctx->vocab.id_to_token.at(prompt[i]).c_str());
+                    WHISPER_LOG_DEBUG("%s: prompt[%d] = %s\n", __func__, i, ctx->vocab.text(prompt[i]));
                 }
                 WHISPER_LOG_DEBUG("\n\n");
 
@@ -5663,7 +8534,7 @@ int whisper_full_with_state(
                     // overallocate to workaround KV cache fragmentation issues
                     const int factor = n_decoders_cur > 1 ? n_decoders_cur + 2 : 1;
 
-                    if (!whisper_kv_cache_init(state->kv_self, state->backends[0], ctx->itype,
+                    if (!whisper_kv_cache_init(state->kv_self, state->backends[0], whisper_kv_type_k(*ctx), whisper_kv_type_v(*ctx),
                                 ctx->model.hparams.n_text_state,
                                 ctx->model.hparams.n_text_layer,
                                 GGML_PAD(ctx->model.hparams.n_text_ctx, 256)*factor)) {
@@ -5675,31 +8546,108 @@ int whisper_full_with_state(
                     state->kv_self_n_dec = n_decoders_cur;
                 }
 
-                whisper_kv_cache_clear(state->kv_self);
+                // [EXPERIMENTAL] prompt cache
+                // the prefix shared with the last prompt of the state is restored instead of decoded, if the window is
+                // the same - at each temperature fallback, or when the same audio is transcribed again
+                // with DTW, the QKs of the prompt are needed, so it is always decoded
+                const bool use_prompt_cache = params.prompt_cache && !ctx->params.dtw_token_timestamps;
+
+                auto & pcache = state->prompt_cache;
+
+                int n_past = use_prompt_cache ? whisper_prompt_cache_match(*state, prompt) : 0;
+
+                // without the logits of the last token, it is decoded again
+                const bool is_full_hit = n_past == (int) prompt.size() && pcache.tokens.size() == prompt.size();
+                if (!is_full_hit && n_past == (int) prompt.size()) {
+                    n_past--;
+                }
+
+                if (n_past > 0) {
+                    whisper_kv_cache_seq_keep(state->kv_self, WHISPER_PROMPT_SEQ);
+                    whisper_kv_cache_seq_rm  (state->kv_self, WHISPER_PROMPT_SEQ, n_past, -1);
+                    whisper_kv_cache_seq_cp  (state->kv_self, WHISPER_PROMPT_SEQ, 0, -1, -1);
+                } else {
+                    whisper_kv_cache_clear(state->kv_self);
+                }
+
+                // estimated time of decoding the restored tokens
+                const int64_t t_past_us = n_past > 0 ? pcache.t_decode_us*n_past/(int64_t) pcache.tokens.size() : 0;
+
+                // row of the logits of the last prompt token
+                int i_last = prompt.size() - 1;
+
+                if (is_full_hit) {
+                    const size_t n_vocab = ctx->vocab.n_vocab;
+                    if (state->logits.size() < prompt.size()*n_vocab) {
+                        state->logits.resize(prompt.size()*n_vocab);
+                    }
+                    memcpy(state->logits.data() + i_last*n_vocab, pcache.logits.data(), n_vocab*sizeof(float));
+
+                    state->t_prompt_cache_saved_us += t_past_us;
+                    state->n_prompt_cache_hit++;
+                } else {
+                    const int64_t t_start_prompt_us = ggml_time_us();
+
+                    whisper_batch_prep_legacy(state->batch, prompt.data() + n_past, prompt.size() - n_past, n_past, 0);
+
+                    if (!whisper_decode_internal(*ctx, *state, state->batch, params.n_threads, ctx->params.dtw_token_timestamps, params.abort_callback, params.abort_callback_user_data)) {
+                        WHISPER_LOG_ERROR("%s: failed to decode\n", __func__);
+                        return -8;
+                    }
+
+                    i_last = prompt.size() - n_past - 1;
+
+                    if (use_prompt_cache) {
+                        if (n_past > 0) {
+                            state->t_prompt_cache_saved_us += t_past_us;
+                            state->n_prompt_cache_hit++;
+                        } else {
+                            state->n_prompt_cache_miss++;
+                        }
+
+                        // keep the KV of the prompt for the next attempt
+                        whisper_kv_cache_seq_rm(state->kv_self, WHISPER_PROMPT_SEQ, -1, -1);
+                        whisper_kv_cache_seq_cp(state->kv_self, 0, WHISPER_PROMPT_SEQ, -1, -1);
 
-                whisper_batch_prep_legacy(state->batch, prompt.data(), prompt.size(), 0, 0);
+                        const size_t n_vocab = ctx->vocab.n_vocab;
 
-                if (!whisper_decode_internal(*ctx, *state, state->batch, params.n_threads, false, params.abort_callback, params.abort_callback_user_data)) {
-                    WHISPER_LOG_ERROR("%s: failed to decode\n", __func__);
-                    return -8;
+                        pcache.enc_key     = state->enc_key;
+                        pcache.tokens      = prompt;
+                        pcache.t_decode_us = t_past_us + (ggml_time_us() - t_start_prompt_us);
+                        pcache.logits.assign(state->logits.begin() + i_last*n_vocab, state->logits.begin() + (i_last + 1)*n_vocab);
+                    }
+                }
+
+                // [EXPERIMENTAL] Token-level timestamps with DTW
+                // keep the QKs of the sot sequence, the rows of the previous attempt at this window are dropped
+                if (ctx->params.dtw_token_timestamps) {
+                    whisper_dtw_reset(*state);
+
+                    if (whisper_dtw_capture(*state, prompt.size() - prompt_init.size(), prompt_init.size())) {
+                        state->dtw.rows_sot = state->dtw.rows_new;
+                    }
                 }
 
                 // Calculate no_speech probability after first decode.
                 // This has to be done before any logit filtering. Hence we cannot use the probs from the whisper_process_logits.
                 {
-                    const int n_logits = ctx->vocab.id_to_token.size();
-                    std::vector<float> logprobs(n_logits);
-                    std::vector<float> probs(n_logits);
+                    const int     n_logits = ctx->vocab.size();
+                    const float * logits   = state->logits.data();
+
+                    float logit_max = -INFINITY;
+                    for (int i = 0; i < n_logits; ++i) {
+                        logit_max = std::max(logit_max, logits[i]);
+                    }
 
-                    whisper_compute_logprobs(state->logits, n_logits, logprobs);
-                    whisper_compute_probs(state->logits, n_logits, logprobs, probs);
-                    state->no_speech_prob = probs[whisper_token_nosp(ctx)];
+                    const float logsumexp = logf(whisper_logits_sumexp(logits, 0, n_logits, logit_max)) + logit_max;
+
+                    state->no_speech_prob = expf(logits[whisper_token_nosp(ctx)] - logsumexp);
                 }
 
                 {
                     const int64_t t_start_sample_us = ggml_time_us();
 
-                    state->decoders[0].i_batch = prompt.size() - 1;
+                    state->decoders[0].i_batch = i_last;
 
                     whisper_process_logits(*ctx, *state, state->decoders[0], params, t_cur);
 
@@ -5717,6 +8665,12 @@ int whisper_full_with_state(
                 }
             }
 
+            // [EXPERIMENTAL] speculative decoding, greedy at temperature 0 only, where the result stays the same
+            const bool use_draft_cur = use_draft && t_cur < 1e-6f;
+
+            state->draft.tokens.clear();
+            state->draft.i_next = 0;
+
             for (int i = 0, n_max = whisper_n_text_ctx(ctx)/2 - 4; i < n_max; ++i) {
                 const int64_t t_start_sample_us = ggml_time_us();
 
@@ -5727,7 +8681,7 @@ int whisper_full_with_state(
                 }
 
                 // sampling
-                // TODO: avoid memory allocations, optimize, avoid threads?
+                // TODO: avoid memory allocations, optimize
                 {
                     std::atomic<int> j_cur(0);
 
@@ -5749,21 +8703,19 @@ int whisper_full_with_state(
                                 case whisper_sampling_strategy::WHISPER_SAMPLING_GREEDY:
                                     {
                                         if (t_cur < 1e-6f) {
-                                            decoder.sequence.tokens.push_back(whisper_sample_token(*ctx, decoder, true));
+                                            decoder.sequence.tokens.push_back(whisper_sample_token(*ctx, decoder, params, true));
                                         } else {
-                                            decoder.sequence.tokens.push_back(whisper_sample_token(*ctx, decoder, false));
+                                            decoder.sequence.tokens.push_back(whisper_sample_token(*ctx, decoder, params, false));
                                         }
 
                                         decoder.sequence.sum_logprobs_all += decoder.sequence.tokens.back().plog;
                                     } break;
                                 case whisper_sampling_strategy::WHISPER_SAMPLING_BEAM_SEARCH:
                                     {
-                                        const auto tokens_new = whisper_sample_token_topk(*ctx, decoder, params.beam_search.beam_size);
+                                        whisper_sample_token_topk(*ctx, decoder, params, params.beam_search.beam_size);
 
-                                        for (const auto & token : tokens_new) {
-                                            bc_per_dec[j].push_back({ j, decoder.seek_delta, decoder.has_ts, decoder.sequence, decoder.grammar, });
-                                            bc_per_dec[j].back().sequence.tokens.push_back(token);
-                                            bc_per_dec[j].back().sequence.sum_logprobs_all += token.plog;
+                                        for (const auto & token : decoder.tokens_topk) {
+                                            bc_per_dec[j].push_back({ j, decoder.seek_delta, decoder.has_ts, token, decoder.sequence.sum_logprobs_all + token.plog, });
                                         }
                                     } break;
                             };
@@ -5772,19 +8724,18 @@ int whisper_full_with_state(
 
                     const int n_threads = std::min(params.n_threads, n_decoders_cur);
 
-                    if (n_threads == 1) {
-                        process();
-                    } else {
-                        std::vector<std::thread> threads(n_threads - 1);
-
-                        for (int t = 0; t < n_threads - 1; ++t) {
-                            threads[t] = std::thread(process);
-                        }
-
+                    // the decoders are spread over the threads of the state's threadpool
+                    // whatever is left if that fails is processed on this thread
+                    if (n_threads == 1 || !ggml_parallel_for_helper(n_threads, whisper_threadpool_acquire(*state, n_threads), [&](int, int) { process(); })) {
                         process();
+                    }
+                }
 
-                        for (int t = 0; t < n_threads - 1; ++t) {
-                            threads[t].join();
+                // greedy decoders sample one token each
+                if (params.strategy == whisper_sampling_strategy::WHISPER_SAMPLING_GREEDY) {
+                    for (int j = 0; j < n_decoders_cur; ++j) {
+                        if (!state->decoders[j].completed && !state->decoders[j].failed) {
+                            state->n_sample += 1;
                         }
                     }
                 }
@@ -5804,8 +8755,8 @@ int whisper_full_with_state(
                             beam_candidates.begin(),
                             beam_candidates.end(),
                             [](const beam_candidate & a, const beam_candidate & b) {
-                        if (a.sequence.sum_logprobs_all != b.sequence.sum_logprobs_all) {
-                            return a.sequence.sum_logprobs_all > b.sequence.sum_logprobs_all;
+                        if (a.sum_logprobs_all != b.sum_logprobs_all) {
+                            return a.sum_logprobs_all > b.sum_logprobs_all;
                         }
                         return a.decoder_idx < b.decoder_idx;
                     });
@@ -5825,19 +8776,27 @@ int whisper_full_with_state(
 
                         auto & cur = beam_candidates[cur_c++];
 
-                        while (beam_candidates.size() > cur_c && whisper_sequence_tokens_equal(beam_candidates[cur_c].sequence, cur.sequence) && i > 0) {
+                        while (beam_candidates.size() > cur_c && beam_candidate_equal(beam_candidates[cur_c], cur) && i > 0) {
                             ++cur_c;
                         }
 
+                        // the source decoders are not modified until all decoders are assigned
+                        const auto & src = state->decoders[cur.decoder_idx];
+
                         decoder.seek_delta = cur.seek_delta;
                         decoder.has_ts     = cur.has_ts;
-                        decoder.sequence   = cur.sequence;
-                        decoder.grammar    = cur.grammar;
+
+                        decoder.sequence_next = src.sequence;
+                        decoder.sequence_next.tokens.push_back(cur.token);
+                        decoder.sequence_next.sum_logprobs_all = cur.sum_logprobs_all;
+
+                        decoder.stacks_next       = src.grammar.stacks;
+                        decoder.partial_utf8_next = src.grammar.partial_utf8;
 
                         whisper_kv_cache_seq_cp(state->kv_self, cur.decoder_idx, WHISPER_MAX_DECODERS + j, -1, -1);
 
                         WHISPER_LOG_DEBUG("%s: beam search: decoder %d: from decoder %d: token = %10s, plog = %8.5f, sum_logprobs = %8.5f\n",
-                                __func__, j, cur.decoder_idx, ctx->vocab.id_to_token.at(decoder.sequence.tokens.back().id).c_str(), decoder.sequence.tokens.back().plog, decoder.sequence.sum_logprobs_all);
+                                __func__, j, cur.decoder_idx, ctx->vocab.text(cur.token.id), cur.token.plog, cur.sum_logprobs_all);
                     }
 
                     for (int j = 0; j < n_decoders_cur; ++j) {
@@ -5847,6 +8806,10 @@ int whisper_full_with_state(
                             continue;
                         }
 
+                        std::swap(decoder.sequence, decoder.sequence_next);
+                        std::swap(decoder.grammar.stacks, decoder.stacks_next);
+                        decoder.grammar.partial_utf8 = decoder.partial_utf8_next;
+
                         whisper_kv_cache_seq_rm(state->kv_self, j,                           -1, -1);
                         whisper_kv_cache_seq_cp(state->kv_self, WHISPER_MAX_DECODERS + j, j, -1, -1);
                         whisper_kv_cache_seq_rm(state->kv_self, WHISPER_MAX_DECODERS + j,    -1, -1);
@@ -5893,9 +8856,9 @@ int whisper_full_with_state(
 
 #ifdef WHISPER_DEBUG
                         {
-                            const auto tt = token.pt > 0.10 ? ctx->vocab.id_to_token.at(token.tid) : "[?]";
+                            const char * tt = token.pt > 0.10 ? ctx->vocab.text(token.tid) : "[?]";
                             WHISPER_LOG_DEBUG("%s: id = %3d, decoder = %d, token = %6d, p = %6.3f, ts = %10s, %6.3f, result_len = %4d '%s'\n",
-                                    __func__, i, j, token.id, token.p, tt.c_str(), token.pt, result_len, ctx->vocab.id_to_token.at(token.id).c_str());
+                                    __func__, i, j, token.id, token.p, tt, token.pt, result_len, ctx->vocab.text(token.id));
                         }
 #endif
 
@@ -5970,35 +8933,90 @@ int whisper_full_with_state(
 
                     const int n_past = prompt.size() + i;
 
-                    for (int j = 0; j < n_decoders_cur; ++j) {
-                        auto & decoder = state->decoders[j];
+                    // [EXPERIMENTAL] speculative decoding
+                    // if the sampled token is the next draft token, its logits were computed by the last verification batch
+                    // otherwise the KV of the rejected draft tokens is dropped and new ones are verified after the token
+                    bool is_drafted = false;
 
-                        if (decoder.failed || decoder.completed) {
-                            continue;
+                    if (use_draft_cur) {
+                        auto & draft   = state->draft;
+                        auto & decoder = state->decoders[0];
+
+                        if (draft.i_next < (int) draft.tokens.size() && draft.tokens[draft.i_next] == decoder.sequence.tokens.back().id) {
+                            decoder.i_batch = ++draft.i_next;
+                            state->n_draft_accept++;
+
+                            is_drafted = true;
+                        } else {
+                            whisper_kv_cache_seq_rm(state->kv_self, 0, n_past, -1);
+
+                            const int n_draft = std::min(params.draft_n_tokens, std::min(whisper_n_text_ctx(ctx) - 1 - n_past, n_max - 1 - i));
+
+                            draft.tokens.clear();
+
+                            if (n_draft > 0 && !whisper_draft_propose(*state, params, prompt, decoder, seek, n_draft)) {
+                                return -9;
+                            }
+                        }
+                    }
+
+                    if (!is_drafted) {
+                        for (int j = 0; j < n_decoders_cur; ++j) {
+                            auto & decoder = state->decoders[j];
+
+                            if (decoder.failed || decoder.completed) {
+                                continue;
+                            }
+
+                            //WHISPER_LOG_DEBUG("%s: decoder %d: token %d, seek_delta %d\n", __func__, j, decoder.sequence.tokens.back().id, decoder.seek_delta);
+
+                            decoder.i_batch = batch.n_tokens;
+
+                            batch.token   [batch.n_tokens]    = decoder.sequence.tokens.back().id;
+                            batch.pos     [batch.n_tokens]    = n_past;
+                            batch.n_seq_id[batch.n_tokens]    = 1;
+                            batch.seq_id  [batch.n_tokens][0] = j;
+                            batch.logits  [batch.n_tokens]    = 1;
+                            batch.n_tokens++;
                         }
 
-                        //WHISPER_LOG_DEBUG("%s: decoder %d: token %d, seek_delta %d\n", __func__, j, decoder.sequence.tokens.back().id, decoder.seek_delta);
+                        if (use_draft_cur) {
+                            for (const whisper_token id : state->draft.tokens) {
+                                batch.token   [batch.n_tokens]    = id;
+                                batch.pos     [batch.n_tokens]    = n_past + batch.n_tokens;
+                                batch.n_seq_id[batch.n_tokens]    = 1;
+                                batch.seq_id  [batch.n_tokens][0] = 0;
+                                batch.logits  [batch.n_tokens]    = 1;
+                                batch.n_tokens++;
+                            }
+                        }
 
-                        decoder.i_batch = batch.n_tokens;
+                        assert(batch.n_tokens > 0);
 
-                        batch.token   [batch.n_tokens]    = decoder.sequence.tokens.back().id;
-                        batch.pos     [batch.n_tokens]    = n_past;
-                        batch.n_seq_id[batch.n_tokens]    = 1;
-                        batch.seq_id  [batch.n_tokens][0] = j;
-                        batch.logits  [batch.n_tokens]    = 1;
-                        batch.n_tokens++;
+                        if (!whisper_decode_internal(*ctx, *state, state->batch, params.n_threads, ctx->params.dtw_token_timestamps, params.abort_callback, params.abort_callback_user_data)) {
+                            WHISPER_LOG_ERROR("%s: failed to decode\n", __func__);
+                            return -9;
+                        }
                     }
 
-                    assert(batch.n_tokens > 0);
+                    // [EXPERIMENTAL] Token-level timestamps with DTW
+                    if (ctx->params.dtw_token_timestamps) {
+                        const bool captured = whisper_dtw_capture(*state, 0, batch.n_tokens);
 
-                    if (!whisper_decode_internal(*ctx, *state, state->batch, params.n_threads, false, params.abort_callback, params.abort_callback_user_data)) {
-                        WHISPER_LOG_ERROR("%s: failed to decode\n", __func__);
-                        return -9;
+                        for (int j = 0; j < n_decoders_cur; ++j) {
+                            auto & decoder = state->decoders[j];
+
+                            if (decoder.failed || decoder.completed) {
+                                continue;
+                            }
+
+                            decoder.sequence.aheads_rows.push_back(captured ? state->dtw.rows_new[decoder.i_batch] : -1);
+                        }
                     }
 
                     const int64_t t_start_sample_us = ggml_time_us();
 
-                    // TODO: avoid memory allocations, optimize, avoid threads?
+                    // TODO: avoid memory allocations, optimize
                     {
                         std::atomic<int> j_cur(0);
 
@@ -6022,20 +9040,10 @@ int whisper_full_with_state(
 
                         const int n_threads = std::min(params.n_threads, n_decoders_cur);
 
-                        if (n_threads == 1) {
-                            process();
-                        } else {
-                            std::vector<std::thread> threads(n_threads - 1);
-
-                            for (int t = 0; t < n_threads - 1; ++t) {
-                                threads[t] = std::thread(process);
-                            }
-
+                        // the decoders are spread over the threads of the state's threadpool
+                        // whatever is left if that fails is processed on this thread
+                        if (n_threads == 1 || !ggml_parallel_for_helper(n_threads, whisper_threadpool_acquire(*state, n_threads), [&](int, int) { process(); })) {
                             process();
-
-                            for (int t = 0; t < n_threads - 1; ++t) {
-                                threads[t].join();
-                            }
                         }
                     }
 
@@ -6097,7 +9105,7 @@ int whisper_full_with_state(
 
             if (success) {
                 //for (auto & token : ctx->decoders[best_decoder_id].sequence.tokens) {
-                //    WHISPER_LOG_DEBUG("%s: token = %d, p = %6.3f, pt = %6.3f, ts = %s, str = %s\n", __func__, token.id, token.p, token.pt, ctx->vocab.id_to_token.at(token.tid).c_str(), ctx->vocab.id_to_token.at(token.id).c_str());
+                //    WHISPER_LOG_DEBUG("%s: token = %d, p = %6.3f, pt = %6.3f, ts = %s, str = %s\n", __func__, token.id, token.p, token.pt, ctx->vocab.text(token.tid), ctx->vocab.text(token.id));
                 //}
 
                 break;
@@ -6142,8 +9150,8 @@ int whisper_full_with_state(
 
                 for (int i = 0; i < (int) tokens_cur.size(); i++) {
                     //printf("%s: %18s %6.3f %18s %6.3f\n", __func__,
-                    //        ctx->vocab.id_to_token[tokens_cur[i].id].c_str(), tokens_cur[i].p,
-                    //        ctx->vocab.id_to_token[tokens_cur[i].tid].c_str(), tokens_cur[i].pt);
+                    //        ctx->vocab.text(tokens_cur[i].id), tokens_cur[i].p,
+                    //        ctx->vocab.text(tokens_cur[i].tid), tokens_cur[i].pt);
 
                     if (params.print_special || tokens_cur[i].id < whisper_token_eot(ctx)) {
                         text += whisper_token_to_str(ctx, tokens_cur[i].id);
@@ -6170,9 +9178,9 @@ int whisper_full_with_state(
                                 }
                             }
 
-                            //printf("tt0 = %d, tt1 = %d, text = %s, token = %s, token_id = %d, tid = %d\n", tt0, tt1, text.c_str(), ctx->vocab.id_to_token[tokens_cur[i].id].c_str(), tokens_cur[i].id, tokens_cur[i].tid);
+                            //printf("tt0 = %d, tt1 = %d, text = %s, token = %s, token_id = %d, tid = %d\n", tt0, tt1, text.c_str(), ctx->vocab.text(tokens_cur[i].id), tokens_cur[i].id, tokens_cur[i].tid);
 
-                            result_all.push_back({ tt0, tt1, text, state->no_speech_prob, {}, speaker_turn_next });
+                            result_all.push_back({ tt0, tt1, text, state->no_speech_prob, {}, speaker_turn_next, state->lang_id });
                             for (int j = i0; j <= i; j++) {
                                 result_all.back().tokens.push_back(tokens_cur[j]);
                             }
@@ -6217,7 +9225,7 @@ int whisper_full_with_state(
                         }
                     }
 
-                    result_all.push_back({ tt0, tt1, text, state->no_speech_prob, {}, speaker_turn_next });
+                    result_all.push_back({ tt0, tt1, text, state->no_speech_prob, {}, speaker_turn_next, state->lang_id });
                     for (int j = i0; j < (int) tokens_cur.size(); j++) {
                         result_all.back().tokens.push_back(tokens_cur[j]);
                     }
@@ -6245,7 +9253,7 @@ int whisper_full_with_state(
                 if (ctx->params.dtw_token_timestamps && n_segments) {
                     const int n_frames = std::min(std::min(WHISPER_CHUNK_SIZE * 100, seek_delta), seek_end - seek);
                     whisper_exp_compute_token_level_timestamps_dtw(
-                            ctx, state, params, result_all.size() - n_segments, n_segments, seek, n_frames, 7, params.n_threads);
+                            ctx, state, params, &best_decoder.sequence, result_all.size() - n_segments, n_segments, seek, n_frames, 7, params.n_threads);
                     if (params.new_segment_callback) {
                         for (int seg = (int) result_all.size() - n_segments; seg < n_segments; seg++) {
                             params.new_segment_callback(ctx, state, seg, params.new_segment_callback_user_data);
@@ -6254,31 +9262,403 @@ int whisper_full_with_state(
                 }
             }
 
-            // ref: https://github.com/ggerganov/whisper.cpp/pull/2629
-            const bool single_timestamp_ending = tokens_cur.size() > 1 &&
-                tokens_cur[tokens_cur.size() - 2].id < whisper_token_beg(ctx) &&
-                tokens_cur[tokens_cur.size() - 1].id > whisper_token_beg(ctx);
-            if (single_timestamp_ending) {
-                WHISPER_LOG_DEBUG("single timestamp ending - skip entire chunk\n");
-                seek_delta = std::min(seek_end - seek, WHISPER_CHUNK_SIZE * 100);
-            }
+            // ref: https://github.com/ggerganov/whisper.cpp/pull/2629
+            const bool single_timestamp_ending = tokens_cur.size() > 1 &&
+                tokens_cur[tokens_cur.size() - 2].id < whisper_token_beg(ctx) &&
+                tokens_cur[tokens_cur.size() - 1].id > whisper_token_beg(ctx);
+            if (single_timestamp_ending) {
+                WHISPER_LOG_DEBUG("single timestamp ending - skip entire chunk\n");
+                seek_delta = std::min(seek_end - seek, WHISPER_CHUNK_SIZE * 100);
+            }
+
+            // update audio window
+            seek += seek_delta;
+
+            WHISPER_LOG_DEBUG("seek = %d, seek_delta = %d\n", seek, seek_delta);
+        }
+    }
+
+    return 0;
+}
+
+int whisper_full(
+        struct whisper_context * ctx,
+    struct whisper_full_params   params,
+                   const float * samples,
+                           int   n_samples) {
+    return whisper_full_with_state(ctx, ctx->state, params, samples, n_samples);
+}
+
+// start of the quietest 100 ms window in [lo, hi), returned as the center of that window
+static int64_t whisper_quietest_point(const float * samples, int64_t lo, int64_t hi) {
+    const int64_t n_win  = WHISPER_SAMPLE_RATE/10;
+    const int64_t n_step = WHISPER_HOP_LENGTH;
+
+    if (hi - lo <= n_win) {
+        return (lo + hi)/2;
+    }
+
+    double energy = 0.0;
+    for (int64_t i = lo; i < lo + n_win; ++i) {
+        energy += samples[i]*samples[i];
+    }
+
+    double  energy_min = energy;
+    int64_t best       = lo;
+
+    for (int64_t s = lo + n_step; s + n_win <= hi; s += n_step) {
+        for (int64_t i = s - n_step; i < s; ++i) {
+            energy -= samples[i]*samples[i];
+        }
+        for (int64_t i = s + n_win - n_step; i < s + n_win; ++i) {
+            energy += samples[i]*samples[i];
+        }
+        if (energy < energy_min) {
+            energy_min = energy;
+            best       = s;
+        }
+    }
+
+    return best + n_win/2;
+}
+
+static void whisper_segment_update_text(struct whisper_context * ctx, whisper_segment & segment, bool print_special) {
+    segment.text.clear();
+    for (const auto & token : segment.tokens) {
+        if (print_special || token.id < whisper_token_eot(ctx)) {
+            segment.text += whisper_token_to_str(ctx, token.id);
+        }
+    }
+}
+
+// append the segments of the next chunk, which starts at t_beg and overlaps the merged result until t_split
+// the text decoded twice in the overlap is found as the longest common run of text tokens between the tail of the
+// merged result and the head of the next chunk - the merged result is kept up to the end of the run and the next
+// chunk continues after it
+// without such a run, the segments of the next chunk that end inside the overlap are dropped
+static void whisper_parallel_merge(
+        struct whisper_context * ctx,
+        std::vector<whisper_segment> & merged,
+        std::vector<whisper_segment> & next,
+                         int64_t   t_beg,
+                         int64_t   t_split,
+                            bool   print_special) {
+    const whisper_token token_eot = whisper_token_eot(ctx);
+
+    // (segment, token) positions of the text tokens near the boundary
+    std::vector<std::pair<int, int>> pos_a;
+    std::vector<std::pair<int, int>> pos_b;
+
+    for (int i = 0; i < (int) merged.size(); ++i) {
+        if (merged[i].t1 <= t_beg) {
+            continue;
+        }
+        for (int j = 0; j < (int) merged[i].tokens.size(); ++j) {
+            if (merged[i].tokens[j].id < token_eot) {
+                pos_a.emplace_back(i, j);
+            }
+        }
+    }
+
+    for (int i = 0; i < (int) next.size() && next[i].t0 < t_split; ++i) {
+        for (int j = 0; j < (int) next[i].tokens.size(); ++j) {
+            if (next[i].tokens[j].id < token_eot) {
+                pos_b.emplace_back(i, j);
+            }
+        }
+    }
+
+    auto id_a = [&](int k) { return merged[pos_a[k].first].tokens[pos_a[k].second].id; };
+    auto id_b = [&](int k) { return next  [pos_b[k].first].tokens[pos_b[k].second].id; };
+
+    // longest common run - the sequences are a few seconds of tokens, so O(n*m) is fine
+    int best_len = 0;
+    int best_end_a = -1;
+    int best_end_b = -1;
+    {
+        std::vector<int> prev(pos_b.size() + 1, 0);
+        std::vector<int> cur (pos_b.size() + 1, 0);
+        for (int a = 0; a < (int) pos_a.size(); ++a) {
+            for (int b = 0; b < (int) pos_b.size(); ++b) {
+                cur[b + 1] = id_a(a) == id_b(b) ? prev[b] + 1 : 0;
+                if (cur[b + 1] > best_len) {
+                    best_len   = cur[b + 1];
+                    best_end_a = a;
+                    best_end_b = b;
+                }
+            }
+            std::swap(prev, cur);
+        }
+    }
+
+    size_t i_next = 0;
+
+    if (best_len >= 2) {
+        // cut the merged result after the run
+        {
+            const int i_seg = pos_a[best_end_a].first;
+            const int i_tok = pos_a[best_end_a].second;
+
+            merged.resize(i_seg + 1);
+            auto & seg = merged.back();
+            if (i_tok + 1 < (int) seg.tokens.size()) {
+                seg.tokens.resize(i_tok + 1);
+                whisper_segment_update_text(ctx, seg, print_special);
+
+                // the segment ends with its last kept token, or at the split point without token timestamps
+                const int64_t t1_tok = seg.tokens.back().t1;
+                seg.t1 = std::min(seg.t1, t1_tok > seg.t0 ? t1_tok : std::max(seg.t0, t_split));
+            }
+        }
+
+        // continue the next chunk after the run
+        {
+            const int i_seg = pos_b[best_end_b].first;
+            const int i_tok = pos_b[best_end_b].second;
+
+            auto & seg = next[i_seg];
+            seg.tokens.erase(seg.tokens.begin(), seg.tokens.begin() + i_tok + 1);
+
+            bool has_text = false;
+            for (const auto & token : seg.tokens) {
+                has_text = has_text || token.id < token_eot;
+            }
+
+            if (has_text) {
+                whisper_segment_update_text(ctx, seg, print_special);
+                i_next = i_seg;
+            } else {
+                i_next = i_seg + 1;
+            }
+        }
+    } else {
+        while (i_next < next.size() && next[i_next].t1 <= t_split) {
+            ++i_next;
+        }
+    }
+
+    for (; i_next < next.size(); ++i_next) {
+        auto & seg = next[i_next];
+
+        // make sure that segments are not overlapping
+        if (!merged.empty()) {
+            seg.t0 = std::max(seg.t0, merged.back().t1);
+            seg.t1 = std::max(seg.t1, seg.t0);
+        }
+
+        merged.push_back(std::move(seg));
+    }
+}
+
+int whisper_full_parallel_with_states(
+        struct whisper_context * ctx,
+          struct whisper_state ** states,
+                           int   n_states,
+    struct whisper_full_params   params,
+                   const float * samples,
+                           int   n_samples,
+                           int   chunk_ms,
+                           int   overlap_ms) {
+    if (states == nullptr || n_states < 1) {
+        WHISPER_LOG_ERROR("%s: no states provided\n", __func__);
+        return -1;
+    }
+
+    const int64_t offset = std::min<int64_t>(n_samples, (int64_t) WHISPER_SAMPLE_RATE*params.offset_ms/1000);
+    const int64_t end    = params.duration_ms > 0 ? std::min<int64_t>(n_samples, offset + (int64_t) WHISPER_SAMPLE_RATE*params.duration_ms/1000) : n_samples;
+
+    const int64_t n_total   = end - offset;
+    const int64_t n_overlap = (int64_t) WHISPER_SAMPLE_RATE*(overlap_ms > 0 ? overlap_ms : 2000)/1000;
+
+    // by default, two chunks per state so that faster states can pick up the remaining work, but never less than
+    // one full window
+    int64_t n_chunk = chunk_ms > 0 ? (int64_t) WHISPER_SAMPLE_RATE*chunk_ms/1000 : n_total/(2*n_states) + 1;
+    n_chunk = std::max<int64_t>(n_chunk, std::max<int64_t>(WHISPER_CHUNK_SIZE*WHISPER_SAMPLE_RATE, 4*n_overlap));
+
+    const int n_chunks = (int) std::max<int64_t>(1, (n_total + n_chunk/2)/n_chunk);
+
+    if (n_chunks == 1) {
+        return whisper_full_with_state(ctx, states[0], params, samples, n_samples);
+    }
+
+    // move each nominal boundary to the quietest point within 1/8 of a chunk of it
+    std::vector<int64_t> bounds = { offset };
+    {
+        const int64_t n_search = n_chunk/8;
+        for (int k = 1; k < n_chunks; ++k) {
+            const int64_t nominal = offset + n_total*k/n_chunks;
+            const int64_t lo = std::max(bounds.back() + n_chunk/2, nominal - n_search);
+            const int64_t hi = std::min(end - n_chunk/2, nominal + n_search);
+
+            bounds.push_back(hi > lo ? whisper_quietest_point(samples, lo, hi) : nominal);
+        }
+        bounds.push_back(end);
+    }
+
+    const int n_workers = std::min(n_states, n_chunks);
+
+    std::vector<std::vector<whisper_segment>> results(n_chunks);
+    std::vector<int> rets   (n_chunks, 0);
+    std::vector<int> lang_id(n_chunks, -1);
+
+    std::atomic<int> i_next(0);
+    std::atomic<int> n_done(0);
+    std::atomic<bool> failed(false);
+
+    std::mutex progress_mutex;
+
+    auto worker = [&](int i_state) {
+        whisper_state * state = states[i_state];
+
+        while (!failed) {
+            const int k = i_next++;
+            if (k >= n_chunks) {
+                break;
+            }
+
+            // every chunk but the first starts n_overlap samples before its boundary
+            const int64_t s0 = k == 0 ? bounds[0] : std::max(offset, bounds[k] - n_overlap);
+            const int64_t s1 = bounds[k + 1];
+
+            auto params_cur = params;
+
+            params_cur.offset_ms      = 0;
+            params_cur.duration_ms    = 0;
+            params_cur.print_progress = false;
+            params_cur.print_realtime = false;
+
+            params_cur.new_segment_callback           = nullptr;
+            params_cur.new_segment_callback_user_data = nullptr;
+
+            params_cur.progress_callback           = nullptr;
+            params_cur.progress_callback_user_data = nullptr;
+
+            rets[k] = whisper_full_with_state(ctx, state, params_cur, samples + s0, (int) (s1 - s0));
+            if (rets[k] != 0) {
+                failed = true;
+                break;
+            }
+
+            lang_id[k] = state->lang_id;
+            results[k] = std::move(state->result_all);
+            state->result_all.clear();
+
+            // chunk-relative timestamps to absolute ones, within the audio of the chunk
+            const int64_t t_shift = 100*s0/WHISPER_SAMPLE_RATE;
+            const int64_t t_end   = 100*s1/WHISPER_SAMPLE_RATE;
+            for (auto & seg : results[k]) {
+                seg.t0 = std::min(seg.t0 + t_shift, t_end);
+                seg.t1 = std::min(seg.t1 + t_shift, t_end);
+                for (auto & token : seg.tokens) {
+                    if (token.t0 >= 0) {
+                        token.t0 += t_shift;
+                    }
+                    if (token.t1 >= 0) {
+                        token.t1 += t_shift;
+                    }
+                    if (token.t_dtw >= 0) {
+                        token.t_dtw += t_shift;
+                    }
+                }
+            }
+
+            // reported with the state of this worker, which is idle until it takes the next chunk
+            if (params.progress_callback) {
+                std::lock_guard<std::mutex> lock(progress_mutex);
+                params.progress_callback(ctx, state, 100*(++n_done)/n_chunks, params.progress_callback_user_data);
+            }
+        }
+    };
+
+    {
+        std::vector<std::thread> workers(n_workers - 1);
+        for (int i = 0; i < n_workers - 1; ++i) {
+            workers[i] = std::thread(worker, i + 1);
+        }
+
+        // the calling thread works with the first state
+        worker(0);
+
+        for (auto & w : workers) {
+            w.join();
+        }
+    }
+
+    for (int k = 0; k < n_chunks; ++k) {
+        if (rets[k] != 0) {
+            WHISPER_LOG_ERROR("%s: failed to process chunk %d / %d\n", __func__, k + 1, n_chunks);
+            return rets[k];
+        }
+    }
+
+    auto * result = states[0];
+
+    result->result_all = std::move(results[0]);
+    result->lang_id    = lang_id[0];
+
+    for (int k = 1; k < n_chunks; ++k) {
+        const int64_t t_beg   = 100*std::max(offset, bounds[k] - n_overlap)/WHISPER_SAMPLE_RATE;
+        const int64_t t_split = 100*bounds[k]/WHISPER_SAMPLE_RATE;
+
+        whisper_parallel_merge(ctx, result->result_all, results[k], t_beg, t_split, params.print_special);
+    }
+
+    for (int i = 1; i < n_workers; ++i) {
+        result->t_mel_us    += states[i]->t_mel_us;
+        result->t_sample_us += states[i]->t_sample_us;
+        result->t_encode_us += states[i]->t_encode_us;
+        result->t_decode_us += states[i]->t_decode_us;
+        result->t_batchd_us += states[i]->t_batchd_us;
+        result->t_prompt_us += states[i]->t_prompt_us;
+
+        result->n_sample += states[i]->n_sample;
+        result->n_encode += states[i]->n_encode;
+        result->n_decode += states[i]->n_decode;
+        result->n_batchd += states[i]->n_batchd;
+        result->n_prompt += states[i]->n_prompt;
+
+        result->t_enc_cache_saved_us += states[i]->t_enc_cache_saved_us;
+        result->n_enc_cache_hit      += states[i]->n_enc_cache_hit;
+        result->n_enc_cache_miss     += states[i]->n_enc_cache_miss;
+
+        result->n_silence_skip   += states[i]->n_silence_skip;
+        result->n_silence_frames += states[i]->n_silence_frames;
+
+        result->n_graph_build   += states[i]->n_graph_build;
+        result->n_graph_reuse   += states[i]->n_graph_reuse;
+        result->n_graph_realloc += states[i]->n_graph_realloc;
+
+        result->t_dtw_us       += states[i]->t_dtw_us;
+        result->n_dtw          += states[i]->n_dtw;
+        result->n_dtw_redecode += states[i]->n_dtw_redecode;
 
-            // update audio window
-            seek += seek_delta;
+        result->t_prompt_cache_saved_us += states[i]->t_prompt_cache_saved_us;
+        result->n_prompt_cache_hit      += states[i]->n_prompt_cache_hit;
+        result->n_prompt_cache_miss     += states[i]->n_prompt_cache_miss;
 
-            WHISPER_LOG_DEBUG("seek = %d, seek_delta = %d\n", seek, seek_delta);
-        }
+        result->t_draft_us     += states[i]->t_draft_us;
+        result->n_draft        += states[i]->n_draft;
+        result->n_draft_accept += states[i]->n_draft_accept;
     }
 
-    return 0;
-}
+    // average the timings
+    result->t_mel_us    /= n_workers;
+    result->t_sample_us /= n_workers;
+    result->t_encode_us /= n_workers;
+    result->t_decode_us /= n_workers;
+    result->t_draft_us  /= n_workers;
 
-int whisper_full(
-        struct whisper_context * ctx,
-    struct whisper_full_params   params,
-                   const float * samples,
-                           int   n_samples) {
-    return whisper_full_with_state(ctx, ctx->state, params, samples, n_samples);
+    // the segments are only known once all chunks are merged, they are reported at once
+    if (params.new_segment_callback && !result->result_all.empty()) {
+        params.new_segment_callback(ctx, result, (int) result->result_all.size(), params.new_segment_callback_user_data);
+    }
+
+    WHISPER_LOG_INFO("%s: processed %d chunks on %d states, split at:\n", __func__, n_chunks, n_workers);
+    for (int k = 1; k < n_chunks; ++k) {
+        WHISPER_LOG_INFO("%s: split %d - %s\n", __func__, k, to_timestamp(100*bounds[k]/WHISPER_SAMPLE_RATE).c_str());
+    }
+
+    return 0;
 }
 
 int whisper_full_parallel(
@@ -6287,113 +9667,235 @@ int whisper_full_parallel(
         const float * samples,
         int n_samples,
         int n_processors) {
-    if (n_processors == 1) {
+    if (n_processors <= 1) {
         return whisper_full(ctx, params, samples, n_samples);
     }
-    int ret = 0;
 
-    // prepare separate states for each thread
-    std::vector<whisper_state*> states;
+    // the default state collects the result, the other chunks are processed on temporary states
+    std::vector<whisper_state *> states = { ctx->state };
+    for (int i = 1; i < n_processors; ++i) {
+        whisper_state * state = whisper_init_state(ctx);
+        if (state == nullptr) {
+            WHISPER_LOG_WARN("%s: failed to create state %d, using %d processors\n", __func__, i, i);
+            break;
+        }
+        states.push_back(state);
+    }
 
-    const int offset_samples = (WHISPER_SAMPLE_RATE*params.offset_ms)/1000;
-    const int n_samples_per_processor = (n_samples - offset_samples)/n_processors;
+    const int ret = whisper_full_parallel_with_states(ctx, states.data(), (int) states.size(), params, samples, n_samples, 0, 0);
 
-    // the calling thread will process the first chunk
-    // while the other threads will process the remaining chunks
+    for (size_t i = 1; i < states.size(); ++i) {
+        whisper_free_state(states[i]);
+    }
 
-    std::vector<std::thread> workers(n_processors - 1);
-    for (int i = 0; i < n_processors - 1; ++i) {
-        // create a new state for each thread
-        states.push_back(whisper_init_state(ctx));
+    return ret;
+}
 
-        const int start_samples = offset_samples + (i + 1)*n_samples_per_processor;
-        const int n_samples_cur = (i == n_processors - 2) ? n_samples - start_samples : n_samples_per_processor;
+int whisper_score_with_state(
+        struct whisper_context * ctx,
+          struct whisper_state * state,
+           const whisper_token * prompt,
+                           int   n_prompt,
+   const whisper_token * const * candidates,
+                     const int * n_candidate_tokens,
+                           int   n_candidates,
+                         float * logprobs,
+                           int   n_threads) {
+    const auto & hparams = ctx->model.hparams;
+
+    const int n_vocab    = hparams.n_vocab;
+    const int n_text_ctx = hparams.n_text_ctx;
+
+    if (prompt == nullptr || n_prompt <= 0 || n_candidates < 0 || (n_candidates > 0 && (candidates == nullptr || n_candidate_tokens == nullptr || logprobs == nullptr))) {
+        WHISPER_LOG_ERROR("%s: invalid arguments\n", __func__);
+        return -1;
+    }
 
-        auto params_cur = params;
+    for (int c = 0; c < n_candidates; ++c) {
+        if (n_candidate_tokens[c] < 0 || n_prompt + n_candidate_tokens[c] > n_text_ctx) {
+            WHISPER_LOG_ERROR("%s: candidate %d does not fit in the text context (%d + %d > %d)\n", __func__,
+                    c, n_prompt, n_candidate_tokens[c], n_text_ctx);
+            return -1;
+        }
+        for (int k = 0; k < n_candidate_tokens[c]; ++k) {
+            if (candidates[c][k] < 0 || candidates[c][k] >= n_vocab) {
+                WHISPER_LOG_ERROR("%s: invalid token %d in candidate %d\n", __func__, candidates[c][k], c);
+                return -1;
+            }
+        }
+    }
 
-        params_cur.offset_ms = 0;
-        params_cur.print_progress = false;
-        params_cur.print_realtime = false;
+    auto & kv_self = state->kv_self;
 
-        params_cur.new_segment_callback = nullptr;
-        params_cur.new_segment_callback_user_data = nullptr;
+    // the prompt goes to sequence 0 and is decoded once, the candidates take the place of the prompt cache
+    whisper_kv_cache_clear(kv_self);
+    state->prompt_cache.tokens.clear();
 
-        params_cur.progress_callback = nullptr;
-        params_cur.progress_callback_user_data = nullptr;
+    whisper_batch_prep_legacy(state->batch, prompt, n_prompt, 0, 0);
 
-        workers[i] = std::thread(whisper_full_with_state, ctx, states[i], std::move(params_cur), samples + start_samples, n_samples_cur);
+    if (!whisper_decode_internal(*ctx, *state, state->batch, n_threads, false, nullptr, nullptr)) {
+        WHISPER_LOG_ERROR("%s: failed to decode the prompt\n", __func__);
+        return -2;
     }
 
-    {
-        auto params_cur = params;
+    // log-probabilities of the first token of each candidate
+    std::vector<float> logits_root(state->logits.begin() + (size_t) n_vocab*(n_prompt - 1), state->logits.begin() + (size_t) n_vocab*n_prompt);
 
-        // We need to disable the print real-time for this one as well, otherwise it will show only for the first chunk.
-        params_cur.print_realtime = false;
+    const float max_root = whisper_logits_mask(logits_root.data(), logits_root.data(), nullptr, 0, n_vocab, 0.0f);
+    const float lse_root = logf(whisper_logits_sumexp(logits_root.data(), 0, n_vocab, max_root)) + max_root;
 
-        // Run the first transformation using default state but only for the first chunk.
-        ret = whisper_full_with_state(ctx, ctx->state, std::move(params_cur), samples, offset_samples + n_samples_per_processor);
+    if (state->batch_score.token == nullptr) {
+        state->batch_score = whisper_batch_init(n_text_ctx, WHISPER_MAX_SEQ);
     }
 
-    for (int i = 0; i < n_processors - 1; ++i) {
-        workers[i].join();
+    auto & batch = state->batch_score;
+
+    // in lexicographic order, the candidates sharing a prefix are next to each other
+    std::vector<int> order(n_candidates);
+    for (int c = 0; c < n_candidates; ++c) {
+        order[c] = c;
     }
+    std::sort(order.begin(), order.end(), [&](int a, int b) {
+        return std::lexicographical_compare(candidates[a], candidates[a] + n_candidate_tokens[a],
+                                            candidates[b], candidates[b] + n_candidate_tokens[b]);
+    });
+
+    // each chunk decodes the trie of up to WHISPER_MAX_SEQ - 1 candidates in a single batch:
+    // a node is one token of the batch, in the sequences of all candidates going through it
+    const int n_seq_max  = WHISPER_MAX_SEQ - 1;
+    const int n_node_max = std::min(n_text_ctx, (int) kv_self.size - n_prompt);
+
+    std::vector<int32_t> parent(n_node_max); // -1 for the children of the root
+    std::vector<int32_t> node_end(n_seq_max);
+    std::vector<float>   lse(n_node_max);
+    std::vector<int32_t> path;
+
+    int n_seq_prev = 0;
 
-    const int64_t offset_t = (int64_t) params.offset_ms/10.0;
+    for (int i0 = 0; i0 < n_candidates; ) {
+        int n_seq  = 0;
+        int n_node = 0;
+        int i1     = i0;
 
-    // combine results into result_state->result_all from all other states
-    for (int i = 0; i < n_processors - 1; ++i) {
-        auto& results_i = states[i]->result_all;
+        path.clear();
 
-        for (auto& result : results_i) {
-            // correct the segment timestamp taking into account the offset
-            result.t0 += 100 * ((i + 1) * n_samples_per_processor) / WHISPER_SAMPLE_RATE + offset_t;
-            result.t1 += 100 * ((i + 1) * n_samples_per_processor) / WHISPER_SAMPLE_RATE + offset_t;
+        for (; i1 < n_candidates && n_seq < n_seq_max; ++i1) {
+            const int c = order[i1];
 
-            // make sure that segments are not overlapping
-            if (!ctx->state->result_all.empty()) {
-                result.t0 = std::max(result.t0, ctx->state->result_all.back().t1);
+            const whisper_token * tokens = candidates[c];
+            const int n_tokens = n_candidate_tokens[c];
+
+            if (n_tokens == 0) {
+                logprobs[c] = 0.0f;
+                continue;
+            }
+
+            // length of the prefix shared with the previous candidate of the chunk
+            int n_common = 0;
+            while (n_common < (int) path.size() && n_common < n_tokens && batch.token[path[n_common]] == tokens[n_common]) {
+                ++n_common;
             }
 
-            ctx->state->result_all.push_back(std::move(result));
+            if (n_node + n_tokens - n_common > n_node_max) {
+                break;
+            }
+
+            path.resize(n_common);
+
+            const whisper_seq_id seq_id = 1 + n_seq;
 
-            // call the new_segment_callback for each segment
-            if (params.new_segment_callback) {
-                params.new_segment_callback(ctx, ctx->state, 1, params.new_segment_callback_user_data);
+            for (int k = 0; k < n_tokens; ++k) {
+                if (k >= n_common) {
+                    const int i = n_node++;
+
+                    batch.token   [i] = tokens[k];
+                    batch.pos     [i] = n_prompt + k;
+                    batch.n_seq_id[i] = 0;
+                    batch.logits  [i] = 0;
+
+                    parent[i] = k == 0 ? -1 : path[k - 1];
+                    if (k > 0) {
+                        batch.logits[path[k - 1]] = 1;
+                    }
+
+                    path.push_back(i);
+                }
+
+                const int i = path[k];
+                batch.seq_id[i][batch.n_seq_id[i]++] = seq_id;
             }
+
+            node_end[n_seq++] = path.back();
         }
 
-        ctx->state->t_mel_us += states[i]->t_mel_us;
+        if (n_node > 0) {
+            batch.n_tokens = n_node;
+
+            // the candidate sequences start from a copy of the prompt
+            for (int s = 1; s <= n_seq_prev; ++s) {
+                whisper_kv_cache_seq_rm(kv_self, s, -1, -1);
+            }
+            for (int s = 1; s <= n_seq; ++s) {
+                whisper_kv_cache_seq_cp(kv_self, 0, s, -1, -1);
+            }
+            n_seq_prev = n_seq;
 
-        ctx->state->t_sample_us += states[i]->t_sample_us;
-        ctx->state->t_encode_us += states[i]->t_encode_us;
-        ctx->state->t_decode_us += states[i]->t_decode_us;
-        ctx->state->t_batchd_us += states[i]->t_batchd_us;
-        ctx->state->t_prompt_us += states[i]->t_prompt_us;
+            if (!whisper_decode_internal(*ctx, *state, batch, n_threads, false, nullptr, nullptr)) {
+                WHISPER_LOG_ERROR("%s: failed to decode the candidates\n", __func__);
+                return -2;
+            }
 
-        ctx->state->n_sample += states[i]->n_sample;
-        ctx->state->n_encode += states[i]->n_encode;
-        ctx->state->n_decode += states[i]->n_decode;
-        ctx->state->n_batchd += states[i]->n_batchd;
-        ctx->state->n_prompt += states[i]->n_prompt;
+            for (int i = 0; i < n_node; ++i) {
+                if (batch.logits[i]) {
+                    float * row = state->logits.data() + (size_t) n_vocab*i;
 
-        whisper_free_state(states[i]);
+                    const float max = whisper_logits_mask(row, row, nullptr, 0, n_vocab, 0.0f);
+                    lse[i] = logf(whisper_logits_sumexp(row, 0, n_vocab, max)) + max;
+                }
+            }
+
+            // sum the log-probabilities along the path of each candidate
+            for (int s = 0, i = i0; i < i1; ++i) {
+                const int c = order[i];
+                if (n_candidate_tokens[c] == 0) {
+                    continue;
+                }
+
+                float sum = 0.0f;
+                for (int32_t node = node_end[s++]; node >= 0; node = parent[node]) {
+                    const int32_t p = parent[node];
+                    if (p < 0) {
+                        sum += logits_root[batch.token[node]] - lse_root;
+                    } else {
+                        sum += state->logits[(size_t) n_vocab*p + batch.token[node]] - lse[p];
+                    }
+                }
+
+                logprobs[c] = sum;
+            }
+        }
+
+        i0 = i1;
     }
 
-    // average the timings
-    ctx->state->t_mel_us    /= n_processors;
-    ctx->state->t_sample_us /= n_processors;
-    ctx->state->t_encode_us /= n_processors;
-    ctx->state->t_decode_us /= n_processors;
+    return 0;
+}
 
-    // print information about the audio boundaries
-    WHISPER_LOG_WARN("\n");
-    WHISPER_LOG_WARN("%s: the audio has been split into %d chunks at the following times:\n", __func__, n_processors);
-    for (int i = 0; i < n_processors - 1; ++i) {
-        WHISPER_LOG_WARN("%s: split %d - %s\n", __func__, (i + 1), to_timestamp(100*((i + 1)*n_samples_per_processor)/WHISPER_SAMPLE_RATE + offset_t).c_str());
+int whisper_score(
+        struct whisper_context * ctx,
+           const whisper_token * prompt,
+                           int   n_prompt,
+   const whisper_token * const * candidates,
+                     const int * n_candidate_tokens,
+                           int   n_candidates,
+                         float * logprobs,
+                           int   n_threads) {
+    if (ctx->state == nullptr) {
+        WHISPER_LOG_ERROR("%s: ERROR state was not loaded.\n", __func__);
+        return -1;
     }
-    WHISPER_LOG_WARN("%s: the transcription quality may be degraded near these boundaries\n", __func__);
 
-    return ret;
+    return whisper_score_with_state(ctx, ctx->state, prompt, n_prompt, candidates, n_candidate_tokens, n_candidates, logprobs, n_threads);
 }
 
 int whisper_full_n_segments_from_state(struct whisper_state * state) {
@@ -6453,11 +9955,11 @@ int whisper_full_n_tokens(struct whisper_context * ctx, int i_segment) {
 }
 
 const char * whisper_full_get_token_text_from_state(struct whisper_context * ctx, struct whisper_state * state, int i_segment, int i_token) {
-    return ctx->vocab.id_to_token[state->result_all[i_segment].tokens[i_token].id].c_str();
+    return ctx->vocab.text(state->result_all[i_segment].tokens[i_token].id);
 }
 
 const char* whisper_full_get_token_text(struct whisper_context * ctx, int i_segment, int i_token) {
-    return ctx->vocab.id_to_token[ctx->state->result_all[i_segment].tokens[i_token].id].c_str();
+    return ctx->vocab.text(ctx->state->result_all[i_segment].tokens[i_token].id);
 }
 
 whisper_token whisper_full_get_token_id_from_state(struct whisper_state * state, int i_segment, int i_token) {
@@ -6484,6 +9986,14 @@ float whisper_full_get_token_p(struct whisper_context * ctx, int i_segment, int
     return ctx->state->result_all[i_segment].tokens[i_token].p;
 }
 
+int whisper_full_get_segment_lang_id_from_state(struct whisper_state * state, int i_segment) {
+    return state->result_all[i_segment].lang_id;
+}
+
+int whisper_full_get_segment_lang_id(struct whisper_context * ctx, int i_segment) {
+    return ctx->state->result_all[i_segment].lang_id;
+}
+
 float whisper_full_get_segment_no_speech_prob(struct whisper_context * ctx, int i_segment) {
     return ctx->state->result_all[i_segment].no_speech_prob;
 }
@@ -6657,116 +10167,431 @@ WHISPER_API const char * whisper_bench_ggml_mul_mat_str(int n_threads) {
     s = "";
     char strbuf[256];
 
-    ggml_time_init();
+    ggml_time_init();
+
+    const int n_max = 128;
+
+    const std::vector<size_t> sizes = {
+        64, 128, 256, 512, 1024, 2048, 4096,
+    };
+
+    const size_t N_max = sizes.back();
+
+    // a: N*N*sizeof(float)
+    // b: N*N*sizeof(float)
+    // c: N*N*sizeof(float)
+    // when F16 is used, there is an extra work buffer of size N*N*sizeof(float)
+    std::vector<uint8_t> buf(3llu*N_max*N_max*sizeof(float) + 3*ggml_tensor_overhead() + ggml_graph_overhead());
+    std::vector<uint8_t> work;
+
+    // put a bunch of random data in the buffer
+    for (size_t i = 0; i < buf.size(); i++) buf[i] = i;
+
+    for (int j = 0; j < (int) sizes.size(); j++) {
+        int n_q4_0 = 0;
+        int n_q4_1 = 0;
+        int n_q5_0 = 0;
+        int n_q5_1 = 0;
+        int n_q8_0 = 0;
+        int n_fp16 = 0;
+        int n_fp32 = 0;
+
+        // GFLOPS/s
+        double s_q4_0 = 0.0;
+        double s_q4_1 = 0.0;
+        double s_q5_0 = 0.0;
+        double s_q5_1 = 0.0;
+        double s_q8_0 = 0.0;
+        double s_fp16 = 0.0;
+        double s_fp32 = 0.0;
+
+        const size_t N = sizes[j];
+
+        for (int k = 0; k < 7; ++k) {
+            const ggml_type wtype =
+                k == 0 ? GGML_TYPE_Q4_0 :
+                k == 1 ? GGML_TYPE_Q4_1 :
+                k == 2 ? GGML_TYPE_Q5_0 :
+                k == 3 ? GGML_TYPE_Q5_1 :
+                k == 4 ? GGML_TYPE_Q8_0 :
+                k == 5 ? GGML_TYPE_F16  : GGML_TYPE_F32;
+
+            double & s = k == 0 ? s_q4_0 : k == 1 ? s_q4_1 : k == 2 ? s_q5_0 : k == 3 ? s_q5_1 : k == 4 ? s_q8_0 : k == 5 ? s_fp16 : /*k == 6*/ s_fp32;
+            int    & n = k == 0 ? n_q4_0 : k == 1 ? n_q4_1 : k == 2 ? n_q5_0 : k == 3 ? n_q5_1 : k == 4 ? n_q8_0 : k == 5 ? n_fp16 : /*k == 6*/ n_fp32;
+
+            struct ggml_init_params gparams = {
+                /*.mem_size   =*/ buf.size(),
+                /*.mem_buffer =*/ buf.data(),
+                /*.no_alloc   =*/ false,
+            };
+
+            struct ggml_context * ctx0 = ggml_init(gparams);
+
+            struct ggml_tensor * a = ggml_new_tensor_2d(ctx0, wtype,         N, N);
+            struct ggml_tensor * b = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, N, N);
+
+            struct ggml_tensor * c = ggml_mul_mat(ctx0, a, b);
+
+            struct ggml_cgraph * gf = ggml_new_graph(ctx0);
+
+            ggml_build_forward_expand(gf, c);
+
+            double tsum = 0.0;
+
+            // heat-up
+            ggml_graph_compute_helper(gf, work, n_threads, nullptr, nullptr);
+
+            for (int i = 0; i < n_max; ++i) {
+                const int64_t t0 = ggml_time_us();
+
+                ggml_graph_compute_helper(gf, work, n_threads, nullptr, nullptr);
+
+                const int64_t t1 = ggml_time_us();
+
+                tsum += (t1 - t0)*1e-6;
+                n++;
+
+                if (tsum > 1.0 && n >= 3) {
+                    break;
+                }
+            }
+
+            ggml_free(ctx0);
+
+            s = ((2.0*N*N*N*n)/tsum)*1e-9;
+        }
+
+        // Q4_0 | Q4_1
+        snprintf(strbuf, sizeof(strbuf), "%4zu x %4zu: Q4_0 %7.1f GFLOPS (%3d runs) | Q4_1 %7.1f GFLOPS (%3d runs)\n",
+                N, N, s_q4_0, n_q4_0, s_q4_1, n_q4_1);
+        s += strbuf;
+
+        // Q5_0 | Q5_1 | Q8_0
+        snprintf(strbuf, sizeof(strbuf), "%4zu x %4zu: Q5_0 %7.1f GFLOPS (%3d runs) | Q5_1 %7.1f GFLOPS (%3d runs) | Q8_0 %7.1f GFLOPS (%3d runs)\n",
+                N, N, s_q5_0, n_q5_0, s_q5_1, n_q5_1, s_q8_0, n_q8_0);
+        s += strbuf;
+
+        // F16 | F32
+        snprintf(strbuf, sizeof(strbuf), "%4zu x %4zu: F16  %7.1f GFLOPS (%3d runs) | F32  %7.1f GFLOPS (%3d runs)\n",
+                N, N, s_fp16, n_fp16, s_fp32, n_fp32);
+        s += strbuf;
+    }
+
+    return s.c_str();
+}
+
+WHISPER_API int whisper_bench_logits(void) {
+    fputs(whisper_bench_logits_str(), stderr);
+    return 0;
+}
+
+// the logit pipeline of whisper_process_logits() on random logits of the size of the multilingual vocabulary:
+// the previous scalar implementation (ref) against the vectorized kernels with the precomputed suppression mask
+WHISPER_API const char * whisper_bench_logits_str(void) {
+    static std::string s;
+    s = "";
+    char strbuf[256];
+
+    ggml_time_init();
+
+    const int n_logits = 51865;
+    const int n_text   = 50364; // token_beg
+    const int n_eot    = 50257;
+
+    std::mt19937 rng(42);
+    std::normal_distribution<float> dist(0.0f, 4.0f);
+
+    std::vector<float> src(n_logits);
+    for (auto & v : src) {
+        v = dist(rng);
+    }
+    src[n_text + 7] = 24.0f; // the timestamps win unless this one is suppressed
+
+    // special tokens and a scattered set of suppressed text tokens (non-speech, regex)
+    std::vector<int> suppressed;
+    for (int i = n_eot + 1; i < n_text; ++i) {
+        suppressed.push_back(i);
+    }
+    for (int i = 0; i < 90; ++i) {
+        suppressed.push_back(rng() % n_eot);
+    }
+
+    std::vector<uint32_t> mask((n_logits + 31)/32, 0);
+    for (int id : suppressed) {
+        whisper_bitmask_set(mask, id);
+    }
+
+    std::vector<float> logits_ref(n_logits), logprobs_ref(n_logits), probs_ref(n_logits);
+    std::vector<float> logits_new(n_logits), logprobs_new(n_logits), probs_new(n_logits);
+
+    auto run_ref = [&](float temperature, int ts_min) {
+        auto & logits   = logits_ref;
+        auto & logprobs = logprobs_ref;
+        auto & probs    = probs_ref;
+
+        memcpy(logits.data(), src.data(), n_logits*sizeof(float));
+        if (temperature > 0.0f) {
+            for (int i = 0; i < n_logits; i++) {
+                logits[i] /= temperature;
+            }
+        }
+        for (int id : suppressed) {
+            logits[id] = -INFINITY;
+        }
+        for (int i = n_text; i < n_text + ts_min; ++i) {
+            logits[i] = -INFINITY;
+        }
+
+        const float logit_max = *std::max_element(logits.begin(), logits.end());
+        float logsumexp = 0.0f;
+        for (int i = 0; i < n_logits; ++i) {
+            if (logits[i] > -INFINITY) {
+                logsumexp += expf(logits[i] - logit_max);
+            }
+        }
+        logsumexp = logf(logsumexp) + logit_max;
+        for (int i = 0; i < n_logits; ++i) {
+            logprobs[i] = logits[i] > -INFINITY ? logits[i] - logsumexp : -INFINITY;
+        }
+
+        float timestamp_logprob = -INFINITY;
+        {
+            float sum = 0.0f;
+            const float logprob_max = *std::max_element(logprobs.begin() + n_text, logprobs.end());
+            for (int i = n_text; i < n_logits; ++i) {
+                if (logprobs[i] > -INFINITY) {
+                    sum += expf(logprobs[i] - logprob_max);
+                }
+            }
+            if (sum > 0.0f) {
+                timestamp_logprob = logf(sum) + logprob_max;
+            }
+        }
+
+        const float max_text_token_logprob = *std::max_element(logprobs.begin(), logprobs.begin() + n_text);
+
+        if (timestamp_logprob > max_text_token_logprob) {
+            for (int i = 0; i < n_text; ++i) {
+                logits[i]   = -INFINITY;
+                logprobs[i] = -INFINITY;
+            }
+        }
+
+        for (int i = 0; i < n_logits; ++i) {
+            probs[i] = logits[i] == -INFINITY ? 0.0f : expf(logprobs[i]);
+        }
+    };
+
+    std::vector<uint32_t> work;
+
+    auto run_new = [&](float temperature, int ts_min) {
+        auto & logits   = logits_new;
+        auto & logprobs = logprobs_new;
+        auto & probs    = probs_new;
+
+        work = mask;
+        whisper_bitmask_set_range(work, n_text, n_text + ts_min);
 
-    const int n_max = 128;
+        const float max_text = whisper_logits_mask(logits.data(), src.data(), work.data(), 0,      n_text,   temperature);
+        const float max_ts   = whisper_logits_mask(logits.data(), src.data(), work.data(), n_text, n_logits, temperature);
 
-    const std::vector<size_t> sizes = {
-        64, 128, 256, 512, 1024, 2048, 4096,
-    };
+        const float logit_max = std::max(max_text, max_ts);
 
-    const size_t N_max = sizes.back();
+        const float sum_text = whisper_logits_sumexp(logits.data(), 0,      n_text,   logit_max);
+        const float sum_ts   = whisper_logits_sumexp(logits.data(), n_text, n_logits, logit_max);
 
-    // a: N*N*sizeof(float)
-    // b: N*N*sizeof(float)
-    // c: N*N*sizeof(float)
-    // when F16 is used, there is an extra work buffer of size N*N*sizeof(float)
-    std::vector<uint8_t> buf(3llu*N_max*N_max*sizeof(float) + 3*ggml_tensor_overhead() + ggml_graph_overhead());
-    std::vector<uint8_t> work;
+        const float logsumexp = logf(sum_text + sum_ts) + logit_max;
 
-    // put a bunch of random data in the buffer
-    for (size_t i = 0; i < buf.size(); i++) buf[i] = i;
+        const float timestamp_logprob = sum_ts > 0.0f ? logf(sum_ts) + logit_max - logsumexp : -INFINITY;
 
-    for (int j = 0; j < (int) sizes.size(); j++) {
-        int n_q4_0 = 0;
-        int n_q4_1 = 0;
-        int n_q5_0 = 0;
-        int n_q5_1 = 0;
-        int n_q8_0 = 0;
-        int n_fp16 = 0;
-        int n_fp32 = 0;
+        if (timestamp_logprob > max_text - logsumexp) {
+            std::fill(logits.begin(),   logits.begin()   + n_text, -INFINITY);
+            std::fill(logprobs.begin(), logprobs.begin() + n_text, -INFINITY);
+            std::fill(probs.begin(),    probs.begin()    + n_text, 0.0f);
 
-        // GFLOPS/s
-        double s_q4_0 = 0.0;
-        double s_q4_1 = 0.0;
-        double s_q5_0 = 0.0;
-        double s_q5_1 = 0.0;
-        double s_q8_0 = 0.0;
-        double s_fp16 = 0.0;
-        double s_fp32 = 0.0;
+            whisper_logits_write(logits.data(), logprobs.data(), probs.data(), n_text, n_logits, logsumexp);
+        } else {
+            whisper_logits_write(logits.data(), logprobs.data(), probs.data(), 0, n_logits, logsumexp);
+        }
+    };
 
-        const size_t N = sizes[j];
+#if defined(__SSE2__)
+    const char * isa = "SSE2";
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    const char * isa = "NEON";
+#else
+    const char * isa = "scalar";
+#endif
+    switch (g_simd_level) {
+        case WHISPER_SIMD_LEVEL_AVX512: isa = "AVX512"; break;
+        case WHISPER_SIMD_LEVEL_AVX2:   isa = "AVX2";   break;
+        default:                                        break;
+    }
 
-        for (int k = 0; k < 7; ++k) {
-            const ggml_type wtype =
-                k == 0 ? GGML_TYPE_Q4_0 :
-                k == 1 ? GGML_TYPE_Q4_1 :
-                k == 2 ? GGML_TYPE_Q5_0 :
-                k == 3 ? GGML_TYPE_Q5_1 :
-                k == 4 ? GGML_TYPE_Q8_0 :
-                k == 5 ? GGML_TYPE_F16  : GGML_TYPE_F32;
+    snprintf(strbuf, sizeof(strbuf), "logits: n_vocab = %d, kernels = %s\n", n_logits, isa);
+    s += strbuf;
 
-            double & s = k == 0 ? s_q4_0 : k == 1 ? s_q4_1 : k == 2 ? s_q5_0 : k == 3 ? s_q5_1 : k == 4 ? s_q8_0 : k == 5 ? s_fp16 : /*k == 6*/ s_fp32;
-            int    & n = k == 0 ? n_q4_0 : k == 1 ? n_q4_1 : k == 2 ? n_q5_0 : k == 3 ? n_q5_1 : k == 4 ? n_q8_0 : k == 5 ? n_fp16 : /*k == 6*/ n_fp32;
+    // (temperature, number of suppressed leading timestamps)
+    const float temps[]  = { 0.0f, 0.4f, 1.0f, };
+    const int   ts_min[] = { 0,    8,    8,    };
 
-            struct ggml_init_params gparams = {
-                /*.mem_size   =*/ buf.size(),
-                /*.mem_buffer =*/ buf.data(),
-                /*.no_alloc   =*/ false,
-            };
+    for (int k = 0; k < 3; ++k) {
+        double t_ref = 0.0;
+        double t_new = 0.0;
+        int    n_run = 0;
 
-            struct ggml_context * ctx0 = ggml_init(gparams);
+        run_ref(temps[k], ts_min[k]);
+        run_new(temps[k], ts_min[k]);
 
-            struct ggml_tensor * a = ggml_new_tensor_2d(ctx0, wtype,         N, N);
-            struct ggml_tensor * b = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, N, N);
+        while (n_run < 10 || (t_ref + t_new < 1.0 && n_run < 10000)) {
+            const int64_t t0 = ggml_time_us();
+            run_ref(temps[k], ts_min[k]);
+            const int64_t t1 = ggml_time_us();
+            run_new(temps[k], ts_min[k]);
+            const int64_t t2 = ggml_time_us();
 
-            struct ggml_tensor * c = ggml_mul_mat(ctx0, a, b);
+            t_ref += (t1 - t0)*1e-6;
+            t_new += (t2 - t1)*1e-6;
+            n_run++;
+        }
 
-            struct ggml_cgraph * gf = ggml_new_graph(ctx0);
+        float err_logprob = 0.0f;
+        float err_prob    = 0.0f;
+        int   n_mismatch  = 0; // suppressed in one and not in the other
+        for (int i = 0; i < n_logits; ++i) {
+            if ((logprobs_ref[i] == -INFINITY) != (logprobs_new[i] == -INFINITY)) {
+                n_mismatch++;
+            } else if (logprobs_ref[i] > -INFINITY) {
+                err_logprob = std::max(err_logprob, std::fabs(logprobs_ref[i] - logprobs_new[i]));
+            }
+            err_prob = std::max(err_prob, std::fabs(probs_ref[i] - probs_new[i]));
+        }
 
-            ggml_build_forward_expand(gf, c);
+        const bool ts_wins = logprobs_ref[0] == -INFINITY && logprobs_ref[1] == -INFINITY;
 
-            double tsum = 0.0;
+        snprintf(strbuf, sizeof(strbuf), "logits: temp %.1f %-10s: ref %8.2f us | fused %8.2f us | %5.2fx | max err logprob %.2e prob %.2e | mismatch %d (%d runs)\n",
+                temps[k], ts_wins ? "timestamps" : "text", 1e6*t_ref/n_run, 1e6*t_new/n_run, t_ref/t_new, err_logprob, err_prob, n_mismatch, n_run);
+        s += strbuf;
+    }
 
-            // heat-up
-            ggml_graph_compute_helper(gf, work, n_threads, nullptr, nullptr);
+    return s.c_str();
+}
 
-            for (int i = 0; i < n_max; ++i) {
-                const int64_t t0 = ggml_time_us();
+WHISPER_API int whisper_bench_tokenize(struct whisper_context * ctx) {
+    fputs(whisper_bench_tokenize_str(ctx), stderr);
+    return 0;
+}
 
-                ggml_graph_compute_helper(gf, work, n_threads, nullptr, nullptr);
+// whisper_tokenize() on a set of prompts: the previous std::regex pre-tokenizer with std::map lookups (ref)
+// against the hand-written pre-tokenizer with the hashed vocabulary, the token ids must be the same
+WHISPER_API const char * whisper_bench_tokenize_str(struct whisper_context * ctx) {
+    static std::string s;
+    s = "";
+    char strbuf[256];
 
-                const int64_t t1 = ggml_time_us();
+    ggml_time_init();
 
-                tsum += (t1 - t0)*1e-6;
-                n++;
+    const auto & vocab = ctx->vocab;
 
-                if (tsum > 1.0 && n >= 3) {
-                    break;
+    std::map<std::string, whisper_vocab::id> token_to_id;
+    for (whisper_vocab::id id = 0; id < vocab.size(); ++id) {
+        token_to_id[std::string(vocab.text(id), vocab.text_len(id))] = id;
+    }
+
+    auto tokenize_ref = [&](const std::string & text) {
+        std::vector<std::string> words;
+        {
+            std::string str = text;
+            std::regex re(R"('s|'t|'re|'ve|'m|'ll|'d| ?[[:alpha:]]+| ?[[:digit:]]+| ?[^\s[:alpha:][:digit:]]+|\s+(?!\S)|\s+)");
+            std::smatch m;
+
+            while (std::regex_search(str, m, re)) {
+                for (auto x : m) {
+                    words.push_back(x);
                 }
+                str = m.suffix();
             }
+        }
 
-            ggml_free(ctx0);
+        std::vector<whisper_vocab::id> tokens;
+        for (const auto & word : words) {
+            int i = 0;
+            int n = word.size();
+            while (i < n) {
+                int j = n;
+                while (j > i) {
+                    auto it = token_to_id.find(word.substr(i, j-i));
+                    if (it != token_to_id.end()) {
+                        tokens.push_back(it->second);
+                        break;
+                    }
+                    --j;
+                }
+                i = j > i ? j : i + 1;
+            }
+        }
 
-            s = ((2.0*N*N*N*n)/tsum)*1e-9;
+        return tokens;
+    };
+
+    const std::vector<std::string> base = {
+        "And so my fellow Americans, ask not what your country can do for you, ask what you can do for your country.",
+        "I'm sure they'll say it's fine - we've done this before, haven't we? You'd think so.",
+        "The meeting is at 10:30 on 2024-03-15, room 4B; call +1 (555) 013-4477 or e-mail ops@example.com!",
+        "  leading spaces,   runs of   spaces,\ttabs\tand\nnew lines\n\n  at the end   ",
+        "Grüße aus Köln — naïve café, déjà vu… 東京 and Київ: “quoted” text ©2025",
+        "PyTorch, CUDA, ggml, whisper.cpp, WhisperRecorder, Kubernetes, gRPC, PostgreSQL, OAuth2, macOS",
+        "$1,234.56 vs 99.9% -- [bracketed] {braces} <angle> #hash @mention ~tilde ^caret |pipe| \\backslash",
+        "'s 't 're 've 'm 'll 'd ''quoted'' rock'n'roll o'clock DON'T WON'T y'all'd've",
+    };
+
+    // the prompts of a long transcription: every line a few times with some variation
+    std::vector<std::string> corpus;
+    size_t n_bytes = 0;
+    for (int k = 0; k < 8; ++k) {
+        for (const auto & line : base) {
+            corpus.push_back(k % 2 ? line : " " + line);
+            n_bytes += corpus.back().size();
         }
+    }
 
-        // Q4_0 | Q4_1
-        snprintf(strbuf, sizeof(strbuf), "%4zu x %4zu: Q4_0 %7.1f GFLOPS (%3d runs) | Q4_1 %7.1f GFLOPS (%3d runs)\n",
-                N, N, s_q4_0, n_q4_0, s_q4_1, n_q4_1);
-        s += strbuf;
+    int n_tokens   = 0;
+    int n_mismatch = 0;
+    for (const auto & text : corpus) {
+        const auto ref = tokenize_ref(text);
+        const auto res = ::tokenize(vocab, text);
+        n_mismatch += ref != res;
+        n_tokens   += res.size();
+    }
 
-        // Q5_0 | Q5_1 | Q8_0
-        snprintf(strbuf, sizeof(strbuf), "%4zu x %4zu: Q5_0 %7.1f GFLOPS (%3d runs) | Q5_1 %7.1f GFLOPS (%3d runs) | Q8_0 %7.1f GFLOPS (%3d runs)\n",
-                N, N, s_q5_0, n_q5_0, s_q5_1, n_q5_1, s_q8_0, n_q8_0);
-        s += strbuf;
+    double t_ref = 0.0;
+    double t_new = 0.0;
+    int    n_run = 0;
 
-        // F16 | F32
-        snprintf(strbuf, sizeof(strbuf), "%4zu x %4zu: F16  %7.1f GFLOPS (%3d runs) | F32  %7.1f GFLOPS (%3d runs)\n",
-                N, N, s_fp16, n_fp16, s_fp32, n_fp32);
-        s += strbuf;
+    while (n_run < 3 || (t_ref + t_new < 2.0 && n_run < 1000)) {
+        const int64_t t0 = ggml_time_us();
+        for (const auto & text : corpus) {
+            tokenize_ref(text);
+        }
+        const int64_t t1 = ggml_time_us();
+        for (const auto & text : corpus) {
+            ::tokenize(vocab, text);
+        }
+        const int64_t t2 = ggml_time_us();
+
+        t_ref += (t1 - t0)*1e-6;
+        t_new += (t2 - t1)*1e-6;
+        n_run++;
     }
 
+    snprintf(strbuf, sizeof(strbuf), "tokenize: n_vocab = %d, max token len = %u, %zu prompts, %zu bytes, %d tokens\n",
+            vocab.size(), vocab.max_token_len, corpus.size(), n_bytes, n_tokens);
+    s += strbuf;
+
+    snprintf(strbuf, sizeof(strbuf), "tokenize: ref %8.2f MB/s | new %8.2f MB/s | %6.2fx | mismatch %d (%d runs)\n",
+            1e-6*n_bytes*n_run/t_ref, 1e-6*n_bytes*n_run/t_new, t_ref/t_new, n_mismatch, n_run);
+    s += strbuf;
+
     return s.c_str();
 }
 
@@ -7100,138 +10925,301 @@ static std::vector<uint32_t> get_alignment_heads_by_layer(const whisper_context_
     return ret;
 }
 
-// dtw + backtrace to return found path
-// based on
-// https://github.com/openai/whisper/blob/main/whisper/timing.py#L83
-static ggml_tensor * dtw_and_backtrace(ggml_context * ctx, ggml_tensor * x) {
-    WHISPER_ASSERT(ggml_n_dims(x) == 2);
-
-    int64_t N = x->ne[0];
-    int64_t M = x->ne[1];
-    struct ggml_tensor * cost = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, N + 1, M + 1);
-    struct ggml_tensor * trace = ggml_new_tensor_2d(ctx, GGML_TYPE_I32, N + 1, M + 1);
-
-    cost = ggml_set_f32(cost, INFINITY);
-    trace = ggml_set_f32(trace, -1);
-    ggml_set_f32_nd(cost, 0, 0, 0, 0, 0.0);
-
-    // dtw
-    // supposedly can be optmized by computing diagonals in parallel ?
-    // Not sure it is worth it since x will be GENERATED_TOKENS*1500 size at most.
-    for (int64_t j = 1; j < M + 1; ++j) {
-        for (int64_t i = 1; i < N + 1; ++i) {
-            float c0 = ggml_get_f32_nd(cost, i - 1, j - 1, 0, 0);
-            float c1 = ggml_get_f32_nd(cost, i - 1, j, 0, 0);
-            float c2 = ggml_get_f32_nd(cost, i, j - 1, 0, 0);
-
-            float c;
-            int32_t t;
-            if (c0 < c1 && c0 < c2) {
-                c = c0;
-                t = 0;
-            } else if (c1 < c0 && c1 < c2) {
-                c = c1;
-                t = 1;
-            } else {
-                c = c2;
-                t = 2;
-            }
-
-            c = ggml_get_f32_nd(x, i - 1, j - 1, 0, 0) + c;
-            ggml_set_f32_nd(cost, i, j, 0, 0, c);
-            ggml_set_i32_nd(trace, i, j, 0, 0, t);
-        }
-    }
-
-    // Backtrace
-    const int64_t BT_MAX_ROWS = N + M - 1;
-    struct ggml_tensor * bt = ggml_new_tensor_2d(ctx, GGML_TYPE_I32, BT_MAX_ROWS, 2);
-    // trace[0, :] = 2;
-    for (int64_t i = 0; i < M + 1; ++i)
-        ggml_set_i32_nd(trace, 0, i, 0, 0, 2);
-    //trace[:, 0] = 1;
-    for (int64_t i = 0; i < N + 1; ++i)
-        ggml_set_i32_nd(trace, i, 0, 0, 0, 1);
-    int bt_row_idx = BT_MAX_ROWS - 1;
-    int64_t i = N;
-    int64_t j = M;
-    while (i > 0 || j > 0) {
-        ggml_set_i32_nd(bt, bt_row_idx, 0, 0, 0, i - 1);
-        ggml_set_i32_nd(bt, bt_row_idx, 1, 0, 0, j - 1);
-        --bt_row_idx;
-
-        int32_t t = ggml_get_i32_nd(trace, i, j, 0, 0);
-        if (t == 0) {
-            --i;
-            --j;
-        } else if (t == 1) {
-            --i;
-        } else if (t == 2) {
-            --j;
+// [EXPERIMENTAL] Token-level timestamps with DTW
+// drop the captured rows and start a new window
+static void whisper_dtw_reset(whisper_state & state) {
+    state.dtw.n_rows = 0;
+    state.dtw.rows_free.clear();
+    state.dtw.rows_sot.clear();
+
+    for (auto & decoder : state.decoders) {
+        decoder.sequence.aheads_rows.clear();
+    }
+}
+
+// copy the alignment heads QKs of the tokens [i0, i0 + n) of the last decoded batch to the workspace
+// the row of each token is stored in ws.rows_new, returns false if the QKs were not saved
+static bool whisper_dtw_capture(whisper_state & state, int i0, int n) {
+    const ggml_tensor * QKs = state.aheads_cross_QKs;
+    if (QKs == nullptr) {
+        return false;
+    }
+
+    const int64_t t_start_us = ggml_time_us();
+
+    auto & ws = state.dtw;
+
+    const int32_t n_ctx    = QKs->ne[0];
+    const int32_t n_tokens = QKs->ne[1];
+    const int32_t n_heads  = QKs->ne[2];
+
+    WHISPER_ASSERT(QKs->type == GGML_TYPE_F32);
+    WHISPER_ASSERT(i0 >= 0 && i0 + n <= n_tokens);
+
+    // the audio context only changes between windows
+    if (ws.n_ctx != n_ctx || ws.n_heads != n_heads) {
+        whisper_dtw_reset(state);
+
+        ws.n_ctx   = n_ctx;
+        ws.n_heads = n_heads;
+    }
+
+    const size_t n_row = (size_t) n_heads*n_ctx;
+
+    // before growing the buffer, free the rows of the beams that were dropped and of the failed decoders
+    if ((int) ws.rows_free.size() < n && (ws.n_rows + n - ws.rows_free.size())*n_row > ws.rows.size()) {
+        ws.rows_live.assign(ws.n_rows, 0);
+        for (const int32_t row : ws.rows_sot) {
+            ws.rows_live[row] = 1;
+        }
+        for (const auto & decoder : state.decoders) {
+            if (decoder.failed) {
+                continue;
+            }
+            for (const int32_t row : decoder.sequence.aheads_rows) {
+                if (row >= 0) {
+                    ws.rows_live[row] = 1;
+                }
+            }
+        }
+
+        ws.rows_free.clear();
+        for (int32_t row = 0; row < ws.n_rows; ++row) {
+            if (!ws.rows_live[row]) {
+                ws.rows_free.push_back(row);
+            }
+        }
+    }
+
+    ws.rows_new.resize(n);
+    for (int i = 0; i < n; ++i) {
+        if (!ws.rows_free.empty()) {
+            ws.rows_new[i] = ws.rows_free.back();
+            ws.rows_free.pop_back();
         } else {
-            WHISPER_ASSERT(0);
+            ws.rows_new[i] = ws.n_rows++;
         }
     }
 
-    // FIXME: manual clip/transpose might not be the most efficient way? (e.g. use ggml funcs)
-    // Clip + transpose
-    // This might not be entirely necessary for our case, but leaving it for now so output matrix
-    // is identical to dtw on openAI timing.py
-    const int64_t result_n_cols = BT_MAX_ROWS-bt_row_idx-1;
-    ggml_tensor * r = ggml_new_tensor_2d(ctx, GGML_TYPE_I32, 2, result_n_cols);
-    for (int64_t i = 0; i < 2; ++i) {
-        for (int64_t j = 0; j < result_n_cols; ++j) {
-            int32_t v = ggml_get_i32_nd(bt, j+bt_row_idx+1, i, 0, 0);
-            ggml_set_i32_nd(r, i, j, 0, 0, v);
+    if (ws.rows.size() < ws.n_rows*n_row) {
+        ws.rows.resize(ws.n_rows*n_row);
+    }
+
+    for (int i = 0; i < n; ++i) {
+        float * dst = ws.rows.data() + ws.rows_new[i]*n_row;
+        for (int h = 0; h < n_heads; ++h) {
+            ggml_backend_tensor_get(QKs, dst + h*n_ctx, ((size_t) h*n_tokens + i0 + i)*n_ctx*sizeof(float), n_ctx*sizeof(float));
         }
     }
 
-    return r;
+    state.t_dtw_us += ggml_time_us() - t_start_us;
+
+    return true;
 }
 
-struct median_filter_user_data {
-    int filter_width;
-};
+// normalize the QKs of each head and audio position over the tokens, median filter them over the audio positions and
+// average the heads, then find the path of lowest cost through the resulting [n_tokens, n_audio] matrix
+// based on https://github.com/openai/whisper/blob/main/whisper/timing.py
+// ws.src holds the QKs of each token, head h at src[i] + h*head_stride. The first n_skip and the last n_skip_back
+// tokens only take part in the normalization.
+// returns the number of steps of the path, stored as (token, audio) index pairs in ws.path
+static int whisper_dtw_align(
+        whisper_dtw_workspace & ws,
+                          int   n_heads,
+                       size_t   head_stride,
+                          int   n_audio,
+                          int   n_skip,
+                          int   n_skip_back,
+                          int   medfilt_width) {
+    const int n_rows = ws.src.size();
+    const int N      = n_rows - n_skip - n_skip_back;
+    const int M      = n_audio;
+    const int half   = medfilt_width/2;
 
-static void median_filter(struct ggml_tensor * dst , const struct ggml_tensor * a, int ith, int /*nth*/, void * userdata) {
-    if (ith != 0) {
-        return;
+    WHISPER_ASSERT(medfilt_width % 2);
+    WHISPER_ASSERT(medfilt_width < M);
+
+    if (N <= 0) {
+        return 0;
     }
-    int filter_width = ((median_filter_user_data *) userdata)->filter_width;
-    WHISPER_ASSERT(filter_width < a->ne[2]);
-    WHISPER_ASSERT(filter_width % 2);
-    WHISPER_ASSERT(ggml_n_dims(a) == 3);
-    WHISPER_ASSERT(a->type == GGML_TYPE_F32);
-
-    std::vector<float> filter;
-    filter.reserve(filter_width);
-    for (int64_t i = 0; i < a->ne[0]; ++i) {
-        for (int64_t j = 0; j < a->ne[1]; ++j) {
-            for (int64_t k = 0; k < a->ne[2]; ++k) {
-                for (int64_t off = -filter_width/2; off <= filter_width/2; ++off) {
-                    // "reflect" padding
-                    int64_t idx = k + off;
-                    if (idx < 0) {
-                        idx = -idx;
-                    } else if (idx >= a->ne[2]) {
-                        idx = 2*(a->ne[2] - 1) - idx;
-                    }
 
-                    filter.push_back(ggml_get_f32_nd(a, i, j, idx, 0));
+    ws.w    .resize((size_t) n_heads*n_rows*M);
+    ws.m    .resize((size_t) n_heads*N*M);
+    ws.acc  .resize(2*M);
+    ws.lanes.resize((size_t) medfilt_width*M);
+
+    double * sum  = ws.acc.data();
+    double * sum2 = ws.acc.data() + M;
+
+    for (int h = 0; h < n_heads; ++h) {
+        float * w = ws.w.data() + (size_t) h*n_rows*M;
+
+        // same arithmetic as ggml_norm() with eps = 1e-9, vectorized over the audio positions
+        std::fill(sum, sum + M, 0.0);
+        for (int t = 0; t < n_rows; ++t) {
+            float * y = w + (size_t) t*M;
+            memcpy(y, ws.src[t] + h*head_stride, M*sizeof(float));
+            for (int k = 0; k < M; ++k) {
+                sum[k] += (double) y[k];
+            }
+        }
+        for (int k = 0; k < M; ++k) {
+            sum[k] = (float) (sum[k]/n_rows);
+        }
+
+        std::fill(sum2, sum2 + M, 0.0);
+        for (int t = 0; t < n_rows; ++t) {
+            float * y = w + (size_t) t*M;
+            for (int k = 0; k < M; ++k) {
+                const float v = y[k] - (float) sum[k];
+                y[k] = v;
+                sum2[k] += (double) (v*v);
+            }
+        }
+        for (int k = 0; k < M; ++k) {
+            sum2[k] = 1.0f/sqrtf((float) (sum2[k]/n_rows) + 1e-9f);
+        }
+
+        for (int t = n_skip; t < n_skip + N; ++t) {
+            float * y = w + (size_t) t*M;
+            for (int k = 0; k < M; ++k) {
+                y[k] *= (float) sum2[k];
+            }
+
+            // median filter with "reflect" padding: lane q holds y shifted by q - half, an odd-even transposition
+            // network sorts the lanes element-wise and the middle lane is the median
+            for (int q = 0; q < medfilt_width; ++q) {
+                const int off = q - half;
+                const int k0  = std::max(0, -off);
+                const int k1  = std::min(M, M - off);
+
+                float * l = ws.lanes.data() + (size_t) q*M;
+                for (int k = 0; k < k0; ++k) {
+                    l[k] = y[-(k + off)];
+                }
+                memcpy(l + k0, y + k0 + off, (k1 - k0)*sizeof(float));
+                for (int k = k1; k < M; ++k) {
+                    l[k] = y[2*(M - 1) - (k + off)];
+                }
+            }
+
+            for (int r = 0; r < medfilt_width; ++r) {
+                for (int q = r & 1; q + 1 < medfilt_width; q += 2) {
+                    float * a = ws.lanes.data() + (size_t) q*M;
+                    float * b = a + M;
+                    for (int k = 0; k < M; ++k) {
+                        const float lo = a[k] < b[k] ? a[k] : b[k];
+                        const float hi = a[k] < b[k] ? b[k] : a[k];
+                        a[k] = lo;
+                        b[k] = hi;
+                    }
                 }
-                std::sort(filter.begin(), filter.end());
-                const float v = filter[filter.size()/2];
-                ggml_set_f32_nd(dst, i, j, k, 0, v);
-                filter.clear();
             }
+
+            memcpy(ws.m.data() + ((size_t) h*N + t - n_skip)*M, ws.lanes.data() + (size_t) half*M, M*sizeof(float));
+        }
+    }
+
+    // the cells (i, j), i = 1..N, j = 1..M of the cost matrix are processed one anti-diagonal d = i + j at a time:
+    // the cells of a diagonal only depend on the two previous ones, so that the inner loop has no dependencies and
+    // only 3 diagonals of the cost are kept. The input and the trace are stored in the same order.
+    ws.diag.resize(N + M + 1);
+    {
+        int32_t n = 0;
+        for (int d = 2; d <= N + M; ++d) {
+            ws.diag[d] = n;
+            n += std::min(N, d - 1) - std::max(1, d - M) + 1;
+        }
+        ws.x    .resize(n);
+        ws.trace.resize(n);
+    }
+
+    // average over the heads, scaled by -1
+    for (int t = 0; t < N; ++t) {
+        for (int k = 0; k < M; ++k) {
+            sum[k] = 0.0;
+        }
+        for (int h = 0; h < n_heads; ++h) {
+            const float * m = ws.m.data() + ((size_t) h*N + t)*M;
+            for (int k = 0; k < M; ++k) {
+                sum[k] += (double) m[k];
+            }
+        }
+        for (int k = 0; k < M; ++k) {
+            const int d = t + k + 2;
+            ws.x[ws.diag[d] + t + 1 - std::max(1, d - M)] = -((float) sum[k]/(float) n_heads);
+        }
+    }
+
+    ws.cost.resize(3*(N + 1));
+
+    for (int d = 0; d <= N + M; ++d) {
+        float       * D   = ws.cost.data() + ((d + 0) % 3)*(N + 1);
+        const float * Dm1 = ws.cost.data() + ((d + 2) % 3)*(N + 1);
+        const float * Dm2 = ws.cost.data() + ((d + 1) % 3)*(N + 1);
+
+        if (d <= M) {
+            D[0] = d == 0 ? 0.0f : INFINITY;
+        }
+        if (d >= 1 && d <= N) {
+            D[d] = INFINITY;
+        }
+        if (d < 2) {
+            continue;
+        }
+
+        const int i0 = std::max(1, d - M);
+        const int i1 = std::min(N, d - 1);
+
+        const float  * x  = ws.x.data()     + ws.diag[d] - i0;
+              int8_t * tr = ws.trace.data() + ws.diag[d] - i0;
+
+        for (int i = i0; i <= i1; ++i) {
+            const float c0 = Dm2[i - 1]; // (i - 1, j - 1)
+            const float c1 = Dm1[i - 1]; // (i - 1, j)
+            const float c2 = Dm1[i];     // (i,     j - 1)
+
+            const bool b0 = (c0 < c1) & (c0 < c2);
+            const bool b1 = (c1 < c0) & (c1 < c2);
+
+            D[i]  = x[i] + (b0 ? c0 : b1 ? c1 : c2);
+            tr[i] = b0 ? 0 : b1 ? 1 : 2;
+        }
+    }
+
+    // backtrace from (N, M), the first row and column of the trace are 2 and 1
+    ws.path.resize(2*(N + M));
+
+    int n = N + M;
+    for (int i = N, j = M; i > 0 || j > 0; ) {
+        --n;
+        ws.path[2*n + 0] = i - 1;
+        ws.path[2*n + 1] = j - 1;
+
+        const int t = i == 0 ? 2 : j == 0 ? 1 : ws.trace[ws.diag[i + j] + i - std::max(1, i + j - M)];
+        if (t == 0) {
+            --i;
+            --j;
+        } else if (t == 1) {
+            --i;
+        } else {
+            --j;
         }
     }
+
+    const int n_steps = N + M - n;
+    memmove(ws.path.data(), ws.path.data() + 2*n, 2*n_steps*sizeof(int32_t));
+
+    return n_steps;
 }
 
+// the tokens of the segments [i_segment, i_segment + n_segments) are aligned with the QKs captured while decoding the
+// window, or decoded again to obtain them if the sequence is not given or some of its text tokens were not decoded
 static void whisper_exp_compute_token_level_timestamps_dtw(
             struct whisper_context * ctx,
               struct whisper_state * state,
         struct whisper_full_params   params,
+     const struct whisper_sequence * sequence,
                                int   i_segment,
                             size_t   n_segments,
                                int   seek,
@@ -7244,122 +11232,121 @@ static void whisper_exp_compute_token_level_timestamps_dtw(
     WHISPER_ASSERT(n_frames <= n_audio_ctx * 2);
     WHISPER_ASSERT(ctx->params.dtw_aheads_preset != WHISPER_AHEADS_NONE);
 
-    // FIXME: Allocating mem everytime we call this func
-    // Our ggml buffer should be pre-allocated somewhere during init and reused
-    // when we call this function
-    struct ggml_init_params gparams = {
-        /*.mem_size   =*/ ctx->params.dtw_mem_size,
-        /*.mem_buffer =*/ NULL,
-        /*.no_alloc   =*/ false,
-    };
-    struct ggml_context * gctx = ggml_init(gparams);
+    const int64_t t_start_us = ggml_time_us();
 
-    // Build token sequence that will be passed to decoder
-    // sot + [lang] + text result + eot
-    std::vector<whisper_token> tokens = { whisper_token_sot(ctx), };
-    if (whisper_is_multilingual(ctx)) {
-        const int lang_id = whisper_lang_id(params.language);
-        state->lang_id = lang_id;
-        tokens.push_back(whisper_token_lang(ctx, lang_id));
-    }
-    const size_t sot_sequence_length = tokens.size();
-    tokens.push_back(whisper_token_not(ctx));
-    for (size_t i = i_segment; i < i_segment + n_segments; ++i) {
-        auto & segment = state->result_all[i];
-        for (auto &t: segment.tokens) {
-            // Only text tokens
-            if (t.id < whisper_token_eot(ctx)) {
-                tokens.push_back(t.id);
+    auto & ws = state->dtw;
+
+    const auto n_audio_tokens = n_frames/2;
+    const whisper_token token_eot = whisper_token_eot(ctx);
+
+    int    n_heads     = ws.n_heads;
+    size_t head_stride = ws.n_ctx;
+    int    n_skip      = 0;
+    int    n_skip_back = 0;
+
+    // the captured rows: sot sequence + the text tokens of the segments, which are the text tokens of the sequence
+    // the last token of the sot sequence takes the place of <|notimestamps|> in the sequence decoded below
+    bool captured = sequence != nullptr && !ws.rows_sot.empty() && n_audio_tokens <= ws.n_ctx;
+    if (captured) {
+        const size_t n_row = (size_t) ws.n_heads*ws.n_ctx;
+
+        ws.src.clear();
+        for (const int32_t row : ws.rows_sot) {
+            ws.src.push_back(ws.rows.data() + row*n_row);
+        }
+        n_skip = ws.rows_sot.size() - 1;
+
+        size_t k = 0;
+        for (size_t i = i_segment; i < i_segment + n_segments && captured; ++i) {
+            for (const auto & t : state->result_all[i].tokens) {
+                if (t.id >= token_eot) {
+                    continue;
+                }
+                while (k < sequence->tokens.size() && sequence->tokens[k].id >= token_eot) {
+                    ++k;
+                }
+                if (k >= sequence->aheads_rows.size() || sequence->tokens[k].id != t.id || sequence->aheads_rows[k] < 0) {
+                    captured = false;
+                    break;
+                }
+                ws.src.push_back(ws.rows.data() + sequence->aheads_rows[k]*n_row);
+                ++k;
             }
         }
     }
-    tokens.push_back(whisper_token_eot(ctx));
 
-    // Get result tokens, pass then along to decoder to get cross attention QKs
-    // used in timestamping
-    // Decoder already returns only alignment head QKs, already concatenated in
-    // one tensor.
-    whisper_kv_cache_clear(state->kv_self);
-    whisper_batch_prep_legacy(state->batch, tokens.data(), tokens.size(), 0, 0);
-    whisper_kv_cache_seq_rm(state->kv_self, 0, 0, -1);
-    if (!whisper_decode_internal(*ctx, *state, state->batch, n_threads, true, nullptr, nullptr)) {
-        WHISPER_LOG_INFO("DECODER FAILED\n");
-        WHISPER_ASSERT(0);
+    if (!captured) {
+        // Build token sequence that will be passed to decoder
+        // sot + [lang] + text result + eot
+        std::vector<whisper_token> tokens = { whisper_token_sot(ctx), };
+        if (whisper_is_multilingual(ctx)) {
+            const int lang_id = whisper_lang_id(params.language);
+            state->lang_id = lang_id;
+            tokens.push_back(whisper_token_lang(ctx, lang_id));
+        }
+        const size_t sot_sequence_length = tokens.size();
+        tokens.push_back(whisper_token_not(ctx));
+        for (size_t i = i_segment; i < i_segment + n_segments; ++i) {
+            auto & segment = state->result_all[i];
+            for (auto &t: segment.tokens) {
+                // Only text tokens
+                if (t.id < token_eot) {
+                    tokens.push_back(t.id);
+                }
+            }
+        }
+        tokens.push_back(token_eot);
+
+        // Get result tokens, pass then along to decoder to get cross attention QKs
+        // used in timestamping
+        // Decoder already returns only alignment head QKs, already concatenated in
+        // one tensor.
+        whisper_kv_cache_clear(state->kv_self);
+        whisper_batch_prep_legacy(state->batch, tokens.data(), tokens.size(), 0, 0);
+        whisper_kv_cache_seq_rm(state->kv_self, 0, 0, -1);
+        if (!whisper_decode_internal(*ctx, *state, state->batch, n_threads, true, nullptr, nullptr)) {
+            WHISPER_LOG_INFO("DECODER FAILED\n");
+            WHISPER_ASSERT(0);
+        }
+        WHISPER_ASSERT(state->aheads_cross_QKs != nullptr);
+
+        // IN: Tensor with audio_ctx*N_TOKENS*N_ALIGNMENT_HEADS dims
+        const ggml_tensor * QKs = state->aheads_cross_QKs;
+        WHISPER_ASSERT(QKs->type == GGML_TYPE_F32);
+        WHISPER_ASSERT(n_audio_tokens <= QKs->ne[0]);
+
+        auto & data = state->aheads_cross_QKs_data;
+        data.resize(ggml_nelements(QKs));
+        ggml_backend_tensor_get(QKs, data.data(), 0, ggml_nbytes(QKs));
+
+        ws.src.clear();
+        for (int64_t i = 0; i < QKs->ne[1]; ++i) {
+            ws.src.push_back(data.data() + i*QKs->ne[0]);
+        }
+
+        n_heads     = QKs->ne[2];
+        head_stride = QKs->ne[0]*QKs->ne[1];
+        n_skip      = sot_sequence_length;
+        n_skip_back = 1;
+
+        state->n_dtw_redecode++;
     }
-    WHISPER_ASSERT(state->aheads_cross_QKs != nullptr);
 
-    const auto n_audio_tokens = n_frames/2;
-    WHISPER_ASSERT(state->aheads_cross_QKs != NULL);
-    WHISPER_ASSERT(n_audio_tokens <= state->aheads_cross_QKs->ne[1]);
-    const auto n_tokens = state->aheads_cross_QKs->ne[0];
-    const auto n_heads = state->aheads_cross_QKs->ne[2];
-
-    // Copy data from decoder buffer to a local CPU tensor, discarding unused audio
-    // tokens (i.e. discarding rows at the end of tensor)
-    // IN: Tensor with N_TOKENS*audio_ctx*N_ALIGNMENT_HEADS dims
-    // OUT: Tensor with N_TOKENS*N_AUDIO_TOKENS*N_ALIGNMENT_HEADS dims
-    WHISPER_ASSERT(state->aheads_cross_QKs->type == GGML_TYPE_F32);
-    WHISPER_ASSERT(ggml_is_contiguous(state->aheads_cross_QKs));
-    ggml_tensor * w = ggml_new_tensor_3d(gctx, GGML_TYPE_F32, n_tokens, n_audio_tokens, n_heads);
-    auto & data = state->aheads_cross_QKs_data;
-    data.resize(n_tokens * n_audio_ctx * n_heads);
-    ggml_backend_tensor_get(state->aheads_cross_QKs, data.data(), 0, sizeof(float) * n_tokens * n_audio_ctx * n_heads);
-    for (int k = 0; k < n_heads; ++k) {
-        for (int j = 0; j < n_audio_tokens; ++j) {
-            memcpy(
-                (char *) w->data + j * w->nb[1] + k * w->nb[2],
-                data.data() + j * n_tokens + k * n_tokens * n_audio_ctx,
-                n_tokens * sizeof(float)
-            );
-        }
-    }
-
-    // Normalize - in original OpenAI code, this is done over dim=-2. In this case,
-    // we already permuted N_TOKENS dimension to columns on last loop, becase ggml_norm
-    // operates over columns. Afterwards, permute to a shape that facilitates mean
-    // operation (after median filter)
-    // IN: Tensor with N_TOKENS*N_AUDIO_TOKENS*N_ALIGNMENT_HEADS dims
-    // OUT: Tensor with N_ALIGNMENT_HEADS*N_TOKENS*N_AUDIO_TOKENS dims
-    w = ggml_norm(gctx, w, 1e-9f);
-    w = ggml_permute(gctx, ggml_permute(gctx, w, 2, 1, 0 ,3), 0, 2, 1, 3);
-
-    // Pass median filter - this is done over AUDIO_TOKENS dimension.
-    // IN: Tensor with N_ALIGNMENT_HEADS*N_TOKENS*N_AUDIO_TOKENS dims
-    // OUT: Same dims
-    median_filter_user_data mf_user_data = {medfilt_width};
-    w = ggml_map_custom1(gctx, w, median_filter, 1, &mf_user_data);
-
-    // Take mean over columns, scale by -1, reshape to 2D tensor, remove SOT sequence and EOT
-    // IN: Tensor with N_ALIGNMENT_HEADS*N_TOKENS*N_AUDIO_TOKENS dims
-    // OUT: Tensor with N_TOKENS*N_AUDIO_TOKENS dims
-    w = ggml_mean(gctx, w);
-    w = ggml_scale(gctx, w, -1.0);
-    w = ggml_reshape_2d(gctx, w, w->ne[1], w->ne[2]);
-
-    // Remove SOT sequence and EOT
-    // Out dimension is (N_TOKENS-sot_sequence_length-1)*N_AUDIO_TOKENS
-    w = ggml_view_2d(gctx, w, w->ne[0] - sot_sequence_length - 1, w->ne[1], w->nb[1], sot_sequence_length * w->nb[0]);
-
-    // Compute
-    struct ggml_cgraph * gf = ggml_new_graph(gctx);
-    ggml_build_forward_expand(gf, w);
-    ggml_graph_compute_with_ctx(gctx, gf, n_threads);
-
-    ggml_tensor * alignment = dtw_and_backtrace(gctx, w);
+    const int n_steps = whisper_dtw_align(ws, n_heads, head_stride, n_audio_tokens, n_skip, n_skip_back, medfilt_width);
 
     // Place timestamps on segments
     int32_t last_v = 0;
     auto seg_i = state->result_all.begin() + i_segment;
     auto tok_i = seg_i->tokens.begin();
-    for (int i = 0; i < alignment->ne[1]; ++i) {
-        int32_t v = ggml_get_i32_nd(alignment, 0, i, 0, 0);
+    for (int i = 0; i < n_steps; ++i) {
+        int32_t v = ws.path[2*i + 0];
         if (v != last_v) {
-            int32_t time_index = ggml_get_i32_nd(alignment, 1, i, 0, 0);
+            int32_t time_index = ws.path[2*i + 1];
             int64_t timestamp = (time_index * 2) + seek; // Each index on DTW result = 20mS audio
             last_v = v;
 
             // Skip non-text tokens
-            while (!(tok_i->id < whisper_token_eot(ctx))) {
+            while (!(tok_i->id < token_eot)) {
                 ++tok_i;
                 if (tok_i == seg_i->tokens.end()) {
                     ++seg_i;
@@ -7386,7 +11373,8 @@ static void whisper_exp_compute_token_level_timestamps_dtw(
         fprintf(stderr, "\n");
     }*/
 
-    ggml_free(gctx);
+    state->n_dtw++;
+    state->t_dtw_us += ggml_time_us() - t_start_us;
 }
 
 void whisper_log_set(ggml_log_callback log_callback, void * user_data) {